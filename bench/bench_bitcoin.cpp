@@ -0,0 +1,414 @@
+// Copyright (c) 2025 GoldcoinPoP Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+
+//
+// Benchmarks for the hot paths that have been reworked for speed.  Runs
+// everything, or just the ones named on the command line, against a scratch
+// data directory, and prints one line per measurement:
+//
+//   make -f makefile.unix bench_bitcoin && ./bench_bitcoin [name ...]
+//
+
+#include "headers.h"
+#undef printf
+#include "json/json_spirit_reader_template.h"
+#define printf OutputDebugStringF
+
+using namespace json_spirit;
+
+// init.o isn't linked, it has the app
+void Shutdown(void* parg)
+{
+    exit(0);
+}
+
+
+static void BenchReport(const char* pszName, int64 nOps, int64 nMicros, const char* pszUnit="op")
+{
+    nMicros = max(nMicros, (int64)1);
+    fprintf(stdout, "%-28s %12"PRI64d" %ss %10"PRI64d"ms %14.0f %ss/s %10.3f us/%s\n",
+        pszName, nOps, pszUnit, nMicros / 1000, (double)nOps * 1000000 / nMicros, pszUnit, (double)nMicros / max(nOps, (int64)1), pszUnit);
+    fflush(stdout);
+}
+
+
+
+
+//
+// debug.log
+//
+
+static const int BENCH_LOG_LINES = 1000000;
+
+static void BenchLogDisabled()
+{
+    // What a LogPrint on a hot path costs when its category is off
+    nLogCategories = 0;
+    int nLines = BENCH_LOG_LINES * 10;
+    uint256 hash = 1;
+    int64 nStart = GetTimeMicros();
+    for (int i = 0; i < nLines; i++)
+        LogPrint(LOG_NET, "received getdata for: %s %d\n", hash.ToString().c_str(), i);
+    BenchReport("log/disabled", nLines, GetTimeMicros() - nStart, "line");
+}
+
+static void BenchLogLines()
+{
+    // A typical ProcessMessage line, with the writer thread draining into
+    // debug.log behind it; the time includes the final flush
+    nLogCategories = LOG_NET;
+    int64 nStart = GetTimeMicros();
+    for (int i = 0; i < BENCH_LOG_LINES; i++)
+        LogPrint(LOG_NET, "received: %s (%d bytes)\n", "inv", 37 * (i % 100));
+    FlushDebugLog();
+    BenchReport("log/lines", BENCH_LOG_LINES, GetTimeMicros() - nStart, "line");
+    nLogCategories = 0;
+}
+
+static void BenchLogThreads()
+{
+    // Four threads logging at once, each into its own buffer
+    const int nThreads = 4;
+    nLogCategories = LOG_NET;
+    int64 nStart = GetTimeMicros();
+    vector<std::thread> vThreads;
+    for (int n = 0; n < nThreads; n++)
+    {
+        vThreads.push_back(std::thread([n]()
+        {
+            for (int i = 0; i < BENCH_LOG_LINES / nThreads; i++)
+                LogPrint(LOG_NET, "thread %d received: %s (%d bytes)\n", n, "inv", 37 * (i % 100));
+        }));
+    }
+    foreach(std::thread& thread, vThreads)
+        thread.join();
+    FlushDebugLog();
+    BenchReport("log/threads", BENCH_LOG_LINES, GetTimeMicros() - nStart, "line");
+    nLogCategories = 0;
+}
+
+
+
+
+//
+// Block index
+//
+
+static const int BENCH_IBD_BLOCKS = 20000;
+static const int BENCH_IBD_TXS = 20;
+
+template<typename T>
+static string BenchSerialize(const T& obj)
+{
+    CDataStream ss(SER_DISK);
+    ss << obj;
+    return string(ss.begin(), ss.end());
+}
+
+static void BenchIBD(const char* pszName, CKeyValueStore& store)
+{
+    // What ConnectBlock writes for each block during initial download, as
+    // one batch: the tx index of every tx an input spends, read and written
+    // back marked spent, a tx index for each new tx, the block index and
+    // the best chain.  Inputs spend random outputs of earlier blocks.
+    vector<uint256> vTxHashes;
+    vTxHashes.reserve(BENCH_IBD_BLOCKS * BENCH_IBD_TXS);
+    int64 nStart = GetTimeMicros();
+    for (int nHeight = 0; nHeight < BENCH_IBD_BLOCKS; nHeight++)
+    {
+        CKVBatch batch;
+        map<uint256, CTxIndex> mapSpent;
+        vector<uint256> vNew;
+        for (int i = 0; i < BENCH_IBD_TXS; i++)
+        {
+            for (int n = 0; n < 2 && !vTxHashes.empty(); n++)
+            {
+                uint256 hashPrev = vTxHashes[GetRand(vTxHashes.size())];
+                if (!mapSpent.count(hashPrev))
+                {
+                    string strValue;
+                    if (store.Lookup(BenchSerialize(make_pair(string("tx"), hashPrev)), strValue) != 1)
+                    {
+                        fprintf(stderr, "%s: tx index read failed at height %d\n", pszName, nHeight);
+                        return;
+                    }
+                    CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK);
+                    ssValue >> mapSpent[hashPrev];
+                }
+                mapSpent[hashPrev].vSpent[GetRand(2)] = CDiskTxPos(1, nHeight * 1000, 100 + i * 200);
+            }
+            uint256 hashTx = Hash(BEGIN(nHeight), END(nHeight), BEGIN(i), END(i));
+            batch.Put(BenchSerialize(make_pair(string("tx"), hashTx)), BenchSerialize(CTxIndex(CDiskTxPos(1, nHeight * 1000, 100 + i * 200), 2)));
+            vNew.push_back(hashTx);
+        }
+        foreach(const PAIRTYPE(uint256, CTxIndex)& item, mapSpent)
+            batch.Put(BenchSerialize(make_pair(string("tx"), item.first)), BenchSerialize(item.second));
+
+        uint256 hashBlock = Hash(BEGIN(nHeight), END(nHeight));
+        CDiskBlockIndex blockindex;
+        blockindex.nHeight = nHeight;
+        batch.Put(BenchSerialize(make_pair(string("blockindex"), hashBlock)), BenchSerialize(blockindex));
+        batch.Put(BenchSerialize(string("hashBestChain")), BenchSerialize(hashBlock));
+        if (!store.Write(batch, false))
+        {
+            fprintf(stderr, "%s: write failed at height %d\n", pszName, nHeight);
+            return;
+        }
+        vTxHashes.insert(vTxHashes.end(), vNew.begin(), vNew.end());
+    }
+    store.Flush();
+    BenchReport(pszName, BENCH_IBD_BLOCKS, GetTimeMicros() - nStart, "block");
+}
+
+class CBenchDB : public CDB
+{
+public:
+    CBenchDB(const char* pszFile) : CDB(pszFile, "cr+") { }
+    Db* GetDb() { return pdb; }
+};
+
+static void BenchIBDBDB()
+{
+    CBenchDB db("bench_blkindex.dat");
+    CBDBStore store(db.GetDb());
+    BenchIBD("ibd/bdb", store);
+}
+
+static void BenchIBDLSM()
+{
+    CLSMStore store(GetDataDir() + "/bench_blkindex");
+    if (!store.Open())
+    {
+        fprintf(stderr, "ibd/lsm: can't open the store\n");
+        return;
+    }
+    BenchIBD("ibd/lsm", store);
+}
+
+
+
+
+//
+// Wallet
+//
+
+// main.cpp keeps it to itself
+bool SelectCoins(int64 nTargetValue, set<CWalletTx*>& setCoinsRet, const set<CWalletTx*>* psetExclude);
+
+static const int BENCH_WALLET_COINS = 500000;
+static const int BENCH_SELECT_COINS = 1000;
+
+static void BenchClearWallet()
+{
+    CRITICAL_BLOCK(cs_mapWallet)
+    {
+        mapWallet.clear();
+        walletCoinIndex.Rebuild();
+        walletTxTimeIndex.Rebuild();
+        walletReceivedTally.Rebuild();
+    }
+}
+
+static void BenchSelectCoins()
+{
+    // Half a million unspent single-output coins from 0.01 to 100, paying
+    // one of our keys.  They only go into mapWallet and the coin index, not
+    // wallet.dat.
+    CKey key;
+    key.MakeNewKey();
+    AddKey(key);
+    CScript scriptPubKey;
+    scriptPubKey << key.GetPubKey() << OP_CHECKSIG;
+    int64 nStart = GetTimeMicros();
+    CRITICAL_BLOCK(cs_mapWallet)
+    {
+        for (int i = 0; i < BENCH_WALLET_COINS; i++)
+        {
+            CWalletTx wtx;
+            wtx.vin.push_back(CTxIn(Hash(BEGIN(i), END(i)), 0));
+            wtx.vout.push_back(CTxOut(CENT + GetRand(100 * COIN), scriptPubKey));
+            CWalletTx& wtxIn = mapWallet[wtx.GetHash()];
+            wtxIn = wtx;
+            walletCoinIndex.Update(&wtxIn);
+        }
+    }
+    BenchReport("wallet/coinindex", BENCH_WALLET_COINS, GetTimeMicros() - nStart, "coin");
+
+    // Payment sized targets, each selection on its own like CreateTransaction
+    int nSelected = 0;
+    nStart = GetTimeMicros();
+    for (int i = 0; i < BENCH_SELECT_COINS; i++)
+    {
+        set<CWalletTx*> setCoins;
+        if (SelectCoins(CENT + GetRand(250 * COIN), setCoins, NULL))
+            nSelected++;
+    }
+    BenchReport("wallet/selectcoins", BENCH_SELECT_COINS, GetTimeMicros() - nStart, "select");
+    if (nSelected != BENCH_SELECT_COINS)
+        fprintf(stderr, "wallet/selectcoins: %d selections failed\n", BENCH_SELECT_COINS - nSelected);
+
+    BenchClearWallet();
+}
+
+static const int BENCH_WALLET_TXS = 50000;
+static const int BENCH_WALLET_DEPTH = 3;
+
+static int64 GetResidentBytes()
+{
+    // Linux only, 0 where there's no /proc
+    long nPages = 0;
+    long nResident = 0;
+    FILE* file = fopen("/proc/self/statm", "r");
+    if (!file)
+        return 0;
+    if (fscanf(file, "%ld %ld", &nPages, &nResident) != 2)
+        nResident = 0;
+    fclose(file);
+    return (int64)nResident * sysconf(_SC_PAGESIZE);
+}
+
+static void BenchWalletLoad()
+{
+    // A chain of our own payments, each spending the one before, so like a
+    // busy wallet's their supporting transactions overlap: every tx is the
+    // supporting tx of the next BENCH_WALLET_DEPTH.  Written straight to
+    // wallet.dat as the shared store keeps them, then loaded.
+    CKey key;
+    key.MakeNewKey();
+    AddKey(key);
+    CScript scriptPubKey;
+    scriptPubKey << key.GetPubKey() << OP_CHECKSIG;
+    {
+        CWalletDB walletdb;
+        deque<uint256> vhashRecent;
+        uint256 hashPrev = 1;
+        for (int i = 0; i < BENCH_WALLET_TXS; i++)
+        {
+            if (i % 1000 == 0)
+                walletdb.TxnBegin();
+            CWalletTx wtx;
+            wtx.vin.push_back(CTxIn(hashPrev, 0));
+            wtx.vout.push_back(CTxOut(COIN, scriptPubKey));
+            wtx.nTimeReceived = i;
+            wtx.fFromMe = true;
+            wtx.fSpent = (i < BENCH_WALLET_TXS - 1);
+            uint256 hash = wtx.GetHash();
+            walletdb.WritePrevTx(hash, CMerkleTx(wtx));
+            walletdb.WritePrevHashes(hash, vector<uint256>(vhashRecent.begin(), vhashRecent.end()));
+            walletdb.WriteTx(hash, wtx);
+            vhashRecent.push_back(hash);
+            if (vhashRecent.size() > BENCH_WALLET_DEPTH)
+                vhashRecent.pop_front();
+            hashPrev = hash;
+            if (i % 1000 == 999 || i == BENCH_WALLET_TXS - 1)
+                walletdb.TxnCommit();
+        }
+        walletdb.Sync();
+    }
+    BenchClearWallet();
+
+    int64 nResidentBefore = GetResidentBytes();
+    int64 nStart = GetTimeMicros();
+    bool fFirstRun;
+    if (!LoadWallet(fFirstRun))
+    {
+        fprintf(stderr, "wallet/load: LoadWallet failed\n");
+        return;
+    }
+    BenchReport("wallet/load", BENCH_WALLET_TXS, GetTimeMicros() - nStart, "tx");
+    int64 nResident = GetResidentBytes() - nResidentBefore;
+    fprintf(stdout, "%-28s %12"PRI64d" bytes resident %10"PRI64d" bytes/tx\n", "wallet/load memory", nResident, nResident / BENCH_WALLET_TXS);
+    fflush(stdout);
+}
+
+
+
+
+//
+// JSON-RPC requests
+//
+
+// rpc.cpp keeps it to itself
+bool ReadJSONFast(string::iterator& begin, string::iterator end, Value& valRet);
+
+static const int BENCH_PARSE_REQUESTS = 200000;
+
+static const char* pszBenchRequests[] =
+{
+    "{\"jsonrpc\":\"1.0\",\"id\":\"curltest\",\"method\":\"getblockcount\",\"params\":[]}",
+    "{\"method\":\"getbalance\",\"params\":[\"*\",6],\"id\":17}",
+    "{\"method\":\"sendtoaddress\",\"params\":[\"1JwSSubhmg6iPtRjtyqhUYYH7bZg3Lfy1T\",12.5,\"payout 2025-06-01\"],\"id\":18}",
+    "{\"method\":\"listtransactions\",\"params\":[\"\",100,true],\"id\":null}",
+};
+
+static void BenchParse(const char* pszName, bool fFast)
+{
+    // What ThreadRPCServer does with each request body
+    vector<string> vRequests(pszBenchRequests, pszBenchRequests + ARRAYLEN(pszBenchRequests));
+    int nFailed = 0;
+    int64 nStart = GetTimeMicros();
+    for (int i = 0; i < BENCH_PARSE_REQUESTS; i++)
+    {
+        string& strRequest = vRequests[i % vRequests.size()];
+        string::iterator begin = strRequest.begin();
+        Value valRequest;
+        if (fFast ? !ReadJSONFast(begin, strRequest.end(), valRequest) : !read_range(begin, strRequest.end(), valRequest))
+            nFailed++;
+    }
+    BenchReport(pszName, BENCH_PARSE_REQUESTS, GetTimeMicros() - nStart, "request");
+    if (nFailed > 0)
+        fprintf(stderr, "%s: %d requests didn't parse\n", pszName, nFailed);
+}
+
+static void BenchParseFast()
+{
+    BenchParse("rpc/parse/fast", true);
+}
+
+static void BenchParseSpirit()
+{
+    BenchParse("rpc/parse/spirit", false);
+}
+
+
+
+
+typedef void (*benchfn_type)();
+
+pair<string, benchfn_type> pBenchTable[] =
+{
+    make_pair("log/disabled",          &BenchLogDisabled),
+    make_pair("log/lines",             &BenchLogLines),
+    make_pair("log/threads",           &BenchLogThreads),
+    make_pair("ibd/bdb",               &BenchIBDBDB),
+    make_pair("ibd/lsm",               &BenchIBDLSM),
+    make_pair("wallet/selectcoins",    &BenchSelectCoins),
+    make_pair("wallet/load",           &BenchWalletLoad),
+    make_pair("rpc/parse/fast",        &BenchParseFast),
+    make_pair("rpc/parse/spirit",      &BenchParseSpirit),
+};
+
+int main(int argc, char* argv[])
+{
+    // debug.log only goes to the file once there's an app
+    wxApp::SetInstance(new wxApp());
+
+    string strDataDir = (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("bench_bitcoin-%%%%%%%%")).string();
+    boost::filesystem::create_directories(strDataDir);
+    strlcpy(pszSetDataDir, strDataDir.c_str(), sizeof(pszSetDataDir));
+
+    for (int i = 0; i < ARRAYLEN(pBenchTable); i++)
+    {
+        bool fRun = (argc < 2);
+        for (int j = 1; j < argc; j++)
+            if (pBenchTable[i].first.find(argv[j]) == 0)
+                fRun = true;
+        if (fRun)
+            pBenchTable[i].second();
+    }
+
+    FlushDebugLog();
+    boost::filesystem::remove_all(strDataDir);
+    return 0;
+}
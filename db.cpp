@@ -4,7 +4,8 @@
 
 #include "headers.h"
 
-void ThreadFlushWalletDB(void* parg);
+void FlushWalletDB();
+void CommitWalletDB();
 
 
 unsigned int nWalletDBUpdated;
@@ -22,6 +23,23 @@ DbEnv dbenv(0);
 static map<string, int> mapFileUseCount;
 static map<string, Db*> mapDb;
 
+static int64 GetDBCacheStat(bool fHit)
+{
+    int64 n = 0;
+    CRITICAL_BLOCK(cs_db)
+    {
+        DB_MPOOL_STAT* pstat = NULL;
+        if (fDbEnvInit && dbenv.memp_stat(&pstat, NULL, 0) == 0)
+        {
+            n = (fHit ? pstat->st_cache_hit : pstat->st_cache_miss);
+            free(pstat);
+        }
+    }
+    return n;
+}
+static CMetricCounter& metricDBCacheHits = GetMetricCounter("pop_db_cache_hits_total", "Pages found in the Berkeley DB cache", "", boost::bind(&GetDBCacheStat, true));
+static CMetricCounter& metricDBCacheMisses = GetMetricCounter("pop_db_cache_misses_total", "Pages read into the Berkeley DB cache", "", boost::bind(&GetDBCacheStat, false));
+
 class CDBInit
 {
 public:
@@ -40,13 +58,13 @@ public:
 instance_of_cdbinit;
 
 
-CDB::CDB(const char* pszFile, const char* pszMode) : pdb(NULL)
+CDB::CDB(const char* pszFile, const char* pszMode) : pdb(NULL), pstore(NULL)
 {
     int ret;
+    fReadOnly = (!strchr(pszMode, '+') && !strchr(pszMode, 'w'));
     if (pszFile == NULL)
         return;
 
-    fReadOnly = (!strchr(pszMode, '+') && !strchr(pszMode, 'w'));
     bool fCreate = strchr(pszMode, 'c');
     unsigned int nFlags = DB_THREAD;
     if (fCreate)
@@ -124,6 +142,8 @@ CDB::CDB(const char* pszFile, const char* pszMode) : pdb(NULL)
 
 void CDB::Close()
 {
+    vBatch.clear();
+    pstore = NULL;
     if (!pdb)
         return;
     if (!vTxn.empty())
@@ -136,6 +156,56 @@ void CDB::Close()
         --mapFileUseCount[strFile];
 }
 
+int CDB::ReadFromStore(const string& strKey, string& strValueRet)
+{
+    // Our own uncommitted writes first, innermost transaction first
+    for (vector<CKVBatch>::reverse_iterator it = vBatch.rbegin(); it != vBatch.rend(); ++it)
+    {
+        int nRet = (*it).Get(strKey, strValueRet);
+        if (nRet != -1)
+            return nRet;
+    }
+    return pstore->Lookup(strKey, strValueRet);
+}
+
+bool CDB::WriteToStore(const string& strKey, const string& strValue, bool fOverwrite)
+{
+    string strOld;
+    if (!fOverwrite && ReadFromStore(strKey, strOld) != 0)
+        return false;
+    if (!vBatch.empty())
+    {
+        vBatch.back().Put(strKey, strValue);
+        return true;
+    }
+    return pstore->Put(strKey, strValue);
+}
+
+bool CDB::EraseFromStore(const string& strKey)
+{
+    if (!vBatch.empty())
+    {
+        vBatch.back().Erase(strKey);
+        return true;
+    }
+    return pstore->Erase(strKey);
+}
+
+bool CDB::CommitStoreBatch()
+{
+    if (vBatch.empty())
+        return false;
+    CKVBatch batch;
+    swap(batch, vBatch.back());
+    vBatch.pop_back();
+    if (!vBatch.empty())
+    {
+        vBatch.back().Append(batch);
+        return true;
+    }
+    return pstore->Write(batch);
+}
+
 void CloseDb(const string& strFile)
 {
     CRITICAL_BLOCK(cs_db)
@@ -151,13 +221,101 @@ void CloseDb(const string& strFile)
     }
 }
 
+//
+// The block index is in blkindex.dat or, with -dbengine=lsm, in a CLSMStore
+// under blkindex/.  Whichever an existing data directory has wins over
+// -dbengine, it only picks the engine for a new one.
+//
+
+enum
+{
+    CHAININDEX_BDB,
+    CHAININDEX_LSM,
+};
+
+static CCriticalSection cs_chainindex;
+static int nChainIndexEngine = -1;
+static CLSMStore* pstoreChainIndex = NULL;
+
+static int GetChainIndexEngine()
+{
+    CRITICAL_BLOCK(cs_chainindex)
+    {
+        if (nChainIndexEngine == -1)
+        {
+            string strDataDir = GetDataDir();
+            string strEngine = (mapArgs.count("-dbengine") ? mapArgs["-dbengine"] : "bdb");
+            if (boost::filesystem::exists(strDataDir + "/blkindex/MANIFEST"))
+                nChainIndexEngine = CHAININDEX_LSM;
+            else if (boost::filesystem::exists(strDataDir + "/blkindex.dat"))
+                nChainIndexEngine = CHAININDEX_BDB;
+            else if (strEngine == "lsm")
+                nChainIndexEngine = CHAININDEX_LSM;
+            else
+                nChainIndexEngine = CHAININDEX_BDB;
+            if (strEngine != "bdb" && strEngine != "lsm")
+                printf("Unknown -dbengine=%s\n", strEngine.c_str());
+            else if (mapArgs.count("-dbengine") && (strEngine == "lsm") != (nChainIndexEngine == CHAININDEX_LSM))
+                printf("-dbengine=%s ignored, the existing block index uses the other engine\n", strEngine.c_str());
+            printf("Block index engine: %s\n", nChainIndexEngine == CHAININDEX_LSM ? "lsm" : "bdb");
+        }
+    }
+    return nChainIndexEngine;
+}
+
+static CKeyValueStore* GetChainIndexStore()
+{
+    CRITICAL_BLOCK(cs_chainindex)
+    {
+        if (!pstoreChainIndex)
+        {
+            CLSMStore* pstoreNew = new CLSMStore(GetDataDir() + "/blkindex");
+            if (!pstoreNew->Open())
+            {
+                delete pstoreNew;
+                throw runtime_error("CTxDB() : can't open block index in blkindex/\n");
+            }
+            pstoreChainIndex = pstoreNew;
+        }
+    }
+    return pstoreChainIndex;
+}
+
+static int64 GetChainIndexTables()
+{
+    CRITICAL_BLOCK(cs_chainindex)
+        if (pstoreChainIndex)
+            return pstoreChainIndex->GetTableCount();
+    return 0;
+}
+static CMetricGauge& metricChainIndexTables = GetMetricGauge("pop_chainindex_tables", "Sorted tables in the log-structured block index", "", &GetChainIndexTables);
+
+static void FlushChainIndex(bool fShutdown)
+{
+    // After shutdown the store stays around closed, writes to it fail the
+    // same way they do once the db environment is gone
+    CRITICAL_BLOCK(cs_chainindex)
+    {
+        if (pstoreChainIndex)
+        {
+            if (fShutdown)
+                pstoreChainIndex->Close();
+            else
+                pstoreChainIndex->Flush();
+        }
+    }
+}
+
 void DBFlush(bool fShutdown)
 {
     // Flush log data to the actual data file
     //  on all files that are not in use
     printf("DBFlush(%s)%s\n", fShutdown ? "true" : "false", fDbEnvInit ? "" : " db not started");
+    FlushChainIndex(fShutdown);
     if (!fDbEnvInit)
         return;
+    if (!walletWriteQueue.Sync())
+        printf("ERROR: DBFlush() : queued wallet records could not be written\n");
     CRITICAL_BLOCK(cs_db)
     {
         map<string, int>::iterator mi = mapFileUseCount.begin();
@@ -194,21 +352,273 @@ void DBFlush(bool fShutdown)
 
 
 
+//
+// CTxIndexCache
+//
+
+CTxIndexCache txIndexCache;
+static CMetricCounter& metricTxIndexCacheHits = GetMetricCounter("pop_txindex_cache_hits_total", "Tx index lookups answered from the cache");
+static CMetricCounter& metricTxIndexCacheMisses = GetMetricCounter("pop_txindex_cache_misses_total", "Tx index lookups that went to the store");
+static CMetricGauge& metricTxIndexCacheBytes = GetMetricGauge("pop_txindex_cache_bytes", "Memory used by cached tx index records", "", boost::bind(&CTxIndexCache::GetBytes, &txIndexCache));
+
+void CTxIndexCache::SetMaxBytes(int64 nMaxBytes)
+{
+    nMaxShardMissBytes = nMaxBytes / TXINDEX_CACHE_MISS_SHARE / TXINDEX_CACHE_SHARDS;
+    nMaxShardBytes = nMaxBytes / TXINDEX_CACHE_SHARDS - nMaxShardMissBytes;
+    for (int i = 0; i < TXINDEX_CACHE_SHARDS; i++)
+    {
+        std::lock_guard<std::mutex> lock(pshard[i].mutex);
+        EvictLocked(pshard[i]);
+    }
+}
+
+int64 CTxIndexCache::GetBytes()
+{
+    int64 nBytes = 0;
+    for (int i = 0; i < TXINDEX_CACHE_SHARDS; i++)
+    {
+        std::lock_guard<std::mutex> lock(pshard[i].mutex);
+        nBytes += pshard[i].nBytes + pshard[i].nMissBytes;
+    }
+    return nBytes;
+}
+
+int CTxIndexCache::Get(const uint256& hash, CTxIndex& txindexRet)
+{
+    CShard& shard = GetShard(hash);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    map<uint256, list<CEntry>::iterator>::iterator mi = shard.mapEntries.find(hash);
+    if (mi == shard.mapEntries.end())
+        return -1;
+    const CEntry& entry = *(*mi).second;
+    list<CEntry>& listLRU = shard.ListOf(entry);
+    listLRU.splice(listLRU.begin(), listLRU, (*mi).second);
+    if (!entry.fFound)
+        return 0;
+    txindexRet = entry.txindex;
+    return 1;
+}
+
+uint64 CTxIndexCache::GetGeneration(const uint256& hash)
+{
+    CShard& shard = GetShard(hash);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    return shard.nGeneration;
+}
+
+void CTxIndexCache::Insert(const uint256& hash, const CTxIndex* ptxindex, uint64 nGeneration)
+{
+    CShard& shard = GetShard(hash);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (shard.nGeneration != nGeneration)
+        return;
+    SetLocked(shard, hash, ptxindex);
+}
+
+void CTxIndexCache::Update(const uint256& hash, const CTxIndex* ptxindex)
+{
+    CShard& shard = GetShard(hash);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.nGeneration++;
+    SetLocked(shard, hash, ptxindex);
+}
+
+void CTxIndexCache::Invalidate(const uint256& hash)
+{
+    CShard& shard = GetShard(hash);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.nGeneration++;
+    map<uint256, list<CEntry>::iterator>::iterator mi = shard.mapEntries.find(hash);
+    if (mi == shard.mapEntries.end())
+        return;
+    const CEntry& entry = *(*mi).second;
+    shard.BytesOf(entry) -= entry.nBytes;
+    shard.ListOf(entry).erase((*mi).second);
+    shard.mapEntries.erase(mi);
+}
+
+void CTxIndexCache::SetLocked(CShard& shard, const uint256& hash, const CTxIndex* ptxindex)
+{
+    // To the front of the list for what it is now, which may not be the
+    // one it was on
+    list<CEntry>& listTo = (ptxindex ? shard.listLRU : shard.listMissLRU);
+    map<uint256, list<CEntry>::iterator>::iterator mi = shard.mapEntries.find(hash);
+    if (mi == shard.mapEntries.end())
+    {
+        listTo.push_front(CEntry());
+        mi = shard.mapEntries.insert(make_pair(hash, listTo.begin())).first;
+    }
+    else
+    {
+        const CEntry& entryOld = *(*mi).second;
+        shard.BytesOf(entryOld) -= entryOld.nBytes;
+        listTo.splice(listTo.begin(), shard.ListOf(entryOld), (*mi).second);
+    }
+
+    CEntry& entry = *(*mi).second;
+    entry.hash = hash;
+    entry.fFound = (ptxindex != NULL);
+    if (ptxindex)
+        entry.txindex = *ptxindex;
+    else
+        entry.txindex.SetNull();
+
+    // The entry, its list and map nodes, and the spent array
+    entry.nBytes = sizeof(CEntry) + sizeof(uint256) + 8 * sizeof(void*) + entry.txindex.vSpent.capacity() * sizeof(CDiskTxPos);
+    shard.BytesOf(entry) += entry.nBytes;
+    EvictLocked(shard);
+}
+
+void CTxIndexCache::EvictListLocked(CShard& shard, list<CEntry>& listLRU, int64& nBytes, int64 nMaxBytes)
+{
+    while (nBytes > nMaxBytes && !listLRU.empty())
+    {
+        CEntry& entry = listLRU.back();
+        nBytes -= entry.nBytes;
+        shard.mapEntries.erase(entry.hash);
+        listLRU.pop_back();
+    }
+}
+
+void CTxIndexCache::EvictLocked(CShard& shard)
+{
+    EvictListLocked(shard, shard.listLRU, shard.nBytes, nMaxShardBytes);
+    EvictListLocked(shard, shard.listMissLRU, shard.nMissBytes, nMaxShardMissBytes);
+}
+
+
+
+
 //
 // CTxDB
 //
 
+CTxDB::CTxDB(const char* pszMode) : CDB(!fClient && GetChainIndexEngine() == CHAININDEX_BDB ? "blkindex.dat" : NULL, pszMode)
+{
+    if (fClient)
+        return;
+    if (pdb)
+    {
+        storeBDB.SetDb(pdb);
+        pstore = &storeBDB;
+    }
+    else if (GetChainIndexEngine() == CHAININDEX_LSM)
+    {
+        pstore = GetChainIndexStore();
+        if (strchr(pszMode, 'c') && !Exists(string("version")))
+        {
+            bool fTmp = fReadOnly;
+            fReadOnly = false;
+            WriteVersion(VERSION);
+            fReadOnly = fTmp;
+        }
+    }
+}
+
+bool CTxDB::WrittenInTxn(uint256 hash)
+{
+    if (vBatch.empty())
+        return false;
+    CDataStream ssKey(SER_DISK);
+    ssKey << make_pair(string("tx"), hash);
+    string strKey(ssKey.begin(), ssKey.end());
+    foreach(const CKVBatch& batch, vBatch)
+        if (batch.mapEntries.count(strKey))
+            return true;
+    return false;
+}
+
+void CTxDB::WroteTxIndex(uint256 hash, const CTxIndex* ptxindex)
+{
+    // Inside a transaction the cache is updated when it commits
+    if (vBatch.empty())
+        txIndexCache.Update(hash, ptxindex);
+}
+
+bool CTxDB::TxnCommit()
+{
+    // Pick the tx index records out of the outermost transaction so the
+    // cache can have them once they're in the store
+    map<uint256, CTxIndex> mapWritten;
+    set<uint256> setErased;
+    if (vBatch.size() == 1)
+    {
+        foreach(const PAIRTYPE(string, CKVBatch::CEntry)& item, vBatch.back().mapEntries)
+        {
+            CDataStream ssKey(item.first.data(), item.first.data() + item.first.size(), SER_DISK);
+            string strType;
+            ssKey >> strType;
+            if (strType != "tx")
+                continue;
+            uint256 hash;
+            ssKey >> hash;
+            if (item.second.fErase)
+            {
+                setErased.insert(hash);
+                continue;
+            }
+            CDataStream ssValue(item.second.strValue.data(), item.second.strValue.data() + item.second.strValue.size(), SER_DISK);
+            ssValue >> mapWritten[hash];
+        }
+    }
+
+    bool fRet = CDB::TxnCommit();
+    foreach(const PAIRTYPE(uint256, CTxIndex)& item, mapWritten)
+    {
+        if (fRet)
+            txIndexCache.Update(item.first, &item.second);
+        else
+            txIndexCache.Invalidate(item.first);
+    }
+    foreach(const uint256& hash, setErased)
+    {
+        if (fRet)
+            txIndexCache.Update(hash, NULL);
+        else
+            txIndexCache.Invalidate(hash);
+    }
+    return fRet;
+}
+
 bool CTxDB::ReadTxIndex(uint256 hash, CTxIndex& txindex)
 {
     assert(!fClient);
     txindex.SetNull();
-    return Read(make_pair(string("tx"), hash), txindex);
+
+    // Our own uncommitted writes aren't in the cache
+    if (WrittenInTxn(hash))
+        return Read(make_pair(string("tx"), hash), txindex);
+
+    int nCached = txIndexCache.Get(hash, txindex);
+    if (nCached != -1)
+    {
+        metricTxIndexCacheHits.Inc();
+        return (nCached == 1);
+    }
+    metricTxIndexCacheMisses.Inc();
+
+    uint64 nGeneration = txIndexCache.GetGeneration(hash);
+    int nRet = ReadRecord(make_pair(string("tx"), hash), txindex);
+    if (nRet != 1)
+    {
+        // A read that failed may work next time, only remember that the
+        // store doesn't have it
+        txindex.SetNull();
+        if (nRet == 0)
+            txIndexCache.Insert(hash, NULL, nGeneration);
+        return false;
+    }
+    txIndexCache.Insert(hash, &txindex, nGeneration);
+    return true;
 }
 
 bool CTxDB::UpdateTxIndex(uint256 hash, const CTxIndex& txindex)
 {
     assert(!fClient);
-    return Write(make_pair(string("tx"), hash), txindex);
+    if (!Write(make_pair(string("tx"), hash), txindex))
+        return false;
+    WroteTxIndex(hash, &txindex);
+    return true;
 }
 
 bool CTxDB::AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeight)
@@ -218,7 +628,10 @@ bool CTxDB::AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeigh
     // Add to tx index
     uint256 hash = tx.GetHash();
     CTxIndex txindex(pos, tx.vout.size());
-    return Write(make_pair(string("tx"), hash), txindex);
+    if (!Write(make_pair(string("tx"), hash), txindex))
+        return false;
+    WroteTxIndex(hash, &txindex);
+    return true;
 }
 
 bool CTxDB::EraseTxIndex(const CTransaction& tx)
@@ -226,13 +639,17 @@ bool CTxDB::EraseTxIndex(const CTransaction& tx)
     assert(!fClient);
     uint256 hash = tx.GetHash();
 
-    return Erase(make_pair(string("tx"), hash));
+    if (!Erase(make_pair(string("tx"), hash)))
+        return false;
+    WroteTxIndex(hash, NULL);
+    return true;
 }
 
 bool CTxDB::ContainsTx(uint256 hash)
 {
     assert(!fClient);
-    return Exists(make_pair(string("tx"), hash));
+    CTxIndex txindex;
+    return ReadTxIndex(hash, txindex);
 }
 
 bool CTxDB::ReadOwnerTxes(uint160 hash160, int nMinHeight, vector<CTransaction>& vtx)
@@ -240,30 +657,20 @@ bool CTxDB::ReadOwnerTxes(uint160 hash160, int nMinHeight, vector<CTransaction>&
     assert(!fClient);
     vtx.clear();
 
-    // Get cursor
-    Dbc* pcursor = GetCursor();
-    if (!pcursor)
+    // Get iterator
+    CKVIterator* pitem = GetIterator();
+    if (!pitem)
         return false;
 
-    unsigned int fFlags = DB_SET_RANGE;
-    loop
-    {
-        // Read next record
-        CDataStream ssKey;
-        if (fFlags == DB_SET_RANGE)
-            ssKey << string("owner") << hash160 << CDiskTxPos(0, 0, 0);
-        CDataStream ssValue;
-        int ret = ReadAtCursor(pcursor, ssKey, ssValue, fFlags);
-        fFlags = DB_NEXT;
-        if (ret == DB_NOTFOUND)
-            break;
-        else if (ret != 0)
-        {
-            pcursor->close();
-            return false;
-        }
-
+    CDataStream ssStart(SER_DISK);
+    ssStart << string("owner") << hash160 << CDiskTxPos(0, 0, 0);
+    for (pitem->Seek(string(ssStart.begin(), ssStart.end())); pitem->Valid(); pitem->Next())
+    {
         // Unserialize
+        const string& strKey = pitem->Key();
+        const string& strValue = pitem->Value();
+        CDataStream ssKey(strKey.data(), strKey.data() + strKey.size(), SER_DISK);
+        CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK);
         string strType;
         uint160 hashItem;
         CDiskTxPos pos;
@@ -279,13 +686,16 @@ bool CTxDB::ReadOwnerTxes(uint160 hash160, int nMinHeight, vector<CTransaction>&
             vtx.resize(vtx.size()+1);
             if (!vtx.back().ReadFromDisk(pos))
             {
-                pcursor->close();
+                delete pitem;
                 return false;
             }
         }
     }
 
-    pcursor->close();
+    bool fError = pitem->Error();
+    delete pitem;
+    if (fError)
+        return error("CTxDB::ReadOwnerTxes() : read error in the block index");
     return true;
 }
 
@@ -357,27 +767,20 @@ CBlockIndex* InsertBlockIndex(uint256 hash)
 
 bool CTxDB::LoadBlockIndex()
 {
-    // Get cursor
-    Dbc* pcursor = GetCursor();
-    if (!pcursor)
+    // Get iterator
+    CKVIterator* pitem = GetIterator();
+    if (!pitem)
         return false;
 
-    unsigned int fFlags = DB_SET_RANGE;
-    loop
-    {
-        // Read next record
-        CDataStream ssKey;
-        if (fFlags == DB_SET_RANGE)
-            ssKey << make_pair(string("blockindex"), uint256(0));
-        CDataStream ssValue;
-        int ret = ReadAtCursor(pcursor, ssKey, ssValue, fFlags);
-        fFlags = DB_NEXT;
-        if (ret == DB_NOTFOUND)
-            break;
-        else if (ret != 0)
-            return false;
-
+    CDataStream ssStart(SER_DISK);
+    ssStart << make_pair(string("blockindex"), uint256(0));
+    for (pitem->Seek(string(ssStart.begin(), ssStart.end())); pitem->Valid(); pitem->Next())
+    {
         // Unserialize
+        const string& strKey = pitem->Key();
+        const string& strValue = pitem->Value();
+        CDataStream ssKey(strKey.data(), strKey.data() + strKey.size(), SER_DISK);
+        CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK);
         string strType;
         ssKey >> strType;
         if (strType == "blockindex")
@@ -407,7 +810,10 @@ bool CTxDB::LoadBlockIndex()
             break;
         }
     }
-    pcursor->close();
+    bool fError = pitem->Error();
+    delete pitem;
+    if (fError)
+        return error("CTxDB::LoadBlockIndex() : read error in the block index");
 
     if (!ReadHashBestChain(hashBestChain))
     {
@@ -420,6 +826,7 @@ bool CTxDB::LoadBlockIndex()
         return error("CTxDB::LoadBlockIndex() : blockindex for hashBestChain not found");
     pindexBest = mapBlockIndex[hashBestChain];
     nBestHeight = pindexBest->nHeight;
+    PublishChainSnapshot();
     printf("LoadBlockIndex(): hashBestChain=%s  height=%d\n", hashBestChain.ToString().substr(0,16).c_str(), nBestHeight);
 
     return true;
@@ -511,6 +918,144 @@ bool LoadAddresses()
 // CWalletDB
 //
 
+CWalletWriteQueue walletWriteQueue;
+static CMetricHistogram& metricWalletCommit = GetMetricHistogram("pop_wallet_commit_seconds", "Time spent committing queued wallet writes");
+
+uint64 CWalletWriteQueue::Queue(const opmap_type& mapOps)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    for (opmap_type::const_iterator mi = mapOps.begin(); mi != mapOps.end(); ++mi)
+        mapPending[(*mi).first] = (*mi).second;
+    return ++nQueued;
+}
+
+bool CWalletWriteQueue::Get(const bytes_type& vchKey, COp& opRet)
+{
+    // Newest first, then what's being written now
+    std::lock_guard<std::mutex> lock(mutex);
+    opmap_type::iterator mi = mapPending.find(vchKey);
+    if (mi == mapPending.end())
+    {
+        mi = mapCommitting.find(vchKey);
+        if (mi == mapCommitting.end())
+            return false;
+    }
+    opRet = (*mi).second;
+    return true;
+}
+
+bool CWalletWriteQueue::CommitLocked(std::unique_lock<std::mutex>& lock)
+{
+    fCommitting = true;
+    mapCommitting.swap(mapPending);
+    uint64 nEnd = nQueued;
+
+    // mapCommitting doesn't change until we're done, so readers can still
+    // look in it while it's written
+    lock.unlock();
+    bool fWritten = false;
+    try
+    {
+        CMetricTimer metrictimer(metricWalletCommit);
+        CWalletDB walletdb;
+        fWritten = walletdb.WriteOps(mapCommitting);
+    }
+    catch (std::exception& e) {
+        PrintExceptionContinue(&e, "CWalletWriteQueue::CommitLocked()");
+    }
+    lock.lock();
+
+    if (fWritten)
+    {
+        // Anything that failed before was back in this group
+        nCommitted = nEnd;
+        nFirstFailed = 0;
+    }
+    else
+    {
+        printf("ERROR: CWalletWriteQueue::CommitLocked() : %d wallet records not written\n", mapCommitting.size());
+        if (nFirstFailed == 0)
+            nFirstFailed = nCommitted + 1;
+
+        // Try them again next time, behind anything newer for the same key
+        for (opmap_type::iterator mi = mapCommitting.begin(); mi != mapCommitting.end(); ++mi)
+            mapPending.insert(*mi);
+    }
+    mapCommitting.clear();
+    fCommitting = false;
+    cond.notify_all();
+    return fWritten;
+}
+
+void CWalletWriteQueue::Commit()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!fCommitting && !mapPending.empty())
+        CommitLocked(lock);
+}
+
+bool CWalletWriteQueue::Sync(uint64 nSeq)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    uint64 nTarget = (nSeq == 0 ? nQueued : nSeq);
+    bool fTried = false;
+    while (nCommitted < nTarget)
+    {
+        if (fCommitting)
+            cond.wait(lock);
+        else if (fTried && nFirstFailed != 0 && nFirstFailed <= nTarget)
+            return false;
+        else
+        {
+            CommitLocked(lock);
+            fTried = true;
+        }
+    }
+    return true;
+}
+
+bool CWalletWriteQueue::IsFailing()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return (nFirstFailed != 0);
+}
+
+bool CWalletDB::WriteOps(const CWalletWriteQueue::opmap_type& mapOps)
+{
+    if (!pdb)
+        return false;
+    if (!CDB::TxnBegin())
+        return error("CWalletDB::WriteOps() : TxnBegin failed");
+    for (CWalletWriteQueue::opmap_type::const_iterator mi = mapOps.begin(); mi != mapOps.end(); ++mi)
+    {
+        const CWalletWriteQueue::bytes_type& vchKey = (*mi).first;
+        const CWalletWriteQueue::COp& op = (*mi).second;
+        Dbt datKey((void*)&vchKey[0], vchKey.size());
+        int ret;
+        if (op.fErase)
+        {
+            ret = pdb->del(GetTxn(), &datKey, 0);
+            if (ret == DB_NOTFOUND)
+                ret = 0;
+        }
+        else
+        {
+            // Records written with fOverwrite=false never change, so finding
+            // one already there is fine
+            Dbt datValue((void*)&op.vchValue[0], op.vchValue.size());
+            ret = pdb->put(GetTxn(), &datKey, &datValue, (op.fOverwrite ? 0 : DB_NOOVERWRITE));
+            if (ret == DB_KEYEXIST)
+                ret = 0;
+        }
+        if (ret != 0)
+        {
+            CDB::TxnAbort();
+            return error("CWalletDB::WriteOps() : error %d", ret);
+        }
+    }
+    return CDB::TxnCommit();
+}
+
 bool CWalletDB::LoadWallet()
 {
     vchDefaultKey.clear();
@@ -563,6 +1108,8 @@ bool CWalletDB::LoadWallet()
 
                 if (wtx.GetHash() != hash)
                     printf("Error in wallet.dat, hash mismatch\n");
+                if (wtx.mapValue.count("n"))
+                    wtx.nOrderPos = atoi64(wtx.mapValue["n"]);
 
                 //// debug print
                 //printf("LoadWallet  %s\n", wtx.GetHash().ToString().c_str());
@@ -572,6 +1119,35 @@ bool CWalletDB::LoadWallet()
                 //    wtx.hashBlock.ToString().substr(0,16).c_str(),
                 //    wtx.mapValue["message"].c_str());
             }
+            else if (strType == "prevtx")
+            {
+                // The supporting transactions themselves stay on disk until needed.
+                // Their keys sort ahead of "prevhashes", and "tx" ahead of both.
+                uint256 hash;
+                ssKey >> hash;
+                walletPrevTxStore.SetStored(hash);
+            }
+            else if (strType == "prevhashes")
+            {
+                uint256 hash;
+                ssKey >> hash;
+                map<uint256, CWalletTx>::iterator mi = mapWallet.find(hash);
+                if (mi == mapWallet.end())
+                {
+                    printf("LoadWallet() : prevhashes for unknown tx %s\n", hash.ToString().substr(0,10).c_str());
+                    continue;
+                }
+                CWalletTx& wtx = (*mi).second;
+                vector<uint256> vhashPrev;
+                ssValue >> vhashPrev;
+                foreach(const uint256& hashPrev, vhashPrev)
+                {
+                    if (walletPrevTxStore.AddRef(hashPrev))
+                        wtx.vhashPrev.push_back(hashPrev);
+                    else
+                        printf("LoadWallet() : missing prevtx %s\n", hashPrev.ToString().substr(0,10).c_str());
+                }
+            }
             else if (strType == "key" || strType == "wkey")
             {
                 vector<unsigned char> vchPubKey;
@@ -614,6 +1190,64 @@ bool CWalletDB::LoadWallet()
             }
         }
         pcursor->close();
+
+        // Older wallets keep a copy of the supporting transactions in every tx
+        // record, move them to the shared store
+        vector<uint256> vUpgrade;
+        foreach(const PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
+            if (!item.second.vtxPrev.empty())
+                vUpgrade.push_back(item.first);
+        if (!vUpgrade.empty())
+        {
+            printf("LoadWallet() : moving supporting transactions of %d wallet transactions\n", vUpgrade.size());
+            TxnBegin();
+            foreach(const uint256& hash, vUpgrade)
+            {
+                CWalletTx& wtx = mapWallet[hash];
+                StoreSupportingTransactions(wtx, *this);
+                WriteTx(hash, wtx);
+            }
+            TxnCommit();
+        }
+
+        TxnBegin();
+        int nErased = walletPrevTxStore.EraseUnused(*this);
+        TxnCommit();
+        if (nErased > 0)
+            printf("LoadWallet() : erased %d unused supporting transactions\n", nErased);
+
+        // Transactions from before nOrderPos, or with a position another one
+        // already has, are numbered after the rest in the order they happened
+        set<int64> setOrderPos;
+        int64 nOrderPosNext = 0;
+        vector<pair<pair<int64, uint256>, CWalletTx*> > vUnordered;
+        for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        {
+            CWalletTx& wtx = (*it).second;
+            if (wtx.nOrderPos < 0 || !setOrderPos.insert(wtx.nOrderPos).second)
+                vUnordered.push_back(make_pair(make_pair(wtx.GetTxTime(), (*it).first), &wtx));
+            else
+                nOrderPosNext = max(nOrderPosNext, wtx.nOrderPos + 1);
+        }
+        if (!vUnordered.empty())
+        {
+            printf("LoadWallet() : numbering %d wallet transactions\n", vUnordered.size());
+            sort(vUnordered.begin(), vUnordered.end());
+            TxnBegin();
+            for (int i = 0; i < vUnordered.size(); i++)
+            {
+                CWalletTx& wtx = *vUnordered[i].second;
+                wtx.nOrderPos = nOrderPosNext++;
+                wtx.mapValue["n"] = strprintf("%"PRI64d, wtx.nOrderPos);
+                WriteTx(wtx.GetHash(), wtx);
+            }
+            TxnCommit();
+        }
+
+        // Keys load after tx records, so index the coins once everything is in
+        walletCoinIndex.Rebuild();
+        walletTxTimeIndex.Rebuild();
+        walletReceivedTally.Rebuild();
     }
 
     printf("nFileVersion = %d\n", nFileVersion);
@@ -672,64 +1306,64 @@ bool LoadWallet(bool& fFirstRunRet)
         CWalletDB().WriteDefaultKey(keyUser.GetPubKey());
     }
 
-    CreateThread(ThreadFlushWalletDB, NULL);
+    // Queued wallet writes only reach disk when this runs, so it can't wait
+    // behind rescans and compactions
+    ScheduleTask("commitwallet", CommitWalletDB, WALLET_COMMIT_INTERVAL, 0, 0, -1, TASK_HIGH);
+    if (!mapArgs.count("-noflushwallet"))
+        ScheduleTask("flushwallet", FlushWalletDB, 500, 0, 5000);
     return true;
 }
 
-void ThreadFlushWalletDB(void* parg)
+// Scheduled every WALLET_COMMIT_INTERVAL ms
+void CommitWalletDB()
 {
-    static bool fOneThread;
-    if (fOneThread)
-        return;
-    fOneThread = true;
-    if (mapArgs.count("-noflushwallet"))
-        return;
+    walletWriteQueue.Commit();
+}
 
-    unsigned int nLastSeen = nWalletDBUpdated;
-    unsigned int nLastFlushed = nWalletDBUpdated;
-    int64 nLastWalletUpdate = GetTime();
-    while (!fShutdown)
-    {
-        Sleep(500);
+// Scheduled every half second
+void FlushWalletDB()
+{
+    static unsigned int nLastSeen = nWalletDBUpdated;
+    static unsigned int nLastFlushed = nWalletDBUpdated;
+    static int64 nLastWalletUpdate = GetTime();
 
-        if (nLastSeen != nWalletDBUpdated)
-        {
-            nLastSeen = nWalletDBUpdated;
-            nLastWalletUpdate = GetTime();
-        }
+    if (nLastSeen != nWalletDBUpdated)
+    {
+        nLastSeen = nWalletDBUpdated;
+        nLastWalletUpdate = GetTime();
+    }
 
-        if (nLastFlushed != nWalletDBUpdated && GetTime() - nLastWalletUpdate >= 2)
+    if (nLastFlushed != nWalletDBUpdated && GetTime() - nLastWalletUpdate >= 2)
+    {
+        TRY_CRITICAL_BLOCK(cs_db)
         {
-            TRY_CRITICAL_BLOCK(cs_db)
+            // Don't do this if any databases are in use
+            int nRefCount = 0;
+            map<string, int>::iterator mi = mapFileUseCount.begin();
+            while (mi != mapFileUseCount.end())
             {
-                // Don't do this if any databases are in use
-                int nRefCount = 0;
-                map<string, int>::iterator mi = mapFileUseCount.begin();
-                while (mi != mapFileUseCount.end())
-                {
-                    nRefCount += (*mi).second;
-                    mi++;
-                }
+                nRefCount += (*mi).second;
+                mi++;
+            }
 
-                if (nRefCount == 0 && !fShutdown)
+            if (nRefCount == 0 && !fShutdown)
+            {
+                string strFile = "wallet.dat";
+                map<string, int>::iterator mi = mapFileUseCount.find(strFile);
+                if (mi != mapFileUseCount.end())
                 {
-                    string strFile = "wallet.dat";
-                    map<string, int>::iterator mi = mapFileUseCount.find(strFile);
-                    if (mi != mapFileUseCount.end())
-                    {
-                        printf("%s ", DateTimeStrFormat("%x %H:%M:%S", GetTime()).c_str());
-                        printf("Flushing wallet.dat\n");
-                        nLastFlushed = nWalletDBUpdated;
-                        int64 nStart = GetTimeMillis();
-
-                        // Flush wallet.dat so it's self contained
-                        CloseDb(strFile);
-                        dbenv.txn_checkpoint(0, 0, 0);
-                        dbenv.lsn_reset(strFile.c_str(), 0);
-
-                        mapFileUseCount.erase(mi++);
-                        printf("Flushed wallet.dat %"PRI64d"ms\n", GetTimeMillis() - nStart);
-                    }
+                    printf("%s ", DateTimeStrFormat("%x %H:%M:%S", GetTime()).c_str());
+                    printf("Flushing wallet.dat\n");
+                    nLastFlushed = nWalletDBUpdated;
+                    int64 nStart = GetTimeMillis();
+
+                    // Flush wallet.dat so it's self contained
+                    CloseDb(strFile);
+                    dbenv.txn_checkpoint(0, 0, 0);
+                    dbenv.lsn_reset(strFile.c_str(), 0);
+
+                    mapFileUseCount.erase(mi++);
+                    printf("Flushed wallet.dat %"PRI64d"ms\n", GetTimeMillis() - nStart);
                 }
             }
         }
@@ -10,6 +10,7 @@ class COutPoint;
 class CUser;
 class CReview;
 class CAddress;
+class CMerkleTx;
 class CWalletTx;
 
 extern map<string, string> mapAddressBook;
@@ -20,6 +21,10 @@ extern bool fClient;
 
 
 extern unsigned int nWalletDBUpdated;
+// Bumped by every tx and key write and every change to a wallet coin;
+// GetSnapshotBalance reads it without cs_mapWallet to tell whether its
+// balance is still good
+extern std::atomic<unsigned int> nWalletUpdated;
 extern DbEnv dbenv;
 
 
@@ -36,6 +41,12 @@ protected:
     vector<DbTxn*> vTxn;
     bool fReadOnly;
 
+    // Subclasses that keep their records in a CKeyValueStore set pstore and
+    // everything goes there instead of pdb.  Transactions collect writes in
+    // vBatch and the outermost commit writes them as one batch.
+    CKeyValueStore* pstore;
+    vector<CKVBatch> vBatch;
+
     explicit CDB(const char* pszFile, const char* pszMode="r+");
     ~CDB() { Close(); }
 public:
@@ -44,17 +55,35 @@ private:
     CDB(const CDB&);
     void operator=(const CDB&);
 
+    int ReadFromStore(const string& strKey, string& strValueRet);
+    bool WriteToStore(const string& strKey, const string& strValue, bool fOverwrite);
+    bool EraseFromStore(const string& strKey);
+    bool CommitStoreBatch();
+
 protected:
+    // 1 if read, 0 if there's no such record, -1 if the database couldn't
+    // be read.  A record that doesn't unserialize throws.
     template<typename K, typename T>
-    bool Read(const K& key, T& value)
+    int ReadRecord(const K& key, T& value)
     {
-        if (!pdb)
-            return false;
+        if (!pdb && !pstore)
+            return -1;
 
         // Key
         CDataStream ssKey(SER_DISK);
         ssKey.reserve(1000);
         ssKey << key;
+
+        if (pstore)
+        {
+            string strValue;
+            int nRet = ReadFromStore(string(ssKey.begin(), ssKey.end()), strValue);
+            if (nRet != 1)
+                return nRet;
+            CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK);
+            ssValue >> value;
+            return 1;
+        }
         Dbt datKey(&ssKey[0], ssKey.size());
 
         // Read
@@ -63,7 +92,7 @@ protected:
         int ret = pdb->get(GetTxn(), &datKey, &datValue, 0);
         memset(datKey.get_data(), 0, datKey.get_size());
         if (datValue.get_data() == NULL)
-            return false;
+            return ((ret == DB_NOTFOUND || ret == DB_KEYEMPTY) ? 0 : -1);
 
         // Unserialize value
         CDataStream ssValue((char*)datValue.get_data(), (char*)datValue.get_data() + datValue.get_size(), SER_DISK);
@@ -72,13 +101,19 @@ protected:
         // Clear and free memory
         memset(datValue.get_data(), 0, datValue.get_size());
         free(datValue.get_data());
-        return (ret == 0);
+        return (ret == 0 ? 1 : -1);
+    }
+
+    template<typename K, typename T>
+    bool Read(const K& key, T& value)
+    {
+        return (ReadRecord(key, value) == 1);
     }
 
     template<typename K, typename T>
     bool Write(const K& key, const T& value, bool fOverwrite=true)
     {
-        if (!pdb)
+        if (!pdb && !pstore)
             return false;
         if (fReadOnly)
             assert(("Write called on database in read-only mode", false));
@@ -87,12 +122,15 @@ protected:
         CDataStream ssKey(SER_DISK);
         ssKey.reserve(1000);
         ssKey << key;
-        Dbt datKey(&ssKey[0], ssKey.size());
 
         // Value
         CDataStream ssValue(SER_DISK);
         ssValue.reserve(10000);
         ssValue << value;
+
+        if (pstore)
+            return WriteToStore(string(ssKey.begin(), ssKey.end()), string(ssValue.begin(), ssValue.end()), fOverwrite);
+        Dbt datKey(&ssKey[0], ssKey.size());
         Dbt datValue(&ssValue[0], ssValue.size());
 
         // Write
@@ -107,7 +145,7 @@ protected:
     template<typename K>
     bool Erase(const K& key)
     {
-        if (!pdb)
+        if (!pdb && !pstore)
             return false;
         if (fReadOnly)
             assert(("Erase called on database in read-only mode", false));
@@ -116,6 +154,9 @@ protected:
         CDataStream ssKey(SER_DISK);
         ssKey.reserve(1000);
         ssKey << key;
+
+        if (pstore)
+            return EraseFromStore(string(ssKey.begin(), ssKey.end()));
         Dbt datKey(&ssKey[0], ssKey.size());
 
         // Erase
@@ -129,13 +170,19 @@ protected:
     template<typename K>
     bool Exists(const K& key)
     {
-        if (!pdb)
+        if (!pdb && !pstore)
             return false;
 
         // Key
         CDataStream ssKey(SER_DISK);
         ssKey.reserve(1000);
         ssKey << key;
+
+        if (pstore)
+        {
+            string strValue;
+            return (ReadFromStore(string(ssKey.begin(), ssKey.end()), strValue) == 1);
+        }
         Dbt datKey(&ssKey[0], ssKey.size());
 
         // Exists
@@ -157,6 +204,14 @@ protected:
         return pcursor;
     }
 
+    // Ordered scan of a store, sees the store as of when it's created
+    CKVIterator* GetIterator()
+    {
+        if (!pstore)
+            return NULL;
+        return pstore->NewIterator();
+    }
+
     int ReadAtCursor(Dbc* pcursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags=DB_NEXT)
     {
         // Read at cursor
@@ -207,6 +262,11 @@ protected:
 public:
     bool TxnBegin()
     {
+        if (pstore)
+        {
+            vBatch.push_back(CKVBatch());
+            return true;
+        }
         if (!pdb)
             return false;
         DbTxn* ptxn = NULL;
@@ -219,6 +279,8 @@ public:
 
     bool TxnCommit()
     {
+        if (pstore)
+            return CommitStoreBatch();
         if (!pdb)
             return false;
         if (vTxn.empty())
@@ -230,6 +292,13 @@ public:
 
     bool TxnAbort()
     {
+        if (pstore)
+        {
+            if (vBatch.empty())
+                return false;
+            vBatch.pop_back();
+            return true;
+        }
         if (!pdb)
             return false;
         if (vTxn.empty())
@@ -261,11 +330,17 @@ public:
 class CTxDB : public CDB
 {
 public:
-    CTxDB(const char* pszMode="r+") : CDB(!fClient ? "blkindex.dat" : NULL, pszMode) { }
+    CTxDB(const char* pszMode="r+");
 private:
     CTxDB(const CTxDB&);
     void operator=(const CTxDB&);
+
+    CBDBStore storeBDB;
+
+    bool WrittenInTxn(uint256 hash);
+    void WroteTxIndex(uint256 hash, const CTxIndex* ptxindex);
 public:
+    bool TxnCommit();
     bool ReadTxIndex(uint256 hash, CTxIndex& txindex);
     bool UpdateTxIndex(uint256 hash, const CTxIndex& txindex);
     bool AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeight);
@@ -306,14 +381,196 @@ bool LoadAddresses();
 
 
 
+//
+// Wallet writes are queued and committed to wallet.dat in groups, one db
+// transaction and log flush for everything queued since the last commit
+// instead of one per record.  Writes to the same key are coalesced.  The
+// queue is committed at least every WALLET_COMMIT_INTERVAL ms, and Sync
+// commits it right away for callers that need their writes on disk before
+// going on.  If a commit is already running, Sync waits for it and then
+// commits whatever queued up behind it, so concurrent callers share a flush.
+// Reads check the queue first, so the wallet always sees its own writes.
+//
+// A commit that fails puts its records back in the queue to be tried again
+// with the next one.  Until a commit succeeds, Sync fails for anything
+// queued at or after the first failed group, and writes report failure.
+//
+static const int64 WALLET_COMMIT_INTERVAL = 50;
+
+class CWalletWriteQueue
+{
+public:
+    typedef vector<char, secure_allocator<char> > bytes_type;
+    struct COp
+    {
+        bool fErase;
+        bool fOverwrite;
+        bytes_type vchValue;
+    };
+    typedef map<bytes_type, COp> opmap_type;
+
+protected:
+    std::mutex mutex;
+    std::condition_variable cond;
+    opmap_type mapPending;
+    opmap_type mapCommitting;
+    uint64 nQueued;
+    uint64 nCommitted;
+    uint64 nFirstFailed;
+    bool fCommitting;
+
+    bool CommitLocked(std::unique_lock<std::mutex>& lock);
+
+public:
+    CWalletWriteQueue()
+    {
+        nQueued = 0;
+        nCommitted = 0;
+        nFirstFailed = 0;
+        fCommitting = false;
+    }
+
+    // Returns the sequence number to pass to Sync
+    uint64 Queue(const opmap_type& mapOps);
+    bool Get(const bytes_type& vchKey, COp& opRet);
+    void Commit();
+
+    // Returns when the groups up to nSeq are on disk, or all of them so far
+    // if it's 0.  False if they couldn't be written.
+    bool Sync(uint64 nSeq=0);
+    bool IsFailing();
+};
+
+extern CWalletWriteQueue walletWriteQueue;
+
+
+
 class CWalletDB : public CDB
 {
 public:
-    CWalletDB(const char* pszMode="r+") : CDB("wallet.dat", pszMode) { }
+    CWalletDB(const char* pszMode="r+") : CDB("wallet.dat", pszMode) { nTxnDepth = 0; nLastQueued = 0; }
 private:
     CWalletDB(const CWalletDB&);
     void operator=(const CWalletDB&);
+
+    friend class CWalletWriteQueue;
+    int nTxnDepth;
+    CWalletWriteQueue::opmap_type mapTxnOps;
+    uint64 nLastQueued;
+
+    bool WriteOps(const CWalletWriteQueue::opmap_type& mapOps);
+
+protected:
+    // Reads and writes go through walletWriteQueue.  A db transaction
+    // collects its writes and queues them together when it commits.  Writes
+    // fail while the queue can't be committed; Sync says when they're on disk.
+    template<typename K>
+    CWalletWriteQueue::bytes_type SerializeKey(const K& key)
+    {
+        CDataStream ssKey(SER_DISK);
+        ssKey.reserve(1000);
+        ssKey << key;
+        return CWalletWriteQueue::bytes_type(ssKey.begin(), ssKey.end());
+    }
+
+    bool QueueOp(const CWalletWriteQueue::bytes_type& vchKey, const CWalletWriteQueue::COp& op)
+    {
+        if (nTxnDepth > 0)
+        {
+            mapTxnOps[vchKey] = op;
+        }
+        else
+        {
+            CWalletWriteQueue::opmap_type mapOps;
+            mapOps[vchKey] = op;
+            nLastQueued = walletWriteQueue.Queue(mapOps);
+        }
+        return !walletWriteQueue.IsFailing();
+    }
+
+    template<typename K, typename T>
+    bool Read(const K& key, T& value)
+    {
+        CWalletWriteQueue::bytes_type vchKey = SerializeKey(key);
+        CWalletWriteQueue::COp op;
+        CWalletWriteQueue::opmap_type::iterator mi = mapTxnOps.find(vchKey);
+        if (mi != mapTxnOps.end())
+            op = (*mi).second;
+        else if (!walletWriteQueue.Get(vchKey, op))
+            return CDB::Read(key, value);
+        if (op.fErase)
+            return false;
+        CDataStream ssValue(op.vchValue.begin(), op.vchValue.end(), SER_DISK);
+        ssValue >> value;
+        return true;
+    }
+
+    template<typename K, typename T>
+    bool Write(const K& key, const T& value, bool fOverwrite=true)
+    {
+        if (!pdb)
+            return false;
+        if (fReadOnly)
+            assert(("Write called on database in read-only mode", false));
+        CDataStream ssValue(SER_DISK);
+        ssValue.reserve(10000);
+        ssValue << value;
+        CWalletWriteQueue::COp op;
+        op.fErase = false;
+        op.fOverwrite = fOverwrite;
+        op.vchValue.assign(ssValue.begin(), ssValue.end());
+        return QueueOp(SerializeKey(key), op);
+    }
+
+    template<typename K>
+    bool Erase(const K& key)
+    {
+        if (!pdb)
+            return false;
+        if (fReadOnly)
+            assert(("Erase called on database in read-only mode", false));
+        CWalletWriteQueue::COp op;
+        op.fErase = true;
+        op.fOverwrite = true;
+        return QueueOp(SerializeKey(key), op);
+    }
+
 public:
+    bool TxnBegin()
+    {
+        if (!pdb)
+            return false;
+        nTxnDepth++;
+        return true;
+    }
+
+    bool TxnCommit()
+    {
+        if (nTxnDepth == 0)
+            return false;
+        if (--nTxnDepth == 0 && !mapTxnOps.empty())
+        {
+            nLastQueued = walletWriteQueue.Queue(mapTxnOps);
+            mapTxnOps.clear();
+        }
+        return !walletWriteQueue.IsFailing();
+    }
+
+    bool TxnAbort()
+    {
+        if (nTxnDepth == 0)
+            return false;
+        nTxnDepth = 0;
+        mapTxnOps.clear();
+        return true;
+    }
+
+    // Returns when everything this object has queued is on disk
+    bool Sync()
+    {
+        return walletWriteQueue.Sync(nLastQueued);
+    }
+
     bool ReadName(const string& strAddress, string& strName)
     {
         strName = "";
@@ -346,15 +603,46 @@ public:
     bool WriteTx(uint256 hash, const CWalletTx& wtx)
     {
         nWalletDBUpdated++;
+        nWalletUpdated++;
         return Write(make_pair(string("tx"), hash), wtx);
     }
 
     bool EraseTx(uint256 hash)
     {
         nWalletDBUpdated++;
+        nWalletUpdated++;
         return Erase(make_pair(string("tx"), hash));
     }
 
+    bool ReadPrevTx(uint256 hash, CMerkleTx& tx)
+    {
+        return Read(make_pair(string("prevtx"), hash), tx);
+    }
+
+    bool WritePrevTx(uint256 hash, const CMerkleTx& tx)
+    {
+        nWalletDBUpdated++;
+        return Write(make_pair(string("prevtx"), hash), tx);
+    }
+
+    bool ErasePrevTx(uint256 hash)
+    {
+        nWalletDBUpdated++;
+        return Erase(make_pair(string("prevtx"), hash));
+    }
+
+    bool WritePrevHashes(uint256 hash, const vector<uint256>& vhashPrev)
+    {
+        nWalletDBUpdated++;
+        return Write(make_pair(string("prevhashes"), hash), vhashPrev);
+    }
+
+    bool ErasePrevHashes(uint256 hash)
+    {
+        nWalletDBUpdated++;
+        return Erase(make_pair(string("prevhashes"), hash));
+    }
+
     bool ReadKey(const vector<unsigned char>& vchPubKey, CPrivKey& vchPrivKey)
     {
         vchPrivKey.clear();
@@ -364,6 +652,7 @@ public:
     bool WriteKey(const vector<unsigned char>& vchPubKey, const CPrivKey& vchPrivKey)
     {
         nWalletDBUpdated++;
+        nWalletUpdated++;
         return Write(make_pair(string("key"), vchPubKey), vchPrivKey, false);
     }
 
@@ -380,6 +669,23 @@ public:
         return Write(string("defaultkey"), vchPubKey);
     }
 
+    bool ReadRescanHeight(int& nHeight)
+    {
+        return Read(string("rescanheight"), nHeight);
+    }
+
+    bool WriteRescanHeight(int nHeight)
+    {
+        nWalletDBUpdated++;
+        return Write(string("rescanheight"), nHeight);
+    }
+
+    bool EraseRescanHeight()
+    {
+        nWalletDBUpdated++;
+        return Erase(string("rescanheight"));
+    }
+
     template<typename T>
     bool ReadSetting(const string& strKey, T& value)
     {
@@ -49,6 +49,10 @@
 #include <set>
 #include <algorithm>
 #include <numeric>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 #include <boost/foreach.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/tuple/tuple.hpp>
@@ -88,6 +92,9 @@
 #ifdef __BSD__
 #include <netinet/in.h>
 #endif
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 
 #pragma hdrstop
@@ -102,6 +109,7 @@ using namespace boost;
 #include "bignum.h"
 #include "base58.h"
 #include "script.h"
+#include "kvstore.h"
 #include "db.h"
 #include "net.h"
 #include "irc.h"
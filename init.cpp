@@ -36,6 +36,7 @@ void Shutdown(void* parg)
         CreateThread(ExitTimeout, NULL);
         Sleep(50);
         printf("Bitcoin exiting\n\n");
+        FlushDebugLog();
         fExit = true;
         exit(0);
     }
@@ -400,6 +401,19 @@ bool CMyApp::OnInit2()
             "  -connect=<ip>   \t  " + _("Connect only to the specified node\n") +
             "  -server         \t  " + _("Accept command line and JSON-RPC commands\n") +
             "  -daemon         \t  " + _("Run in the background as a daemon and accept commands\n") +
+            "  -rpcthreads=<n> \t  " + _("Number of threads serving JSON-RPC connections (default: 4)\n") +
+            "  -rpcqueue=<n>   \t  " + _("Number of JSON-RPC requests to queue when all threads are busy (default: 16)\n") +
+            "  -rescan         \t  " + _("Rescan the block chain for missing wallet transactions\n") +
+            "  -dbengine=<name> \t  " + _("Block index storage for a new data directory, bdb or lsm (default: bdb)\n") +
+            "  -txindexcache=<n> \t  " + _("Megabytes of transaction index records to keep in memory (default: 32)\n") +
+            "  -debug=<cat>    \t  " + _("Log debug output for category net, rpc, wallet, pop or all\n") +
+            "  -loglevel=<level> \t  " + _("Log error, warning, info or debug messages and more severe (default: info)\n") +
+            "  -trace          \t  " + _("Record block, transaction and message events to trace.dat\n") +
+            "  -lockstats      \t  " + _("Record lock wait and hold times for getlockstats\n") +
+            "  -metricsport=<port> \t  " + _("Serve Prometheus metrics over HTTP on localhost <port>\n") +
+            "  -rawport=<port> \t  " + _("Serve raw blocks and transactions over HTTP on localhost <port>\n") +
+            "  -pubport=<port> \t  " + _("Send new blocks and transactions to subscribers on localhost <port>\n") +
+            "  -pubqueue=<n>   \t  " + _("Megabytes to queue for a slow subscriber before dropping the oldest messages (default: 64)\n") +
             "  -?              \t  " + _("This help message\n");
 
 #if defined(__WXMSW__) && wxUSE_GUI
@@ -417,11 +431,50 @@ bool CMyApp::OnInit2()
         strlcpy(pszSetDataDir, mapArgs["-datadir"].c_str(), sizeof(pszSetDataDir));
 
     if (mapArgs.count("-debug"))
+    {
         fDebug = true;
+        foreach(const string& strCategory, mapMultiArgs["-debug"])
+        {
+            if (strCategory == "" || strCategory == "1" || strCategory == "all")
+                nLogCategories |= LOG_ALL;
+            else if (strCategory == "net")
+                nLogCategories |= LOG_NET;
+            else if (strCategory == "rpc")
+                nLogCategories |= LOG_RPC;
+            else if (strCategory == "wallet")
+                nLogCategories |= LOG_WALLET;
+            else if (strCategory == "pop")
+                nLogCategories |= LOG_POP;
+        }
+    }
+
+    if (mapArgs.count("-loglevel"))
+    {
+        string strLevel = mapArgs["-loglevel"];
+        if (strLevel == "error")
+            nLogLevel = LOGLEVEL_ERROR;
+        else if (strLevel == "warning")
+            nLogLevel = LOGLEVEL_WARNING;
+        else if (strLevel == "info")
+            nLogLevel = LOGLEVEL_INFO;
+        else if (strLevel == "debug")
+            nLogLevel = LOGLEVEL_DEBUG;
+        else
+            fprintf(stderr, "Unknown -loglevel=%s, using info\n", strLevel.c_str());
+    }
 
     if (mapArgs.count("-printtodebugger"))
         fPrintToDebugger = true;
 
+    if (mapArgs.count("-trace"))
+        OpenTraceFile();
+
+    if (mapArgs.count("-lockstats"))
+        fLockStats = true;
+
+    if (mapArgs.count("-txindexcache"))
+        txIndexCache.SetMaxBytes(atoi64(mapArgs["-txindexcache"]) * 1000000);
+
     if (!fDebug && !pszSetDataDir[0])
         ShrinkDebugFile();
     printf("\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n");
@@ -524,6 +577,7 @@ bool CMyApp::OnInit2()
         printf("mapKeys.size() = %d\n",         mapKeys.size());
         printf("mapPubKeys.size() = %d\n",      mapPubKeys.size());
         printf("mapWallet.size() = %d\n",       mapWallet.size());
+        printf("walletPrevTxStore.size() = %d\n", walletPrevTxStore.size());
         printf("mapAddressBook.size() = %d\n",  mapAddressBook.size());
 
     if (!strErrors.empty())
@@ -532,6 +586,20 @@ bool CMyApp::OnInit2()
         return false;
     }
 
+    // Rescan the block chain for wallet transactions, or finish one that was interrupted
+    int nRescanHeight = -1;
+    if (mapArgs.count("-rescan"))
+        nRescanHeight = 0;
+    else if (CWalletDB("r").ReadRescanHeight(nRescanHeight))
+        printf("Resuming wallet rescan at height %d\n", nRescanHeight);
+    if (nRescanHeight >= 0)
+    {
+        printf("Rescanning...\n");
+        nStart = GetTimeMillis();
+        ScanForWalletTransactions(nRescanHeight);
+        printf(" rescan      %15"PRI64d"ms\n", GetTimeMillis() - nStart);
+    }
+
     // Add wallet transactions that aren't already in a block to mapTransactions
     ReacceptWalletTransactions();
 
@@ -614,6 +682,20 @@ bool CMyApp::OnInit2()
     if (mapArgs.count("-server") || fDaemon)
         CreateThread(ThreadRPCServer, NULL);
 
+    if (mapArgs.count("-metricsport"))
+        CreateThread(ThreadMetricsServer, NULL);
+
+    if (mapArgs.count("-rawport"))
+        CreateThread(ThreadRawServer, NULL);
+
+    if (mapArgs.count("-pubport"))
+        CreateThread(ThreadNotifyPublisher, NULL);
+
+    // Periodic jobs, off the message thread
+    ScheduleTask("resendwallettx", ResendWalletTransactions, 5 * 60 * 1000, 115 * 60 * 1000, 10 * 1000);
+    // First run once the first peers are connected, like it used to from SendMessages
+    ScheduleTask("rebroadcastaddr", RebroadcastAddress, 24 * 60 * 60 * 1000, 0, 1000, 60 * 1000);
+
     if (fFirstRun)
         SetStartOnSystemStartup(true);
 
@@ -0,0 +1,1462 @@
+// Copyright (c) 2025 GoldcoinPoP Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+
+#include "headers.h"
+#ifndef __WXMSW__
+#include <fcntl.h>
+#endif
+
+
+
+static unsigned int pnCRCTable[256];
+
+class CCRCInit
+{
+public:
+    CCRCInit()
+    {
+        for (unsigned int i = 0; i < 256; i++)
+        {
+            unsigned int c = i;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? 0xedb88320 ^ (c >> 1) : (c >> 1);
+            pnCRCTable[i] = c;
+        }
+    }
+}
+instance_of_ccrcinit;
+
+// CRC-32 (IEEE)
+static unsigned int Checksum(const char* pch, size_t nSize)
+{
+    unsigned int nCRC = 0xffffffff;
+    for (size_t i = 0; i < nSize; i++)
+        nCRC = pnCRCTable[(nCRC ^ (unsigned char)pch[i]) & 0xff] ^ (nCRC >> 8);
+    return nCRC ^ 0xffffffff;
+}
+
+static bool FileCommit(FILE* file)
+{
+    if (fflush(file) != 0)
+        return false;
+#ifdef __WXMSW__
+    return (_commit(_fileno(file)) == 0);
+#else
+    return (fsync(fileno(file)) == 0);
+#endif
+}
+
+static bool FileTruncate(FILE* file, int64 nSize)
+{
+#ifdef __WXMSW__
+    return (_chsize(_fileno(file), nSize) == 0);
+#else
+    return (ftruncate(fileno(file), nSize) == 0);
+#endif
+}
+
+// Make creating, renaming or removing a file in the directory durable
+static void DirCommit(const string& strDir)
+{
+#ifndef __WXMSW__
+    int fd = open(strDir.c_str(), O_RDONLY);
+    if (fd >= 0)
+    {
+        fsync(fd);
+        close(fd);
+    }
+#endif
+}
+
+static bool RenameOver(const string& strFrom, const string& strTo)
+{
+#ifdef __WXMSW__
+    return MoveFileExA(strFrom.c_str(), strTo.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    if (rename(strFrom.c_str(), strTo.c_str()) != 0)
+        return false;
+    DirCommit(boost::filesystem::path(strTo).parent_path().string());
+    return true;
+#endif
+}
+
+static bool ReadWholeFile(const string& strPath, string& strRet)
+{
+    strRet.clear();
+    FILE* file = fopen(strPath.c_str(), "rb");
+    if (!file)
+        return false;
+    char pch[65536];
+    size_t n;
+    while ((n = fread(pch, 1, sizeof(pch), file)) > 0)
+        strRet.append(pch, n);
+    bool fRet = !ferror(file);
+    fclose(file);
+    return fRet;
+}
+
+
+
+
+//
+// CBDBStore
+//
+
+class CBDBIterator : public CKVIterator
+{
+protected:
+    Dbc* pcursor;
+    bool fValid;
+    bool fError;
+    string strKey;
+    string strValue;
+
+    void Read(unsigned int fFlags)
+    {
+        fValid = false;
+        if (!pcursor)
+            return;
+        Dbt datKey;
+        if (fFlags == DB_SET_RANGE)
+        {
+            datKey.set_data(&strKey[0]);
+            datKey.set_size(strKey.size());
+        }
+        Dbt datValue;
+        datKey.set_flags(DB_DBT_MALLOC);
+        datValue.set_flags(DB_DBT_MALLOC);
+        int ret = pcursor->get(&datKey, &datValue, fFlags);
+        if (ret != 0 || datKey.get_data() == NULL || datValue.get_data() == NULL)
+        {
+            if (ret != DB_NOTFOUND)
+                fError = true;
+            return;
+        }
+        strKey.assign((char*)datKey.get_data(), datKey.get_size());
+        strValue.assign((char*)datValue.get_data(), datValue.get_size());
+        free(datKey.get_data());
+        free(datValue.get_data());
+        fValid = true;
+    }
+
+public:
+    CBDBIterator(Db* pdb)
+    {
+        pcursor = NULL;
+        fValid = false;
+        fError = false;
+        if (pdb && pdb->cursor(NULL, &pcursor, 0) != 0)
+            pcursor = NULL;
+        if (!pcursor)
+            fError = true;
+    }
+
+    ~CBDBIterator()
+    {
+        if (pcursor)
+            pcursor->close();
+    }
+
+    void Seek(const string& strKeyIn)
+    {
+        fError = !pcursor;
+
+        // DB_SET_RANGE needs a non-empty key
+        if (strKeyIn.empty())
+        {
+            Read(DB_FIRST);
+            return;
+        }
+        strKey = strKeyIn;
+        Read(DB_SET_RANGE);
+    }
+
+    bool Valid() const { return fValid; }
+    void Next() { if (fValid) Read(DB_NEXT); }
+    const string& Key() const { return strKey; }
+    const string& Value() const { return strValue; }
+    bool Error() const { return fError; }
+};
+
+int CBDBStore::Lookup(const string& strKey, string& strValueRet, const CKVSnapshot* psnapshot)
+{
+    if (!pdb)
+        return -1;
+    Dbt datKey((void*)strKey.data(), strKey.size());
+    Dbt datValue;
+    datValue.set_flags(DB_DBT_MALLOC);
+    int ret = pdb->get(NULL, &datKey, &datValue, 0);
+    if (datValue.get_data() == NULL)
+        return ((ret == DB_NOTFOUND || ret == DB_KEYEMPTY) ? 0 : -1);
+    strValueRet.assign((char*)datValue.get_data(), datValue.get_size());
+    free(datValue.get_data());
+    return (ret == 0 ? 1 : -1);
+}
+
+bool CBDBStore::Write(const CKVBatch& batch, bool fSync)
+{
+    if (!pdb)
+        return false;
+    if (batch.empty())
+        return true;
+    DbTxn* ptxn = NULL;
+    if (dbenv.txn_begin(NULL, &ptxn, fSync ? 0 : DB_TXN_NOSYNC) != 0 || !ptxn)
+        return false;
+    foreach(const PAIRTYPE(string, CKVBatch::CEntry)& item, batch.mapEntries)
+    {
+        Dbt datKey((void*)item.first.data(), item.first.size());
+        int ret;
+        if (item.second.fErase)
+        {
+            ret = pdb->del(ptxn, &datKey, 0);
+            if (ret == DB_NOTFOUND)
+                ret = 0;
+        }
+        else
+        {
+            Dbt datValue((void*)item.second.strValue.data(), item.second.strValue.size());
+            ret = pdb->put(ptxn, &datKey, &datValue, 0);
+        }
+        if (ret != 0)
+        {
+            ptxn->abort();
+            return false;
+        }
+    }
+    return (ptxn->commit(0) == 0);
+}
+
+CKVIterator* CBDBStore::NewIterator(const CKVSnapshot* psnapshot)
+{
+    return new CBDBIterator(pdb);
+}
+
+bool CBDBStore::Flush()
+{
+    return (dbenv.log_flush(NULL) == 0);
+}
+
+
+
+
+//
+// CLSMStore
+//
+
+static const uint64 LSM_TABLE_MAGIC = 0x31454c4254504f50ULL; // "POPTBLE1"
+// Version 2 replays every log from the one the manifest names, version 1
+// only had the one log
+static const int LSM_MANIFEST_VERSION = 2;
+static const unsigned int LSM_FOOTER_SIZE = 28;
+static const int LSM_BLOOM_BITS_PER_KEY = 10;
+static const int LSM_BLOOM_HASHES = 7;
+static const unsigned int LSM_MAX_RECORD = 0x10000000;
+
+static uint64 BloomHash(const string& strKey)
+{
+    // FNV-1a
+    uint64 h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < strKey.size(); i++)
+    {
+        h ^= (unsigned char)strKey[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static void SerializeBatch(CDataStream& ss, const CKVBatch& batch)
+{
+    WriteCompactSize(ss, batch.mapEntries.size());
+    foreach(const PAIRTYPE(string, CKVBatch::CEntry)& item, batch.mapEntries)
+    {
+        unsigned char chErase = item.second.fErase;
+        ss << item.first << chErase << item.second.strValue;
+    }
+}
+
+static void UnserializeBatch(CDataStream& ss, CKVBatch& batch)
+{
+    uint64 nCount = ReadCompactSize(ss);
+    for (uint64 i = 0; i < nCount; i++)
+    {
+        string strKey;
+        unsigned char chErase;
+        string strValue;
+        ss >> strKey >> chErase >> strValue;
+        if (chErase)
+            batch.Erase(strKey);
+        else
+            batch.Put(strKey, strValue);
+    }
+}
+
+
+
+class CLSMStore::CMemTable : public CKVBatch
+{
+public:
+    // Set when a writer froze it and switched logs: everything in it is in
+    // the logs before this one.  0 if a reader froze it mid-log.
+    unsigned int nLogEnd;
+
+    CMemTable()
+    {
+        nLogEnd = 0;
+    }
+};
+
+class CLSMStore::CTable
+{
+public:
+    unsigned int nFile;
+    int nLevel;
+    string strPath;
+    uint64 nDataEnd;
+    uint64 nEntries;
+    vector<string> vIndexKey;
+    vector<uint64> vIndexPos;
+    vector<unsigned int> vIndexChecksum;
+    vector<unsigned char> vBloom;
+    std::atomic<bool> fObsolete;
+
+protected:
+    FILE* file;
+    std::mutex mutex;
+
+public:
+    typedef vector<pair<string, CKVBatch::CEntry> > block_type;
+
+    CTable(unsigned int nFileIn, int nLevelIn, const string& strPathIn)
+    {
+        nFile = nFileIn;
+        nLevel = nLevelIn;
+        strPath = strPathIn;
+        nDataEnd = 0;
+        nEntries = 0;
+        fObsolete = false;
+        file = NULL;
+    }
+
+    ~CTable()
+    {
+        if (file)
+            fclose(file);
+        // Merged into a newer table and no longer read by anyone
+        if (fObsolete)
+            unlink(strPath.c_str());
+    }
+
+    bool Open()
+    {
+        file = fopen(strPath.c_str(), "rb");
+        if (!file)
+            return error("CTable::Open() : can't open %s", strPath.c_str());
+        if (fseek(file, 0, SEEK_END) != 0)
+            return error("CTable::Open() : fseek failed on %s", strPath.c_str());
+        int64 nFileSize = ftell(file);
+        if (nFileSize < LSM_FOOTER_SIZE)
+            return error("CTable::Open() : %s is truncated", strPath.c_str());
+
+        // Footer
+        char pchFooter[LSM_FOOTER_SIZE];
+        if (fseek(file, nFileSize - LSM_FOOTER_SIZE, SEEK_SET) != 0 || fread(pchFooter, 1, LSM_FOOTER_SIZE, file) != LSM_FOOTER_SIZE)
+            return error("CTable::Open() : can't read footer of %s", strPath.c_str());
+        CDataStream ssFooter(pchFooter, pchFooter + LSM_FOOTER_SIZE, SER_DISK);
+        uint64 nIndexPos;
+        unsigned int nIndexChecksum;
+        uint64 nMagic;
+        ssFooter >> nIndexPos >> nEntries >> nIndexChecksum >> nMagic;
+        if (nMagic != LSM_TABLE_MAGIC || nIndexPos > (uint64)(nFileSize - LSM_FOOTER_SIZE))
+            return error("CTable::Open() : bad footer in %s", strPath.c_str());
+
+        // Index and bloom filter
+        string strIndex(nFileSize - LSM_FOOTER_SIZE - nIndexPos, '\0');
+        if (fseek(file, nIndexPos, SEEK_SET) != 0 || (!strIndex.empty() && fread(&strIndex[0], 1, strIndex.size(), file) != strIndex.size()))
+            return error("CTable::Open() : can't read index of %s", strPath.c_str());
+        if (Checksum(strIndex.data(), strIndex.size()) != nIndexChecksum)
+            return error("CTable::Open() : index checksum mismatch in %s", strPath.c_str());
+        try
+        {
+            CDataStream ssIndex(strIndex.data(), strIndex.data() + strIndex.size(), SER_DISK);
+            ssIndex >> vIndexKey >> vIndexPos >> vIndexChecksum >> vBloom;
+        }
+        catch (std::exception& e)
+        {
+            return error("CTable::Open() : can't parse index of %s", strPath.c_str());
+        }
+        if (vIndexPos.size() != vIndexKey.size() || vIndexChecksum.size() != vIndexKey.size())
+            return error("CTable::Open() : bad index in %s", strPath.c_str());
+        nDataEnd = nIndexPos;
+        return true;
+    }
+
+    bool MayContain(const string& strKey) const
+    {
+        if (vBloom.empty())
+            return true;
+        uint64 nBits = vBloom.size() * 8;
+        uint64 h = BloomHash(strKey);
+        uint64 h1 = h & 0xffffffff;
+        uint64 h2 = (h >> 32) | 1;
+        for (int i = 0; i < LSM_BLOOM_HASHES; i++)
+        {
+            uint64 nBit = (h1 + i * h2) % nBits;
+            if (!(vBloom[nBit / 8] & (1 << (nBit % 8))))
+                return false;
+        }
+        return true;
+    }
+
+    int GetBlockCount() const { return vIndexKey.size(); }
+
+    // Last block whose first key is <= strKey, -1 if strKey is before them all
+    int FindBlock(const string& strKey) const
+    {
+        vector<string>::const_iterator it = upper_bound(vIndexKey.begin(), vIndexKey.end(), strKey);
+        return (it - vIndexKey.begin()) - 1;
+    }
+
+    bool ReadBlock(int nBlock, block_type& vRet)
+    {
+        vRet.clear();
+        uint64 nBegin = vIndexPos[nBlock];
+        uint64 nEnd = (nBlock + 1 < (int)vIndexPos.size() ? vIndexPos[nBlock + 1] : nDataEnd);
+        if (nEnd < nBegin || nEnd - nBegin > LSM_MAX_RECORD)
+            return error("CTable::ReadBlock() : bad block %d in %s", nBlock, strPath.c_str());
+        string strBlock(nEnd - nBegin, '\0');
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (fseek(file, nBegin, SEEK_SET) != 0 || (!strBlock.empty() && fread(&strBlock[0], 1, strBlock.size(), file) != strBlock.size()))
+                return error("CTable::ReadBlock() : can't read block %d of %s", nBlock, strPath.c_str());
+        }
+        if (Checksum(strBlock.data(), strBlock.size()) != vIndexChecksum[nBlock])
+            return error("CTable::ReadBlock() : checksum mismatch in block %d of %s", nBlock, strPath.c_str());
+        try
+        {
+            CDataStream ss(strBlock.data(), strBlock.data() + strBlock.size(), SER_DISK);
+            while (!ss.empty())
+            {
+                vRet.push_back(make_pair(string(), CKVBatch::CEntry()));
+                unsigned char chErase;
+                ss >> vRet.back().first >> chErase >> vRet.back().second.strValue;
+                vRet.back().second.fErase = chErase;
+            }
+        }
+        catch (std::exception& e)
+        {
+            return error("CTable::ReadBlock() : can't parse block %d of %s", nBlock, strPath.c_str());
+        }
+        return true;
+    }
+
+    // 1 found, 0 erased, -1 not in this table, -2 read error
+    int Get(const string& strKey, string& strValueRet)
+    {
+        if (!MayContain(strKey))
+            return -1;
+        int nBlock = FindBlock(strKey);
+        if (nBlock < 0)
+            return -1;
+        block_type vBlock;
+        if (!ReadBlock(nBlock, vBlock))
+            return -2;
+        foreach(const PAIRTYPE(string, CKVBatch::CEntry)& item, vBlock)
+        {
+            if (item.first == strKey)
+            {
+                if (item.second.fErase)
+                    return 0;
+                strValueRet = item.second.strValue;
+                return 1;
+            }
+            if (item.first > strKey)
+                break;
+        }
+        return -1;
+    }
+};
+
+class CLSMStore::CVersion
+{
+public:
+    // Newest first
+    vector<std::shared_ptr<const CMemTable> > vImm;
+    vector<std::shared_ptr<CTable> > vTables;
+    int64 nImmBytes;
+
+    CVersion()
+    {
+        nImmBytes = 0;
+    }
+};
+
+class CLSMSnapshot : public CKVSnapshot
+{
+public:
+    std::shared_ptr<const CLSMStore::CVersion> pversion;
+};
+
+
+
+//
+// Sources walk one memtable or table in key order, erase markers included.
+// The merge source combines them, newest first, into one ordered view where
+// the newest entry for a key hides the older ones.  A source that can't read
+// ends early with Error() set, so a scan can tell that from the real end.
+//
+class CLSMStore::CSource
+{
+public:
+    virtual ~CSource() { }
+    virtual void Seek(const string& strKey) = 0;
+    virtual bool Valid() const = 0;
+    virtual void Next() = 0;
+    virtual const string& Key() const = 0;
+    virtual const CKVBatch::CEntry& Entry() const = 0;
+    virtual bool Error() const { return false; }
+};
+
+class CMemTableSource : public CLSMStore::CSource
+{
+protected:
+    std::shared_ptr<const CLSMStore::CMemTable> pmem;
+    CKVBatch::entrymap_type::const_iterator it;
+
+public:
+    CMemTableSource(std::shared_ptr<const CLSMStore::CMemTable> pmemIn) : pmem(pmemIn)
+    {
+        it = pmem->mapEntries.end();
+    }
+
+    void Seek(const string& strKey) { it = pmem->mapEntries.lower_bound(strKey); }
+    bool Valid() const { return it != pmem->mapEntries.end(); }
+    void Next() { ++it; }
+    const string& Key() const { return (*it).first; }
+    const CKVBatch::CEntry& Entry() const { return (*it).second; }
+};
+
+class CTableSource : public CLSMStore::CSource
+{
+protected:
+    std::shared_ptr<CLSMStore::CTable> ptable;
+    int nBlock;
+    CLSMStore::CTable::block_type vBlock;
+    unsigned int nPos;
+    bool fError;
+
+    void LoadBlock(int nBlockIn)
+    {
+        nBlock = nBlockIn;
+        nPos = 0;
+        vBlock.clear();
+        while (nBlock < ptable->GetBlockCount())
+        {
+            if (!ptable->ReadBlock(nBlock, vBlock))
+            {
+                // Error already logged, end the scan here
+                nBlock = ptable->GetBlockCount();
+                vBlock.clear();
+                fError = true;
+                return;
+            }
+            if (!vBlock.empty())
+                return;
+            nBlock++;
+        }
+    }
+
+public:
+    CTableSource(std::shared_ptr<CLSMStore::CTable> ptableIn) : ptable(ptableIn)
+    {
+        nBlock = ptable->GetBlockCount();
+        nPos = 0;
+        fError = false;
+    }
+
+    void Seek(const string& strKey)
+    {
+        fError = false;
+        LoadBlock(max(ptable->FindBlock(strKey), 0));
+        while (Valid() && Key() < strKey)
+            Next();
+    }
+
+    bool Valid() const { return nBlock < ptable->GetBlockCount() && nPos < vBlock.size(); }
+
+    void Next()
+    {
+        if (++nPos >= vBlock.size())
+            LoadBlock(nBlock + 1);
+    }
+
+    const string& Key() const { return vBlock[nPos].first; }
+    const CKVBatch::CEntry& Entry() const { return vBlock[nPos].second; }
+    bool Error() const { return fError; }
+};
+
+class CMergeSource : public CLSMStore::CSource
+{
+protected:
+    vector<CLSMStore::CSource*> vSources;
+    int nCurrent;
+
+    void FindSmallest()
+    {
+        // On ties the newest source, which comes first, wins
+        nCurrent = -1;
+        for (int i = 0; i < vSources.size(); i++)
+            if (vSources[i]->Valid() && (nCurrent == -1 || vSources[i]->Key() < vSources[nCurrent]->Key()))
+                nCurrent = i;
+    }
+
+public:
+    CMergeSource()
+    {
+        nCurrent = -1;
+    }
+
+    ~CMergeSource()
+    {
+        foreach(CLSMStore::CSource* psource, vSources)
+            delete psource;
+    }
+
+    void Add(CLSMStore::CSource* psource) { vSources.push_back(psource); }
+
+    void Seek(const string& strKey)
+    {
+        foreach(CLSMStore::CSource* psource, vSources)
+            psource->Seek(strKey);
+        FindSmallest();
+    }
+
+    bool Valid() const { return nCurrent != -1; }
+
+    void Next()
+    {
+        string strKey = Key();
+        foreach(CLSMStore::CSource* psource, vSources)
+            if (psource->Valid() && psource->Key() == strKey)
+                psource->Next();
+        FindSmallest();
+    }
+
+    const string& Key() const { return vSources[nCurrent]->Key(); }
+    const CKVBatch::CEntry& Entry() const { return vSources[nCurrent]->Entry(); }
+
+    bool Error() const
+    {
+        foreach(const CLSMStore::CSource* psource, vSources)
+            if (psource->Error())
+                return true;
+        return false;
+    }
+};
+
+class CLSMIterator : public CKVIterator
+{
+protected:
+    std::shared_ptr<const CLSMStore::CVersion> pversion;
+    CMergeSource merge;
+
+    void SkipErased()
+    {
+        while (merge.Valid() && merge.Entry().fErase)
+            merge.Next();
+    }
+
+public:
+    CLSMIterator(std::shared_ptr<const CLSMStore::CVersion> pversionIn) : pversion(pversionIn)
+    {
+        foreach(const std::shared_ptr<const CLSMStore::CMemTable>& pmem, pversion->vImm)
+            merge.Add(new CMemTableSource(pmem));
+        foreach(const std::shared_ptr<CLSMStore::CTable>& ptable, pversion->vTables)
+            merge.Add(new CTableSource(ptable));
+    }
+
+    void Seek(const string& strKey) { merge.Seek(strKey); SkipErased(); }
+    bool Valid() const { return merge.Valid(); }
+    void Next() { merge.Next(); SkipErased(); }
+    const string& Key() const { return merge.Key(); }
+    const string& Value() const { return merge.Entry().strValue; }
+    bool Error() const { return merge.Error(); }
+};
+
+
+
+
+CLSMStore::CLSMStore(const string& strDirIn, int64 nMemTableSizeIn)
+{
+    strDir = strDirIn;
+    nMemTableSize = nMemTableSizeIn;
+    pmem.reset(new CMemTable());
+    pversion.reset(new CVersion());
+    fileLog = NULL;
+    nLogFile = 0;
+    nFirstLog = 0;
+    nNextFile = 1;
+    fOpen = false;
+    fCompactQueued = false;
+    nFlushes = 0;
+    fFlushFailed = false;
+    fMergeFailed = false;
+}
+
+CLSMStore::~CLSMStore()
+{
+    Close();
+}
+
+string CLSMStore::FileName(unsigned int nFile, const char* pszExt) const
+{
+    return strprintf("%s/%06u.%s", strDir.c_str(), nFile, pszExt);
+}
+
+bool CLSMStore::ReadManifest(bool& fFoundRet)
+{
+    string strPath = strDir + "/MANIFEST";
+    fFoundRet = boost::filesystem::exists(strPath);
+    if (!fFoundRet)
+        return true;
+
+    string strManifest;
+    if (!ReadWholeFile(strPath, strManifest) || strManifest.size() < sizeof(unsigned int))
+        return error("CLSMStore::ReadManifest() : can't read %s", strPath.c_str());
+    unsigned int nSize = strManifest.size() - sizeof(unsigned int);
+    unsigned int nChecksum;
+    memcpy(&nChecksum, &strManifest[nSize], sizeof(nChecksum));
+    if (Checksum(strManifest.data(), nSize) != nChecksum)
+        return error("CLSMStore::ReadManifest() : checksum mismatch in %s", strPath.c_str());
+
+    int nVersion;
+    unsigned int nNextFileRead;
+    vector<unsigned int> vFile;
+    vector<int> vLevel;
+    try
+    {
+        CDataStream ss(strManifest.data(), strManifest.data() + nSize, SER_DISK);
+        ss >> nVersion >> nNextFileRead >> nFirstLog >> vFile >> vLevel;
+    }
+    catch (std::exception& e)
+    {
+        return error("CLSMStore::ReadManifest() : can't parse %s", strPath.c_str());
+    }
+    if (nVersion > LSM_MANIFEST_VERSION)
+        return error("CLSMStore::ReadManifest() : %s is from a newer version", strPath.c_str());
+    if (vFile.size() != vLevel.size())
+        return error("CLSMStore::ReadManifest() : bad table list in %s", strPath.c_str());
+
+    CVersion* pversionNew = new CVersion();
+    for (int i = 0; i < vFile.size(); i++)
+    {
+        std::shared_ptr<CTable> ptable(new CTable(vFile[i], vLevel[i], FileName(vFile[i], "tbl")));
+        if (!ptable->Open())
+        {
+            delete pversionNew;
+            return false;
+        }
+        pversionNew->vTables.push_back(ptable);
+    }
+    pversion.reset(pversionNew);
+    nNextFile = nNextFileRead;
+    return true;
+}
+
+bool CLSMStore::WriteManifest(const CVersion& version, unsigned int nFirstLogIn)
+{
+    vector<unsigned int> vFile;
+    vector<int> vLevel;
+    foreach(const std::shared_ptr<CTable>& ptable, version.vTables)
+    {
+        vFile.push_back(ptable->nFile);
+        vLevel.push_back(ptable->nLevel);
+    }
+    CDataStream ss(SER_DISK);
+    ss << LSM_MANIFEST_VERSION << (unsigned int)nNextFile << nFirstLogIn << vFile << vLevel;
+    unsigned int nChecksum = Checksum(&ss[0], ss.size());
+    ss.write((char*)&nChecksum, sizeof(nChecksum));
+
+    string strTmp = strDir + "/MANIFEST.tmp";
+    FILE* file = fopen(strTmp.c_str(), "wb");
+    if (!file)
+        return error("CLSMStore::WriteManifest() : can't create %s", strTmp.c_str());
+    bool fOk = (fwrite(&ss[0], 1, ss.size(), file) == ss.size() && FileCommit(file));
+    fclose(file);
+    if (!fOk)
+        return error("CLSMStore::WriteManifest() : write to %s failed", strTmp.c_str());
+    if (!RenameOver(strTmp, strDir + "/MANIFEST"))
+        return error("CLSMStore::WriteManifest() : rename of %s failed", strTmp.c_str());
+    return true;
+}
+
+bool CLSMStore::ReplayLog(unsigned int nFile)
+{
+    string strPath = FileName(nFile, "log");
+    FILE* file = fopen(strPath.c_str(), "r+b");
+    if (!file)
+        return true;
+
+    int64 nGood = 0;
+    int nRecords = 0;
+    loop
+    {
+        unsigned int pnHeader[2];
+        if (fread(pnHeader, 1, sizeof(pnHeader), file) != sizeof(pnHeader))
+            break;
+        unsigned int nSize = pnHeader[0];
+        if (nSize > LSM_MAX_RECORD)
+            break;
+        string strRecord(nSize, '\0');
+        if (nSize > 0 && fread(&strRecord[0], 1, nSize, file) != nSize)
+            break;
+        if (Checksum(strRecord.data(), nSize) != pnHeader[1])
+            break;
+        CKVBatch batch;
+        try
+        {
+            CDataStream ss(strRecord.data(), strRecord.data() + nSize, SER_DISK);
+            UnserializeBatch(ss, batch);
+        }
+        catch (std::exception& e)
+        {
+            break;
+        }
+        pmem->Append(batch);
+        nGood += sizeof(pnHeader) + nSize;
+        nRecords++;
+    }
+
+    // Anything after the last complete record was being written when we
+    // went down, drop it so new records follow good ones
+    fseek(file, 0, SEEK_END);
+    int64 nFileSize = ftell(file);
+    if (nFileSize > nGood)
+    {
+        printf("CLSMStore::ReplayLog() : dropping %"PRI64d" bytes of incomplete log at the end of %s\n", nFileSize - nGood, strPath.c_str());
+        if (!FileTruncate(file, nGood) || !FileCommit(file))
+        {
+            fclose(file);
+            return error("CLSMStore::ReplayLog() : can't truncate %s", strPath.c_str());
+        }
+    }
+    fclose(file);
+    printf("CLSMStore::ReplayLog() : replayed %d records from %s\n", nRecords, strPath.c_str());
+    return true;
+}
+
+bool CLSMStore::NewLog(unsigned int& nFileRet, FILE*& fileRet)
+{
+    nFileRet = nNextFile++;
+    string strPath = FileName(nFileRet, "log");
+    fileRet = fopen(strPath.c_str(), "wb");
+    if (!fileRet)
+        return error("CLSMStore::NewLog() : can't create %s", strPath.c_str());
+
+    // Records go out in one write each, so a failed one leaves nothing
+    // behind in the stream's buffer
+    setvbuf(fileRet, NULL, _IONBF, 0);
+    DirCommit(strDir);
+    return true;
+}
+
+bool CLSMStore::AppendLog(const CKVBatch& batch, bool fSync)
+{
+    // Caller holds mutexWrite
+    if (!fileLog && !NewLog(nLogFile, fileLog))
+    {
+        fileLog = NULL;
+        return false;
+    }
+    unsigned int pnHeader[2] = { 0, 0 };
+    CDataStream ss(SER_DISK);
+    ss.reserve(batch.nBytes + 100);
+    ss.write((char*)pnHeader, sizeof(pnHeader));
+    SerializeBatch(ss, batch);
+    pnHeader[0] = ss.size() - sizeof(pnHeader);
+    pnHeader[1] = Checksum(&ss[sizeof(pnHeader)], pnHeader[0]);
+    memcpy(&ss[0], pnHeader, sizeof(pnHeader));
+    long nPos = ftell(fileLog);
+    if (fwrite(&ss[0], 1, ss.size(), fileLog) != ss.size() ||
+        (fSync ? !FileCommit(fileLog) : fflush(fileLog) != 0))
+    {
+        string strPath = FileName(nLogFile, "log");
+        // Don't leave a torn record for the next one to land behind, and
+        // put the stream back at the new end of the file so the next record
+        // doesn't land past a hole.  If that can't be done go on in a new
+        // log, replay reads them in order.
+        clearerr(fileLog);
+        if (nPos < 0 || !FileTruncate(fileLog, nPos) || fseek(fileLog, nPos, SEEK_SET) != 0)
+        {
+            fclose(fileLog);
+            if (!NewLog(nLogFile, fileLog))
+                fileLog = NULL;
+        }
+        return error("CLSMStore::AppendLog() : write to %s failed", strPath.c_str());
+    }
+    return true;
+}
+
+bool CLSMStore::SwitchLog()
+{
+    // Caller holds mutexWrite.  The old log has to be all on disk before
+    // writes start landing in the new one, or a crash could keep the later
+    // writes and lose the earlier ones.
+    if (!FileCommit(fileLog))
+        return error("CLSMStore::SwitchLog() : can't sync %s", FileName(nLogFile, "log").c_str());
+    unsigned int nNewLog;
+    FILE* fileNewLog;
+    if (!NewLog(nNewLog, fileNewLog))
+        return false;
+    fclose(fileLog);
+    fileLog = fileNewLog;
+    nLogFile = nNewLog;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    FreezeMemTable(nNewLog);
+    return true;
+}
+
+bool CLSMStore::WriteTable(CSource* psource, bool fDropErased, int nLevel, std::shared_ptr<CTable>& ptableRet)
+{
+    ptableRet.reset();
+    unsigned int nFile = nNextFile++;
+    string strPath = FileName(nFile, "tbl");
+    FILE* file = fopen(strPath.c_str(), "wb");
+    if (!file)
+        return error("CLSMStore::WriteTable() : can't create %s", strPath.c_str());
+
+    vector<string> vIndexKey;
+    vector<uint64> vIndexPos;
+    vector<unsigned int> vIndexChecksum;
+    vector<uint64> vHash;
+    CDataStream ssBlock(SER_DISK);
+    ssBlock.reserve(LSM_BLOCK_SIZE * 2);
+    uint64 nPos = 0;
+    bool fOk = true;
+    for (psource->Seek(""); psource->Valid() && fOk; psource->Next())
+    {
+        const CKVBatch::CEntry& entry = psource->Entry();
+        if (fDropErased && entry.fErase)
+            continue;
+        if (ssBlock.empty())
+            vIndexKey.push_back(psource->Key());
+        unsigned char chErase = entry.fErase;
+        ssBlock << psource->Key() << chErase << entry.strValue;
+        vHash.push_back(BloomHash(psource->Key()));
+
+        if (ssBlock.size() >= LSM_BLOCK_SIZE)
+        {
+            vIndexPos.push_back(nPos);
+            vIndexChecksum.push_back(Checksum(&ssBlock[0], ssBlock.size()));
+            fOk = (fwrite(&ssBlock[0], 1, ssBlock.size(), file) == ssBlock.size());
+            nPos += ssBlock.size();
+            ssBlock.clear();
+        }
+    }
+    if (fOk && !ssBlock.empty())
+    {
+        vIndexPos.push_back(nPos);
+        vIndexChecksum.push_back(Checksum(&ssBlock[0], ssBlock.size()));
+        fOk = (fwrite(&ssBlock[0], 1, ssBlock.size(), file) == ssBlock.size());
+        nPos += ssBlock.size();
+    }
+
+    // A source that couldn't be read would make a table that's missing
+    // records, and the caller would drop the inputs that still have them
+    if (psource->Error())
+    {
+        fclose(file);
+        unlink(strPath.c_str());
+        return error("CLSMStore::WriteTable() : read error in the input, %s not written", strPath.c_str());
+    }
+
+    if (fOk && vHash.empty())
+    {
+        // Everything cancelled out
+        fclose(file);
+        unlink(strPath.c_str());
+        return true;
+    }
+
+    // Bloom filter
+    uint64 nBits = max((uint64)64, (uint64)vHash.size() * LSM_BLOOM_BITS_PER_KEY);
+    vector<unsigned char> vBloom((nBits + 7) / 8, 0);
+    nBits = vBloom.size() * 8;
+    foreach(uint64 h, vHash)
+    {
+        uint64 h1 = h & 0xffffffff;
+        uint64 h2 = (h >> 32) | 1;
+        for (int i = 0; i < LSM_BLOOM_HASHES; i++)
+        {
+            uint64 nBit = (h1 + i * h2) % nBits;
+            vBloom[nBit / 8] |= (1 << (nBit % 8));
+        }
+    }
+
+    // Index, bloom filter and footer
+    CDataStream ssIndex(SER_DISK);
+    ssIndex << vIndexKey << vIndexPos << vIndexChecksum << vBloom;
+    CDataStream ssFooter(SER_DISK);
+    ssFooter << nPos << (uint64)vHash.size() << Checksum(&ssIndex[0], ssIndex.size()) << LSM_TABLE_MAGIC;
+    assert(ssFooter.size() == LSM_FOOTER_SIZE);
+    if (fOk)
+        fOk = (fwrite(&ssIndex[0], 1, ssIndex.size(), file) == ssIndex.size() &&
+               fwrite(&ssFooter[0], 1, ssFooter.size(), file) == ssFooter.size() &&
+               FileCommit(file));
+    fclose(file);
+    if (!fOk)
+    {
+        unlink(strPath.c_str());
+        return error("CLSMStore::WriteTable() : write to %s failed", strPath.c_str());
+    }
+
+    std::shared_ptr<CTable> ptable(new CTable(nFile, nLevel, strPath));
+    if (!ptable->Open())
+        return false;
+    ptableRet = ptable;
+    return true;
+}
+
+std::shared_ptr<const CLSMStore::CVersion> CLSMStore::FreezeMemTable(unsigned int nLogEnd)
+{
+    // Caller holds mutex.  Moves the memtable into the immutable list so
+    // the version it returns won't change.
+    if (pmem->empty())
+        return pversion;
+    pmem->nLogEnd = nLogEnd;
+    CVersion* pversionNew = new CVersion(*pversion);
+    pversionNew->vImm.insert(pversionNew->vImm.begin(), pmem);
+    pversionNew->nImmBytes += pmem->nBytes;
+    pversion.reset(pversionNew);
+    pmem.reset(new CMemTable());
+    return pversion;
+}
+
+int CLSMStore::GetFrozenCount() const
+{
+    // Caller holds mutex.  Only counts the ones writers froze, readers'
+    // are small.
+    int nCount = 0;
+    foreach(const std::shared_ptr<const CMemTable>& pmemImm, pversion->vImm)
+        if (pmemImm->nLogEnd)
+            nCount++;
+    return nCount;
+}
+
+
+
+//
+// Flushes and merges run on the thread pool.  Open stores are kept in a
+// list the compaction job walks, Close takes its store out of the list,
+// waiting for a pass that's in progress, so the job never sees a store
+// that's gone.
+//
+static std::mutex mutexLSMStores;
+static set<CLSMStore*> setLSMStores;
+
+static void CompactLSMStores()
+{
+    std::lock_guard<std::mutex> lock(mutexLSMStores);
+    foreach(CLSMStore* pstore, setLSMStores)
+        pstore->Compact();
+}
+
+void CLSMStore::QueueCompact()
+{
+    if (!fCompactQueued.exchange(true))
+        GetThreadPool().Submit(CompactLSMStores, TASK_LOW);
+}
+
+bool CLSMStore::WaitForFlush()
+{
+    // Caller holds mutexWrite
+    std::unique_lock<std::mutex> lock(mutex);
+    while (GetFrozenCount() > LSM_MAX_FROZEN)
+    {
+        int64 nFlushesBefore = nFlushes;
+        lock.unlock();
+        QueueCompact();
+        lock.lock();
+        condFlushed.wait_for(lock, std::chrono::seconds(1), [&]{ return nFlushes != nFlushesBefore; });
+        if (nFlushes == nFlushesBefore)
+        {
+            // The pool's workers are all busy, maybe with jobs waiting on
+            // this write, do the flush here
+            lock.unlock();
+            Compact();
+            lock.lock();
+        }
+        if (fFlushFailed && GetFrozenCount() > LSM_MAX_FROZEN)
+            return error("CLSMStore::Write() : can't flush %s, not taking more writes", strDir.c_str());
+    }
+    return true;
+}
+
+bool CLSMStore::FlushMemTables()
+{
+    // Caller holds mutexCompact
+    std::shared_ptr<const CVersion> pversionFlush;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pversionFlush = pversion;
+    }
+    if (pversionFlush->vImm.empty())
+        return true;
+
+    int64 nStart = GetTimeMillis();
+    CMergeSource merge;
+    foreach(const std::shared_ptr<const CMemTable>& pmemImm, pversionFlush->vImm)
+        merge.Add(new CMemTableSource(pmemImm));
+    std::shared_ptr<CTable> ptable;
+    if (!WriteTable(&merge, pversionFlush->vTables.empty(), 0, ptable))
+        return false;
+
+    // Logs from before the last log switch among these memtables only have
+    // writes that are in the table now
+    unsigned int nFirstLogNew = nFirstLog;
+    foreach(const std::shared_ptr<const CMemTable>& pmemImm, pversionFlush->vImm)
+        nFirstLogNew = max(nFirstLogNew, pmemImm->nLogEnd);
+    CVersion versionNew;
+    if (ptable)
+        versionNew.vTables.push_back(ptable);
+    versionNew.vTables.insert(versionNew.vTables.end(), pversionFlush->vTables.begin(), pversionFlush->vTables.end());
+    if (!WriteManifest(versionNew, nFirstLogNew))
+    {
+        if (ptable)
+            ptable->fObsolete = true;
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        // More may have been frozen since, keep those
+        CVersion* pversionNew = new CVersion(versionNew);
+        for (int i = 0; i < (int)pversion->vImm.size() - (int)pversionFlush->vImm.size(); i++)
+        {
+            pversionNew->vImm.push_back(pversion->vImm[i]);
+            pversionNew->nImmBytes += pversion->vImm[i]->nBytes;
+        }
+        pversion.reset(pversionNew);
+    }
+    for (unsigned int nFile = nFirstLog; nFile < nFirstLogNew; nFile++)
+        unlink(FileName(nFile, "log").c_str());
+    nFirstLog = nFirstLogNew;
+    printf("CLSMStore::FlushMemTables() : wrote %s, %"PRI64d" bytes of writes in %"PRI64d"ms\n", ptable ? ptable->strPath.c_str() : "nothing", pversionFlush->nImmBytes, GetTimeMillis() - nStart);
+    return true;
+}
+
+bool CLSMStore::MergeTables()
+{
+    // Caller holds mutexCompact.  Tables are newest first and their levels
+    // never decrease going back, so each level's tables are together.
+    loop
+    {
+        std::shared_ptr<const CVersion> pversionMerge;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pversionMerge = pversion;
+        }
+        const vector<std::shared_ptr<CTable> >& vTables = pversionMerge->vTables;
+
+        int nBegin = -1;
+        int nEnd = -1;
+        for (int i = 0; i < vTables.size(); )
+        {
+            int j = i;
+            while (j < vTables.size() && vTables[j]->nLevel == vTables[i]->nLevel)
+                j++;
+            if (j - i >= LSM_MERGE_WIDTH)
+            {
+                nBegin = i;
+                nEnd = j;
+                break;
+            }
+            i = j;
+        }
+        if (nBegin == -1)
+            return true;
+
+        // Erase markers can go once there's nothing older for them to hide
+        int64 nStart = GetTimeMillis();
+        int nLevel = vTables[nBegin]->nLevel + 1;
+        CMergeSource merge;
+        for (int i = nBegin; i < nEnd; i++)
+            merge.Add(new CTableSource(vTables[i]));
+        std::shared_ptr<CTable> ptable;
+        if (!WriteTable(&merge, nEnd == vTables.size(), nLevel, ptable))
+            return false;
+
+        CVersion* pversionNew = new CVersion();
+        pversionNew->vTables.insert(pversionNew->vTables.end(), vTables.begin(), vTables.begin() + nBegin);
+        if (ptable)
+            pversionNew->vTables.push_back(ptable);
+        pversionNew->vTables.insert(pversionNew->vTables.end(), vTables.begin() + nEnd, vTables.end());
+        if (!WriteManifest(*pversionNew, nFirstLog))
+        {
+            delete pversionNew;
+            if (ptable)
+                ptable->fObsolete = true;
+            return false;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pversionNew->vImm = pversion->vImm;
+            pversionNew->nImmBytes = pversion->nImmBytes;
+            pversion.reset(pversionNew);
+        }
+        for (int i = nBegin; i < nEnd; i++)
+            vTables[i]->fObsolete = true;
+        printf("CLSMStore::MergeTables() : merged %d level %d tables into %s in %"PRI64d"ms\n", nEnd - nBegin, nLevel - 1, ptable ? ptable->strPath.c_str() : "nothing", GetTimeMillis() - nStart);
+    }
+}
+
+bool CLSMStore::Compact()
+{
+    std::lock_guard<std::mutex> lockCompact(mutexCompact);
+    fCompactQueued = false;
+    if (!fOpen)
+        return true;
+
+    bool fFlushed = FlushMemTables();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        nFlushes++;
+        fFlushFailed = !fFlushed;
+    }
+    condFlushed.notify_all();
+    if (!fFlushed)
+        return false;
+
+    // A failed merge keeps its inputs and the store stays readable with
+    // more tables than it needs.  Don't keep rereading a bad table every
+    // pass, leave merging until the store is reopened.
+    if (fMergeFailed)
+        return true;
+    if (!MergeTables())
+    {
+        fMergeFailed = true;
+        return error("CLSMStore::Compact() : merging tables in %s failed, not merging again until restart", strDir.c_str());
+    }
+    return true;
+}
+
+void CLSMStore::DeleteObsoleteFiles()
+{
+    // Logs from nFirstLog on are live
+    set<unsigned int> setLive;
+    foreach(const std::shared_ptr<CTable>& ptable, pversion->vTables)
+        setLive.insert(ptable->nFile);
+
+    try
+    {
+        for (boost::filesystem::directory_iterator it(strDir); it != boost::filesystem::directory_iterator(); ++it)
+        {
+            string strName = it->path().filename().string();
+            string strExt = it->path().extension().string();
+            unsigned int nFile = atoi(strName.c_str());
+            if (strName == "MANIFEST.tmp" ||
+                (strExt == ".log" && nFile < nFirstLog) ||
+                (strExt == ".tbl" && !setLive.count(nFile)))
+            {
+                printf("CLSMStore::DeleteObsoleteFiles() : removing %s\n", strName.c_str());
+                boost::filesystem::remove(it->path());
+            }
+        }
+    }
+    catch (boost::filesystem::filesystem_error& e)
+    {
+        printf("CLSMStore::DeleteObsoleteFiles() : %s\n", e.what());
+    }
+}
+
+bool CLSMStore::Open()
+{
+    // Compact skips the store until it's open, and Close takes it out of
+    // the list again
+    {
+        std::lock_guard<std::mutex> lock(mutexLSMStores);
+        setLSMStores.insert(this);
+    }
+
+    std::lock_guard<std::mutex> lockWrite(mutexWrite);
+    std::lock_guard<std::mutex> lockCompact(mutexCompact);
+    if (fOpen)
+        return true;
+    _mkdir(strDir.c_str());
+
+    bool fFound;
+    pmem.reset(new CMemTable());
+    if (!ReadManifest(fFound))
+        return false;
+
+    // Replay the live logs oldest first.  A crash in the middle of a flush
+    // can leave files numbered past what the manifest knows about, new
+    // files go after all of them.
+    vector<unsigned int> vLogs;
+    try
+    {
+        for (boost::filesystem::directory_iterator it(strDir); it != boost::filesystem::directory_iterator(); ++it)
+        {
+            string strExt = it->path().extension().string();
+            unsigned int nFile = atoi(it->path().filename().string().c_str());
+            if (strExt == ".log" || strExt == ".tbl")
+                nNextFile = max((unsigned int)nNextFile, nFile + 1);
+            if (fFound && strExt == ".log" && nFile >= nFirstLog)
+                vLogs.push_back(nFile);
+        }
+    }
+    catch (boost::filesystem::filesystem_error& e)
+    {
+        return error("CLSMStore::Open() : can't list %s: %s", strDir.c_str(), e.what());
+    }
+    sort(vLogs.begin(), vLogs.end());
+    foreach(unsigned int nFile, vLogs)
+        if (!ReplayLog(nFile))
+            return false;
+
+    // New writes go in a new log, and what was replayed is frozen so a
+    // flush can retire the old logs
+    if (!NewLog(nLogFile, fileLog))
+        return false;
+    if (!fFound)
+    {
+        nFirstLog = nLogFile;
+        if (!WriteManifest(*pversion, nFirstLog))
+            return false;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        FreezeMemTable(nLogFile);
+    }
+    DeleteObsoleteFiles();
+    fOpen = true;
+    fMergeFailed = false;
+    fFlushFailed = false;
+    printf("CLSMStore::Open() : %s has %d tables\n", strDir.c_str(), pversion->vTables.size());
+
+    // Picks up what earlier passes left, like a flush that failed
+    ScheduleTask("lsmcompact", CompactLSMStores, 10 * 1000);
+    QueueCompact();
+    return true;
+}
+
+void CLSMStore::Close()
+{
+    // The memtables are in the logs and get replayed on the next open
+    {
+        std::lock_guard<std::mutex> lock(mutexLSMStores);
+        setLSMStores.erase(this);
+    }
+    std::lock_guard<std::mutex> lockWrite(mutexWrite);
+    std::lock_guard<std::mutex> lockCompact(mutexCompact);
+    if (!fOpen)
+        return;
+    if (fileLog)
+    {
+        FileCommit(fileLog);
+        fclose(fileLog);
+    }
+    fileLog = NULL;
+    fOpen = false;
+}
+
+int CLSMStore::Lookup(const string& strKey, string& strValueRet, const CKVSnapshot* psnapshot)
+{
+    std::shared_ptr<const CVersion> pversionRead;
+    if (psnapshot)
+    {
+        pversionRead = ((const CLSMSnapshot*)psnapshot)->pversion;
+    }
+    else
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        int nRet = pmem->Get(strKey, strValueRet);
+        if (nRet != -1)
+            return nRet;
+        pversionRead = pversion;
+    }
+
+    foreach(const std::shared_ptr<const CMemTable>& pmemImm, pversionRead->vImm)
+    {
+        int nRet = pmemImm->Get(strKey, strValueRet);
+        if (nRet != -1)
+            return nRet;
+    }
+    foreach(const std::shared_ptr<CTable>& ptable, pversionRead->vTables)
+    {
+        int nRet = ptable->Get(strKey, strValueRet);
+        if (nRet == -2)
+            return -1;
+        if (nRet != -1)
+            return nRet;
+    }
+    return 0;
+}
+
+bool CLSMStore::Write(const CKVBatch& batch, bool fSync)
+{
+    if (batch.empty())
+        return true;
+    std::lock_guard<std::mutex> lockWrite(mutexWrite);
+    if (!fOpen)
+        return false;
+    if (!WaitForFlush())
+        return false;
+    if (!AppendLog(batch, fSync))
+        return false;
+
+    bool fFull;
+    bool fFlush;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pmem->Append(batch);
+        fFull = (pmem->nBytes >= nMemTableSize);
+        fFlush = (pmem->nBytes + pversion->nImmBytes >= nMemTableSize || pversion->vImm.size() >= 16);
+    }
+
+    // The write is in the log either way, if the switch fails the memtable
+    // keeps filling and the next write tries again
+    if (fFull)
+        SwitchLog();
+    if (fFlush)
+        QueueCompact();
+    return true;
+}
+
+CKVSnapshot* CLSMStore::GetSnapshot()
+{
+    CLSMSnapshot* psnapshot = new CLSMSnapshot();
+    std::lock_guard<std::mutex> lock(mutex);
+    psnapshot->pversion = FreezeMemTable();
+    return psnapshot;
+}
+
+CKVIterator* CLSMStore::NewIterator(const CKVSnapshot* psnapshot)
+{
+    std::shared_ptr<const CVersion> pversionRead;
+    if (psnapshot)
+    {
+        pversionRead = ((const CLSMSnapshot*)psnapshot)->pversion;
+    }
+    else
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pversionRead = FreezeMemTable();
+    }
+    return new CLSMIterator(pversionRead);
+}
+
+bool CLSMStore::Flush()
+{
+    std::lock_guard<std::mutex> lockWrite(mutexWrite);
+    if (!fOpen || !fileLog)
+        return false;
+    return FileCommit(fileLog);
+}
+
+int CLSMStore::GetTableCount()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return pversion->vTables.size();
+}
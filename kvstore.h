@@ -0,0 +1,272 @@
+// Copyright (c) 2025 GoldcoinPoP Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+
+//
+// Ordered key-value storage behind CTxDB.  The chain index can live in
+// Berkeley DB as it always has (CBDBStore) or in CLSMStore, a log-structured
+// merge store that turns the append-heavy index writes of block download
+// into sequential writes.  Keys and values are the serialized bytes CDB
+// already produces, and both engines keep keys in the same byte order so
+// cursor scans behave the same.
+//
+
+class CKVBatch
+{
+public:
+    struct CEntry
+    {
+        bool fErase;
+        string strValue;
+    };
+    typedef map<string, CEntry> entrymap_type;
+
+    // Later writes to a key replace earlier ones
+    entrymap_type mapEntries;
+    unsigned int nBytes;
+
+    CKVBatch()
+    {
+        nBytes = 0;
+    }
+
+    void Put(const string& strKey, const string& strValue)
+    {
+        CEntry& entry = mapEntries[strKey];
+        entry.fErase = false;
+        entry.strValue = strValue;
+        nBytes += strKey.size() + strValue.size();
+    }
+
+    void Erase(const string& strKey)
+    {
+        CEntry& entry = mapEntries[strKey];
+        entry.fErase = true;
+        entry.strValue.clear();
+        nBytes += strKey.size();
+    }
+
+    // 1 if the batch writes the key, 0 if it erases it, -1 if it doesn't touch it
+    int Get(const string& strKey, string& strValueRet) const
+    {
+        entrymap_type::const_iterator mi = mapEntries.find(strKey);
+        if (mi == mapEntries.end())
+            return -1;
+        if ((*mi).second.fErase)
+            return 0;
+        strValueRet = (*mi).second.strValue;
+        return 1;
+    }
+
+    void Append(const CKVBatch& batch)
+    {
+        for (entrymap_type::const_iterator mi = batch.mapEntries.begin(); mi != batch.mapEntries.end(); ++mi)
+            mapEntries[(*mi).first] = (*mi).second;
+        nBytes += batch.nBytes;
+    }
+
+    bool empty() const { return mapEntries.empty(); }
+    void clear() { mapEntries.clear(); nBytes = 0; }
+};
+
+
+
+class CKVIterator
+{
+public:
+    virtual ~CKVIterator() { }
+
+    // Position at the first key >= strKey
+    virtual void Seek(const string& strKey) = 0;
+    virtual bool Valid() const = 0;
+    virtual void Next() = 0;
+    virtual const string& Key() const = 0;
+    virtual const string& Value() const = 0;
+
+    // True if the scan stopped early on a read error rather than at the end
+    // of the store.  Check it once Valid() goes false.
+    virtual bool Error() const = 0;
+};
+
+
+
+// A consistent view of the store as of when it was taken
+class CKVSnapshot
+{
+public:
+    virtual ~CKVSnapshot() { }
+};
+
+
+
+class CKeyValueStore
+{
+public:
+    virtual ~CKeyValueStore() { }
+
+    // 1 found, 0 not in the store, -1 the store couldn't be read
+    virtual int Lookup(const string& strKey, string& strValueRet, const CKVSnapshot* psnapshot=NULL) = 0;
+
+    // Applies the whole batch or none of it
+    virtual bool Write(const CKVBatch& batch, bool fSync=true) = 0;
+
+    // Caller deletes.  With no snapshot, iterators see the store as of when
+    // they were created.
+    virtual CKVIterator* NewIterator(const CKVSnapshot* psnapshot=NULL) = 0;
+    virtual CKVSnapshot* GetSnapshot() = 0;
+
+    // Make everything written so far durable
+    virtual bool Flush() = 0;
+
+    bool Get(const string& strKey, string& strValueRet, const CKVSnapshot* psnapshot=NULL)
+    {
+        return (Lookup(strKey, strValueRet, psnapshot) == 1);
+    }
+
+    bool Put(const string& strKey, const string& strValue, bool fSync=true)
+    {
+        CKVBatch batch;
+        batch.Put(strKey, strValue);
+        return Write(batch, fSync);
+    }
+
+    bool Erase(const string& strKey, bool fSync=true)
+    {
+        CKVBatch batch;
+        batch.Erase(strKey);
+        return Write(batch, fSync);
+    }
+
+    bool Exists(const string& strKey)
+    {
+        string strValue;
+        return Get(strKey, strValue);
+    }
+};
+
+
+
+
+//
+// Berkeley DB btree, one db transaction per batch.  The Db handle belongs to
+// CDB.  There are no snapshots, GetSnapshot returns NULL and reads always
+// see the latest data.
+//
+class CBDBStore : public CKeyValueStore
+{
+protected:
+    Db* pdb;
+
+public:
+    CBDBStore(Db* pdbIn=NULL)
+    {
+        pdb = pdbIn;
+    }
+
+    void SetDb(Db* pdbIn) { pdb = pdbIn; }
+
+    int Lookup(const string& strKey, string& strValueRet, const CKVSnapshot* psnapshot=NULL);
+    bool Write(const CKVBatch& batch, bool fSync=true);
+    CKVIterator* NewIterator(const CKVSnapshot* psnapshot=NULL);
+    CKVSnapshot* GetSnapshot() { return NULL; }
+    bool Flush();
+};
+
+
+
+
+//
+// Log-structured merge store.  Writes are appended to a log and applied to
+// a sorted in-memory table; when the memory tables pass nMemTableSize they
+// are written out as an immutable sorted table file and the log starts
+// over.  Reads go through the memory tables and then the table files from
+// newest to oldest, and each table keeps a sparse index and a bloom filter
+// in memory so a lookup reads at most one block and most misses read none.
+// Tables are merged LSM_MERGE_WIDTH at a time as they pile up, each merge
+// producing a table a level up, so every record is rewritten about once per
+// level.
+//
+// A writer that fills the memtable switches to a new log and freezes the
+// memtable; flushing and merging run on the thread pool.  Writers only wait
+// for them when more than LSM_MAX_FROZEN frozen memtables are waiting to be
+// written out.
+//
+// The MANIFEST file names the live tables and the oldest log with writes
+// that aren't in a table yet.  It is replaced by writing a new one and
+// renaming it over the old, so after a crash the store reopens with the
+// last complete manifest and replays the logs from there up to the last
+// complete record.
+//
+static const int LSM_MERGE_WIDTH = 4;
+static const int LSM_MAX_FROZEN = 4;
+static const unsigned int LSM_BLOCK_SIZE = 4096;
+static const int64 LSM_MEMTABLE_SIZE = 32 * 1024 * 1024;
+
+class CLSMStore : public CKeyValueStore
+{
+public:
+    class CMemTable;
+    class CTable;
+    class CVersion;
+    class CSource;
+
+protected:
+    string strDir;
+    int64 nMemTableSize;
+
+    // mutexWrite serializes writers and the log they append to.
+    // mutexCompact serializes flushes, merges and manifest writes.  mutex
+    // guards pmem and pversion, which readers copy and then use without
+    // holding it, and the flush state writers wait on.  Taken in that order.
+    std::mutex mutexWrite;
+    std::mutex mutexCompact;
+    std::mutex mutex;
+    std::condition_variable condFlushed;
+    std::shared_ptr<CMemTable> pmem;
+    std::shared_ptr<const CVersion> pversion;
+
+    FILE* fileLog;
+    unsigned int nLogFile;
+    unsigned int nFirstLog;
+    std::atomic<unsigned int> nNextFile;
+    bool fOpen;
+    std::atomic<bool> fCompactQueued;
+    int64 nFlushes;
+    bool fFlushFailed;
+    bool fMergeFailed;
+
+    string FileName(unsigned int nFile, const char* pszExt) const;
+    bool ReadManifest(bool& fFoundRet);
+    bool WriteManifest(const CVersion& version, unsigned int nFirstLogIn);
+    bool ReplayLog(unsigned int nFile);
+    bool NewLog(unsigned int& nFileRet, FILE*& fileRet);
+    bool AppendLog(const CKVBatch& batch, bool fSync);
+    bool SwitchLog();
+    bool WriteTable(CSource* psource, bool fDropErased, int nLevel, std::shared_ptr<CTable>& ptableRet);
+    std::shared_ptr<const CVersion> FreezeMemTable(unsigned int nLogEnd=0);
+    int GetFrozenCount() const;
+    bool WaitForFlush();
+    void QueueCompact();
+    bool FlushMemTables();
+    bool MergeTables();
+    void DeleteObsoleteFiles();
+
+public:
+    CLSMStore(const string& strDirIn, int64 nMemTableSizeIn=LSM_MEMTABLE_SIZE);
+    ~CLSMStore();
+
+    bool Open();
+    void Close();
+
+    int Lookup(const string& strKey, string& strValueRet, const CKVSnapshot* psnapshot=NULL);
+    bool Write(const CKVBatch& batch, bool fSync=true);
+    CKVIterator* NewIterator(const CKVSnapshot* psnapshot=NULL);
+    CKVSnapshot* GetSnapshot();
+    bool Flush();
+
+    // Writes out the frozen memtables and merges tables.  Runs on the
+    // thread pool, writers only call it when the pool is falling behind.
+    bool Compact();
+
+    int GetTableCount();
+};
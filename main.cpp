@@ -36,7 +36,12 @@ multimap<uint256, CDataStream*> mapOrphanTransactionsByPrev;
 
 map<uint256, CWalletTx> mapWallet;
 vector<uint256> vWalletUpdated;
+std::atomic<unsigned int> nWalletUpdated(0);
 CCriticalSection cs_mapWallet;
+CWalletCoinIndex walletCoinIndex;
+CWalletTxTimeIndex walletTxTimeIndex;
+CWalletReceivedTally walletReceivedTally;
+CWalletPrevTxStore walletPrevTxStore;
 
 map<vector<unsigned char>, CPrivKey> mapKeys;
 map<uint160, vector<unsigned char> > mapPubKeys;
@@ -51,6 +56,14 @@ CCriticalSection cs_mapAddressBook;
 
 vector<unsigned char> vchDefaultKey;
 
+// Metrics
+static CMetricHistogram& metricTxAccept = GetMetricHistogram("pop_tx_accept_seconds", "Time to check and accept a loose transaction");
+static CMetricHistogram& metricBlockCheck = GetMetricHistogram("pop_block_check_seconds", "Time spent in CheckBlock");
+static CMetricHistogram& metricBlockAccept = GetMetricHistogram("pop_block_accept_seconds", "Time spent in AcceptBlock, including connecting the block");
+static CMetricHistogram& metricBlockConnect = GetMetricHistogram("pop_block_connect_seconds", "Time spent in ConnectBlock");
+static CMetricGauge& metricPooledTx = GetMetricGauge("pop_mempool_transactions", "Transactions in the memory pool");
+static CMetricGauge& metricHeight = GetMetricGauge("pop_block_height", "Height of the best chain");
+
 // Settings
 int fGenerateBitcoins = false;
 int64 nTransactionFee = 0;
@@ -88,7 +101,6 @@ bool CBlock::ValidateParticipation(int nHeight) const
     return true;
 }
 
-static const int POP_ACTIVATION_HEIGHT = 3500000;
 CAddress addrIncoming;
 int fLimitProcessors = false;
 int nLimitProcessors = 1;
@@ -105,21 +117,26 @@ int fMinimizeOnClose = true;
 // mapKeys
 //
 
-bool AddKey(const CKey& key)
+bool AddKey(const CKey& key, CWalletDB* pwalletdb)
 {
     CRITICAL_BLOCK(cs_mapKeys)
     {
         mapKeys[key.GetPubKey()] = key.GetPrivKey();
         mapPubKeys[Hash160(key.GetPubKey())] = key.GetPubKey();
     }
-    return CWalletDB().WriteKey(key.GetPubKey(), key.GetPrivKey());
+    if (pwalletdb)
+        return pwalletdb->WriteKey(key.GetPubKey(), key.GetPrivKey());
+
+    // The key has to be on disk before anything can be sent to it
+    CWalletDB walletdb;
+    return (walletdb.WriteKey(key.GetPubKey(), key.GetPrivKey()) && walletdb.Sync());
 }
 
-vector<unsigned char> GenerateNewKey()
+vector<unsigned char> GenerateNewKey(CWalletDB* pwalletdb)
 {
     CKey key;
     key.MakeNewKey();
-    if (!AddKey(key))
+    if (!AddKey(key, pwalletdb))
         throw runtime_error("GenerateNewKey() : AddKey failed\n");
     return key.GetPubKey();
 }
@@ -132,7 +149,9 @@ vector<unsigned char> GenerateNewKey()
 // mapWallet
 //
 
-bool AddToWallet(const CWalletTx& wtxIn)
+// pwalletdb lets a caller that has a wallet db transaction open keep these
+// writes inside it; otherwise each record is written on its own.
+bool AddToWallet(const CWalletTx& wtxIn, CWalletDB* pwalletdb)
 {
     uint256 hash = wtxIn.GetHash();
     CRITICAL_BLOCK(cs_mapWallet)
@@ -142,7 +161,11 @@ bool AddToWallet(const CWalletTx& wtxIn)
         CWalletTx& wtx = (*ret.first).second;
         bool fInsertedNew = ret.second;
         if (fInsertedNew)
+        {
             wtx.nTimeReceived = GetAdjustedTime();
+            wtx.nOrderPos = walletTxTimeIndex.NewOrderPos();
+            wtx.mapValue["n"] = strprintf("%"PRI64d, wtx.nOrderPos);
+        }
 
         bool fUpdated = false;
         if (!fInsertedNew)
@@ -171,12 +194,32 @@ bool AddToWallet(const CWalletTx& wtxIn)
             }
         }
 
-        //// debug print
-        printf("AddToWallet %s  %s%s\n", wtxIn.GetHash().ToString().substr(0,6).c_str(), (fInsertedNew ? "new" : ""), (fUpdated ? "update" : ""));
+        LogPrint(LOG_WALLET, "AddToWallet %s  %s%s\n", wtxIn.GetHash().ToString().substr(0,6).c_str(), (fInsertedNew ? "new" : ""), (fUpdated ? "update" : ""));
+
+        if (fInsertedNew || fUpdated)
+        {
+            walletCoinIndex.Update(&wtx);
+            walletTxTimeIndex.Update(&wtx);
+            walletReceivedTally.Update(&wtx);
+        }
+
+        // Supporting transactions go to the shared store, the record only keeps their hashes
+        if (fInsertedNew && (!wtx.vtxPrev.empty() || !wtx.vhashPrev.empty()))
+        {
+            if (pwalletdb)
+            {
+                StoreSupportingTransactions(wtx, *pwalletdb);
+            }
+            else
+            {
+                CWalletDB walletdb;
+                StoreSupportingTransactions(wtx, walletdb);
+            }
+        }
 
         // Write to disk
         if (fInsertedNew || fUpdated)
-            if (!wtx.WriteToDisk())
+            if (!(pwalletdb ? pwalletdb->WriteTx(hash, wtx) : wtx.WriteToDisk()))
                 return false;
 
         // If default receiving address gets used, replace it with a new one
@@ -186,9 +229,17 @@ bool AddToWallet(const CWalletTx& wtxIn)
         {
             if (txout.scriptPubKey == scriptDefaultKey)
             {
-                CWalletDB walletdb;
-                walletdb.WriteDefaultKey(GenerateNewKey());
-                walletdb.WriteName(PubKeyToAddress(vchDefaultKey), "");
+                if (pwalletdb)
+                {
+                    pwalletdb->WriteDefaultKey(GenerateNewKey(pwalletdb));
+                    pwalletdb->WriteName(PubKeyToAddress(vchDefaultKey), "");
+                }
+                else
+                {
+                    CWalletDB walletdb;
+                    walletdb.WriteDefaultKey(GenerateNewKey());
+                    walletdb.WriteName(PubKeyToAddress(vchDefaultKey), "");
+                }
             }
         }
 
@@ -218,8 +269,23 @@ bool EraseFromWallet(uint256 hash)
 {
     CRITICAL_BLOCK(cs_mapWallet)
     {
-        if (mapWallet.erase(hash))
-            CWalletDB().EraseTx(hash);
+        map<uint256, CWalletTx>::iterator mi = mapWallet.find(hash);
+        if (mi != mapWallet.end())
+        {
+            CWalletDB walletdb;
+            CWalletTx& wtx = (*mi).second;
+            if (!wtx.vhashPrev.empty())
+            {
+                foreach(const uint256& hashPrev, wtx.vhashPrev)
+                    walletPrevTxStore.Release(hashPrev, walletdb);
+                walletdb.ErasePrevHashes(hash);
+            }
+            walletCoinIndex.Remove(&wtx);
+            walletTxTimeIndex.Remove(&wtx);
+            walletReceivedTally.Remove(&wtx);
+            mapWallet.erase(mi);
+            walletdb.EraseTx(hash);
+        }
     }
     return true;
 }
@@ -240,12 +306,355 @@ void WalletUpdateSpent(const COutPoint& prevout)
                 printf("WalletUpdateSpent found spent coin %sbc %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
                 wtx.fSpent = true;
                 wtx.WriteToDisk();
+                walletCoinIndex.Update(&wtx);
                 vWalletUpdated.push_back(prevout.hash);
             }
         }
     }
 }
 
+// Every change to a wallet coin comes through here, so it tells
+// GetSnapshotBalance the wallet changed even before the write is queued
+void CWalletCoinIndex::Update(CWalletTx* pcoin)
+{
+    nWalletUpdated++;
+    Remove(pcoin);
+    if (pcoin->fSpent)
+        return;
+
+    // Index the raw credit, coinbase maturity is checked when selecting
+    int64 nCredit = pcoin->CTransaction::GetCredit();
+    if (nCredit <= 0)
+        return;
+    setCoins.insert(make_pair(nCredit, pcoin));
+    mapIndexed[pcoin] = nCredit;
+}
+
+void CWalletCoinIndex::Remove(CWalletTx* pcoin)
+{
+    nWalletUpdated++;
+    map<CWalletTx*, int64>::iterator mi = mapIndexed.find(pcoin);
+    if (mi == mapIndexed.end())
+        return;
+    setCoins.erase(make_pair((*mi).second, pcoin));
+    mapIndexed.erase(mi);
+}
+
+void CWalletCoinIndex::Rebuild()
+{
+    nWalletUpdated++;
+    setCoins.clear();
+    mapIndexed.clear();
+    for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        Update(&(*it).second);
+}
+
+// Steps key back to the newest transaction before it
+bool CWalletTxTimeIndex::GetPrev(key_type& key) const
+{
+    map<key_type, CWalletTx*>::const_iterator it = mapByTime.lower_bound(key);
+    if (it == mapByTime.begin())
+        return false;
+    --it;
+    key = (*it).first;
+    return true;
+}
+
+// Steps key back to the newest transaction before it that pays any of
+// vAddresses, so a page costs its length times the number of addresses
+// however many transactions they have
+bool CWalletTxTimeIndex::GetPrevByAddress(const vector<uint160>& vAddresses, key_type& key) const
+{
+    bool fFound = false;
+    key_type keyPrev;
+    foreach(const uint160& hash160, vAddresses)
+    {
+        map<uint160, set<key_type> >::const_iterator mi = mapByAddress.find(hash160);
+        if (mi == mapByAddress.end())
+            continue;
+        set<key_type>::const_iterator it = (*mi).second.lower_bound(key);
+        if (it == (*mi).second.begin())
+            continue;
+        --it;
+        if (!fFound || *it > keyPrev)
+            keyPrev = *it;
+        fFound = true;
+    }
+    if (fFound)
+        key = keyPrev;
+    return fFound;
+}
+
+void CWalletTxTimeIndex::Update(CWalletTx* pwtx)
+{
+    Remove(pwtx);
+
+    CIndexed& indexed = mapIndexed[pwtx];
+    indexed.key = make_pair(pwtx->GetTxTime(), pwtx->nOrderPos);
+    mapByTime[indexed.key] = pwtx;
+    mapByOrder[pwtx->nOrderPos] = pwtx;
+    nOrderPosNext = max(nOrderPosNext, pwtx->nOrderPos + 1);
+
+    // Only our own bitcoin addresses, not ip addresses
+    foreach(const CTxOut& txout, pwtx->vout)
+    {
+        uint160 hash160 = txout.scriptPubKey.GetBitcoinAddressHash160();
+        if (hash160 == 0 || !mapPubKeys.count(hash160))
+            continue;
+        if (std::find(indexed.vAddresses.begin(), indexed.vAddresses.end(), hash160) != indexed.vAddresses.end())
+            continue;
+        indexed.vAddresses.push_back(hash160);
+        mapByAddress[hash160].insert(indexed.key);
+    }
+}
+
+void CWalletTxTimeIndex::Remove(CWalletTx* pwtx)
+{
+    map<CWalletTx*, CIndexed>::iterator mi = mapIndexed.find(pwtx);
+    if (mi == mapIndexed.end())
+        return;
+    const CIndexed& indexed = (*mi).second;
+    mapByTime.erase(indexed.key);
+    mapByOrder.erase(indexed.key.second);
+    foreach(const uint160& hash160, indexed.vAddresses)
+    {
+        set<key_type>& setKeys = mapByAddress[hash160];
+        setKeys.erase(indexed.key);
+        if (setKeys.empty())
+            mapByAddress.erase(hash160);
+    }
+    mapIndexed.erase(mi);
+}
+
+void CWalletTxTimeIndex::Rebuild()
+{
+    mapByTime.clear();
+    mapByOrder.clear();
+    mapByAddress.clear();
+    mapIndexed.clear();
+    for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        Update(&(*it).second);
+}
+
+bool CWalletReceivedTally::Sum(const CTally& tally, int nMinDepth, int64& nAmountRet, int& nConfRet) const
+{
+    // Take the buckets too recent for nMinDepth off the total, they're
+    // at the end so only those are looked at
+    int nMaxHeight = (nMinDepth <= 0 ? INT_MAX : nBestHeight - nMinDepth + 1);
+    nAmountRet = tally.nTotal;
+    for (map<int, pair<int64, int> >::const_reverse_iterator it = tally.mapByHeight.rbegin(); it != tally.mapByHeight.rend(); ++it)
+    {
+        int nHeight = (*it).first;
+        if (nHeight <= nMaxHeight)
+        {
+            nConfRet = (nHeight == INT_MAX ? 0 : nBestHeight - nHeight + 1);
+            return true;
+        }
+        nAmountRet -= (*it).second.first;
+    }
+    return false;
+}
+
+bool CWalletReceivedTally::GetReceived(const uint160& hash160, int nMinDepth, int64& nAmountRet, int& nConfRet) const
+{
+    map<uint160, CTally>::const_iterator mi = mapTally.find(hash160);
+    if (mi == mapTally.end())
+        return false;
+    return Sum((*mi).second, nMinDepth, nAmountRet, nConfRet);
+}
+
+void CWalletReceivedTally::GetAllReceived(int nMinDepth, map<uint160, pair<int64, int> >& mapRet) const
+{
+    for (map<uint160, CTally>::const_iterator mi = mapTally.begin(); mi != mapTally.end(); ++mi)
+    {
+        int64 nAmount;
+        int nConf;
+        if (Sum((*mi).second, nMinDepth, nAmount, nConf))
+            mapRet[(*mi).first] = make_pair(nAmount, nConf);
+    }
+}
+
+void CWalletReceivedTally::Update(CWalletTx* pwtx)
+{
+    Remove(pwtx);
+    if (pwtx->IsCoinBase() || !pwtx->IsFinal())
+        return;
+
+    int nHeight = INT_MAX;
+    if (pwtx->hashBlock != 0)
+    {
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(pwtx->hashBlock);
+        if (mi != mapBlockIndex.end() && (*mi).second->IsInMainChain())
+            nHeight = (*mi).second->nHeight;
+        else
+            setRecheck.insert(pwtx->GetHash());
+    }
+
+    CIndexed& indexed = mapIndexed[pwtx];
+    indexed.nHeight = nHeight;
+    foreach(const CTxOut& txout, pwtx->vout)
+    {
+        uint160 hash160 = txout.scriptPubKey.GetBitcoinAddressHash160();
+        if (hash160 == 0)
+            continue;
+        indexed.vReceived.push_back(make_pair(hash160, txout.nValue));
+        CTally& tally = mapTally[hash160];
+        tally.nTotal += txout.nValue;
+        pair<int64, int>& bucket = tally.mapByHeight[nHeight];
+        bucket.first += txout.nValue;
+        bucket.second++;
+    }
+}
+
+void CWalletReceivedTally::Remove(CWalletTx* pwtx)
+{
+    map<CWalletTx*, CIndexed>::iterator mi = mapIndexed.find(pwtx);
+    if (mi == mapIndexed.end())
+        return;
+    const CIndexed& indexed = (*mi).second;
+    foreach(const PAIRTYPE(uint160, int64)& item, indexed.vReceived)
+    {
+        CTally& tally = mapTally[item.first];
+        tally.nTotal -= item.second;
+        pair<int64, int>& bucket = tally.mapByHeight[indexed.nHeight];
+        bucket.first -= item.second;
+        if (--bucket.second == 0)
+            tally.mapByHeight.erase(indexed.nHeight);
+        if (tally.mapByHeight.empty())
+            mapTally.erase(item.first);
+    }
+    mapIndexed.erase(mi);
+}
+
+void CWalletReceivedTally::BestChainChanged()
+{
+    // Anything still off the main chain goes back in setRecheck
+    set<uint256> setCheck;
+    setCheck.swap(setRecheck);
+    foreach(const uint256& hash, setCheck)
+    {
+        map<uint256, CWalletTx>::iterator mi = mapWallet.find(hash);
+        if (mi != mapWallet.end())
+            Update(&(*mi).second);
+    }
+}
+
+void CWalletReceivedTally::Rebuild()
+{
+    mapTally.clear();
+    mapIndexed.clear();
+    setRecheck.clear();
+    for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        Update(&(*it).second);
+}
+
+bool CWalletPrevTxStore::AddRef(const uint256& hash)
+{
+    map<uint256, CEntry>::iterator mi = mapEntries.find(hash);
+    if (mi == mapEntries.end() || !(*mi).second.fStored)
+        return false;
+    (*mi).second.nRefCount++;
+    return true;
+}
+
+bool CWalletPrevTxStore::Add(const CMerkleTx& tx, CWalletDB& walletdb)
+{
+    uint256 hash = tx.GetHash();
+    CEntry& entry = mapEntries[hash];
+    entry.nRefCount++;
+    if (entry.fStored)
+    {
+        // Already stored, only rewrite it to pick up a new merkle branch
+        if (tx.hashBlock == 0 || (entry.fLoaded && entry.tx.hashBlock == tx.hashBlock))
+            return true;
+    }
+    entry.tx = tx;
+    entry.fLoaded = true;
+    if (!walletdb.WritePrevTx(hash, tx))
+    {
+        if (--entry.nRefCount == 0 && !entry.fStored)
+            mapEntries.erase(hash);
+        return false;
+    }
+    entry.fStored = true;
+    return true;
+}
+
+void CWalletPrevTxStore::Release(const uint256& hash, CWalletDB& walletdb)
+{
+    map<uint256, CEntry>::iterator mi = mapEntries.find(hash);
+    if (mi == mapEntries.end())
+        return;
+    if (--(*mi).second.nRefCount > 0)
+        return;
+    mapEntries.erase(mi);
+    walletdb.ErasePrevTx(hash);
+}
+
+int CWalletPrevTxStore::EraseUnused(CWalletDB& walletdb)
+{
+    // A release whose erase didn't reach the disk before a crash, or a tx
+    // record that went while its prevhashes didn't, leaves records behind
+    // that nothing would ever release
+    int nErased = 0;
+    for (map<uint256, CEntry>::iterator mi = mapEntries.begin(); mi != mapEntries.end();)
+    {
+        if ((*mi).second.nRefCount > 0)
+        {
+            ++mi;
+            continue;
+        }
+        if ((*mi).second.fStored)
+            walletdb.ErasePrevTx((*mi).first);
+        mapEntries.erase(mi++);
+        nErased++;
+    }
+    return nErased;
+}
+
+bool CWalletPrevTxStore::Get(const uint256& hash, CMerkleTx& txRet)
+{
+    map<uint256, CEntry>::iterator mi = mapEntries.find(hash);
+    if (mi == mapEntries.end())
+        return false;
+    CEntry& entry = (*mi).second;
+    if (!entry.fLoaded)
+    {
+        if (!CWalletDB("r").ReadPrevTx(hash, entry.tx))
+            return error("CWalletPrevTxStore::Get() : ReadPrevTx %s failed", hash.ToString().substr(0,10).c_str());
+        entry.fLoaded = true;
+    }
+    txRet = entry.tx;
+    return true;
+}
+
+bool StoreSupportingTransactions(CWalletTx& wtx, CWalletDB& walletdb)
+{
+    CRITICAL_BLOCK(cs_mapWallet)
+    {
+        // A copy of a wallet transaction can come back with its hashes only.
+        // Keep the ones we still have a record for.
+        vector<uint256> vhashKept;
+        foreach(const uint256& hashPrev, wtx.vhashPrev)
+        {
+            if (walletPrevTxStore.AddRef(hashPrev))
+                vhashKept.push_back(hashPrev);
+            else
+                printf("StoreSupportingTransactions() : no stored tx %s, dropped\n", hashPrev.ToString().substr(0,10).c_str());
+        }
+        wtx.vhashPrev.swap(vhashKept);
+
+        foreach(const CMerkleTx& txPrev, wtx.vtxPrev)
+        {
+            if (!walletPrevTxStore.Add(txPrev, walletdb))
+                return false;
+            wtx.vhashPrev.push_back(txPrev.GetHash());
+        }
+        wtx.vtxPrev.clear();
+    }
+    return walletdb.WritePrevHashes(wtx.GetHash(), wtx.vhashPrev);
+}
+
 
 
 
@@ -420,9 +829,13 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
         // Update the tx's hashBlock
         hashBlock = pblock->GetHash();
 
-        // Locate the transaction
+        // Locate the transaction by the leaves of the merkle tree, which the
+        // block keeps for the other wallet transactions in it
+        if (pblock->vMerkleTree.empty())
+            pblock->BuildMerkleTree();
+        uint256 hash = GetHash();
         for (nIndex = 0; nIndex < pblock->vtx.size(); nIndex++)
-            if (pblock->vtx[nIndex] == *(CTransaction*)this)
+            if (pblock->vMerkleTree[nIndex] == hash)
                 break;
         if (nIndex == pblock->vtx.size())
         {
@@ -449,6 +862,52 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
 
 
 
+int SetMerkleBranches(CTxDB& txdb, const vector<CMerkleTx*>& vpTx)
+{
+    if (fClient)
+        return 0;
+
+    // Group the transactions by the block they're in
+    map<pair<unsigned int, unsigned int>, vector<CMerkleTx*> > mapBlockTx;
+    foreach(CMerkleTx* ptx, vpTx)
+    {
+        CTxIndex txindex;
+        if (txdb.ReadTxIndex(ptx->GetHash(), txindex))
+            mapBlockTx[make_pair(txindex.pos.nFile, txindex.pos.nBlockPos)].push_back(ptx);
+    }
+
+    // Read each block and build its merkle tree once for all of them
+    int nFound = 0;
+    for (map<pair<unsigned int, unsigned int>, vector<CMerkleTx*> >::iterator mi = mapBlockTx.begin(); mi != mapBlockTx.end(); ++mi)
+    {
+        CBlock block;
+        if (!block.ReadFromDisk((*mi).first.first, (*mi).first.second))
+            continue;
+        uint256 hashBlock = block.GetHash();
+        block.BuildMerkleTree();
+        map<uint256, int> mapIndex;
+        for (int i = 0; i < block.vtx.size(); i++)
+            mapIndex[block.vMerkleTree[i]] = i;
+
+        foreach(CMerkleTx* ptx, (*mi).second)
+        {
+            map<uint256, int>::iterator it = mapIndex.find(ptx->GetHash());
+            if (it == mapIndex.end())
+            {
+                printf("ERROR: SetMerkleBranches() : couldn't find tx in block\n");
+                continue;
+            }
+            ptx->hashBlock = hashBlock;
+            ptx->nIndex = (*it).second;
+            ptx->vMerkleBranch = block.GetMerkleBranch(ptx->nIndex);
+            nFound++;
+        }
+    }
+    return nFound;
+}
+
+
+
 void CWalletTx::AddSupportingTransactions(CTxDB& txdb)
 {
     vtxPrev.clear();
@@ -463,42 +922,53 @@ void CWalletTx::AddSupportingTransactions(CTxDB& txdb)
         // This critsect is OK because txdb is already open
         CRITICAL_BLOCK(cs_mapWallet)
         {
-            map<uint256, const CMerkleTx*> mapWalletPrev;
+            // Work through one generation of inputs at a time, so the merkle
+            // branches of a generation are filled in with a single pass over
+            // the blocks they're in
             set<uint256> setAlreadyDone;
-            for (int i = 0; i < vWorkQueue.size(); i++)
+            while (!vWorkQueue.empty())
             {
-                uint256 hash = vWorkQueue[i];
-                if (setAlreadyDone.count(hash))
-                    continue;
-                setAlreadyDone.insert(hash);
-
-                CMerkleTx tx;
-                if (mapWallet.count(hash))
-                {
-                    tx = mapWallet[hash];
-                    foreach(const CMerkleTx& txWalletPrev, mapWallet[hash].vtxPrev)
-                        mapWalletPrev[txWalletPrev.GetHash()] = &txWalletPrev;
-                }
-                else if (mapWalletPrev.count(hash))
-                {
-                    tx = *mapWalletPrev[hash];
-                }
-                else if (!fClient && txdb.ReadDiskTx(hash, tx))
-                {
-                    ;
-                }
-                else
+                vector<CMerkleTx> vtxGeneration;
+                foreach(const uint256& hash, vWorkQueue)
                 {
-                    printf("ERROR: AddSupportingTransactions() : unsupported transaction\n");
-                    continue;
+                    if (setAlreadyDone.count(hash))
+                        continue;
+                    setAlreadyDone.insert(hash);
+
+                    CMerkleTx tx;
+                    if (mapWallet.count(hash))
+                    {
+                        tx = mapWallet[hash];
+                    }
+                    else if (walletPrevTxStore.Get(hash, tx))
+                    {
+                        ;
+                    }
+                    else if (!fClient && txdb.ReadDiskTx(hash, tx))
+                    {
+                        ;
+                    }
+                    else
+                    {
+                        printf("ERROR: AddSupportingTransactions() : unsupported transaction\n");
+                        continue;
+                    }
+                    vtxGeneration.push_back(tx);
                 }
+                vWorkQueue.clear();
 
-                int nDepth = tx.SetMerkleBranch();
-                vtxPrev.push_back(tx);
+                vector<CMerkleTx*> vpTx;
+                foreach(CMerkleTx& tx, vtxGeneration)
+                    vpTx.push_back(&tx);
+                SetMerkleBranches(txdb, vpTx);
 
-                if (nDepth < COPY_DEPTH)
-                    foreach(const CTxIn& txin, tx.vin)
-                        vWorkQueue.push_back(txin.prevout.hash);
+                foreach(CMerkleTx& tx, vtxGeneration)
+                {
+                    vtxPrev.push_back(tx);
+                    if (tx.GetDepthInMainChain() < COPY_DEPTH)
+                        foreach(const CTxIn& txin, tx.vin)
+                            vWorkQueue.push_back(txin.prevout.hash);
+                }
             }
         }
     }
@@ -506,6 +976,22 @@ void CWalletTx::AddSupportingTransactions(CTxDB& txdb)
     reverse(vtxPrev.begin(), vtxPrev.end());
 }
 
+void CWalletTx::GetSupportingTransactions(vector<CMerkleTx>& vtxPrevRet) const
+{
+    vtxPrevRet = vtxPrev;
+    if (vhashPrev.empty())
+        return;
+    CRITICAL_BLOCK(cs_mapWallet)
+    {
+        foreach(const uint256& hash, vhashPrev)
+        {
+            CMerkleTx tx;
+            if (walletPrevTxStore.Get(hash, tx))
+                vtxPrevRet.push_back(tx);
+        }
+    }
+}
+
 
 
 
@@ -518,6 +1004,7 @@ void CWalletTx::AddSupportingTransactions(CTxDB& txdb)
 
 bool CTransaction::AcceptTransaction(CTxDB& txdb, bool fCheckInputs, bool* pfMissingInputs)
 {
+    CMetricTimer metrictimer(metricTxAccept);
     if (pfMissingInputs)
         *pfMissingInputs = false;
 
@@ -591,6 +1078,8 @@ bool CTransaction::AcceptTransaction(CTxDB& txdb, bool fCheckInputs, bool* pfMis
         EraseFromWallet(ptxOld->GetHash());
 
     printf("AcceptTransaction(): accepted %s\n", hash.ToString().substr(0,6).c_str());
+    TRACE(TRACE_TX_ACCEPT, 'i', hash);
+    NotifyTransaction(*this);
     return true;
 }
 
@@ -606,6 +1095,7 @@ bool CTransaction::AddToMemoryPool()
         for (int i = 0; i < vin.size(); i++)
             mapNextTx[vin[i].prevout] = CInPoint(&mapTransactions[hash], i);
         nTransactionsUpdated++;
+        PublishChainSnapshot();
     }
     return true;
 }
@@ -620,6 +1110,7 @@ bool CTransaction::RemoveFromMemoryPool()
             mapNextTx.erase(txin.prevout);
         mapTransactions.erase(GetHash());
         nTransactionsUpdated++;
+        PublishChainSnapshot();
     }
     return true;
 }
@@ -681,9 +1172,13 @@ bool CMerkleTx::AcceptTransaction(CTxDB& txdb, bool fCheckInputs)
 
 bool CWalletTx::AcceptWalletTransaction(CTxDB& txdb, bool fCheckInputs)
 {
+    // Before cs_mapTransactions, the store is under cs_mapWallet
+    vector<CMerkleTx> vtxSupporting;
+    GetSupportingTransactions(vtxSupporting);
+
     CRITICAL_BLOCK(cs_mapTransactions)
     {
-        foreach(CMerkleTx& tx, vtxPrev)
+        foreach(CMerkleTx& tx, vtxSupporting)
         {
             if (!tx.IsCoinBase())
             {
@@ -727,6 +1222,7 @@ void ReacceptWalletTransactions()
                             printf("ReacceptWalletTransactions found spent coin %sbc %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
                             wtx.fSpent = true;
                             wtx.WriteToDisk();
+                            walletCoinIndex.Update(&wtx);
                             break;
                         }
                     }
@@ -743,9 +1239,150 @@ void ReacceptWalletTransactions()
 }
 
 
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Wallet rescan
+//
+
+// Blocks each thread scans per round.  The height to resume from is saved in
+// wallet.dat after every round, so an interrupted rescan picks up from there.
+static const int RESCAN_BLOCKS_PER_THREAD = 500;
+
+bool ScanBlocksForWallet(const vector<CBlockIndex*>& vChain, int nBegin, int nEnd, const CKeyFilter& filter, const set<uint256>& setWalletTx, vector<CWalletTx>& vMatchRet)
+{
+    // Blocks are mostly stored in chain order, so keep the current block file
+    // open and read straight through it
+    CAutoFile filein;
+    unsigned int nFileOpen = 0;
+    try
+    {
+        for (int i = nBegin; i < nEnd && !fShutdown; i++)
+        {
+            const CBlockIndex* pindex = vChain[i];
+            if (!filein || pindex->nFile != nFileOpen)
+            {
+                filein.fclose();
+                filein = OpenBlockFile(pindex->nFile, 0, "rb");
+                nFileOpen = pindex->nFile;
+                if (!filein)
+                    return error("ScanBlocksForWallet() : OpenBlockFile failed");
+            }
+            if (fseek(filein, pindex->nBlockPos, SEEK_SET) != 0)
+                return error("ScanBlocksForWallet() : fseek failed");
+            CBlock block;
+            filein >> block;
+
+            for (int nIndex = 0; nIndex < block.vtx.size(); nIndex++)
+            {
+                const CTransaction& tx = block.vtx[nIndex];
+                bool fMatch = false;
+                foreach(const CTxOut& txout, tx.vout)
+                {
+                    if (filter.IsMine(txout.scriptPubKey))
+                    {
+                        fMatch = true;
+                        break;
+                    }
+                }
+                if (!fMatch && (setWalletTx.empty() || !setWalletTx.count(tx.GetHash())))
+                    continue;
+
+                CWalletTx wtx(tx);
+                wtx.hashBlock = block.GetHash();
+                wtx.nIndex = nIndex;
+                wtx.vMerkleBranch = block.GetMerkleBranch(nIndex);
+                vMatchRet.push_back(wtx);
+            }
+        }
+    }
+    catch (std::exception& e)
+    {
+        return error("ScanBlocksForWallet() : %s", e.what());
+    }
+    return true;
+}
+
+// Find wallet transactions in the main chain from nStartHeight on, as
+// AddToWalletIfMine would have when the blocks were connected.  The height
+// range is split across threads and their results are added in height order.
+// Spent flags are left to ReacceptWalletTransactions, which gets them from the
+// tx index.
+bool ScanForWalletTransactions(int nStartHeight)
+{
+    // Snapshot of what the threads match against
+    CKeyFilter filter;
+    CRITICAL_BLOCK(cs_mapKeys)
+        foreach(const PAIRTYPE(const vector<unsigned char>, CPrivKey)& item, mapKeys)
+            filter.Add(item.first);
+    set<uint256> setWalletTx;
+    CRITICAL_BLOCK(cs_mapWallet)
+        foreach(const PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
+            setWalletTx.insert(item.first);
+
+    vector<CBlockIndex*> vChain;
+    CRITICAL_BLOCK(cs_main)
+    {
+        for (CBlockIndex* pindex = pindexBest; pindex && pindex->nHeight >= nStartHeight; pindex = pindex->pprev)
+            vChain.push_back(pindex);
+        reverse(vChain.begin(), vChain.end());
+    }
+
+    int nThreads = GetThreadPool().GetThreadCount();
+    printf("ScanForWalletTransactions() : %d blocks from height %d, %d keys, %d threads\n", vChain.size(), nStartHeight, filter.size(), nThreads);
+
+    int nFound = 0;
+    for (int nRound = 0; nRound < vChain.size(); nRound += nThreads * RESCAN_BLOCKS_PER_THREAD)
+    {
+        // Each thread takes a contiguous range of heights
+        int nRoundEnd = min((int)vChain.size(), nRound + nThreads * RESCAN_BLOCKS_PER_THREAD);
+        int nPerThread = (nRoundEnd - nRound + nThreads - 1) / nThreads;
+        vector<vector<CWalletTx> > vMatches(nThreads);
+        vector<char> vfOk(nThreads, true);
+        CTaskGroup group(GetThreadPool(), TASK_LOW);
+        for (int n = 0; n < nThreads; n++)
+        {
+            int nBegin = min(nRoundEnd, nRound + n * nPerThread);
+            int nEnd = min(nRoundEnd, nBegin + nPerThread);
+            group.Run([&, n, nBegin, nEnd]()
+            {
+                vfOk[n] = ScanBlocksForWallet(vChain, nBegin, nEnd, filter, setWalletTx, vMatches[n]);
+            });
+        }
+        group.Wait();
+
+        if (fShutdown)
+            return false;
+        for (int n = 0; n < nThreads; n++)
+            if (!vfOk[n])
+                return error("ScanForWalletTransactions() : reading blocks failed");
+
+        // The ranges are in height order, so adding them in thread order keeps
+        // the wallet's history in chain order
+        foreach(vector<CWalletTx>& vMatch, vMatches)
+        {
+            foreach(CWalletTx& wtx, vMatch)
+            {
+                AddToWallet(wtx);
+                nFound++;
+            }
+        }
+
+        CWalletDB().WriteRescanHeight(vChain[nRoundEnd - 1]->nHeight + 1);
+        printf("ScanForWalletTransactions() : %d/%d blocks (%d%%), %d transactions found\n", nRoundEnd, vChain.size(), nRoundEnd * 100 / vChain.size(), nFound);
+    }
+
+    CWalletDB().EraseRescanHeight();
+    return true;
+}
+
+
 void CWalletTx::RelayWalletTransaction(CTxDB& txdb)
 {
-    foreach(const CMerkleTx& tx, vtxPrev)
+    vector<CMerkleTx> vtxSupporting;
+    GetSupportingTransactions(vtxSupporting);
+    foreach(const CMerkleTx& tx, vtxSupporting)
     {
         if (!tx.IsCoinBase())
         {
@@ -765,37 +1402,32 @@ void CWalletTx::RelayWalletTransaction(CTxDB& txdb)
     }
 }
 
+// Scheduled infrequently and randomly to avoid giving away that these are
+// our transactions
 void ResendWalletTransactions()
 {
-    // Do this infrequently and randomly to avoid giving away
-    // that these are our transactions.
-    static int64 nNextTime;
-    if (GetTime() < nNextTime)
-        return;
-    bool fFirst = (nNextTime == 0);
-    nNextTime = GetTime() + GetRand(120 * 60);
-    if (fFirst)
-        return;
-
     // Rebroadcast any of our txes that aren't in a block yet
     printf("ResendWalletTransactions()\n");
-    CTxDB txdb("r");
-    CRITICAL_BLOCK(cs_mapWallet)
+    CRITICAL_BLOCK(cs_main)
     {
-        // Sort them in chronological order
-        multimap<unsigned int, CWalletTx*> mapSorted;
-        foreach(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
-        {
-            CWalletTx& wtx = item.second;
-            // Don't rebroadcast until it's had plenty of time that
-            // it should have gotten in already by now.
-            if (nTimeBestReceived - wtx.nTimeReceived > 60 * 60)
-                mapSorted.insert(make_pair(wtx.nTimeReceived, &wtx));
-        }
-        foreach(PAIRTYPE(const unsigned int, CWalletTx*)& item, mapSorted)
+        CTxDB txdb("r");
+        CRITICAL_BLOCK(cs_mapWallet)
         {
-            CWalletTx& wtx = *item.second;
-            wtx.RelayWalletTransaction(txdb);
+            // Sort them in chronological order
+            multimap<unsigned int, CWalletTx*> mapSorted;
+            foreach(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
+            {
+                CWalletTx& wtx = item.second;
+                // Don't rebroadcast until it's had plenty of time that
+                // it should have gotten in already by now.
+                if (nTimeBestReceived - wtx.nTimeReceived > 60 * 60)
+                    mapSorted.insert(make_pair(wtx.nTimeReceived, &wtx));
+            }
+            foreach(PAIRTYPE(const unsigned int, CWalletTx*)& item, mapSorted)
+            {
+                CWalletTx& wtx = *item.second;
+                wtx.RelayWalletTransaction(txdb);
+            }
         }
     }
 }
@@ -1091,6 +1723,9 @@ bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
 
 bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex)
 {
+    CTraceScope tracescope(TRACE_BLOCK_CONNECT, pindex->GetBlockHash(), pindex->nHeight);
+    CMetricTimer metrictimer(metricBlockConnect);
+
     //// issue here: it doesn't know the version
     unsigned int nTxPos = pindex->nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK) - 1 + GetSizeOfCompactSize(vtx.size());
 
@@ -1216,6 +1851,12 @@ bool Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
     foreach(CTransaction& tx, vResurrect)
         tx.AcceptTransaction(txdb, false);
 
+    // Wallet payments in the disconnected branch aren't confirmed anymore
+    CRITICAL_BLOCK(cs_mapWallet)
+        foreach(const CTransaction& tx, vResurrect)
+            if (mapWallet.count(tx.GetHash()))
+                walletReceivedTally.Recheck(tx.GetHash());
+
     // Delete redundant memory transactions that are in the connected branch
     foreach(CTransaction& tx, vDelete)
         tx.RemoveFromMemoryPool();
@@ -1290,6 +1931,9 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
         nBestHeight = pindexBest->nHeight;
         nTimeBestReceived = GetTime();
         nTransactionsUpdated++;
+        CRITICAL_BLOCK(cs_mapWallet)
+            walletReceivedTally.BestChainChanged();
+        PublishChainSnapshot();
         printf("AddToBlockIndex: new best=%s  height=%d\n", hashBestChain.ToString().substr(0,16).c_str(), nBestHeight);
     }
 
@@ -1298,6 +1942,8 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
 
     if (pindexNew == pindexBest)
     {
+        NotifyBlock(*this);
+
         // Notify UI to display prev block's coinbase if it was ours
         static uint256 hashPrevBestCoinBase;
         CRITICAL_BLOCK(cs_mapWallet)
@@ -1426,7 +2072,12 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
         return error("ProcessBlock() : already have block (orphan) %s", hash.ToString().substr(0,16).c_str());
 
     // Preliminary checks
-    if (!pblock->CheckBlock())
+    int64 nStart = GetTimeMicros();
+    TRACE(TRACE_BLOCK_CHECK, 'B', hash);
+    bool fChecked = pblock->CheckBlock();
+    TRACE(TRACE_BLOCK_CHECK, 'E', hash);
+    metricBlockCheck.Observe(GetTimeMicros() - nStart);
+    if (!fChecked)
     {
         delete pblock;
         return error("ProcessBlock() : CheckBlock FAILED");
@@ -1446,7 +2097,12 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
     }
 
     // Store to disk
-    if (!pblock->AcceptBlock())
+    nStart = GetTimeMicros();
+    TRACE(TRACE_BLOCK_ACCEPT, 'B', hash);
+    bool fAccepted = pblock->AcceptBlock();
+    TRACE(TRACE_BLOCK_ACCEPT, 'E', hash);
+    metricBlockAccept.Observe(GetTimeMicros() - nStart);
+    if (!fAccepted)
     {
         delete pblock;
         return error("ProcessBlock() : AcceptBlock FAILED");
@@ -1583,6 +2239,130 @@ FILE* AppendBlockFile(unsigned int& nFileRet)
     }
 }
 
+//
+// Raw blocks and transactions are read as the bytes that are in the block
+// files, without deserializing them.  A block's size is written just in front
+// of it, a transaction has to be walked to find where it ends.
+//
+bool GetBlockFileRange(const uint256& hash, CDiskTxPos& posRet, unsigned int& nSizeRet)
+{
+    CRITICAL_BLOCK(cs_main)
+    {
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+        if (mi == mapBlockIndex.end())
+            return false;
+        posRet = CDiskTxPos((*mi).second->nFile, (*mi).second->nBlockPos, (*mi).second->nBlockPos);
+    }
+
+    CAutoFile filein = OpenBlockFile(posRet.nFile, posRet.nBlockPos - sizeof(nSizeRet), "rb");
+    if (!filein)
+        return error("GetBlockFileRange() : OpenBlockFile failed");
+    try
+    {
+        filein >> nSizeRet;
+    }
+    catch (std::exception& e)
+    {
+        return error("GetBlockFileRange() : read failed");
+    }
+    if (nSizeRet > MAX_SIZE)
+        return error("GetBlockFileRange() : block size %u out of range", nSizeRet);
+    return true;
+}
+
+bool GetTransactionFileRange(const uint256& hash, CDiskTxPos& posRet, unsigned int& nSizeRet)
+{
+    CTxIndex txindex;
+    if (!CTxDB("r").ReadTxIndex(hash, txindex))
+        return false;
+    posRet = txindex.pos;
+
+    CAutoFile filein = OpenBlockFile(posRet.nFile, posRet.nTxPos, "rb");
+    if (!filein)
+        return error("GetTransactionFileRange() : OpenBlockFile failed");
+    try
+    {
+        // nVersion, vin, vout, nLockTime, skipping over everything but the
+        // lengths of the lists and scripts
+        nSizeRet = sizeof(int);
+        if (fseek(filein, sizeof(int), SEEK_CUR) != 0)
+            return error("GetTransactionFileRange() : fseek failed");
+        for (int nList = 0; nList < 2; nList++)
+        {
+            bool fIn = (nList == 0);
+            uint64 nCount = ReadCompactSize(filein);
+            nSizeRet += GetSizeOfCompactSize(nCount);
+            for (uint64 i = 0; i < nCount; i++)
+            {
+                // CTxIn starts with prevout, CTxOut with nValue
+                unsigned int nSkip = (fIn ? sizeof(uint256) + sizeof(unsigned int) : sizeof(int64));
+                if (fseek(filein, nSkip, SEEK_CUR) != 0)
+                    return error("GetTransactionFileRange() : fseek failed");
+                nSizeRet += nSkip;
+
+                // Script, then nSequence for a CTxIn
+                uint64 nScriptSize = ReadCompactSize(filein);
+                if (nScriptSize > MAX_SIZE)
+                    return error("GetTransactionFileRange() : script size out of range");
+                nSkip = nScriptSize + (fIn ? sizeof(unsigned int) : 0);
+                if (fseek(filein, nSkip, SEEK_CUR) != 0)
+                    return error("GetTransactionFileRange() : fseek failed");
+                nSizeRet += GetSizeOfCompactSize(nScriptSize) + nSkip;
+                if (nSizeRet > MAX_SIZE)
+                    return error("GetTransactionFileRange() : transaction size out of range");
+            }
+        }
+        nSizeRet += sizeof(unsigned int);
+    }
+    catch (std::exception& e)
+    {
+        return error("GetTransactionFileRange() : read failed");
+    }
+    return true;
+}
+
+bool ReadFileRange(const CDiskTxPos& pos, unsigned int nSize, vector<unsigned char>& vchRet)
+{
+    CAutoFile filein = OpenBlockFile(pos.nFile, pos.nTxPos, "rb");
+    if (!filein)
+        return error("ReadFileRange() : OpenBlockFile failed");
+    vchRet.resize(nSize);
+    if (nSize > 0 && fread(&vchRet[0], 1, nSize, filein) != nSize)
+        return error("ReadFileRange() : fread failed");
+    return true;
+}
+
+bool GetRawBlock(const uint256& hash, vector<unsigned char>& vchRet)
+{
+    CDiskTxPos pos;
+    unsigned int nSize;
+    if (!GetBlockFileRange(hash, pos, nSize))
+        return false;
+    return ReadFileRange(pos, nSize, vchRet);
+}
+
+bool GetRawTransaction(const uint256& hash, vector<unsigned char>& vchRet)
+{
+    // Not in a block yet
+    CRITICAL_BLOCK(cs_mapTransactions)
+    {
+        map<uint256, CTransaction>::iterator mi = mapTransactions.find(hash);
+        if (mi != mapTransactions.end())
+        {
+            CDataStream ss(SER_NETWORK);
+            ss << (*mi).second;
+            vchRet.assign(ss.begin(), ss.end());
+            return true;
+        }
+    }
+
+    CDiskTxPos pos;
+    unsigned int nSize;
+    if (!GetTransactionFileRange(hash, pos, nSize))
+        return false;
+    return ReadFileRange(pos, nSize, vchRet);
+}
+
 bool LoadBlockIndex(bool fAllowNew)
 {
     //
@@ -1852,6 +2632,7 @@ bool ProcessMessages(CNode* pfrom)
         bool fRet = false;
         try
         {
+            CTraceScope tracescope(TRACE_MSG_IN, strCommand.c_str(), nMessageSize);
             CRITICAL_BLOCK(cs_main)
                 fRet = ProcessMessage(pfrom, strCommand, vMsg);
             if (fShutdown)
@@ -1896,8 +2677,8 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     static map<unsigned int, vector<unsigned char> > mapReuseKey;
     RandAddSeedPerfmon();
     if (fDebug)
-        printf("%s ", DateTimeStrFormat("%x %H:%M:%S", GetTime()).c_str());
-    printf("received: %s (%d bytes)\n", strCommand.c_str(), vRecv.size());
+        LogPrint(LOG_NET, "%s ", DateTimeStrFormat("%x %H:%M:%S", GetTime()).c_str());
+    LogPrint(LOG_NET, "received: %s (%d bytes)\n", strCommand.c_str(), vRecv.size());
     if (mapArgs.count("-dropmessagestest") && GetRand(atoi(mapArgs["-dropmessagestest"])) == 0)
     {
         printf("dropmessagestest DROPPING RECV MESSAGE\n");
@@ -2070,7 +2851,7 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         {
             if (fShutdown)
                 return true;
-            printf("received getdata for: %s\n", inv.ToString().c_str());
+            LogPrint(LOG_NET, "received getdata for: %s\n", inv.ToString().c_str());
 
             if (inv.type == MSG_BLOCK)
             {
@@ -2216,6 +2997,7 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
         CInv inv(MSG_BLOCK, pblock->GetHash());
         pfrom->AddInventoryKnown(inv);
+        TRACE(TRACE_BLOCK_RECEIVED, 'i', inv.hash, ::GetSerializeSize(*pblock, SER_NETWORK));
 
         if (ProcessBlock(pfrom, pblock.release()))
             mapAlreadyAskedFor.erase(inv);
@@ -2333,6 +3115,24 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
 
 
+// Scheduled every 24 hours
+void RebroadcastAddress()
+{
+    CRITICAL_BLOCK(cs_main)
+    CRITICAL_BLOCK(cs_vNodes)
+    {
+        foreach(CNode* pnode, vNodes)
+        {
+            // Periodically clear setAddrKnown to allow refresh broadcasts
+            pnode->setAddrKnown.clear();
+
+            // Rebroadcast our address
+            if (addrLocalHost.IsRoutable() && !fUseProxy)
+                pnode->PushAddress(addrLocalHost);
+        }
+    }
+}
+
 bool SendMessages(CNode* pto, bool fSendTrickle)
 {
     CRITICAL_BLOCK(cs_main)
@@ -2341,31 +3141,9 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         if (pto->nVersion == 0)
             return true;
 
-        // Keep-alive ping
-        if (pto->nLastSend && GetTime() - pto->nLastSend > 30 * 60 && pto->vSend.empty())
-            pto->PushMessage("ping");
-
-        // Address refresh broadcast
-        static int64 nLastRebroadcast;
-        if (GetTime() - nLastRebroadcast > 24 * 60 * 60) // every 24 hours
-        {
-            nLastRebroadcast = GetTime();
-            CRITICAL_BLOCK(cs_vNodes)
-            {
-                foreach(CNode* pnode, vNodes)
-                {
-                    // Periodically clear setAddrKnown to allow refresh broadcasts
-                    pnode->setAddrKnown.clear();
-
-                    // Rebroadcast our address
-                    if (addrLocalHost.IsRoutable() && !fUseProxy)
-                        pnode->PushAddress(addrLocalHost);
-                }
-            }
-        }
-
-        // Resend wallet transactions that haven't gotten in a block yet
-        ResendWalletTransactions();
+        // Keep-alive ping
+        if (pto->nLastSend && GetTime() - pto->nLastSend > 30 * 60 && pto->vSend.empty())
+            pto->PushMessage("ping");
 
 
         //
@@ -2470,7 +3248,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             const CInv& inv = (*pto->mapAskFor.begin()).second;
             if (!AlreadyHave(txdb, inv))
             {
-                printf("sending getdata: %s\n", inv.ToString().c_str());
+                LogPrint(LOG_NET, "sending getdata: %s\n", inv.ToString().c_str());
                 vGetData.push_back(inv);
                 if (vGetData.size() >= 1000)
                 {
@@ -2585,6 +3363,53 @@ void BlockSHA256(const void* pin, unsigned int nBlocks, void* pout)
 }
 
 
+// Appends the memory pool transactions that can go in a block on the current
+// best block, in an order where inputs come first.  Returns the total fees,
+// with each transaction's fee in pvFeesRet if given.
+int64 AddBlockTransactions(CBlock* pblock, vector<int64>* pvFeesRet)
+{
+    int64 nFees = 0;
+    CRITICAL_BLOCK(cs_main)
+    CRITICAL_BLOCK(cs_mapTransactions)
+    {
+        CTxDB txdb("r");
+        map<uint256, CTxIndex> mapTestPool;
+        vector<char> vfAlreadyAdded(mapTransactions.size());
+        bool fFoundSomething = true;
+        unsigned int nBlockSize = 0;
+        while (fFoundSomething && nBlockSize < MAX_SIZE/2)
+        {
+            fFoundSomething = false;
+            unsigned int n = 0;
+            for (map<uint256, CTransaction>::iterator mi = mapTransactions.begin(); mi != mapTransactions.end(); ++mi, ++n)
+            {
+                if (vfAlreadyAdded[n])
+                    continue;
+                CTransaction& tx = (*mi).second;
+                if (tx.IsCoinBase() || !tx.IsFinal())
+                    continue;
+
+                // Transaction fee based on block size
+                int64 nMinFee = tx.GetMinFee(nBlockSize);
+
+                int64 nFeesBefore = nFees;
+                map<uint256, CTxIndex> mapTestPoolTmp(mapTestPool);
+                if (!tx.ConnectInputs(txdb, mapTestPoolTmp, CDiskTxPos(1,1,1), 0, nFees, false, true, nMinFee))
+                    continue;
+                swap(mapTestPool, mapTestPoolTmp);
+
+                pblock->vtx.push_back(tx);
+                if (pvFeesRet)
+                    pvFeesRet->push_back(nFees - nFeesBefore);
+                nBlockSize += ::GetSerializeSize(tx, SER_NETWORK);
+                vfAlreadyAdded[n] = true;
+                fFoundSomething = true;
+            }
+        }
+    }
+    return nFees;
+}
+
 void ParticipationValidator()
 {
     printf("ParticipationValidator started\n");
@@ -2646,42 +3471,7 @@ void ParticipationValidator()
         pblock->vtx.push_back(txNew);
 
         // Collect the latest transactions into the block
-        int64 nFees = 0;
-        CRITICAL_BLOCK(cs_main)
-        CRITICAL_BLOCK(cs_mapTransactions)
-        {
-            CTxDB txdb("r");
-            map<uint256, CTxIndex> mapTestPool;
-            vector<char> vfAlreadyAdded(mapTransactions.size());
-            bool fFoundSomething = true;
-            unsigned int nBlockSize = 0;
-            while (fFoundSomething && nBlockSize < MAX_SIZE/2)
-            {
-                fFoundSomething = false;
-                unsigned int n = 0;
-                for (map<uint256, CTransaction>::iterator mi = mapTransactions.begin(); mi != mapTransactions.end(); ++mi, ++n)
-                {
-                    if (vfAlreadyAdded[n])
-                        continue;
-                    CTransaction& tx = (*mi).second;
-                    if (tx.IsCoinBase() || !tx.IsFinal())
-                        continue;
-
-                    // Transaction fee based on block size
-                    int64 nMinFee = tx.GetMinFee(nBlockSize);
-
-                    map<uint256, CTxIndex> mapTestPoolTmp(mapTestPool);
-                    if (!tx.ConnectInputs(txdb, mapTestPoolTmp, CDiskTxPos(1,1,1), 0, nFees, false, true, nMinFee))
-                        continue;
-                    swap(mapTestPool, mapTestPoolTmp);
-
-                    pblock->vtx.push_back(tx);
-                    nBlockSize += ::GetSerializeSize(tx, SER_NETWORK);
-                    vfAlreadyAdded[n] = true;
-                    fFoundSomething = true;
-                }
-            }
-        }
+        int64 nFees = AddBlockTransactions(pblock.get());
         pblock->nBits = nBits;
         pblock->vtx[0].vout[0].nValue = pblock->GetBlockValue(nFees);
         printf("Validating participation with %d transactions\n", pblock->vtx.size());
@@ -2856,9 +3646,147 @@ int64 GetBalance()
     return nTotal;
 }
 
+static CChainSnapshot chainSnapshot;
+static CCriticalSection cs_chainSnapshot;
+static std::mutex mutexTemplateChanged;
+static std::condition_variable condTemplateChanged;
+
+void PublishChainSnapshot()
+{
+    int nPooledTx;
+    unsigned int nTransactionsUpdatedNow;
+    CRITICAL_BLOCK(cs_mapTransactions)
+    {
+        nPooledTx = mapTransactions.size();
+        nTransactionsUpdatedNow = nTransactionsUpdated;
+    }
+
+    CRITICAL_BLOCK(cs_chainSnapshot)
+    {
+        chainSnapshot.nHeight = nBestHeight;
+        chainSnapshot.hashBestChain = hashBestChain;
+        chainSnapshot.nBestTime = (pindexBest ? pindexBest->nTime : 0);
+        chainSnapshot.nBits = (pindexBest ? pindexBest->nBits : 0);
+        chainSnapshot.nPooledTx = nPooledTx;
+        chainSnapshot.nTransactionsUpdated = nTransactionsUpdatedNow;
+    }
+    metricPooledTx.Set(nPooledTx);
+    metricHeight.Set(nBestHeight);
+
+    // Wake long polls waiting on the block template
+    {
+        std::lock_guard<std::mutex> lock(mutexTemplateChanged);
+    }
+    condTemplateChanged.notify_all();
+}
+
+CChainSnapshot GetChainSnapshot()
+{
+    CChainSnapshot snapshot;
+    CRITICAL_BLOCK(cs_chainSnapshot)
+        snapshot = chainSnapshot;
+    return snapshot;
+}
+
+int64 GetSnapshotBalance()
+{
+    CChainSnapshot snapshot = GetChainSnapshot();
+    if (snapshot.fBalanceValid && snapshot.hashBalanceChain == snapshot.hashBestChain && snapshot.nBalanceWalletUpdated == nWalletUpdated)
+        return snapshot.nBalance;
+
+    // The wallet or the tip moved since, wait for the wallet.  The counter
+    // is read under the lock, a write that lands after makes the next
+    // reader compute it again.
+    int64 nBalance = 0;
+    unsigned int nWalletUpdatedNow = 0;
+    CRITICAL_BLOCK(cs_mapWallet)
+    {
+        nWalletUpdatedNow = nWalletUpdated;
+        nBalance = GetBalance();
+    }
+
+    CRITICAL_BLOCK(cs_chainSnapshot)
+    {
+        chainSnapshot.nBalance = nBalance;
+        chainSnapshot.fBalanceValid = true;
+        chainSnapshot.hashBalanceChain = snapshot.hashBestChain;
+        chainSnapshot.nBalanceWalletUpdated = nWalletUpdatedNow;
+    }
+    return nBalance;
+}
+
+// Long poll for getblocktemplate.  Returns once the best block is no longer
+// hashPrev, or once the memory pool has moved on from nTransactionsUpdatedPrev
+// and had a few seconds to settle, so a burst of transactions makes one new
+// template instead of many.
+void WaitForBlockTemplateChange(const uint256& hashPrev, unsigned int nTransactionsUpdatedPrev)
+{
+    static const int64 nSettleTime = 5000;
+    int64 nPoolChanged = 0;
+    std::unique_lock<std::mutex> lock(mutexTemplateChanged);
+    while (!fShutdown)
+    {
+        CChainSnapshot snapshot = GetChainSnapshot();
+        if (snapshot.hashBestChain != hashPrev)
+            return;
+        if (snapshot.nTransactionsUpdated != nTransactionsUpdatedPrev)
+        {
+            if (nPoolChanged == 0)
+                nPoolChanged = GetTimeMillis();
+            if (GetTimeMillis() - nPoolChanged >= nSettleTime)
+                return;
+        }
+        condTemplateChanged.wait_for(lock, std::chrono::seconds(1));
+    }
+}
+
+
+
+// Enough candidates below the target for the subset search to work with,
+// taken largest first from the coin index
+static const unsigned int MAX_SELECT_CANDIDATES = 1000;
+static const int BNB_MAX_TRIES = 100000;
+
+bool SelectCoinsExactMatch(const vector<pair<int64, CWalletTx*> >& vValue, int64 nTotalLower, int64 nTargetValue, vector<char>& vfBestRet)
+{
+    // Branch and bound: depth first search over include/exclude decisions,
+    // largest coins first, for a subset that adds up to exactly the target
+    // so no change output is needed.  Backtrack as soon as the running total
+    // overshoots or what's left can't reach the target.
+    vector<char> vfIncluded(vValue.size(), false);
+    int64 nTotal = 0;
+    int64 nRemaining = nTotalLower;
+    unsigned int i = 0;
+    for (int nTries = 0; nTries < BNB_MAX_TRIES; nTries++)
+    {
+        if (nTotal == nTargetValue)
+        {
+            vfBestRet = vfIncluded;
+            return true;
+        }
 
+        if (nTotal > nTargetValue || nTotal + nRemaining < nTargetValue || i == vValue.size())
+        {
+            // Walk back to the last included coin and try without it
+            while (i > 0 && !vfIncluded[i-1])
+                nRemaining += vValue[--i].first;
+            if (i == 0)
+                return false;
+            vfIncluded[i-1] = false;
+            nTotal -= vValue[i-1].first;
+        }
+        else
+        {
+            vfIncluded[i] = true;
+            nTotal += vValue[i].first;
+            nRemaining -= vValue[i].first;
+            i++;
+        }
+    }
+    return false;
+}
 
-bool SelectCoins(int64 nTargetValue, set<CWalletTx*>& setCoinsRet)
+bool SelectCoins(int64 nTargetValue, set<CWalletTx*>& setCoinsRet, const set<CWalletTx*>* psetExclude=NULL)
 {
     setCoinsRet.clear();
 
@@ -2870,29 +3798,38 @@ bool SelectCoins(int64 nTargetValue, set<CWalletTx*>& setCoinsRet)
 
     CRITICAL_BLOCK(cs_mapWallet)
     {
-        for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        // Exact match or the lowest larger coin, straight from the index
+        CWalletCoinIndex::const_iterator itTarget = walletCoinIndex.lower_bound(nTargetValue);
+        for (CWalletCoinIndex::const_iterator it = itTarget; it != walletCoinIndex.end(); ++it)
         {
-            CWalletTx* pcoin = &(*it).second;
-            if (!pcoin->IsFinal() || pcoin->fSpent)
+            CWalletTx* pcoin = (*it).second;
+            if (!pcoin->IsFinal() || pcoin->GetBlocksToMaturity() > 0)
                 continue;
-            int64 n = pcoin->GetCredit();
-            if (n <= 0)
+            if (psetExclude && psetExclude->count(pcoin))
                 continue;
-            if (n < nTargetValue)
-            {
-                vValue.push_back(make_pair(n, pcoin));
-                nTotalLower += n;
-            }
-            else if (n == nTargetValue)
+            if ((*it).first == nTargetValue)
             {
                 setCoinsRet.insert(pcoin);
                 return true;
             }
-            else if (n < nLowestLarger)
-            {
-                nLowestLarger = n;
-                pcoinLowestLarger = pcoin;
-            }
+            nLowestLarger = (*it).first;
+            pcoinLowestLarger = pcoin;
+            break;
+        }
+
+        // Coins below the target, largest first, until we have enough of them
+        for (CWalletCoinIndex::const_iterator it = itTarget; it != walletCoinIndex.begin();)
+        {
+            --it;
+            CWalletTx* pcoin = (*it).second;
+            if (!pcoin->IsFinal() || pcoin->GetBlocksToMaturity() > 0)
+                continue;
+            if (psetExclude && psetExclude->count(pcoin))
+                continue;
+            vValue.push_back(*it);
+            nTotalLower += (*it).first;
+            if (vValue.size() >= MAX_SELECT_CANDIDATES && nTotalLower >= nTargetValue)
+                break;
         }
     }
 
@@ -2904,10 +3841,27 @@ bool SelectCoins(int64 nTargetValue, set<CWalletTx*>& setCoinsRet)
         return true;
     }
 
-    // Solve subset sum by stochastic approximation
-    sort(vValue.rbegin(), vValue.rend());
+    // Try for a combination that needs no change first
+    vector<char> vfBest;
+    if (SelectCoinsExactMatch(vValue, nTotalLower, nTargetValue, vfBest))
+    {
+        for (int i = 0; i < vValue.size(); i++)
+            if (vfBest[i])
+                setCoinsRet.insert(vValue[i].second);
+
+        //// debug print
+        printf("SelectCoins() exact match: ");
+        for (int i = 0; i < vValue.size(); i++)
+            if (vfBest[i])
+                printf("%s ", FormatMoney(vValue[i].first).c_str());
+        printf("total %s\n", FormatMoney(nTargetValue).c_str());
+        return true;
+    }
+
+    // Solve subset sum by stochastic approximation, vValue is already
+    // sorted largest first
     vector<char> vfIncluded;
-    vector<char> vfBest(vValue.size(), true);
+    vfBest.assign(vValue.size(), true);
     int64 nBest = nTotalLower;
 
     for (int nRep = 0; nRep < 1000 && nBest != nTargetValue; nRep++)
@@ -2962,13 +3916,61 @@ bool SelectCoins(int64 nTargetValue, set<CWalletTx*>& setCoinsRet)
 
 
 
-bool CreateTransaction(CScript scriptPubKey, int64 nValue, CWalletTx& wtxNew, CKey& keyRet, int64& nFeeRequiredRet)
+// Signing an input hashes the whole transaction and then verifies the result,
+// so with many inputs it pays to spread them over the thread pool.  Each job
+// signs into its own copy, since the signature hash blanks every scriptSig.
+static const int MIN_INPUTS_PER_SIGN_THREAD = 16;
+
+void SignTransaction(const vector<const CWalletTx*>& vpcoinFrom, CTransaction& txTo)
+{
+    int nInputs = txTo.vin.size();
+    int nThreads = min(GetThreadPool().GetThreadCount(), nInputs / MIN_INPUTS_PER_SIGN_THREAD);
+    if (nThreads < 2)
+    {
+        for (int nIn = 0; nIn < nInputs; nIn++)
+            SignSignature(*vpcoinFrom[nIn], txTo, nIn);
+        return;
+    }
+
+    const CTransaction txUnsigned = txTo;
+    vector<CScript> vscriptSig(nInputs);
+    CTaskGroup group(GetThreadPool(), TASK_HIGH);
+    for (int nThread = 0; nThread < nThreads; nThread++)
+    {
+        group.Run([&, nThread]()
+        {
+            CTransaction txTmp = txUnsigned;
+            for (int nIn = nThread; nIn < nInputs; nIn += nThreads)
+            {
+                SignSignature(*vpcoinFrom[nIn], txTmp, nIn);
+                vscriptSig[nIn] = txTmp.vin[nIn].scriptSig;
+            }
+        });
+    }
+    group.Wait();
+
+    for (int nIn = 0; nIn < nInputs; nIn++)
+        txTo.vin[nIn].scriptSig = vscriptSig[nIn];
+}
+
+// The caller opens txdb, it must be opened before the mapWallet lock
+bool CreateTransaction(CTxDB& txdb, const vector<pair<CScript, int64> >& vecSend, CWalletTx& wtxNew, CKey& keyRet, int64& nFeeRequiredRet, const set<CWalletTx*>* psetExclude=NULL)
 {
     nFeeRequiredRet = 0;
+    if (vecSend.empty())
+        return false;
+    int64 nValue = 0;
+    foreach(const PAIRTYPE(CScript, int64)& s, vecSend)
+    {
+        if (!MoneyRange(s.second))
+            return false;
+        nValue += s.second;
+        if (!MoneyRange(nValue))
+            return false;
+    }
+
     CRITICAL_BLOCK(cs_main)
     {
-        // txdb must be opened before the mapWallet lock
-        CTxDB txdb("r");
         CRITICAL_BLOCK(cs_mapWallet)
         {
             int64 nFee = nTransactionFee;
@@ -2977,23 +3979,19 @@ bool CreateTransaction(CScript scriptPubKey, int64 nValue, CWalletTx& wtxNew, CK
                 wtxNew.vin.clear();
                 wtxNew.vout.clear();
                 wtxNew.fFromMe = true;
-                if (nValue < 0)
-                    return false;
-                int64 nValueOut = nValue;
                 int64 nTotalValue = nValue + nFee;
 
                 // Choose coins to use
                 set<CWalletTx*> setCoins;
-                if (!SelectCoins(nTotalValue, setCoins))
+                if (!SelectCoins(nTotalValue, setCoins, psetExclude))
                     return false;
                 int64 nValueIn = 0;
                 foreach(CWalletTx* pcoin, setCoins)
                     nValueIn += pcoin->GetCredit();
 
-                // Fill a vout to the payee
-                bool fChangeFirst = GetRand(2);
-                if (!fChangeFirst)
-                    wtxNew.vout.push_back(CTxOut(nValueOut, scriptPubKey));
+                // Fill vouts to the payees
+                foreach(const PAIRTYPE(CScript, int64)& s, vecSend)
+                    wtxNew.vout.push_back(CTxOut(s.second, s.first));
 
                 // Fill a vout back to self with any change
                 if (nValueIn > nTotalValue)
@@ -3011,29 +4009,32 @@ bool CreateTransaction(CScript scriptPubKey, int64 nValue, CWalletTx& wtxNew, CK
 
                     // Fill a vout to ourself, using same address type as the payment
                     CScript scriptChange;
-                    if (scriptPubKey.GetBitcoinAddressHash160() != 0)
+                    if (vecSend[0].first.GetBitcoinAddressHash160() != 0)
                         scriptChange.SetBitcoinAddress(keyRet.GetPubKey());
                     else
                         scriptChange << keyRet.GetPubKey() << OP_CHECKSIG;
-                    wtxNew.vout.push_back(CTxOut(nValueIn - nTotalValue, scriptChange));
-                }
 
-                // Fill a vout to the payee
-                if (fChangeFirst)
-                    wtxNew.vout.push_back(CTxOut(nValueOut, scriptPubKey));
+                    // Put it at a random position among the payees
+                    vector<CTxOut>::iterator position = wtxNew.vout.begin() + GetRand(wtxNew.vout.size() + 1);
+                    wtxNew.vout.insert(position, CTxOut(nValueIn - nTotalValue, scriptChange));
+                }
 
                 // Fill vin
+                vector<const CWalletTx*> vpcoinFrom;
                 foreach(CWalletTx* pcoin, setCoins)
+                {
                     for (int nOut = 0; nOut < pcoin->vout.size(); nOut++)
+                    {
                         if (pcoin->vout[nOut].IsMine())
+                        {
                             wtxNew.vin.push_back(CTxIn(pcoin->GetHash(), nOut));
+                            vpcoinFrom.push_back(pcoin);
+                        }
+                    }
+                }
 
                 // Sign
-                int nIn = 0;
-                foreach(CWalletTx* pcoin, setCoins)
-                    for (int nOut = 0; nOut < pcoin->vout.size(); nOut++)
-                        if (pcoin->vout[nOut].IsMine())
-                            SignSignature(*pcoin, wtxNew, nIn++);
+                SignTransaction(vpcoinFrom, wtxNew);
 
                 // Check that enough fee is included
                 if (nFee < wtxNew.GetMinFee())
@@ -3053,9 +4054,113 @@ bool CreateTransaction(CScript scriptPubKey, int64 nValue, CWalletTx& wtxNew, CK
     return true;
 }
 
+bool CreateTransaction(CScript scriptPubKey, int64 nValue, CWalletTx& wtxNew, CKey& keyRet, int64& nFeeRequiredRet)
+{
+    vector<pair<CScript, int64> > vecSend;
+    vecSend.push_back(make_pair(scriptPubKey, nValue));
+    CTxDB txdb("r");
+    return CreateTransaction(txdb, vecSend, wtxNew, keyRet, nFeeRequiredRet);
+}
+
+// A batched send is split into several transactions when it would reach
+// this size.  GetMinFee only lets a transaction under 60K in free while the
+// block is under 80K, so a 60K piece would take a block to itself and the
+// rest would wait or pay.  Pieces a quarter of that go in free a few to a
+// block.
+static const unsigned int MAX_BATCH_TX_SIZE = 80000 / 4;
+
+// Serialized size of a CTxOut paying to a bitcoin address
+static const int TXOUT_ADDRESS_SIZE = 34;
+
+bool CreateTransactions(const vector<pair<CScript, int64> >& vecSend, const CWalletTx& wtxTemplate, vector<CWalletTx>& vwtxNew, vector<CKey>& vkeyRet, int64& nFeeRequiredRet)
+{
+    vwtxNew.clear();
+    vkeyRet.clear();
+    nFeeRequiredRet = 0;
+    if (vecSend.empty())
+        return false;
+    int64 nValue = 0;
+    foreach(const PAIRTYPE(CScript, int64)& s, vecSend)
+    {
+        if (!MoneyRange(s.second))
+            return false;
+        nValue += s.second;
+        if (!MoneyRange(nValue))
+            return false;
+    }
+
+    CTxDB txdb("r");
+    CRITICAL_BLOCK(cs_main)
+    {
+        CRITICAL_BLOCK(cs_mapWallet)
+        {
+            // Coins taken by the earlier transactions of this batch
+            set<CWalletTx*> setSpent;
+
+            // Start by leaving about half of each transaction for inputs
+            unsigned int nBatchOutputs = MAX_BATCH_TX_SIZE / 2 / TXOUT_ADDRESS_SIZE;
+            unsigned int nNext = 0;
+            while (nNext < vecSend.size())
+            {
+                unsigned int nOutputs = min((unsigned int)vecSend.size() - nNext, nBatchOutputs);
+                vector<pair<CScript, int64> > vecPart(vecSend.begin() + nNext, vecSend.begin() + nNext + nOutputs);
+
+                CWalletTx wtx = wtxTemplate;
+                CKey key;
+                int64 nFeeRequired = 0;
+                if (!CreateTransaction(txdb, vecPart, wtx, key, nFeeRequired, &setSpent))
+                {
+                    nFeeRequiredRet += nFeeRequired;
+                    return false;
+                }
+
+                // Too many small coins to pay this many outputs, try a smaller piece
+                if (::GetSerializeSize((const CTransaction&)wtx, SER_NETWORK) >= MAX_BATCH_TX_SIZE && nOutputs > 1)
+                {
+                    nBatchOutputs = nOutputs / 2;
+                    continue;
+                }
+
+                foreach(const CTxIn& txin, wtx.vin)
+                    setSpent.insert(&mapWallet[txin.prevout.hash]);
+                nFeeRequiredRet += nFeeRequired;
+                vwtxNew.push_back(wtx);
+                vkeyRet.push_back(key);
+                nNext += nOutputs;
+            }
+        }
+    }
+
+    if (vwtxNew.size() > 1)
+        printf("CreateTransactions() : split %d payments into %d transactions\n", vecSend.size(), vwtxNew.size());
+    return true;
+}
+
+// Takes back what committing a transaction did to the wallet when its
+// records can't be written, so it isn't resent later and a retry can spend
+// the same coins.  The undo is queued behind the writes that failed, so the
+// records end up the same way if the queue recovers.
+static void UndoCommitTransaction(const CWalletTx& wtxNew, const vector<CWalletTx*>& vpcoinSpent)
+{
+    printf("UndoCommitTransaction() : dropping %s\n", wtxNew.GetHash().ToString().substr(0,10).c_str());
+    CRITICAL_BLOCK(cs_mapWallet)
+    {
+        foreach(CWalletTx* pcoin, vpcoinSpent)
+        {
+            pcoin->fSpent = false;
+            pcoin->WriteToDisk();
+            walletCoinIndex.Update(pcoin);
+            vWalletUpdated.push_back(pcoin->GetHash());
+        }
+        EraseFromWallet(wtxNew.GetHash());
+    }
+    MainFrameRepaint();
+}
+
 // Call after CreateTransaction unless you want to abort
 bool CommitTransaction(CWalletTx& wtxNew, const CKey& key)
 {
+    vector<CWalletTx*> vpcoinSpent;
     CRITICAL_BLOCK(cs_main)
     {
         printf("CommitTransaction:\n%s", wtxNew.ToString().c_str());
@@ -3080,12 +4185,23 @@ bool CommitTransaction(CWalletTx& wtxNew, const CKey& key)
                 setCoins.insert(&mapWallet[txin.prevout.hash]);
             foreach(CWalletTx* pcoin, setCoins)
             {
+                if (pcoin->fSpent)
+                    continue;
                 pcoin->fSpent = true;
                 pcoin->WriteToDisk();
+                walletCoinIndex.Update(pcoin);
                 vWalletUpdated.push_back(pcoin->GetHash());
+                vpcoinSpent.push_back(pcoin);
             }
         }
 
+        // The spent coins have to be on disk before the transaction goes out
+        if (!walletWriteQueue.Sync())
+        {
+            UndoCommitTransaction(wtxNew, vpcoinSpent);
+            throw runtime_error("CommitTransaction() : writing wallet records failed\n");
+        }
+
         // Track how many getdata requests our transaction gets
         CRITICAL_BLOCK(cs_mapRequestCount)
             mapRequestCount[wtxNew.GetHash()] = 0;
@@ -3106,6 +4222,96 @@ bool CommitTransaction(CWalletTx& wtxNew, const CKey& key)
 
 
 
+// Commit the transactions of a batched send.  All of their wallet records are
+// queued as one group and go to disk in one db transaction, so a crash can't
+// leave coins marked spent without the transaction that spent them.
+bool CommitTransactions(vector<CWalletTx>& vwtxNew, const vector<CKey>& vkey)
+{
+    bool fAccepted = true;
+    vector<vector<CWalletTx*> > vvpcoinSpent(vwtxNew.size());
+    CRITICAL_BLOCK(cs_main)
+    {
+        CRITICAL_BLOCK(cs_mapWallet)
+        {
+            CWalletDB walletdb;
+            if (!walletdb.TxnBegin())
+                return error("CommitTransactions() : TxnBegin failed");
+            bool fWritten = true;
+
+            // Add the change private keys to wallet
+            foreach(const CKey& key, vkey)
+                if (!key.IsNull() && !AddKey(key, &walletdb))
+                    fWritten = false;
+
+            for (int i = 0; i < vwtxNew.size(); i++)
+            {
+                CWalletTx& wtxNew = vwtxNew[i];
+                printf("CommitTransactions:\n%s", wtxNew.ToString().c_str());
+                if (!AddToWallet(wtxNew, &walletdb))
+                    fWritten = false;
+
+                // Mark old coins as spent
+                set<CWalletTx*> setCoins;
+                foreach(const CTxIn& txin, wtxNew.vin)
+                    setCoins.insert(&mapWallet[txin.prevout.hash]);
+                foreach(CWalletTx* pcoin, setCoins)
+                {
+                    if (pcoin->fSpent)
+                        continue;
+                    pcoin->fSpent = true;
+                    if (!walletdb.WriteTx(pcoin->GetHash(), *pcoin))
+                        fWritten = false;
+                    walletCoinIndex.Update(pcoin);
+                    vWalletUpdated.push_back(pcoin->GetHash());
+                    vvpcoinSpent[i].push_back(pcoin);
+                }
+            }
+
+            if (!fWritten)
+                walletdb.TxnAbort();
+            else if (!walletdb.TxnCommit())
+                fWritten = false;
+            if (!fWritten)
+            {
+                for (int i = vwtxNew.size() - 1; i >= 0; i--)
+                    UndoCommitTransaction(vwtxNew[i], vvpcoinSpent[i]);
+                throw runtime_error("CommitTransactions() : writing wallet records failed\n");
+            }
+        }
+
+        // Wait for the flush after letting go of cs_mapWallet, writes from
+        // other threads that queue up meanwhile go to disk with ours
+        if (!walletWriteQueue.Sync())
+        {
+            for (int i = vwtxNew.size() - 1; i >= 0; i--)
+                UndoCommitTransaction(vwtxNew[i], vvpcoinSpent[i]);
+            throw runtime_error("CommitTransactions() : writing wallet records failed\n");
+        }
+
+        foreach(CWalletTx& wtxNew, vwtxNew)
+        {
+            // Track how many getdata requests our transaction gets
+            CRITICAL_BLOCK(cs_mapRequestCount)
+                mapRequestCount[wtxNew.GetHash()] = 0;
+
+            // Broadcast
+            if (!wtxNew.AcceptTransaction())
+            {
+                // This must not fail. The transaction has already been signed and recorded.
+                printf("CommitTransactions() : Error: Transaction %s not valid\n", wtxNew.GetHash().ToString().substr(0,10).c_str());
+                fAccepted = false;
+                continue;
+            }
+            wtxNew.RelayWalletTransaction();
+        }
+    }
+    MainFrameRepaint();
+    return fAccepted;
+}
+
+
+
+
 string SendMoney(CScript scriptPubKey, int64 nValue, CWalletTx& wtxNew, bool fAskFee)
 {
     CRITICAL_BLOCK(cs_main)
@@ -3150,3 +4356,43 @@ string SendMoneyToBitcoinAddress(string strAddress, int64 nValue, CWalletTx& wtx
 
     return SendMoney(scriptPubKey, nValue, wtxNew, fAskFee);
 }
+
+
+
+string SendMoneyToMany(const vector<pair<CScript, int64> >& vecSend, const CWalletTx& wtxTemplate, vector<CWalletTx>& vwtxNew)
+{
+    // Check amounts
+    if (vecSend.empty())
+        return _("No recipients");
+    int64 nValue = 0;
+    foreach(const PAIRTYPE(CScript, int64)& s, vecSend)
+    {
+        if (s.second <= 0 || !MoneyRange(s.second))
+            return _("Invalid amount");
+        nValue += s.second;
+        if (!MoneyRange(nValue))
+            return _("Invalid amount");
+    }
+    if (nValue + nTransactionFee > GetBalance())
+        return _("Insufficient funds");
+
+    CRITICAL_BLOCK(cs_main)
+    {
+        vector<CKey> vkey;
+        int64 nFeeRequired;
+        if (!CreateTransactions(vecSend, wtxTemplate, vwtxNew, vkey, nFeeRequired))
+        {
+            string strError;
+            if (nValue + nFeeRequired > GetBalance())
+                strError = strprintf(_("Error: This is an oversized transaction that requires a transaction fee of %s  "), FormatMoney(nFeeRequired).c_str());
+            else
+                strError = _("Error: Transaction creation failed  ");
+            printf("SendMoneyToMany() : %s", strError.c_str());
+            return strError;
+        }
+
+        if (!CommitTransactions(vwtxNew, vkey))
+            return _("Error: The transaction was rejected.  This might happen if some of the coins in your wallet were already spent, such as if you used a copy of wallet.dat and coins were spent in the copy but not marked as spent here.");
+    }
+    return "";
+}
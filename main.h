@@ -17,7 +17,10 @@ class CKeyItem;
 static const unsigned int MAX_SIZE = 0x02000000;
 static const int64 COIN = 100000000;
 static const int64 CENT = 1000000;
+static const int64 MAX_MONEY = 1172245700 * COIN;
+inline bool MoneyRange(int64 nValue) { return (nValue >= 0 && nValue <= MAX_MONEY); }
 static const int COINBASE_MATURITY = 100;
+static const int POP_ACTIVATION_HEIGHT = 3500000;
 
 static const CBigNum bnProofOfWorkLimit(~uint256(0) >> 32);
 
@@ -28,6 +31,7 @@ static const CBigNum bnProofOfWorkLimit(~uint256(0) >> 32);
 
 extern CCriticalSection cs_main;
 extern map<uint256, CBlockIndex*> mapBlockIndex;
+extern map<uint256, CBlock*> mapOrphanBlocks;
 extern const uint256 hashGenesisBlock;
 extern CBlockIndex* pindexGenesisBlock;
 extern int nBestHeight;
@@ -58,25 +62,40 @@ extern int fMinimizeOnClose;
 bool CheckDiskSpace(int64 nAdditionalBytes=0);
 FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode="rb");
 FILE* AppendBlockFile(unsigned int& nFileRet);
-bool AddKey(const CKey& key);
-vector<unsigned char> GenerateNewKey();
-bool AddToWallet(const CWalletTx& wtxIn);
+bool GetBlockFileRange(const uint256& hash, CDiskTxPos& posRet, unsigned int& nSizeRet);
+bool GetTransactionFileRange(const uint256& hash, CDiskTxPos& posRet, unsigned int& nSizeRet);
+bool ReadFileRange(const CDiskTxPos& pos, unsigned int nSize, vector<unsigned char>& vchRet);
+bool GetRawBlock(const uint256& hash, vector<unsigned char>& vchRet);
+bool GetRawTransaction(const uint256& hash, vector<unsigned char>& vchRet);
+bool AddKey(const CKey& key, CWalletDB* pwalletdb=NULL);
+vector<unsigned char> GenerateNewKey(CWalletDB* pwalletdb=NULL);
+bool AddToWallet(const CWalletTx& wtxIn, CWalletDB* pwalletdb=NULL);
+bool StoreSupportingTransactions(CWalletTx& wtx, CWalletDB& walletdb);
+int SetMerkleBranches(CTxDB& txdb, const vector<CMerkleTx*>& vpTx);
 void WalletUpdateSpent(const COutPoint& prevout);
 void ReacceptWalletTransactions();
+void ResendWalletTransactions();
+void RebroadcastAddress();
+bool ScanForWalletTransactions(int nStartHeight);
 bool LoadBlockIndex(bool fAllowNew=true);
 void PrintBlockTree();
+unsigned int GetNextWorkRequired(const CBlockIndex* pindexLast);
 bool ProcessMessages(CNode* pfrom);
 bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 int64 GetBalance();
 bool CreateTransaction(CScript scriptPubKey, int64 nValue, CWalletTx& wtxNew, CKey& keyRet, int64& nFeeRequiredRet);
 bool CommitTransaction(CWalletTx& wtxNew, const CKey& key);
+bool CreateTransactions(const vector<pair<CScript, int64> >& vecSend, const CWalletTx& wtxTemplate, vector<CWalletTx>& vwtxNew, vector<CKey>& vkeyRet, int64& nFeeRequiredRet);
+bool CommitTransactions(vector<CWalletTx>& vwtxNew, const vector<CKey>& vkey);
 bool BroadcastTransaction(CWalletTx& wtxNew);
 string SendMoney(CScript scriptPubKey, int64 nValue, CWalletTx& wtxNew, bool fAskFee=false);
 string SendMoneyToBitcoinAddress(string strAddress, int64 nValue, CWalletTx& wtxNew, bool fAskFee=false);
+string SendMoneyToMany(const vector<pair<CScript, int64> >& vecSend, const CWalletTx& wtxTemplate, vector<CWalletTx>& vwtxNew);
 void GenerateBitcoins(bool fGenerate);
 void ThreadBitcoinMiner(void* parg);
 void BitcoinMiner();
+int64 AddBlockTransactions(CBlock* pblock, vector<int64>* pvFeesRet=NULL);
 
 
 
@@ -706,12 +725,14 @@ class CWalletTx : public CMerkleTx
 {
 public:
     vector<CMerkleTx> vtxPrev;
+    vector<uint256> vhashPrev;  // in mapWallet, vtxPrev is moved to walletPrevTxStore
     map<string, string> mapValue;
     vector<pair<string, string> > vOrderForm;
     unsigned int fTimeReceivedIsTxTime;
     unsigned int nTimeReceived;  // time received by this node
     char fFromMe;
     char fSpent;
+    int64 nOrderPos;  // order added to the wallet, kept in mapValue["n"]
     //// probably need to sign the order info so know it came from payer
 
     // memory only UI hints
@@ -740,6 +761,7 @@ public:
         nTimeReceived = 0;
         fFromMe = false;
         fSpent = false;
+        nOrderPos = -1;
         nTimeDisplayed = 0;
         nLinesDisplayed = 0;
     }
@@ -767,6 +789,7 @@ public:
     int GetRequestCount() const;
 
     void AddSupportingTransactions(CTxDB& txdb);
+    void GetSupportingTransactions(vector<CMerkleTx>& vtxPrevRet) const;
 
     bool AcceptWalletTransaction(CTxDB& txdb, bool fCheckInputs=true);
     bool AcceptWalletTransaction() { CTxDB txdb("r"); return AcceptWalletTransaction(txdb); }
@@ -837,6 +860,89 @@ public:
 
 
 
+//
+// Tx index records CTxDB has read, already deserialized, including
+// transactions it looked for and didn't find.  Split into shards by hash,
+// each with its own lock and LRU list, so lookups from different threads
+// rarely wait on each other.  CTxDB writes through it when a write reaches
+// the store.  A read that misses notes the shard's generation before going
+// to the store and only fills the cache if no write landed in between, so
+// a slow reader can't put back a record that was just replaced.  Misses
+// have an LRU list and a slice of the budget of their own, so invs for
+// transactions we've never seen can't push out records we have.  Only a
+// record the store says isn't there is cached as a miss, never a read that
+// failed.
+//
+static const int TXINDEX_CACHE_SHARDS = 16;
+static const int64 TXINDEX_CACHE_SIZE = 32;
+static const int TXINDEX_CACHE_MISS_SHARE = 8;  // misses get 1/8th of the budget
+
+class CTxIndexCache
+{
+protected:
+    struct CEntry
+    {
+        uint256 hash;
+        bool fFound;
+        CTxIndex txindex;
+        int64 nBytes;
+    };
+
+    struct CShard
+    {
+        std::mutex mutex;
+        list<CEntry> listLRU;
+        list<CEntry> listMissLRU;
+        map<uint256, list<CEntry>::iterator> mapEntries;
+        int64 nBytes;
+        int64 nMissBytes;
+        uint64 nGeneration;
+
+        CShard()
+        {
+            nBytes = 0;
+            nMissBytes = 0;
+            nGeneration = 0;
+        }
+
+        list<CEntry>& ListOf(const CEntry& entry) { return (entry.fFound ? listLRU : listMissLRU); }
+        int64& BytesOf(const CEntry& entry) { return (entry.fFound ? nBytes : nMissBytes); }
+    };
+
+    CShard pshard[TXINDEX_CACHE_SHARDS];
+    std::atomic<int64> nMaxShardBytes;
+    std::atomic<int64> nMaxShardMissBytes;
+
+    CShard& GetShard(uint256 hash) { return pshard[hash.begin()[0] % TXINDEX_CACHE_SHARDS]; }
+    void SetLocked(CShard& shard, const uint256& hash, const CTxIndex* ptxindex);
+    void EvictLocked(CShard& shard);
+    void EvictListLocked(CShard& shard, list<CEntry>& listLRU, int64& nBytes, int64 nMaxBytes);
+
+public:
+    CTxIndexCache()
+    {
+        SetMaxBytes(TXINDEX_CACHE_SIZE * 1000000);
+    }
+
+    void SetMaxBytes(int64 nMaxBytes);
+    int64 GetBytes();
+
+    // 1 if cached, 0 if cached as not in the index, -1 if not cached
+    int Get(const uint256& hash, CTxIndex& txindexRet);
+
+    // Fill after a miss, ptxindex NULL if the store didn't have it
+    uint64 GetGeneration(const uint256& hash);
+    void Insert(const uint256& hash, const CTxIndex* ptxindex, uint64 nGeneration);
+
+    // Write-through, ptxindex NULL when erased
+    void Update(const uint256& hash, const CTxIndex* ptxindex);
+    void Invalidate(const uint256& hash);
+};
+
+extern CTxIndexCache txIndexCache;
+
+
+
 
 
 //
@@ -1413,10 +1519,228 @@ public:
 
 
 
+//
+// Unspent wallet coins ordered by value, so coin selection can find an exact
+// match or the next larger coin without walking all of mapWallet.  Finality
+// and coinbase maturity change as the chain grows, so those are still checked
+// by the caller at selection time.  Protected by cs_mapWallet.
+//
+class CWalletCoinIndex
+{
+protected:
+    set<pair<int64, CWalletTx*> > setCoins;
+    map<CWalletTx*, int64> mapIndexed;
+
+public:
+    typedef set<pair<int64, CWalletTx*> >::const_iterator const_iterator;
+
+    const_iterator begin() const { return setCoins.begin(); }
+    const_iterator end() const { return setCoins.end(); }
+    const_iterator lower_bound(int64 nValue) const { return setCoins.lower_bound(make_pair(nValue, (CWalletTx*)NULL)); }
+    int size() const { return setCoins.size(); }
+
+    void Update(CWalletTx* pcoin);
+    void Remove(CWalletTx* pcoin);
+    void Rebuild();
+};
+
+
+
+//
+// Wallet transactions ordered by (GetTxTime, nOrderPos), overall and for each
+// of our addresses they pay, so listtransactions and the transaction list can
+// show a page without walking and sorting all of mapWallet.  The time moves
+// when a transaction gets into a block, so listtransactionssince pages by
+// nOrderPos instead, which only goes up as transactions are added and never
+// changes after.
+// Protected by cs_mapWallet.
+//
+class CWalletTxTimeIndex
+{
+public:
+    typedef pair<int64, int64> key_type;
+    typedef map<key_type, CWalletTx*>::const_iterator const_iterator;
+    typedef map<key_type, CWalletTx*>::const_reverse_iterator const_reverse_iterator;
+    typedef map<int64, CWalletTx*>::const_iterator const_order_iterator;
+
+protected:
+    struct CIndexed
+    {
+        key_type key;
+        vector<uint160> vAddresses;
+    };
+    map<key_type, CWalletTx*> mapByTime;
+    map<int64, CWalletTx*> mapByOrder;
+    map<uint160, set<key_type> > mapByAddress;
+    map<CWalletTx*, CIndexed> mapIndexed;
+    int64 nOrderPosNext;
+
+public:
+    CWalletTxTimeIndex()
+    {
+        nOrderPosNext = 0;
+    }
+
+    const_iterator begin() const { return mapByTime.begin(); }
+    const_iterator end() const { return mapByTime.end(); }
+    const_reverse_iterator rbegin() const { return mapByTime.rbegin(); }
+    const_reverse_iterator rend() const { return mapByTime.rend(); }
+    const_iterator find(const key_type& key) const { return mapByTime.find(key); }
+    int size() const { return mapByTime.size(); }
+
+    const_order_iterator upper_bound_order(int64 nOrderPos) const { return mapByOrder.upper_bound(nOrderPos); }
+    const_order_iterator end_order() const { return mapByOrder.end(); }
+    int64 NewOrderPos() { return nOrderPosNext++; }
+
+    bool GetPrev(key_type& key) const;
+    bool GetPrevByAddress(const vector<uint160>& vAddresses, key_type& key) const;
+    void Update(CWalletTx* pwtx);
+    void Remove(CWalletTx* pwtx);
+    void Rebuild();
+};
+
+
+
+//
+// Amounts paid to each bitcoin address by wallet transactions, bucketed by
+// the height of the block they're in, so the received-by calls add up the
+// buckets instead of scanning the wallet.  Unconfirmed payments are at height
+// INT_MAX.  A transaction in a block that isn't on the main chain may be in
+// one that's being connected, so it's looked at again when the best chain
+// changes.  Generated and non-final transactions aren't counted.
+// Protected by cs_mapWallet.
+//
+class CWalletReceivedTally
+{
+protected:
+    struct CTally
+    {
+        int64 nTotal;
+        map<int, pair<int64, int> > mapByHeight;  // amount and number of outputs
+
+        CTally() { nTotal = 0; }
+    };
+    struct CIndexed
+    {
+        int nHeight;
+        vector<pair<uint160, int64> > vReceived;
+    };
+    map<uint160, CTally> mapTally;
+    map<CWalletTx*, CIndexed> mapIndexed;
+    set<uint256> setRecheck;
+
+    bool Sum(const CTally& tally, int nMinDepth, int64& nAmountRet, int& nConfRet) const;
+
+public:
+    bool GetReceived(const uint160& hash160, int nMinDepth, int64& nAmountRet, int& nConfRet) const;
+    void GetAllReceived(int nMinDepth, map<uint160, pair<int64, int> >& mapRet) const;
+    void Update(CWalletTx* pwtx);
+    void Remove(CWalletTx* pwtx);
+    void Recheck(const uint256& hash) { setRecheck.insert(hash); }
+    void BestChainChanged();
+    void Rebuild();
+};
+
+
+
+//
+// The supporting transactions of wallet transactions.  Chains of our own
+// transactions share most of their vtxPrev, so each one is kept here once with
+// a count of the mapWallet entries using it, and stored once in wallet.dat.
+// They're only needed to relay unconfirmed transactions, so they aren't read
+// from disk until asked for.  Protected by cs_mapWallet.
+//
+class CWalletPrevTxStore
+{
+protected:
+    struct CEntry
+    {
+        int nRefCount;
+        bool fStored;
+        bool fLoaded;
+        CMerkleTx tx;
+
+        CEntry()
+        {
+            nRefCount = 0;
+            fStored = false;
+            fLoaded = false;
+        }
+    };
+    map<uint256, CEntry> mapEntries;
+
+public:
+    int size() const { return mapEntries.size(); }
+
+    // LoadWallet found the record on disk
+    void SetStored(const uint256& hash) { mapEntries[hash].fStored = true; }
+
+    // Fails if there is no record to refer to
+    bool AddRef(const uint256& hash);
+    bool Add(const CMerkleTx& tx, CWalletDB& walletdb);
+    void Release(const uint256& hash, CWalletDB& walletdb);
+    bool Get(const uint256& hash, CMerkleTx& txRet);
+
+    // After loading, erases the records no wallet transaction refers to
+    int EraseUnused(CWalletDB& walletdb);
+};
+
+
+
+//
+// Copy of the figures RPC and the UI poll, so reading them doesn't wait for
+// cs_main or cs_mapWallet while a block is being connected.  Whoever changes
+// the chain tip or the memory pool publishes a new one; the balance is
+// recomputed by the first reader after the wallet or tip changes, which
+// waits for the wallet if it's busy rather than show an old balance.
+//
+class CChainSnapshot
+{
+public:
+    int nHeight;
+    uint256 hashBestChain;
+    unsigned int nBestTime;
+    unsigned int nBits;
+    int nPooledTx;
+    unsigned int nTransactionsUpdated;
+    int64 nBalance;
+    bool fBalanceValid;
+    uint256 hashBalanceChain;
+    unsigned int nBalanceWalletUpdated;
+
+    CChainSnapshot()
+    {
+        nHeight = -1;
+        hashBestChain = 0;
+        nBestTime = 0;
+        nBits = 0;
+        nPooledTx = 0;
+        nTransactionsUpdated = 0;
+        nBalance = 0;
+        fBalanceValid = false;
+        hashBalanceChain = 0;
+        nBalanceWalletUpdated = 0;
+    }
+};
+
+void PublishChainSnapshot();
+CChainSnapshot GetChainSnapshot();
+int64 GetSnapshotBalance();
+void WaitForBlockTemplateChange(const uint256& hashPrev, unsigned int nTransactionsUpdatedPrev);
+
+
+
+
+
+
 extern map<uint256, CTransaction> mapTransactions;
 extern map<uint256, CWalletTx> mapWallet;
 extern vector<uint256> vWalletUpdated;
 extern CCriticalSection cs_mapWallet;
+extern CWalletCoinIndex walletCoinIndex;
+extern CWalletTxTimeIndex walletTxTimeIndex;
+extern CWalletReceivedTally walletReceivedTally;
+extern CWalletPrevTxStore walletPrevTxStore;
 extern map<vector<unsigned char>, CPrivKey> mapKeys;
 extern map<uint160, vector<unsigned char> > mapPubKeys;
 extern CCriticalSection cs_mapKeys;
@@ -34,6 +34,18 @@ deque<pair<int64, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 map<CInv, int64> mapAlreadyAskedFor;
 
+static int64 GetPeerCount(bool fInbound)
+{
+    int64 nCount = 0;
+    CRITICAL_BLOCK(cs_vNodes)
+        foreach(CNode* pnode, vNodes)
+            if (pnode->fInbound == fInbound)
+                nCount++;
+    return nCount;
+}
+static CMetricGauge& metricPeersIn = GetMetricGauge("pop_peers", "Connected peers", "direction=\"in\"", boost::bind(&GetPeerCount, true));
+static CMetricGauge& metricPeersOut = GetMetricGauge("pop_peers", "Connected peers", "direction=\"out\"", boost::bind(&GetPeerCount, false));
+
 // Settings
 int fUseProxy = false;
 CAddress addrProxy("127.0.0.1:9050");
@@ -1381,7 +1393,7 @@ bool StopNode()
     fShutdown = true;
     nTransactionsUpdated++;
     int64 nStart = GetTime();
-    while (vnThreadsRunning[0] > 0 || vnThreadsRunning[2] > 0 || vnThreadsRunning[3] > 0 || vnThreadsRunning[4] > 0)
+    while (vnThreadsRunning[0] > 0 || vnThreadsRunning[2] > 0 || vnThreadsRunning[3] > 0 || vnThreadsRunning[4] > 0 || nRPCWorkersRunning > 0)
     {
         if (GetTime() - nStart > 20)
             break;
@@ -1392,13 +1404,301 @@ bool StopNode()
     if (vnThreadsRunning[2] > 0) printf("ThreadMessageHandler still running\n");
     if (vnThreadsRunning[3] > 0) printf("ThreadBitcoinMiner still running\n");
     if (vnThreadsRunning[4] > 0) printf("ThreadRPCServer still running\n");
-    while (vnThreadsRunning[2] > 0 || vnThreadsRunning[4] > 0)
+    if (nRPCWorkersRunning > 0) printf("ThreadRPCWorker still running\n");
+    while (vnThreadsRunning[2] > 0 || vnThreadsRunning[4] > 0 || nRPCWorkersRunning > 0)
         Sleep(20);
     Sleep(50);
 
     return true;
 }
 
+
+
+
+
+
+
+
+//
+// Notifications
+//
+// With -pubport, subscribers connected to that port on localhost are sent
+// each block as it becomes the best block and each transaction as it's
+// accepted into the memory pool.  Every message is
+//
+//   unsigned int nSize, unsigned int nSequence, string strTopic, vector<unsigned char> vchBody
+//
+// serialized like the network protocol, with topics hashblock, rawblock,
+// hashtx and rawtx.  Validation only queues the message, the publisher
+// thread does the sending.  Each subscriber has its own queue, bounded by
+// -pubqueue megabytes, and when a new message doesn't fit in a slow
+// subscriber's queue its oldest messages are dropped, which the subscriber
+// sees as a gap in the sequence numbers.
+//
+
+class CSubscriber
+{
+public:
+    SOCKET hSocket;
+    deque<std::shared_ptr<const string> > queue;
+    int64 nQueueBytes;
+    unsigned int nSendOffset;
+    bool fSending;
+    int64 nDropped;
+
+    CSubscriber(SOCKET hSocketIn)
+    {
+        hSocket = hSocketIn;
+        nQueueBytes = 0;
+        nSendOffset = 0;
+        fSending = false;
+        nDropped = 0;
+    }
+};
+
+static std::mutex mutexNotify;
+static std::condition_variable condNotify;
+static list<CSubscriber> listSubscribers;
+static std::atomic<int> nSubscribers(0);
+static bool fNotifyPending = false;
+static unsigned int nNotifySequence = 0;
+static int64 nNotifyQueueMaxBytes = 64 * 1000000;
+
+static void PushNotification(const char* pszTopic, const vector<unsigned char>& vchBody)
+{
+    std::lock_guard<std::mutex> lock(mutexNotify);
+    CDataStream ss(SER_NETWORK);
+    ss << nNotifySequence++ << string(pszTopic) << vchBody;
+    unsigned int nSize = ss.size();
+    std::shared_ptr<string> pmsg(new string());
+    pmsg->reserve(sizeof(nSize) + nSize);
+    pmsg->append((const char*)&nSize, sizeof(nSize));
+    pmsg->append(ss.begin(), ss.end());
+
+    foreach(CSubscriber& subscriber, listSubscribers)
+    {
+        while (subscriber.nQueueBytes + (int64)pmsg->size() > nNotifyQueueMaxBytes)
+        {
+            // Don't cut into a message that's partly sent or being sent
+            deque<std::shared_ptr<const string> >::iterator itOldest = subscriber.queue.begin();
+            if (itOldest != subscriber.queue.end() && (subscriber.nSendOffset > 0 || subscriber.fSending))
+                itOldest++;
+            if (itOldest == subscriber.queue.end())
+                break;
+            subscriber.nQueueBytes -= (*itOldest)->size();
+            subscriber.queue.erase(itOldest);
+            subscriber.nDropped++;
+        }
+        subscriber.queue.push_back(pmsg);
+        subscriber.nQueueBytes += pmsg->size();
+    }
+    fNotifyPending = true;
+    condNotify.notify_one();
+}
+
+void NotifyBlock(const CBlock& block)
+{
+    if (nSubscribers == 0)
+        return;
+    uint256 hash = block.GetHash();
+    CDataStream ss(SER_NETWORK);
+    ss << block;
+    PushNotification("hashblock", vector<unsigned char>(hash.begin(), hash.end()));
+    PushNotification("rawblock", vector<unsigned char>(ss.begin(), ss.end()));
+}
+
+void NotifyTransaction(const CTransaction& tx)
+{
+    if (nSubscribers == 0)
+        return;
+    uint256 hash = tx.GetHash();
+    CDataStream ss(SER_NETWORK);
+    ss << tx;
+    PushNotification("hashtx", vector<unsigned char>(hash.begin(), hash.end()));
+    PushNotification("rawtx", vector<unsigned char>(ss.begin(), ss.end()));
+}
+
+static bool SetNonBlocking(SOCKET hSocket)
+{
+    int nOne = 1;
+#ifdef __WXMSW__
+    return (ioctlsocket(hSocket, FIONBIO, (u_long*)&nOne) != SOCKET_ERROR);
+#else
+    return (fcntl(hSocket, F_SETFL, O_NONBLOCK) != SOCKET_ERROR);
+#endif
+}
+
+void ThreadNotifyPublisher2(void* parg);
+void ThreadNotifyPublisher(void* parg)
+{
+    IMPLEMENT_RANDOMIZE_STACK(ThreadNotifyPublisher(parg));
+    try
+    {
+        ThreadNotifyPublisher2(parg);
+    }
+    catch (std::exception& e) {
+        PrintException(&e, "ThreadNotifyPublisher()");
+    } catch (...) {
+        PrintException(NULL, "ThreadNotifyPublisher()");
+    }
+    printf("ThreadNotifyPublisher exiting\n");
+}
+
+void ThreadNotifyPublisher2(void* parg)
+{
+    printf("ThreadNotifyPublisher started\n");
+    if (mapArgs.count("-pubqueue"))
+        nNotifyQueueMaxBytes = max(1, atoi(mapArgs["-pubqueue"])) * (int64)1000000;
+
+    SOCKET hListen = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (hListen == INVALID_SOCKET)
+    {
+        printf("Error: Couldn't open socket for notifications (socket returned error %d)\n", WSAGetLastError());
+        return;
+    }
+#ifndef __WXMSW__
+    int nOne = 1;
+    setsockopt(hListen, SOL_SOCKET, SO_REUSEADDR, (void*)&nOne, sizeof(int));
+#endif
+
+    // Bind to loopback so only local processes can subscribe
+    struct sockaddr_in sockaddr;
+    memset(&sockaddr, 0, sizeof(sockaddr));
+    sockaddr.sin_family = AF_INET;
+    sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sockaddr.sin_port = htons(atoi(mapArgs["-pubport"]));
+    if (!SetNonBlocking(hListen) ||
+        ::bind(hListen, (struct sockaddr*)&sockaddr, sizeof(sockaddr)) == SOCKET_ERROR ||
+        listen(hListen, SOMAXCONN) == SOCKET_ERROR)
+    {
+        printf("Error: Unable to listen for notification subscribers on port %d (error %d)\n", ntohs(sockaddr.sin_port), WSAGetLastError());
+        closesocket(hListen);
+        return;
+    }
+    printf("Publishing notifications on port %d\n", ntohs(sockaddr.sin_port));
+
+    while (!fShutdown)
+    {
+        // Accept new subscribers
+        loop
+        {
+            struct sockaddr_in sockaddrPeer;
+            socklen_t len = sizeof(sockaddrPeer);
+            SOCKET hSocket = accept(hListen, (struct sockaddr*)&sockaddrPeer, &len);
+            if (hSocket == INVALID_SOCKET)
+                break;
+            if (!SetNonBlocking(hSocket))
+            {
+                closesocket(hSocket);
+                continue;
+            }
+            std::lock_guard<std::mutex> lock(mutexNotify);
+            listSubscribers.push_back(CSubscriber(hSocket));
+            nSubscribers++;
+            printf("notification subscriber connected, %d subscribers\n", (int)nSubscribers);
+        }
+
+        // Send as much as each subscriber will take without blocking.  The
+        // sends happen outside mutexNotify so validation never waits on a
+        // socket.  Only this thread adds or removes subscribers, so the list
+        // holds still without the lock, and the message being sent is marked
+        // so PushNotification won't drop it meanwhile.
+        bool fBlocked = false;
+        fd_set fdsetSend;
+        FD_ZERO(&fdsetSend);
+        SOCKET hSocketMax = hListen;
+        {
+            std::lock_guard<std::mutex> lock(mutexNotify);
+            fNotifyPending = false;
+        }
+        for (list<CSubscriber>::iterator it = listSubscribers.begin(); it != listSubscribers.end();)
+        {
+            CSubscriber& subscriber = *it;
+            bool fDisconnect = false;
+            loop
+            {
+                std::shared_ptr<const string> pmsg;
+                {
+                    std::lock_guard<std::mutex> lock(mutexNotify);
+                    if (subscriber.queue.empty())
+                        break;
+                    pmsg = subscriber.queue.front();
+                    subscriber.fSending = true;
+                }
+                const string& strMsg = *pmsg;
+                int nBytes = send(subscriber.hSocket, strMsg.data() + subscriber.nSendOffset, strMsg.size() - subscriber.nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+                int nErr = WSAGetLastError();
+                {
+                    std::lock_guard<std::mutex> lock(mutexNotify);
+                    subscriber.fSending = false;
+                    if (nBytes > 0)
+                    {
+                        subscriber.nSendOffset += nBytes;
+                        if (subscriber.nSendOffset == strMsg.size())
+                        {
+                            subscriber.queue.pop_front();
+                            subscriber.nQueueBytes -= strMsg.size();
+                            subscriber.nSendOffset = 0;
+                        }
+                    }
+                }
+                if (nBytes > 0)
+                    continue;
+                if (nBytes < 0 && (nErr == WSAEWOULDBLOCK || nErr == WSAEMSGSIZE || nErr == WSAEINTR || nErr == WSAEINPROGRESS))
+                {
+                    FD_SET(subscriber.hSocket, &fdsetSend);
+                    hSocketMax = max(hSocketMax, subscriber.hSocket);
+                    fBlocked = true;
+                }
+                else
+                {
+                    fDisconnect = true;
+                }
+                break;
+            }
+            if (fDisconnect)
+            {
+                closesocket(subscriber.hSocket);
+                std::lock_guard<std::mutex> lock(mutexNotify);
+                printf("notification subscriber disconnected, %"PRI64d" messages dropped\n", subscriber.nDropped);
+                it = listSubscribers.erase(it);
+                nSubscribers--;
+            }
+            else
+            {
+                ++it;
+            }
+        }
+
+        // Wait for a subscriber to take more, or for something new to send
+        if (fBlocked)
+        {
+            fd_set fdsetRecv;
+            FD_ZERO(&fdsetRecv);
+            FD_SET(hListen, &fdsetRecv);
+            struct timeval timeout;
+            timeout.tv_sec  = 0;
+            timeout.tv_usec = 50000;
+            select(hSocketMax + 1, &fdsetRecv, &fdsetSend, NULL, &timeout);
+        }
+        else
+        {
+            std::unique_lock<std::mutex> lock(mutexNotify);
+            condNotify.wait_for(lock, std::chrono::milliseconds(100), []() { return fNotifyPending || fShutdown; });
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mutexNotify);
+    foreach(CSubscriber& subscriber, listSubscribers)
+        closesocket(subscriber.hSocket);
+    listSubscribers.clear();
+    nSubscribers = 0;
+    closesocket(hListen);
+}
+
+
+
+
 class CNetCleanup
 {
 public:
@@ -8,6 +8,8 @@ class CInv;
 class CRequestTracker;
 class CNode;
 class CBlockIndex;
+class CBlock;
+class CTransaction;
 extern int nBestHeight;
 
 
@@ -33,6 +35,9 @@ bool AnySubscribed(unsigned int nChannel);
 bool BindListenPort(string& strError=REF(string()));
 void StartNode(void* parg);
 bool StopNode();
+void ThreadNotifyPublisher(void* parg);
+void NotifyBlock(const CBlock& block);
+void NotifyTransaction(const CTransaction& tx);
 
 
 
@@ -716,6 +721,7 @@ public:
 
         printf("(%d bytes) ", nSize);
         printf("\n");
+        TRACE(TRACE_MSG_OUT, 'i', GetMessageCommand(), nSize);
 
         nHeaderStart = -1;
         nMessageStart = -1;
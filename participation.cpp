@@ -42,7 +42,7 @@ void ParticipationMiner()
         if (myStake < MINIMUM_STAKE)
         {
             if (GetTime() % 3600 == 0) // Log once per hour
-                printf("Insufficient stake for participation. Current: %s, Required: %s\n", 
+                LogPrint(LOG_POP, "Insufficient stake for participation. Current: %s, Required: %s\n", 
                        FormatMoney(myStake).c_str(), 
                        FormatMoney(MINIMUM_STAKE).c_str());
             continue;
@@ -56,7 +56,10 @@ void ParticipationMiner()
         uint256 prevBlockHash = pindexPrev->GetBlockHash();
         uint160 myAddress = Hash160(key.GetPubKey());
         
-        if (!g_participationValidator.checkParticipation(myAddress, prevBlockHash, pindexPrev->nHeight + 1))
+        TRACE(TRACE_LOTTERY, 'B', prevBlockHash, pindexPrev->nHeight + 1);
+        bool fWon = g_participationValidator.checkParticipation(myAddress, prevBlockHash, pindexPrev->nHeight + 1);
+        TRACE(TRACE_LOTTERY, 'E', prevBlockHash, pindexPrev->nHeight + 1);
+        if (!fWon)
         {
             // We didn't win this round - that's okay, equal chance next time
             continue;
@@ -144,7 +147,7 @@ void ParticipationMiner()
         // Update merkle root
         pblock->hashMerkleRoot = pblock->BuildMerkleTree();
         
-        printf("ParticipationMiner: Creating block with %zu transactions\n", pblock->vtx.size());
+        LogPrint(LOG_POP, "ParticipationMiner: Creating block with %zu transactions\n", pblock->vtx.size());
         
         // Sign the block with our participation key
         std::vector<unsigned char> vchSig;
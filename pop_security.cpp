@@ -172,20 +172,20 @@ public:
         UpdateStatistics();
         
         if (stats.totalParticipants < MIN_PARTICIPANTS) {
-            printf("Warning: Low participant count (%d < %d)\n",
+            LogPrintLevel(LOGLEVEL_WARNING, "Warning: Low participant count (%d < %d)\n",
                    stats.totalParticipants, MIN_PARTICIPANTS);
             return false;
         }
         
         if (stats.totalStaked < MIN_TOTAL_STAKE) {
-            printf("Warning: Low total stake (%s < %s GLC)\n",
+            LogPrintLevel(LOGLEVEL_WARNING, "Warning: Low total stake (%s < %s GLC)\n",
                    FormatMoney(stats.totalStaked).c_str(),
                    FormatMoney(MIN_TOTAL_STAKE).c_str());
             return false;
         }
         
         if (stats.participationRate < MIN_PARTICIPATION_RATE) {
-            printf("Warning: Low participation rate (%.1f%% < %.1f%%)\n",
+            LogPrintLevel(LOGLEVEL_WARNING, "Warning: Low participation rate (%.1f%% < %.1f%%)\n",
                    stats.participationRate * 100,
                    MIN_PARTICIPATION_RATE * 100);
             return false;
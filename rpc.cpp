@@ -22,6 +22,107 @@ typedef Value(*rpcfn_type)(const Array& params, bool fHelp);
 extern map<string, rpcfn_type> mapCallTable;
 
 
+//
+// Calls that return a long array push the elements one at a time.  Given a
+// keep-alive HTTP/1.1 socket, the reply is written out in chunks as it's
+// produced instead of being built as a tree, serialized and copied into the
+// HTTP reply.  HTTP/1.0 clients don't know chunked encoding, so they and
+// clients closing the connection get the serialized text in one piece with
+// a Content-Length once it's finished.  Without a socket the elements are
+// collected into an Array.
+//
+class CJSONArrayWriter
+{
+protected:
+    tcp::iostream* pstream;
+    bool fKeepAlive;
+    bool fChunked;
+    bool fStarted;
+    int nCount;
+    string strBuffer;
+    string strSuffix;
+    Array arrayCollect;
+
+    enum { CHUNK_SIZE = 64 * 1024 };
+
+    void Flush()
+    {
+        if (!fStarted)
+        {
+            *pstream << strprintf(
+                    "HTTP/1.1 200 OK\r\n"
+                    "Connection: %s\r\n"
+                    "%s"
+                    "Content-Type: application/json\r\n"
+                    "Date: Sat, 08 Jul 2006 12:04:08 GMT\r\n"
+                    "Server: json-rpc/1.0\r\n"
+                    "\r\n",
+                (fKeepAlive ? "keep-alive" : "close"),
+                (fChunked ? string("Transfer-Encoding: chunked\r\n") : strprintf("Content-Length: %u\r\n", (unsigned int)strBuffer.size())).c_str());
+            fStarted = true;
+        }
+        if (strBuffer.empty())
+            return;
+        if (fChunked)
+            *pstream << strprintf("%x\r\n", (unsigned int)strBuffer.size()) << strBuffer << "\r\n";
+        else
+            *pstream << strBuffer;
+        strBuffer.clear();
+        if (!*pstream)
+            throw runtime_error("RPC client disconnected");
+    }
+
+public:
+    CJSONArrayWriter()
+    {
+        pstream = NULL;
+        fKeepAlive = false;
+        fChunked = false;
+        fStarted = false;
+        nCount = 0;
+    }
+
+    CJSONArrayWriter(tcp::iostream& stream, bool fKeepAliveIn, bool fHTTP11, const Value& id)
+    {
+        pstream = &stream;
+        fKeepAlive = fKeepAliveIn;
+        fChunked = (fKeepAlive && fHTTP11);
+        fStarted = false;
+        nCount = 0;
+        strBuffer = "{\"result\":[";
+        strSuffix = "],\"error\":null,\"id\":" + write_string(id, false) + "}\n";
+    }
+
+    void Push(const Value& val)
+    {
+        if (pstream == NULL)
+        {
+            arrayCollect.push_back(val);
+            return;
+        }
+        if (nCount++ > 0)
+            strBuffer += ',';
+        strBuffer += write_string(val, false);
+        if (fChunked && strBuffer.size() >= CHUNK_SIZE)
+            Flush();
+    }
+
+    void Finish()
+    {
+        strBuffer += strSuffix;
+        Flush();
+        if (fChunked)
+            *pstream << "0\r\n\r\n";
+        *pstream << std::flush;
+    }
+
+    bool Started() const { return fStarted; }
+    const Array& GetArray() const { return arrayCollect; }
+};
+
+typedef void(*rpcstreamfn_type)(const Array& params, bool fHelp, CJSONArrayWriter& writer);
+
+
 
 
 
@@ -82,7 +183,7 @@ Value getblockcount(const Array& params, bool fHelp)
             "getblockcount\n"
             "Returns the number of blocks in the longest block chain.");
 
-    return nBestHeight + 1;
+    return GetChainSnapshot().nHeight + 1;
 }
 
 
@@ -93,7 +194,7 @@ Value getblocknumber(const Array& params, bool fHelp)
             "getblocknumber\n"
             "Returns the block number of the latest block in the longest block chain.");
 
-    return nBestHeight;
+    return GetChainSnapshot().nHeight;
 }
 
 
@@ -108,15 +209,15 @@ Value getconnectioncount(const Array& params, bool fHelp)
 }
 
 
-double GetDifficulty()
+double GetDifficulty(const CChainSnapshot& snapshot)
 {
     // Floating point number that is a multiple of the minimum difficulty,
     // minimum difficulty = 1.0.
-    if (pindexBest == NULL)
+    if (snapshot.nBits == 0)
         return 1.0;
     int nShift = 256 - 32 - 31; // to fit in a uint
     double dMinimum = (CBigNum().SetCompact(bnProofOfWorkLimit.GetCompact()) >> nShift).getuint();
-    double dCurrently = (CBigNum().SetCompact(pindexBest->nBits) >> nShift).getuint();
+    double dCurrently = (CBigNum().SetCompact(snapshot.nBits) >> nShift).getuint();
     return dMinimum / dCurrently;
 }
 
@@ -127,7 +228,7 @@ Value getdifficulty(const Array& params, bool fHelp)
             "getdifficulty\n"
             "Returns the proof-of-work difficulty as a multiple of the minimum difficulty.");
 
-    return GetDifficulty();
+    return GetDifficulty(GetChainSnapshot());
 }
 
 
@@ -138,7 +239,7 @@ Value getbalance(const Array& params, bool fHelp)
             "getbalance\n"
             "Returns the server's available balance.");
 
-    return ((double)GetBalance() / (double)COIN);
+    return ((double)GetSnapshotBalance() / (double)COIN);
 }
 
 
@@ -185,14 +286,16 @@ Value getinfo(const Array& params, bool fHelp)
         throw runtime_error(
             "getinfo");
 
+    CChainSnapshot snapshot = GetChainSnapshot();
     Object obj;
-    obj.push_back(Pair("balance",       (double)GetBalance() / (double)COIN));
-    obj.push_back(Pair("blocks",        (int)nBestHeight + 1));
+    obj.push_back(Pair("balance",       (double)GetSnapshotBalance() / (double)COIN));
+    obj.push_back(Pair("blocks",        (int)snapshot.nHeight + 1));
     obj.push_back(Pair("connections",   (int)vNodes.size()));
     obj.push_back(Pair("proxy",         (fUseProxy ? addrProxy.ToStringIPPort() : string())));
     obj.push_back(Pair("generate",      (bool)fGenerateBitcoins));
     obj.push_back(Pair("genproclimit",  (int)(fLimitProcessors ? nLimitProcessors : -1)));
-    obj.push_back(Pair("difficulty",    (double)GetDifficulty()));
+    obj.push_back(Pair("difficulty",    (double)GetDifficulty(snapshot)));
+    obj.push_back(Pair("pooledtx",      (int)snapshot.nPooledTx));
     return obj;
 }
 
@@ -314,12 +417,78 @@ Value sendtoaddress(const Array& params, bool fHelp)
 }
 
 
-Value listtransactions(const Array& params, bool fHelp)
+Value sendmany(const Array& params, bool fHelp)
 {
-    if (fHelp || params.size() > 2)
+    if (fHelp || params.size() < 1 || params.size() > 2)
         throw runtime_error(
-            "listtransactions [count=10] [includegenerated=false]\n"
-            "Returns up to [count] most recent transactions.");
+            "sendmany {address:amount,...} [comment]\n"
+            "amounts are real and are rounded to the nearest 0.01\n"
+            "Large batches are split into several transactions, returns their ids.");
+
+    Object sendTo = params[0].get_obj();
+
+    // Wallet comments
+    CWalletTx wtx;
+    if (params.size() > 1 && params[1].type() != null_type && !params[1].get_str().empty())
+        wtx.mapValue["message"] = params[1].get_str();
+
+    set<string> setAddress;
+    vector<pair<CScript, int64> > vecSend;
+    foreach(const Pair& s, sendTo)
+    {
+        const string& strAddress = s.name_;
+        if (setAddress.count(strAddress))
+            throw runtime_error("Duplicated address: " + strAddress);
+        setAddress.insert(strAddress);
+
+        CScript scriptPubKey;
+        if (!scriptPubKey.SetBitcoinAddress(strAddress))
+            throw runtime_error("Invalid bitcoin address: " + strAddress);
+
+        // Amount
+        if (s.value_.get_real() <= 0.0 || s.value_.get_real() > 21000000.0)
+            throw runtime_error("Invalid amount");
+        int64 nAmount = roundint64(s.value_.get_real() * 100.00) * CENT;
+
+        vecSend.push_back(make_pair(scriptPubKey, nAmount));
+    }
+
+    vector<CWalletTx> vwtx;
+    string strError = SendMoneyToMany(vecSend, wtx, vwtx);
+    if (strError != "")
+        throw runtime_error(strError);
+
+    Array ret;
+    foreach(const CWalletTx& wtxSent, vwtx)
+        ret.push_back(wtxSent.GetHash().GetHex());
+    return ret;
+}
+
+
+void WalletTxToJSON(const CWalletTx& wtx, int64 nTime, Object& entry)
+{
+    // Immature generated coins still count, GetCredit(true) would leave them out
+    int64 nNet = wtx.CTransaction::GetCredit() - wtx.GetDebit();
+    string strCategory = "receive";
+    if (wtx.IsCoinBase())
+        strCategory = "generate";
+    else if (nNet < 0)
+        strCategory = "send";
+
+    entry.push_back(Pair("txid",          wtx.GetHash().GetHex()));
+    entry.push_back(Pair("time",          (boost::int64_t)nTime));
+    entry.push_back(Pair("confirmations", wtx.GetDepthInMainChain()));
+    entry.push_back(Pair("category",      strCategory));
+    entry.push_back(Pair("amount",        (double)nNet / (double)COIN));
+}
+
+void streamlisttransactions(const Array& params, bool fHelp, CJSONArrayWriter& writer)
+{
+    if (fHelp || params.size() > 4)
+        throw runtime_error(
+            "listtransactions [count=10] [includegenerated=false] [skip=0] [label]\n"
+            "Returns up to [count] most recently received transactions, skipping the first [skip].\n"
+            "Given a [label], only transactions paying its addresses.");
 
     int64 nCount = 10;
     if (params.size() > 0)
@@ -327,11 +496,120 @@ Value listtransactions(const Array& params, bool fHelp)
     bool fGenerated = false;
     if (params.size() > 1)
         fGenerated = params[1].get_bool();
+    int64 nSkip = 0;
+    if (params.size() > 2)
+        nSkip = params[2].get_int64();
+    if (nCount < 0 || nSkip < 0)
+        throw runtime_error("Negative count or skip");
+
+    // Addresses with the label
+    vector<uint160> vLabelAddresses;
+    if (params.size() > 3)
+    {
+        string strLabel = params[3].get_str();
+        CRITICAL_BLOCK(cs_mapAddressBook)
+        {
+            foreach(const PAIRTYPE(string, string)& item, mapAddressBook)
+            {
+                uint160 hash160;
+                if (item.second == strLabel && AddressToHash160(item.first, hash160))
+                    vLabelAddresses.push_back(hash160);
+            }
+        }
+    }
 
-    Array ret;
-    //// not finished
-    ret.push_back("not implemented yet");
-    return ret;
+    // Newest first, from the whole wallet or the label's addresses.  Taken
+    // a slice at a time, the writer may be sending to a slow client and
+    // mustn't hold cs_mapWallet while it does.
+    CWalletTxTimeIndex::key_type key(INT64_MAX, 0);
+    int64 nPushed = 0;
+    bool fMore = true;
+    while (fMore && nPushed < nCount)
+    {
+        Array vSlice;
+        CRITICAL_BLOCK(cs_mapWallet)
+        {
+            while (vSlice.size() < 1000 && nPushed + vSlice.size() < nCount)
+            {
+                if (params.size() > 3)
+                    fMore = walletTxTimeIndex.GetPrevByAddress(vLabelAddresses, key);
+                else
+                    fMore = walletTxTimeIndex.GetPrev(key);
+                if (!fMore)
+                    break;
+                const CWalletTx& wtx = *(*walletTxTimeIndex.find(key)).second;
+                if (!fGenerated && wtx.IsCoinBase())
+                    continue;
+                if (nSkip > 0)
+                {
+                    nSkip--;
+                    continue;
+                }
+                Object entry;
+                WalletTxToJSON(wtx, key.first, entry);
+                vSlice.push_back(entry);
+            }
+        }
+        foreach(const Value& entry, vSlice)
+            writer.Push(entry);
+        nPushed += vSlice.size();
+    }
+}
+
+Value listtransactions(const Array& params, bool fHelp)
+{
+    CJSONArrayWriter writer;
+    streamlisttransactions(params, fHelp, writer);
+    return writer.GetArray();
+}
+
+
+Value listtransactionssince(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 3)
+        throw runtime_error(
+            "listtransactionssince [cursor] [count=100] [includegenerated=false]\n"
+            "Returns up to [count] transactions added to the wallet after [cursor], in the\n"
+            "order they were added, as \"transactions\" with the \"cursor\" to pass next time.\n"
+            "Without a [cursor], starts from the first transaction in the wallet.");
+
+    int64 nCursor = -1;
+    if (params.size() > 0 && !params[0].get_str().empty())
+    {
+        string strCursor = params[0].get_str();
+        if (strCursor.find_first_not_of("0123456789") != string::npos)
+            throw runtime_error("Invalid cursor");
+        nCursor = atoi64(strCursor);
+    }
+    int64 nCount = 100;
+    if (params.size() > 1)
+        nCount = params[1].get_int64();
+    bool fGenerated = false;
+    if (params.size() > 2)
+        fGenerated = params[2].get_bool();
+    if (nCount < 0)
+        throw runtime_error("Negative count");
+
+    Array transactions;
+    CRITICAL_BLOCK(cs_mapWallet)
+    {
+        for (CWalletTxTimeIndex::const_order_iterator it = walletTxTimeIndex.upper_bound_order(nCursor); it != walletTxTimeIndex.end_order() && transactions.size() < nCount; ++it)
+        {
+            // Move the cursor past what we skip too
+            nCursor = (*it).first;
+            const CWalletTx& wtx = *(*it).second;
+            if (!fGenerated && wtx.IsCoinBase())
+                continue;
+            Object entry;
+            WalletTxToJSON(wtx, wtx.GetTxTime(), entry);
+            transactions.push_back(entry);
+        }
+    }
+
+    Object result;
+    result.push_back(Pair("transactions", transactions));
+    result.push_back(Pair("cursor",       (nCursor < 0 ? string("") : strprintf("%"PRI64d, nCursor))));
+    return result;
 }
 
 
@@ -357,20 +635,10 @@ Value getreceivedbyaddress(const Array& params, bool fHelp)
 
     // Tally
     int64 nAmount = 0;
+    int nConf;
     CRITICAL_BLOCK(cs_mapWallet)
-    {
-        for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx& wtx = (*it).second;
-            if (wtx.IsCoinBase() || !wtx.IsFinal())
-                continue;
-
-            foreach(const CTxOut& txout, wtx.vout)
-                if (txout.scriptPubKey == scriptPubKey)
-                    if (wtx.GetDepthInMainChain() >= nMinDepth)
-                        nAmount += txout.nValue;
-        }
-    }
+        if (!walletReceivedTally.GetReceived(scriptPubKey.GetBitcoinAddressHash160(), nMinDepth, nAmount, nConf))
+            nAmount = 0;
 
     return (double)nAmount / (double)COIN;
 }
@@ -383,9 +651,9 @@ Value getreceivedbylabel(const Array& params, bool fHelp)
             "getreceivedbylabel <label> [minconf=1]\n"
             "Returns the total amount received by addresses with <label> in transactions with at least [minconf] confirmations.");
 
-    // Get the set of pub keys that have the label
+    // Get the set of addresses that have the label
     string strLabel = params[0].get_str();
-    set<CScript> setPubKey;
+    set<uint160> setHash160;
     CRITICAL_BLOCK(cs_mapAddressBook)
     {
         foreach(const PAIRTYPE(string, string)& item, mapAddressBook)
@@ -398,7 +666,7 @@ Value getreceivedbylabel(const Array& params, bool fHelp)
                 CScript scriptPubKey;
                 if (scriptPubKey.SetBitcoinAddress(strAddress))
                     if (IsMine(scriptPubKey))
-                        setPubKey.insert(scriptPubKey);
+                        setHash160.insert(scriptPubKey.GetBitcoinAddressHash160());
             }
         }
     }
@@ -412,16 +680,12 @@ Value getreceivedbylabel(const Array& params, bool fHelp)
     int64 nAmount = 0;
     CRITICAL_BLOCK(cs_mapWallet)
     {
-        for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        foreach(const uint160& hash160, setHash160)
         {
-            const CWalletTx& wtx = (*it).second;
-            if (wtx.IsCoinBase() || !wtx.IsFinal())
-                continue;
-
-            foreach(const CTxOut& txout, wtx.vout)
-                if (setPubKey.count(txout.scriptPubKey))
-                    if (wtx.GetDepthInMainChain() >= nMinDepth)
-                        nAmount += txout.nValue;
+            int64 nReceived;
+            int nConf;
+            if (walletReceivedTally.GetReceived(hash160, nMinDepth, nReceived, nConf))
+                nAmount += nReceived;
         }
     }
 
@@ -440,7 +704,29 @@ struct tallyitem
     }
 };
 
-Value ListReceived(const Array& params, bool fByLabels)
+// Addresses always decode to the same hash, so the address book is only
+// decoded once
+bool CachedAddressToHash160(const string& strAddress, uint160& hash160Ret)
+{
+    static map<string, uint160> mapCache;
+    static CCriticalSection cs_mapCache;
+    CRITICAL_BLOCK(cs_mapCache)
+    {
+        map<string, uint160>::iterator mi = mapCache.find(strAddress);
+        if (mi != mapCache.end())
+        {
+            hash160Ret = (*mi).second;
+            return (hash160Ret != 0);
+        }
+    }
+    if (!AddressToHash160(strAddress, hash160Ret))
+        hash160Ret = 0;
+    CRITICAL_BLOCK(cs_mapCache)
+        mapCache[strAddress] = hash160Ret;
+    return (hash160Ret != 0);
+}
+
+void ListReceived(const Array& params, bool fByLabels, CJSONArrayWriter& writer)
 {
     // Minimum confirmations
     int nMinDepth = 1;
@@ -452,73 +738,54 @@ Value ListReceived(const Array& params, bool fByLabels)
     if (params.size() > 1)
         fIncludeEmpty = params[1].get_bool();
 
-    // Tally
-    map<uint160, tallyitem> mapTally;
+    // Tally, only our own addresses are looked up below
+    map<uint160, pair<int64, int> > mapTally;
     CRITICAL_BLOCK(cs_mapWallet)
-    {
-        for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx& wtx = (*it).second;
-            if (wtx.IsCoinBase() || !wtx.IsFinal())
-                continue;
-
-            int nDepth = wtx.GetDepthInMainChain();
-            if (nDepth < nMinDepth)
-                continue;
-
-            foreach(const CTxOut& txout, wtx.vout)
-            {
-                // Only counting our own bitcoin addresses and not ip addresses
-                uint160 hash160 = txout.scriptPubKey.GetBitcoinAddressHash160();
-                if (hash160 == 0 || !mapPubKeys.count(hash160)) // IsMine
-                    continue;
+        walletReceivedTally.GetAllReceived(nMinDepth, mapTally);
 
-                tallyitem& item = mapTally[hash160];
-                item.nAmount += txout.nValue;
-                item.nConf = min(item.nConf, nDepth);
-            }
-        }
+    // Reply
+    // The writer may be sending to a slow client, so don't hold
+    // cs_mapAddressBook while pushing
+    vector<pair<string, string> > vAddressBook;
+    CRITICAL_BLOCK(cs_mapAddressBook)
+    {
+        vAddressBook.assign(mapAddressBook.begin(), mapAddressBook.end());
     }
 
-    // Reply
-    Array ret;
     map<string, tallyitem> mapLabelTally;
-    CRITICAL_BLOCK(cs_mapAddressBook)
+    foreach(const PAIRTYPE(string, string)& item, vAddressBook)
     {
-        foreach(const PAIRTYPE(string, string)& item, mapAddressBook)
-        {
-            const string& strAddress = item.first;
-            const string& strLabel = item.second;
-            uint160 hash160;
-            if (!AddressToHash160(strAddress, hash160))
-                continue;
-            map<uint160, tallyitem>::iterator it = mapTally.find(hash160);
-            if (it == mapTally.end() && !fIncludeEmpty)
-                continue;
+        const string& strAddress = item.first;
+        const string& strLabel = item.second;
+        uint160 hash160;
+        if (!CachedAddressToHash160(strAddress, hash160) || !mapPubKeys.count(hash160)) // IsMine
+            continue;
+        map<uint160, pair<int64, int> >::iterator it = mapTally.find(hash160);
+        if (it == mapTally.end() && !fIncludeEmpty)
+            continue;
 
-            int64 nAmount = 0;
-            int nConf = INT_MAX;
-            if (it != mapTally.end())
-            {
-                nAmount = (*it).second.nAmount;
-                nConf = (*it).second.nConf;
-            }
+        int64 nAmount = 0;
+        int nConf = INT_MAX;
+        if (it != mapTally.end())
+        {
+            nAmount = (*it).second.first;
+            nConf = (*it).second.second;
+        }
 
-            if (fByLabels)
-            {
-                tallyitem& item = mapLabelTally[strLabel];
-                item.nAmount += nAmount;
-                item.nConf = min(item.nConf, nConf);
-            }
-            else
-            {
-                Object obj;
-                obj.push_back(Pair("address",       strAddress));
-                obj.push_back(Pair("label",         strLabel));
-                obj.push_back(Pair("amount",        (double)nAmount / (double)COIN));
-                obj.push_back(Pair("confirmations", (nConf == INT_MAX ? 0 : nConf)));
-                ret.push_back(obj);
-            }
+        if (fByLabels)
+        {
+            tallyitem& item = mapLabelTally[strLabel];
+            item.nAmount += nAmount;
+            item.nConf = min(item.nConf, nConf);
+        }
+        else
+        {
+            Object obj;
+            obj.push_back(Pair("address",       strAddress));
+            obj.push_back(Pair("label",         strLabel));
+            obj.push_back(Pair("amount",        (double)nAmount / (double)COIN));
+            obj.push_back(Pair("confirmations", (nConf == INT_MAX ? 0 : nConf)));
+            writer.Push(obj);
         }
     }
 
@@ -532,14 +799,12 @@ Value ListReceived(const Array& params, bool fByLabels)
             obj.push_back(Pair("label",         (*it).first));
             obj.push_back(Pair("amount",        (double)nAmount / (double)COIN));
             obj.push_back(Pair("confirmations", (nConf == INT_MAX ? 0 : nConf)));
-            ret.push_back(obj);
+            writer.Push(obj);
         }
     }
-
-    return ret;
 }
 
-Value listreceivedbyaddress(const Array& params, bool fHelp)
+void streamlistreceivedbyaddress(const Array& params, bool fHelp, CJSONArrayWriter& writer)
 {
     if (fHelp || params.size() > 2)
         throw runtime_error(
@@ -552,10 +817,17 @@ Value listreceivedbyaddress(const Array& params, bool fHelp)
             "  \"amount\" : total amount received by the address\n"
             "  \"confirmations\" : number of confirmations of the most recent transaction included");
 
-    return ListReceived(params, false);
+    ListReceived(params, false, writer);
 }
 
-Value listreceivedbylabel(const Array& params, bool fHelp)
+Value listreceivedbyaddress(const Array& params, bool fHelp)
+{
+    CJSONArrayWriter writer;
+    streamlistreceivedbyaddress(params, fHelp, writer);
+    return writer.GetArray();
+}
+
+void streamlistreceivedbylabel(const Array& params, bool fHelp, CJSONArrayWriter& writer)
 {
     if (fHelp || params.size() > 2)
         throw runtime_error(
@@ -567,11 +839,302 @@ Value listreceivedbylabel(const Array& params, bool fHelp)
             "  \"amount\" : total amount received by addresses with this label\n"
             "  \"confirmations\" : number of confirmations of the most recent transaction included");
 
-    return ListReceived(params, true);
+    ListReceived(params, true, writer);
+}
+
+Value listreceivedbylabel(const Array& params, bool fHelp)
+{
+    CJSONArrayWriter writer;
+    streamlistreceivedbylabel(params, fHelp, writer);
+    return writer.GetArray();
+}
+
+
+
+
+Object LockTimesToJSON(const CLockTimes& times)
+{
+    Object obj;
+    obj.push_back(Pair("count",     (boost::int64_t)times.nCount));
+    obj.push_back(Pair("total",     (boost::int64_t)times.nTotal));
+    obj.push_back(Pair("max",       (boost::int64_t)times.nMax));
+    Array histogram;
+    int nBuckets = LOCKSTATS_BUCKETS;
+    while (nBuckets > 0 && times.vnBucket[nBuckets-1] == 0)
+        nBuckets--;
+    for (int i = 0; i < nBuckets; i++)
+        histogram.push_back((boost::int64_t)times.vnBucket[i]);
+    obj.push_back(Pair("histogram", histogram));
+    return obj;
+}
+
+void LockSiteStatsToJSON(const CLockSiteStats& stats, Object& obj)
+{
+    obj.push_back(Pair("acquired",  (boost::int64_t)stats.nAcquired));
+    obj.push_back(Pair("contended", (boost::int64_t)stats.nContended));
+    obj.push_back(Pair("tryfailed", (boost::int64_t)stats.nTryFailed));
+    obj.push_back(Pair("waitus",    LockTimesToJSON(stats.wait)));
+    obj.push_back(Pair("holdus",    LockTimesToJSON(stats.hold)));
+}
+
+Value getblocktemplate(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "getblocktemplate [longpollid]\n"
+            "Returns what's needed to build a block on the current best block:\n"
+            "  \"version\", \"previousblockhash\", \"height\", \"bits\", \"curtime\", \"mintime\",\n"
+            "  \"coinbasevalue\", \"transactions\" (each with \"data\", \"hash\" and \"fee\")\n"
+            "  and \"longpollid\".  Below the proof of participation height it also has\n"
+            "  \"target\", and \"bits\" is the proof of work the block needs.\n"
+            "Given the [longpollid] of an earlier template, waits until the best block\n"
+            "changes or the memory pool has changed for a few seconds before returning.");
+
+    // Long poll
+    if (params.size() > 0)
+    {
+        string strLongPollId = params[0].get_str();
+        if (strLongPollId.size() <= 64)
+            throw runtime_error("Invalid longpollid");
+        uint256 hashPrev;
+        hashPrev.SetHex(strLongPollId.substr(0, 64));
+        WaitForBlockTemplateChange(hashPrev, strtoul(strLongPollId.substr(64).c_str(), NULL, 10));
+        if (fShutdown)
+            throw runtime_error("Shutting down");
+    }
+
+    CBlock block;
+    CBlockIndex* pindexPrev;
+    unsigned int nBits = 0;
+    unsigned int nTransactionsUpdatedLast;
+    vector<int64> vFees;
+    int64 nFees;
+    CRITICAL_BLOCK(cs_main)
+    {
+        pindexPrev = pindexBest;
+        if (pindexPrev == NULL)
+            throw runtime_error("No best block yet");
+
+        // No difficulty with proof of participation, the lottery decides
+        if (pindexPrev->nHeight + 1 < POP_ACTIVATION_HEIGHT)
+            nBits = GetNextWorkRequired(pindexPrev);
+        nTransactionsUpdatedLast = GetChainSnapshot().nTransactionsUpdated;
+        nFees = AddBlockTransactions(&block, &vFees);
+    }
+
+    Array transactions;
+    for (int i = 0; i < block.vtx.size(); i++)
+    {
+        const CTransaction& tx = block.vtx[i];
+        CDataStream ss(SER_NETWORK);
+        ss << tx;
+        Object entry;
+        entry.push_back(Pair("data", HexStr(ss.begin(), ss.end(), false)));
+        entry.push_back(Pair("hash", tx.GetHash().GetHex()));
+        entry.push_back(Pair("fee",  (boost::int64_t)vFees[i]));
+        transactions.push_back(entry);
+    }
+
+    int64 nMinTime = pindexPrev->GetMedianTimePast() + 1;
+    Object result;
+    result.push_back(Pair("version",           block.nVersion));
+    result.push_back(Pair("previousblockhash", pindexPrev->GetBlockHash().GetHex()));
+    result.push_back(Pair("height",            pindexPrev->nHeight + 1));
+    result.push_back(Pair("bits",              strprintf("%08x", nBits)));
+    if (pindexPrev->nHeight + 1 < POP_ACTIVATION_HEIGHT)
+        result.push_back(Pair("target",            CBigNum().SetCompact(nBits).getuint256().GetHex()));
+    result.push_back(Pair("curtime",           (boost::int64_t)max(nMinTime, GetAdjustedTime())));
+    result.push_back(Pair("mintime",           (boost::int64_t)nMinTime));
+    result.push_back(Pair("coinbasevalue",     (boost::int64_t)block.GetBlockValue(nFees)));
+    result.push_back(Pair("transactions",      transactions));
+    result.push_back(Pair("longpollid",        pindexPrev->GetBlockHash().GetHex() + strprintf("%u", nTransactionsUpdatedLast)));
+    return result;
+}
+
+
+Value submitblock(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "submitblock <hexdata>\n"
+            "Submits a block built from getblocktemplate, relaying it if it's accepted.\n"
+            "Returns null if the block was accepted onto the best chain, \"orphan\" if its\n"
+            "parent is unknown, \"inconclusive\" if it was stored on a side chain, otherwise\n"
+            "the reason it wasn't accepted.");
+
+    vector<unsigned char> vchBlock = ParseHex(params[0].get_str());
+    if (vchBlock.empty())
+        throw runtime_error("Block decode failed");
+    CDataStream ssBlock(vchBlock, SER_NETWORK);
+    CBlock* pblock = new CBlock();
+    try
+    {
+        ssBlock >> *pblock;
+    }
+    catch (std::exception& e)
+    {
+        delete pblock;
+        throw runtime_error("Block decode failed");
+    }
+
+    // ProcessBlock takes ownership of pblock
+    uint256 hash = pblock->GetHash();
+    CRITICAL_BLOCK(cs_main)
+    {
+        if (mapBlockIndex.count(hash) || mapOrphanBlocks.count(hash))
+        {
+            delete pblock;
+            return "duplicate";
+        }
+
+        // Track how many getdata requests this block gets
+        CRITICAL_BLOCK(cs_mapRequestCount)
+            mapRequestCount[hash] = 0;
+
+        if (!ProcessBlock(NULL, pblock))
+            return "rejected";
+
+        // ProcessBlock also succeeds for a block it only holds until its
+        // parent arrives, or one it stored on a chain that isn't the best
+        if (mapOrphanBlocks.count(hash))
+            return "orphan";
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+        if (mi == mapBlockIndex.end() || !(*mi).second->IsInMainChain())
+            return "inconclusive";
+    }
+    return Value::null;
+}
+
+
+Value getrawblock(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getrawblock <hash>\n"
+            "Returns the block with the given hash as hex, as it is stored on disk.");
+
+    uint256 hash;
+    hash.SetHex(params[0].get_str());
+    vector<unsigned char> vchBlock;
+    if (!GetRawBlock(hash, vchBlock))
+        throw runtime_error("Block not found");
+    return HexStr(vchBlock, false);
+}
+
+
+Value getrawtransaction(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getrawtransaction <txid>\n"
+            "Returns the transaction with the given txid as hex, from the block it's in\n"
+            "or from the memory pool.");
+
+    uint256 hash;
+    hash.SetHex(params[0].get_str());
+    vector<unsigned char> vchTx;
+    if (!GetRawTransaction(hash, vchTx))
+        throw runtime_error("Transaction not found");
+    return HexStr(vchTx, false);
+}
+
+
+Value getlockstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "getlockstats [reset=false]\n"
+            "Returns lock wait and hold times in microseconds for each lock and call site,\n"
+            "busiest first, and any locks seen taken in both orders.  Needs -lockstats.\n"
+            "histogram[i] counts times under 2^i microseconds.\n"
+            "[reset] clears the statistics after returning them.");
+
+    bool fReset = false;
+    if (params.size() > 0)
+        fReset = params[0].get_bool();
+
+    map<string, CLockStats> mapStats;
+    vector<string> vInversions;
+    GetLockStats(mapStats, vInversions);
+    if (fReset)
+        ResetLockStats();
+
+    // Most time spent waiting first
+    vector<pair<int64, string> > vSorted;
+    for (map<string, CLockStats>::iterator mi = mapStats.begin(); mi != mapStats.end(); ++mi)
+        vSorted.push_back(make_pair(-(*mi).second.wait.nTotal, (*mi).first));
+    sort(vSorted.begin(), vSorted.end());
+
+    Array locks;
+    foreach(const PAIRTYPE(int64, string)& item, vSorted)
+    {
+        const CLockStats& stats = mapStats[item.second];
+        Object obj;
+        obj.push_back(Pair("name", item.second));
+        LockSiteStatsToJSON(stats, obj);
+
+        vector<pair<int64, string> > vSites;
+        for (map<string, CLockSiteStats>::const_iterator mi = stats.mapSites.begin(); mi != stats.mapSites.end(); ++mi)
+            vSites.push_back(make_pair(-(*mi).second.wait.nTotal, (*mi).first));
+        sort(vSites.begin(), vSites.end());
+        Array sites;
+        foreach(const PAIRTYPE(int64, string)& site, vSites)
+        {
+            Object objSite;
+            objSite.push_back(Pair("site", site.second));
+            LockSiteStatsToJSON((*stats.mapSites.find(site.second)).second, objSite);
+            sites.push_back(objSite);
+        }
+        obj.push_back(Pair("sites", sites));
+        locks.push_back(obj);
+    }
+
+    Array inversions;
+    foreach(const string& strInversion, vInversions)
+        inversions.push_back(strInversion);
+
+    Object ret;
+    ret.push_back(Pair("enabled",    fLockStats));
+    ret.push_back(Pair("locks",      locks));
+    ret.push_back(Pair("inversions", inversions));
+    return ret;
 }
 
 
+Value getscheduledtasks(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getscheduledtasks\n"
+            "Returns the periodic maintenance jobs with their schedule and how long\n"
+            "their runs have taken, in milliseconds.");
+
+    vector<CScheduledTask> vTasks;
+    GetScheduledTasks(vTasks);
+    int64 nNow = GetTimeMillis();
 
+    Array ret;
+    foreach(const CScheduledTask& task, vTasks)
+    {
+        Object obj;
+        obj.push_back(Pair("name",        task.strName));
+        obj.push_back(Pair("interval",    (boost::int64_t)task.nInterval));
+        obj.push_back(Pair("jitter",      (boost::int64_t)task.nJitter));
+        obj.push_back(Pair("maxruntime",  (boost::int64_t)task.nMaxRuntime));
+        obj.push_back(Pair("runs",        (boost::int64_t)task.nRuns));
+        obj.push_back(Pair("overruns",    (boost::int64_t)task.nOverruns));
+        obj.push_back(Pair("totaltime",   (boost::int64_t)task.nTotalTime));
+        obj.push_back(Pair("maxtime",     (boost::int64_t)task.nMaxTime));
+        obj.push_back(Pair("lasttime",    (boost::int64_t)task.nLastTime));
+        obj.push_back(Pair("running",     task.fRunning));
+        if (task.fRunning)
+            obj.push_back(Pair("runningfor", (boost::int64_t)(nNow - task.nLastStart)));
+        else
+            obj.push_back(Pair("nextin",  (boost::int64_t)max((int64)0, task.nNextStart - nNow)));
+        ret.push_back(obj);
+    }
+    return ret;
+}
 
 
 
@@ -603,16 +1166,47 @@ pair<string, rpcfn_type> pCallTable[] =
     make_pair("getlabel",              &getlabel),
     make_pair("getaddressesbylabel",   &getaddressesbylabel),
     make_pair("sendtoaddress",         &sendtoaddress),
+    make_pair("sendmany",              &sendmany),
     make_pair("listtransactions",      &listtransactions),
+    make_pair("listtransactionssince", &listtransactionssince),
     make_pair("getamountreceived",     &getreceivedbyaddress), // deprecated, renamed to getreceivedbyaddress
     make_pair("getallreceived",        &listreceivedbyaddress), // deprecated, renamed to listreceivedbyaddress
     make_pair("getreceivedbyaddress",  &getreceivedbyaddress),
     make_pair("getreceivedbylabel",    &getreceivedbylabel),
     make_pair("listreceivedbyaddress", &listreceivedbyaddress),
     make_pair("listreceivedbylabel",   &listreceivedbylabel),
+    make_pair("getblocktemplate",      &getblocktemplate),
+    make_pair("submitblock",           &submitblock),
+    make_pair("getrawblock",           &getrawblock),
+    make_pair("getrawtransaction",     &getrawtransaction),
+    make_pair("getlockstats",          &getlockstats),
+    make_pair("getscheduledtasks",     &getscheduledtasks),
 };
 map<string, rpcfn_type> mapCallTable(pCallTable, pCallTable + sizeof(pCallTable)/sizeof(pCallTable[0]));
 
+// Streamed versions of calls in the call table, used when the call is made
+// on its own rather than as part of a batch
+pair<string, rpcstreamfn_type> pStreamTable[] =
+{
+    make_pair("getallreceived",        &streamlistreceivedbyaddress),
+    make_pair("listreceivedbyaddress", &streamlistreceivedbyaddress),
+    make_pair("listreceivedbylabel",   &streamlistreceivedbylabel),
+    make_pair("listtransactions",      &streamlisttransactions),
+};
+map<string, rpcstreamfn_type> mapStreamTable(pStreamTable, pStreamTable + sizeof(pStreamTable)/sizeof(pStreamTable[0]));
+
+// Time taken by each call.  Registered up front so the map is read only and
+// timing a call takes no lock.
+map<string, CMetricHistogram*> RegisterRPCMetrics()
+{
+    map<string, CMetricHistogram*> mapRet;
+    for (map<string, rpcfn_type>::iterator mi = mapCallTable.begin(); mi != mapCallTable.end(); ++mi)
+        mapRet[(*mi).first] = &GetMetricHistogram("pop_rpc_duration_seconds", "Time to execute an RPC call", "method=\"" + (*mi).first + "\"");
+    return mapRet;
+}
+map<string, CMetricHistogram*> mapRPCMetrics = RegisterRPCMetrics();
+CMetricCounter& metricRPCErrors = GetMetricCounter("pop_rpc_errors_total", "RPC calls that returned an error");
+
 
 
 
@@ -638,14 +1232,15 @@ string HTTPPost(const string& strMsg)
         strMsg.c_str());
 }
 
-string HTTPReply(const string& strMsg, int nStatus=200)
+string HTTPReply(const string& strMsg, int nStatus=200, bool fKeepAlive=false)
 {
     string strStatus;
     if (nStatus == 200) strStatus = "OK";
     if (nStatus == 500) strStatus = "Internal Server Error";
+    if (nStatus == 503) strStatus = "Service Unavailable";
     return strprintf(
             "HTTP/1.1 %d %s\r\n"
-            "Connection: close\r\n"
+            "Connection: %s\r\n"
             "Content-Length: %d\r\n"
             "Content-Type: application/json\r\n"
             "Date: Sat, 08 Jul 2006 12:04:08 GMT\r\n"
@@ -654,36 +1249,125 @@ string HTTPReply(const string& strMsg, int nStatus=200)
             "%s",
         nStatus,
         strStatus.c_str(),
+        (fKeepAlive ? "keep-alive" : "close"),
         strMsg.size(),
         strMsg.c_str());
 }
 
-int ReadHTTPHeader(tcp::iostream& stream)
+int ReadHTTPHeader(tcp::iostream& stream, bool& fKeepAliveRet, bool& fChunkedRet, string* pstrFirstLineRet=NULL, bool* pfHTTP11Ret=NULL)
 {
+    // HTTP/1.1 connections stay open unless the client says otherwise
     int nLen = 0;
+    bool fFirstLine = true;
+    fKeepAliveRet = false;
+    fChunkedRet = false;
+    if (pfHTTP11Ret)
+        *pfHTTP11Ret = false;
     loop
     {
         string str;
         std::getline(stream, str);
         if (str.empty() || str == "\r")
             break;
+        if (fFirstLine)
+        {
+            fKeepAliveRet = (str.find("HTTP/1.1") != string::npos);
+            if (pfHTTP11Ret)
+                *pfHTTP11Ret = fKeepAliveRet;
+            if (pstrFirstLineRet)
+                *pstrFirstLineRet = str;
+        }
+        fFirstLine = false;
         if (str.substr(0,15) == "Content-Length:")
-            nLen = atoi(str.substr(15));
+            nLen = (int)max(min(atoi64(str.substr(15)), (int64)INT_MAX), (int64)0);
+        if (boost::algorithm::istarts_with(str, "Connection:"))
+        {
+            string strConnection = str.substr(11);
+            boost::algorithm::trim(strConnection);
+            if (boost::algorithm::iequals(strConnection, "close"))
+                fKeepAliveRet = false;
+            else if (boost::algorithm::iequals(strConnection, "keep-alive"))
+                fKeepAliveRet = true;
+        }
+        if (boost::algorithm::istarts_with(str, "Transfer-Encoding:"))
+            fChunkedRet = (str.find("chunked") != string::npos);
     }
     return nLen;
 }
 
-inline string ReadHTTP(tcp::iostream& stream)
+// Reads the body a piece at a time, so memory only goes to what actually
+// arrives rather than to whatever length the sender claims
+static void ReadHTTPBytes(tcp::iostream& stream, unsigned int nLen, string& strRet)
+{
+    char pch[16 * 1024];
+    while (nLen > 0 && stream)
+    {
+        unsigned int nRead = min(nLen, (unsigned int)sizeof(pch));
+        stream.read(pch, nRead);
+        strRet.append(pch, stream.gcount());
+        nLen -= nRead;
+    }
+}
+
+static string RefuseHTTPBody(tcp::iostream& stream, unsigned int nMaxSize)
+{
+    printf("ReadHTTP() : body is over %u bytes, dropping the connection\n", nMaxSize);
+    stream.setstate(std::ios::failbit);
+    return string();
+}
+
+string ReadHTTPChunked(tcp::iostream& stream, unsigned int nMaxSize)
+{
+    string strRet;
+    loop
+    {
+        string str;
+        std::getline(stream, str);
+        if (!stream)
+            break;
+        int64 nLen = strtoll(str.c_str(), NULL, 16);
+        if (nLen <= 0)
+            break;
+        if (nLen > nMaxSize - strRet.size())
+            return RefuseHTTPBody(stream, nMaxSize);
+        ReadHTTPBytes(stream, nLen, strRet);
+        std::getline(stream, str);
+    }
+
+    // Skip any trailers up to the blank line
+    loop
+    {
+        string str;
+        std::getline(stream, str);
+        if (!stream || str.empty() || str == "\r")
+            break;
+    }
+    return strRet;
+}
+
+inline string ReadHTTP(tcp::iostream& stream, bool& fKeepAliveRet, bool& fHTTP11Ret, unsigned int nMaxSize)
 {
     // Read header
-    int nLen = ReadHTTPHeader(stream);
+    bool fChunked;
+    int nLen = ReadHTTPHeader(stream, fKeepAliveRet, fChunked, NULL, &fHTTP11Ret);
+    if (fChunked)
+        return ReadHTTPChunked(stream, nMaxSize);
     if (nLen <= 0)
         return string();
+    if ((unsigned int)nLen > nMaxSize)
+        return RefuseHTTPBody(stream, nMaxSize);
 
     // Read message
-    vector<char> vch(nLen);
-    stream.read(&vch[0], nLen);
-    return string(vch.begin(), vch.end());
+    string strRet;
+    ReadHTTPBytes(stream, nLen, strRet);
+    return strRet;
+}
+
+inline string ReadHTTP(tcp::iostream& stream)
+{
+    // Replies from our own server, a long listing can be big
+    bool fKeepAlive, fHTTP11;
+    return ReadHTTP(stream, fKeepAlive, fHTTP11, UINT_MAX);
 }
 
 
@@ -704,7 +1388,281 @@ string JSONRPCRequest(const string& strMethod, const Array& params, const Value&
     return write_string(Value(request), false) + "\n";
 }
 
-string JSONRPCReply(const Value& result, const Value& error, const Value& id)
+//
+// Hand-written reader for the small requests the RPC server sees all the
+// time.  It builds the same Value tree read_range would, without going
+// through the spirit grammar.  Anything unusual (\u escapes, odd numbers,
+// deep nesting) makes it give up so the caller can fall back on read_range.
+//
+class CFastJSONReader
+{
+protected:
+    const char* p;
+    const char* pend;
+    int nDepth;
+
+    enum { MAX_DEPTH = 64 };
+
+    static bool IsDigit(char c) { return (c >= '0' && c <= '9'); }
+
+    void SkipSpaces()
+    {
+        while (p < pend && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+            p++;
+    }
+
+    bool ReadLiteral(const char* psz, int nLen)
+    {
+        if (pend - p < nLen || memcmp(p, psz, nLen) != 0)
+            return false;
+        p += nLen;
+        return true;
+    }
+
+    bool ReadString(string& strRet)
+    {
+        // Copy runs of plain characters at a time
+        p++;
+        const char* pstart = p;
+        while (p < pend && *p != '"' && *p != '\\')
+            p++;
+        strRet.assign(pstart, p);
+        while (p < pend && *p != '"')
+        {
+            if (*p == '\\')
+            {
+                if (++p == pend)
+                    return false;
+                switch (*p)
+                {
+                    case '"':  strRet += '"';  break;
+                    case '\\': strRet += '\\'; break;
+                    case '/':  strRet += '/';  break;
+                    case 'b':  strRet += '\b'; break;
+                    case 'f':  strRet += '\f'; break;
+                    case 'n':  strRet += '\n'; break;
+                    case 'r':  strRet += '\r'; break;
+                    case 't':  strRet += '\t'; break;
+                    default:   return false;
+                }
+                p++;
+            }
+            else
+            {
+                pstart = p;
+                while (p < pend && *p != '"' && *p != '\\')
+                    p++;
+                strRet.append(pstart, p);
+            }
+        }
+        if (p == pend)
+            return false;
+        p++;
+        return true;
+    }
+
+    bool ReadNumber(Value& valRet)
+    {
+        const char* pstart = p;
+        bool fReal = false;
+        if (p < pend && *p == '-')
+            p++;
+        if (p == pend || !IsDigit(*p))
+            return false;
+        // JSON doesn't allow leading zeros, leave those to read_range
+        if (*p == '0' && p + 1 < pend && IsDigit(p[1]))
+            return false;
+        while (p < pend && IsDigit(*p))
+            p++;
+        if (p < pend && *p == '.')
+        {
+            fReal = true;
+            if (++p == pend || !IsDigit(*p))
+                return false;
+            while (p < pend && IsDigit(*p))
+                p++;
+        }
+        if (p < pend && (*p == 'e' || *p == 'E'))
+        {
+            fReal = true;
+            p++;
+            if (p < pend && (*p == '+' || *p == '-'))
+                p++;
+            if (p == pend || !IsDigit(*p))
+                return false;
+            while (p < pend && IsDigit(*p))
+                p++;
+        }
+
+        // The request buffer isn't terminated after the number
+        char pszNum[64];
+        if (p - pstart >= (int)sizeof(pszNum))
+            return false;
+        memcpy(pszNum, pstart, p - pstart);
+        pszNum[p - pstart] = '\0';
+
+        errno = 0;
+        if (fReal)
+        {
+            // strtod goes by the locale's decimal point.  If it stops short
+            // of the end, let json_spirit have the whole request instead.
+            char* pszEnd;
+            double d = strtod(pszNum, &pszEnd);
+            if (*pszEnd != '\0')
+                return false;
+            valRet = d;
+        }
+        else if (pszNum[0] == '-')
+        {
+            long long n = strtoll(pszNum, NULL, 10);
+            if (errno == ERANGE)
+                return false;
+            valRet = (boost::int64_t)n;
+        }
+        else
+        {
+            unsigned long long n = strtoull(pszNum, NULL, 10);
+            if (errno == ERANGE)
+                return false;
+            if (n > (unsigned long long)INT64_MAX)
+                valRet = (boost::uint64_t)n;
+            else
+                valRet = (boost::int64_t)n;
+        }
+        return true;
+    }
+
+    bool ReadArray(Value& valRet)
+    {
+        p++;
+        valRet = Array();
+        Array& array = valRet.get_array();
+        SkipSpaces();
+        if (p < pend && *p == ']')
+        {
+            p++;
+            return true;
+        }
+        loop
+        {
+            array.push_back(Value());
+            if (!ReadValue(array.back()))
+                return false;
+            SkipSpaces();
+            if (p == pend)
+                return false;
+            char c = *p++;
+            if (c == ']')
+                return true;
+            if (c != ',')
+                return false;
+        }
+    }
+
+    bool ReadObject(Value& valRet)
+    {
+        p++;
+        valRet = Object();
+        Object& obj = valRet.get_obj();
+        SkipSpaces();
+        if (p < pend && *p == '}')
+        {
+            p++;
+            return true;
+        }
+        loop
+        {
+            SkipSpaces();
+            if (p == pend || *p != '"')
+                return false;
+            obj.push_back(Pair("", Value()));
+            if (!ReadString(obj.back().name_))
+                return false;
+            SkipSpaces();
+            if (p == pend || *p++ != ':')
+                return false;
+            if (!ReadValue(obj.back().value_))
+                return false;
+            SkipSpaces();
+            if (p == pend)
+                return false;
+            char c = *p++;
+            if (c == '}')
+                return true;
+            if (c != ',')
+                return false;
+        }
+    }
+
+    bool ReadValue(Value& valRet)
+    {
+        SkipSpaces();
+        if (p == pend)
+            return false;
+        switch (*p)
+        {
+            case '{':
+            case '[':
+            {
+                if (++nDepth > MAX_DEPTH)
+                    return false;
+                bool fRet = (*p == '{' ? ReadObject(valRet) : ReadArray(valRet));
+                nDepth--;
+                return fRet;
+            }
+            case '"':
+            {
+                string str;
+                if (!ReadString(str))
+                    return false;
+                valRet = str;
+                return true;
+            }
+            case 't':
+                valRet = true;
+                return ReadLiteral("true", 4);
+            case 'f':
+                valRet = false;
+                return ReadLiteral("false", 5);
+            case 'n':
+                valRet = Value::null;
+                return ReadLiteral("null", 4);
+            default:
+                return ReadNumber(valRet);
+        }
+    }
+
+public:
+    CFastJSONReader(const char* pbegin, const char* pendIn)
+    {
+        p = pbegin;
+        pend = pendIn;
+        nDepth = 0;
+    }
+
+    bool Read(Value& valRet, const char*& pnextRet)
+    {
+        if (!ReadValue(valRet))
+            return false;
+        pnextRet = p;
+        return true;
+    }
+};
+
+bool ReadJSONFast(string::iterator& begin, string::iterator end, Value& valRet)
+{
+    if (begin == end)
+        return false;
+    const char* pbegin = &*begin;
+    const char* pnext;
+    CFastJSONReader reader(pbegin, pbegin + (end - begin));
+    if (!reader.Read(valRet, pnext))
+        return false;
+    begin += (pnext - pbegin);
+    return true;
+}
+
+Object JSONRPCReplyObj(const Value& result, const Value& error, const Value& id)
 {
     Object reply;
     if (error.type() != null_type)
@@ -713,7 +1671,119 @@ string JSONRPCReply(const Value& result, const Value& error, const Value& id)
         reply.push_back(Pair("result", result));
     reply.push_back(Pair("error", error));
     reply.push_back(Pair("id", id));
-    return write_string(Value(reply), false) + "\n";
+    return reply;
+}
+
+string JSONRPCReply(const Value& result, const Value& error, const Value& id)
+{
+    return write_string(Value(JSONRPCReplyObj(result, error, id)), false) + "\n";
+}
+
+Value JSONRPCExecOne(const Value& valRequest, Value& idRet)
+{
+    if (valRequest.type() != obj_type)
+        throw runtime_error("Invalid request.");
+    const Object& request = valRequest.get_obj();
+    idRet = find_value(request, "id");
+    if (find_value(request, "method").type() != str_type ||
+        find_value(request, "params").type() != array_type)
+        throw runtime_error("Invalid request.");
+
+    string strMethod    = find_value(request, "method").get_str();
+    const Array& params = find_value(request, "params").get_array();
+
+    // Execute
+    map<string, rpcfn_type>::iterator mi = mapCallTable.find(strMethod);
+    if (mi == mapCallTable.end())
+        throw runtime_error("Method not found.");
+    CMetricTimer metrictimer(*mapRPCMetrics.find(strMethod)->second);
+    return (*(*mi).second)(params, false);
+}
+
+Object JSONRPCExecReply(const Value& valRequest)
+{
+    Value id;
+    try
+    {
+        Value result = JSONRPCExecOne(valRequest, id);
+        return JSONRPCReplyObj(result, Value::null, id);
+    }
+    catch (std::exception& e)
+    {
+        metricRPCErrors.Inc();
+        return JSONRPCReplyObj(Value::null, e.what(), id);
+    }
+}
+
+// Calls that only read, so the calls of a batch can run side by side
+static const char* pszConcurrentRPC[] =
+{
+    "help",
+    "getblockcount",
+    "getblocknumber",
+    "getconnectioncount",
+    "getdifficulty",
+    "getbalance",
+    "getgenerate",
+    "getinfo",
+    "getlabel",
+    "getaddressesbylabel",
+    "listtransactions",
+    "listtransactionssince",
+    "getreceivedbyaddress",
+    "getreceivedbylabel",
+    "listreceivedbyaddress",
+    "listreceivedbylabel",
+    "getscheduledtasks",
+    "getrawblock",
+    "getrawtransaction",
+};
+static set<string> setConcurrentRPC(pszConcurrentRPC, pszConcurrentRPC + sizeof(pszConcurrentRPC)/sizeof(pszConcurrentRPC[0]));
+
+bool IsConcurrentRPC(const Value& valRequest)
+{
+    if (valRequest.type() != obj_type)
+        return false;
+    const Value& method = find_value(valRequest.get_obj(), "method");
+    return (method.type() == str_type && setConcurrentRPC.count(method.get_str()));
+}
+
+rpcstreamfn_type GetStreamRPC(const Value& valRequest)
+{
+    if (valRequest.type() != obj_type)
+        return NULL;
+    const Object& request = valRequest.get_obj();
+    const Value& method = find_value(request, "method");
+    if (method.type() != str_type || find_value(request, "params").type() != array_type)
+        return NULL;
+    map<string, rpcstreamfn_type>::iterator mi = mapStreamTable.find(method.get_str());
+    if (mi == mapStreamTable.end())
+        return NULL;
+    return (*mi).second;
+}
+
+// JSON-RPC 2.0 batch: an array of requests answered by one array of replies
+// in the same order.  The read only calls go to the thread pool, the rest
+// run here one after another in the order given.
+string JSONRPCExecBatch(const Array& vRequest)
+{
+    if (vRequest.empty())
+        return JSONRPCReply(Value::null, "Invalid request.", Value::null);
+
+    vector<Object> vReply(vRequest.size());
+    CTaskGroup group(GetThreadPool(), TASK_HIGH);
+    for (int i = 0; i < vRequest.size(); i++)
+        if (IsConcurrentRPC(vRequest[i]))
+            group.Run([&, i]() { vReply[i] = JSONRPCExecReply(vRequest[i]); });
+    for (int i = 0; i < vRequest.size(); i++)
+        if (!IsConcurrentRPC(vRequest[i]))
+            vReply[i] = JSONRPCExecReply(vRequest[i]);
+    group.Wait();
+
+    Array ret;
+    foreach(const Object& reply, vReply)
+        ret.push_back(reply);
+    return write_string(Value(ret), false) + "\n";
 }
 
 
@@ -738,74 +1808,554 @@ void ThreadRPCServer(void* parg)
     printf("ThreadRPCServer exiting\n");
 }
 
-void ThreadRPCServer2(void* parg)
-{
-    printf("ThreadRPCServer started\n");
+//
+// The metrics and raw data servers only listen on localhost and answer one
+// GET per connection.  The handler gets the path that was asked for.
+//
+typedef void (*localhttpfn_type)(tcp::iostream& stream, const string& strPath);
 
-    // Bind to loopback 127.0.0.1 so the socket can only be accessed locally
+bool WaitForRPCRequest(tcp::iostream& stream, int nTimeout);
+
+void ServeLocalHTTP(int nPort, localhttpfn_type pfn)
+{
     boost::asio::io_service io_service;
-    tcp::endpoint endpoint(boost::asio::ip::address_v4::loopback(), 8332);
+    tcp::endpoint endpoint(boost::asio::ip::address_v4::loopback(), nPort);
     tcp::acceptor acceptor(io_service, endpoint);
 
     loop
     {
-        // Accept connection
         tcp::iostream stream;
         tcp::endpoint peer;
-        vnThreadsRunning[4]--;
         acceptor.accept(*stream.rdbuf(), peer);
-        vnThreadsRunning[4]++;
         if (fShutdown)
             return;
-
-        // Shouldn't be possible for anyone else to connect, but just in case
         if (peer.address().to_string() != "127.0.0.1")
             continue;
+        if (!WaitForRPCRequest(stream, 5))
+            continue;
+
+        // "GET <path> HTTP/1.1"
+        bool fKeepAlive, fChunked;
+        string strRequest;
+        ReadHTTPHeader(stream, fKeepAlive, fChunked, &strRequest);
+        vector<string> vWords;
+        boost::algorithm::split(vWords, strRequest, boost::algorithm::is_space(), boost::algorithm::token_compress_on);
+        (*pfn)(stream, (vWords.size() >= 2 ? vWords[1] : string()));
+    }
+}
+
+string HTTPLocalReply(int nStatus, const string& strContentType, unsigned int nLen)
+{
+    return strprintf(
+            "HTTP/1.1 %d %s\r\n"
+            "Connection: close\r\n"
+            "Content-Length: %u\r\n"
+            "Content-Type: %s\r\n"
+            "Server: json-rpc/1.0\r\n"
+            "\r\n",
+        nStatus,
+        (nStatus == 200 ? "OK" : "Not Found"),
+        nLen,
+        strContentType.c_str());
+}
+
+
+//
+// With -metricsport, any GET on that port of localhost gets the metrics in
+// the Prometheus text format.
+//
+void ServeMetrics(tcp::iostream& stream, const string& strPath)
+{
+    // There's only one thing to serve, so the path doesn't matter
+    string strMetrics = GetMetricsText();
+    stream << HTTPLocalReply(200, "text/plain; version=0.0.4", strMetrics.size()) << strMetrics << std::flush;
+}
+
+void ThreadMetricsServer(void* parg)
+{
+    IMPLEMENT_RANDOMIZE_STACK(ThreadMetricsServer(parg));
+    try
+    {
+        printf("ThreadMetricsServer started\n");
+        ServeLocalHTTP(atoi(mapArgs["-metricsport"]), ServeMetrics);
+    }
+    catch (std::exception& e) {
+        PrintException(&e, "ThreadMetricsServer()");
+    } catch (...) {
+        PrintException(NULL, "ThreadMetricsServer()");
+    }
+    printf("ThreadMetricsServer exiting\n");
+}
+
+
+//
+// With -rawport, GET /block/<hash> and GET /tx/<txid> on that port of
+// localhost return the block or transaction as binary.  The bytes go from the
+// block file to the socket with sendfile where we have it.
+//
+bool SendFileRange(tcp::iostream& stream, const CDiskTxPos& pos, unsigned int nSize)
+{
+    CAutoFile filein = OpenBlockFile(pos.nFile, pos.nTxPos, "rb");
+    if (!filein)
+        return false;
+#ifdef __linux__
+    SOCKET hSocket = stream.rdbuf()->native_handle();
+    off_t nOffset = pos.nTxPos;
+    while (nSize > 0)
+    {
+        ssize_t nSent = sendfile(hSocket, fileno(filein), &nOffset, nSize);
+        if (nSent < 0 && errno == EINTR)
+            continue;
+        if (nSent <= 0)
+            return false;
+        nSize -= nSent;
+    }
+#else
+    char pchBuf[64 * 1024];
+    while (nSize > 0)
+    {
+        unsigned int nRead = fread(pchBuf, 1, min(nSize, (unsigned int)sizeof(pchBuf)), filein);
+        if (nRead == 0)
+            return false;
+        stream.write(pchBuf, nRead);
+        nSize -= nRead;
+    }
+    stream << std::flush;
+#endif
+    return (bool)stream;
+}
+
+void ServeRaw(tcp::iostream& stream, const string& strPath)
+{
+    bool fBlock = boost::algorithm::starts_with(strPath, "/block/");
+    bool fTx = boost::algorithm::starts_with(strPath, "/tx/");
+    uint256 hash;
+    if (fBlock || fTx)
+        hash.SetHex(strPath.substr(fBlock ? 7 : 4));
+
+    CDiskTxPos pos;
+    unsigned int nSize;
+    vector<unsigned char> vch;
+    if ((fBlock && GetBlockFileRange(hash, pos, nSize)) ||
+        (fTx && GetTransactionFileRange(hash, pos, nSize)))
+    {
+        stream << HTTPLocalReply(200, "application/octet-stream", nSize) << std::flush;
+        SendFileRange(stream, pos, nSize);
+    }
+    else if (fTx && GetRawTransaction(hash, vch))
+    {
+        // Still in the memory pool
+        stream << HTTPLocalReply(200, "application/octet-stream", vch.size());
+        stream.write((const char*)&vch[0], vch.size());
+        stream << std::flush;
+    }
+    else
+    {
+        stream << HTTPLocalReply(404, "text/plain", 0) << std::flush;
+    }
+}
+
+void ThreadRawServer(void* parg)
+{
+    IMPLEMENT_RANDOMIZE_STACK(ThreadRawServer(parg));
+    try
+    {
+        printf("ThreadRawServer started\n");
+        ServeLocalHTTP(atoi(mapArgs["-rawport"]), ServeRaw);
+    }
+    catch (std::exception& e) {
+        PrintException(&e, "ThreadRawServer()");
+    } catch (...) {
+        PrintException(NULL, "ThreadRawServer()");
+    }
+    printf("ThreadRawServer exiting\n");
+}
+
+//
+// Connections are accepted on one thread and handed to a few worker threads
+// through a bounded queue.  A worker answers one request and gives a
+// keep-alive connection back to the idle list, where a poller thread waits
+// for the next request on all of them at once and queues the connection
+// again when it arrives, so idle clients don't hold workers.  New
+// connections start out idle too.  Connections idle longer than
+// RPC_IDLE_TIMEOUT are closed, and once a request starts arriving it has
+// RPC_REQUEST_TIMEOUT to finish.  When the queue or the idle list is full,
+// new connections get 503.
+//
+
+static const int RPC_IDLE_TIMEOUT = 30;
+static const int RPC_REQUEST_TIMEOUT = 30;
+// Request bodies over this are refused, a block in hex is about 2MB
+static const unsigned int MAX_RPC_REQUEST_SIZE = 8 * 1024 * 1024;
+static const unsigned int RPC_MAX_IDLE = 128;
+
+std::atomic<int> nRPCWorkersRunning(0);
 
-        // Receive request
-        string strRequest = ReadHTTP(stream);
-        printf("ThreadRPCServer request=%s", strRequest.c_str());
+class CRPCConnectionQueue
+{
+protected:
+    std::mutex mutex;
+    std::condition_variable cond;
+    deque<tcp::iostream*> queue;
+    unsigned int nMaxSize;
+
+    // Connections waiting for their next request, with when they went idle
+    vector<pair<tcp::iostream*, int64> > vIdle;
+#ifndef __WXMSW__
+    // Written to when a connection goes idle, so the poller adds it to its
+    // select without waiting out the current one
+    int pfdWake[2];
+#endif
+
+    void Refuse(tcp::iostream* pstream)
+    {
+        string strReply = JSONRPCReply(Value::null, "Server busy.", Value::null);
+        *pstream << HTTPReply(strReply, 503) << std::flush;
+        delete pstream;
+    }
+
+public:
+    CRPCConnectionQueue()
+    {
+        nMaxSize = 16;
+#ifndef __WXMSW__
+        if (pipe(pfdWake) != 0)
+            pfdWake[0] = pfdWake[1] = -1;
+#endif
+    }
+
+    void SetMaxSize(unsigned int nMaxSizeIn) { nMaxSize = nMaxSizeIn; }
+
+    bool Push(tcp::iostream* pstream)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (queue.size() >= nMaxSize)
+                return false;
+            queue.push_back(pstream);
+        }
+        cond.notify_one();
+        return true;
+    }
+
+    tcp::iostream* Pop()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (queue.empty() && !fShutdown)
+            cond.wait_for(lock, std::chrono::seconds(1));
+        if (queue.empty())
+            return NULL;
+        tcp::iostream* pstream = queue.front();
+        queue.pop_front();
+        return pstream;
+    }
+
+    // Wait for the connection's next request without holding a worker
+    void Park(tcp::iostream* pstream)
+    {
+        // Pipelined requests may already be buffered
+        if (pstream->rdbuf()->in_avail() > 0)
+        {
+            if (!Push(pstream))
+                Refuse(pstream);
+            return;
+        }
+        bool fFull;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            fFull = (vIdle.size() >= RPC_MAX_IDLE);
+            if (!fFull)
+                vIdle.push_back(make_pair(pstream, GetTime()));
+        }
+        if (fFull)
+        {
+            Refuse(pstream);
+            return;
+        }
+#ifndef __WXMSW__
+        char c = 0;
+        if (pfdWake[1] >= 0 && write(pfdWake[1], &c, 1) < 0)
+            printf("CRPCConnectionQueue::Park() : wake write failed\n");
+#endif
+    }
+
+    // One pass of the poller, waits up to a second
+    void PollIdle()
+    {
+        vector<SOCKET> vSocket;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            foreach(const PAIRTYPE(tcp::iostream*, int64)& item, vIdle)
+                vSocket.push_back(item.first->rdbuf()->native_handle());
+        }
 
-        // Handle multiple invocations per request
+        fd_set fdsetRecv;
+        FD_ZERO(&fdsetRecv);
+        SOCKET hSocketMax = 0;
+        foreach(SOCKET hSocket, vSocket)
+        {
+            FD_SET(hSocket, &fdsetRecv);
+            hSocketMax = max(hSocketMax, hSocket);
+        }
+        struct timeval timeout;
+        timeout.tv_sec  = 1;
+        timeout.tv_usec = 0;
+#ifdef __WXMSW__
+        // No wake pipe, look for newly idle connections more often
+        timeout.tv_sec  = 0;
+        timeout.tv_usec = 50000;
+        if (vSocket.empty())
+        {
+            Sleep(50);
+            return;
+        }
+#else
+        if (pfdWake[0] >= 0)
+        {
+            FD_SET(pfdWake[0], &fdsetRecv);
+            hSocketMax = max(hSocketMax, (SOCKET)pfdWake[0]);
+        }
+#endif
+        int nRet = select(hSocketMax + 1, &fdsetRecv, NULL, NULL, &timeout);
+        if (nRet < 0)
+        {
+            Sleep(50);
+            return;
+        }
+#ifndef __WXMSW__
+        if (pfdWake[0] >= 0 && FD_ISSET(pfdWake[0], &fdsetRecv))
+        {
+            char pch[64];
+            if (read(pfdWake[0], pch, sizeof(pch)) < 0)
+                printf("CRPCConnectionQueue::PollIdle() : wake read failed\n");
+        }
+#endif
+
+        // Readable ones go to the workers, a closed connection reads as
+        // readable and the worker finds it empty
+        vector<tcp::iostream*> vReady;
+        vector<tcp::iostream*> vExpired;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            int64 nNow = GetTime();
+            for (vector<pair<tcp::iostream*, int64> >::iterator it = vIdle.begin(); it != vIdle.end(); )
+            {
+                SOCKET hSocket = (*it).first->rdbuf()->native_handle();
+                bool fPolled = (find(vSocket.begin(), vSocket.end(), hSocket) != vSocket.end());
+                if (fPolled && FD_ISSET(hSocket, &fdsetRecv))
+                    vReady.push_back((*it).first);
+                else if (nNow - (*it).second >= RPC_IDLE_TIMEOUT || fShutdown)
+                    vExpired.push_back((*it).first);
+                else
+                {
+                    ++it;
+                    continue;
+                }
+                it = vIdle.erase(it);
+            }
+        }
+        foreach(tcp::iostream* pstream, vReady)
+            if (!Push(pstream))
+                Refuse(pstream);
+        foreach(tcp::iostream* pstream, vExpired)
+            delete pstream;
+    }
+};
+
+static CRPCConnectionQueue rpcConnectionQueue;
+
+bool WaitForRPCRequest(tcp::iostream& stream, int nTimeout)
+{
+    // Pipelined requests may already be buffered
+    if (stream.rdbuf()->in_avail() > 0)
+        return true;
+
+    // Wait a second at a time so shutdown doesn't wait out an idle client
+    SOCKET hSocket = stream.rdbuf()->native_handle();
+    for (int nWaited = 0; nWaited < nTimeout && !fShutdown; nWaited++)
+    {
+        fd_set fdsetRecv;
+        FD_ZERO(&fdsetRecv);
+        FD_SET(hSocket, &fdsetRecv);
+        struct timeval timeout;
+        timeout.tv_sec  = 1;
+        timeout.tv_usec = 0;
+        int nRet = select(hSocket + 1, &fdsetRecv, NULL, NULL, &timeout);
+        if (nRet != 0)
+            return (nRet > 0);
+    }
+    return false;
+}
+
+// Answers one request, returns whether to keep the connection
+bool ServeRPCRequest(tcp::iostream& stream)
+{
+    // Receive request.  Once it starts arriving it has to arrive in time, a
+    // client trickling it in doesn't get to keep the worker.
+    bool fKeepAlive = false;
+    bool fHTTP11 = false;
+    stream.expires_after(std::chrono::seconds(RPC_REQUEST_TIMEOUT));
+    string strRequest = ReadHTTP(stream, fKeepAlive, fHTTP11, MAX_RPC_REQUEST_SIZE);
+    stream.expires_at((std::chrono::steady_clock::time_point::max)());
+    if (strRequest.empty() || !stream)
+        return false;
+    LogPrint(LOG_RPC, "ThreadRPCServer request=%s", strRequest.c_str());
+
+    Value id;
+    try
+    {
+        // Parse request.  Old clients may put several requests in one body,
+        // they get one reply with an array of answers, like a batch.
+        Array vRequest;
         string::iterator begin = strRequest.begin();
         while (skipspaces(begin), begin != strRequest.end())
         {
-            string::iterator prev = begin;
-            Value id;
+            Value valRequest;
+            if (!ReadJSONFast(begin, strRequest.end(), valRequest) &&
+                !read_range(begin, strRequest.end(), valRequest))
+                throw runtime_error("Parse error.");
+            vRequest.push_back(valRequest);
+        }
+        if (vRequest.empty())
+            throw runtime_error("Parse error.");
+        const Value& valRequest = (vRequest.size() == 1 ? vRequest[0] : Value(vRequest));
+
+        // Batch
+        if (valRequest.type() == array_type)
+        {
+            string strReply = JSONRPCExecBatch(valRequest.get_array());
+            stream << HTTPReply(strReply, 200, fKeepAlive) << std::flush;
+            return fKeepAlive;
+        }
+
+        // Stream long lists straight to the socket
+        rpcstreamfn_type pfnStream = GetStreamRPC(valRequest);
+        if (pfnStream != NULL)
+        {
+            id = find_value(valRequest.get_obj(), "id");
+            CJSONArrayWriter writer(stream, fKeepAlive, fHTTP11, id);
+            CMetricTimer metrictimer(*mapRPCMetrics.find(find_value(valRequest.get_obj(), "method").get_str())->second);
             try
             {
-                // Parse request
-                Value valRequest;
-                if (!read_range(begin, strRequest.end(), valRequest))
-                    throw runtime_error("Parse error.");
-                const Object& request = valRequest.get_obj();
-                if (find_value(request, "method").type() != str_type ||
-                    find_value(request, "params").type() != array_type)
-                    throw runtime_error("Invalid request.");
-
-                string strMethod    = find_value(request, "method").get_str();
-                const Array& params = find_value(request, "params").get_array();
-                id                  = find_value(request, "id");
-
-                // Execute
-                map<string, rpcfn_type>::iterator mi = mapCallTable.find(strMethod);
-                if (mi == mapCallTable.end())
-                    throw runtime_error("Method not found.");
-                Value result = (*(*mi).second)(params, false);
-
-                // Send reply
-                string strReply = JSONRPCReply(result, Value::null, id);
-                stream << HTTPReply(strReply, 200) << std::flush;
+                (*pfnStream)(find_value(valRequest.get_obj(), "params").get_array(), false, writer);
+                writer.Finish();
             }
             catch (std::exception& e)
             {
-                // Send error reply
-                string strReply = JSONRPCReply(Value::null, e.what(), id);
-                stream << HTTPReply(strReply, 500) << std::flush;
+                if (!writer.Started())
+                    throw;
+                // Too late for an error reply, cut the connection
+                metricRPCErrors.Inc();
+                printf("ThreadRPCServer stream aborted: %s\n", e.what());
+                return false;
             }
-            if (begin == prev)
-                break;
+            return fKeepAlive;
         }
+
+        Value result = JSONRPCExecOne(valRequest, id);
+
+        // Send reply
+        string strReply = JSONRPCReply(result, Value::null, id);
+        stream << HTTPReply(strReply, 200, fKeepAlive) << std::flush;
+    }
+    catch (std::exception& e)
+    {
+        // Send error reply
+        metricRPCErrors.Inc();
+        string strReply = JSONRPCReply(Value::null, e.what(), id);
+        stream << HTTPReply(strReply, 500, fKeepAlive) << std::flush;
+    }
+    return fKeepAlive && stream;
+}
+
+void ThreadRPCWorker(void* parg)
+{
+    loop
+    {
+        tcp::iostream* pstream = rpcConnectionQueue.Pop();
+        if (pstream == NULL)
+            break;
+        nRPCWorkersRunning++;
+        bool fKeepAlive = false;
+        try
+        {
+            fKeepAlive = ServeRPCRequest(*pstream);
+        }
+        catch (std::exception& e) {
+            PrintExceptionContinue(&e, "ThreadRPCWorker()");
+        } catch (...) {
+            PrintExceptionContinue(NULL, "ThreadRPCWorker()");
+        }
+        if (fKeepAlive && !fShutdown)
+            rpcConnectionQueue.Park(pstream);
+        else
+            delete pstream;
+        nRPCWorkersRunning--;
+    }
+    printf("ThreadRPCWorker exiting\n");
+}
+
+void ThreadRPCPoller(void* parg)
+{
+    nRPCWorkersRunning++;
+    try
+    {
+        while (!fShutdown)
+            rpcConnectionQueue.PollIdle();
+        rpcConnectionQueue.PollIdle();
+    }
+    catch (std::exception& e) {
+        PrintExceptionContinue(&e, "ThreadRPCPoller()");
+    } catch (...) {
+        PrintExceptionContinue(NULL, "ThreadRPCPoller()");
+    }
+    nRPCWorkersRunning--;
+    printf("ThreadRPCPoller exiting\n");
+}
+
+void ThreadRPCServer2(void* parg)
+{
+    printf("ThreadRPCServer started\n");
+
+    int nThreads = 4;
+    if (mapArgs.count("-rpcthreads"))
+        nThreads = max(1, atoi(mapArgs["-rpcthreads"]));
+    if (mapArgs.count("-rpcqueue"))
+        rpcConnectionQueue.SetMaxSize(max(1, atoi(mapArgs["-rpcqueue"])));
+    for (int i = 0; i < nThreads; i++)
+        if (!CreateThread(ThreadRPCWorker, NULL))
+            printf("Error: CreateThread(ThreadRPCWorker) failed\n");
+    if (!CreateThread(ThreadRPCPoller, NULL))
+        printf("Error: CreateThread(ThreadRPCPoller) failed\n");
+
+    // Bind to loopback 127.0.0.1 so the socket can only be accessed locally
+    boost::asio::io_service io_service;
+    tcp::endpoint endpoint(boost::asio::ip::address_v4::loopback(), 8332);
+    tcp::acceptor acceptor(io_service, endpoint);
+
+    loop
+    {
+        // Accept connection
+        tcp::iostream* pstream = new tcp::iostream();
+        tcp::endpoint peer;
+        vnThreadsRunning[4]--;
+        acceptor.accept(*pstream->rdbuf(), peer);
+        vnThreadsRunning[4]++;
+        if (fShutdown)
+        {
+            delete pstream;
+            return;
+        }
+
+        // Shouldn't be possible for anyone else to connect, but just in case
+        if (peer.address().to_string() != "127.0.0.1")
+        {
+            delete pstream;
+            continue;
+        }
+
+        // Wait for the request with the other idle connections
+        rpcConnectionQueue.Park(pstream);
     }
 }
 
@@ -907,8 +2457,12 @@ int CommandLineRPC(int argc, char *argv[])
             if (strMethod == "setgenerate"            && n > 0) ConvertTo<bool>(params[0]);
             if (strMethod == "setgenerate"            && n > 1) ConvertTo<boost::int64_t>(params[1]);
             if (strMethod == "sendtoaddress"          && n > 1) ConvertTo<double>(params[1]);
+            if (strMethod == "sendmany"               && n > 0) ConvertTo<Object>(params[0]);
             if (strMethod == "listtransactions"       && n > 0) ConvertTo<boost::int64_t>(params[0]);
             if (strMethod == "listtransactions"       && n > 1) ConvertTo<bool>(params[1]);
+            if (strMethod == "listtransactions"       && n > 2) ConvertTo<boost::int64_t>(params[2]);
+            if (strMethod == "listtransactionssince"  && n > 1) ConvertTo<boost::int64_t>(params[1]);
+            if (strMethod == "listtransactionssince"  && n > 2) ConvertTo<bool>(params[2]);
             if (strMethod == "getamountreceived"      && n > 1) ConvertTo<boost::int64_t>(params[1]); // deprecated
             if (strMethod == "getreceivedbyaddress"   && n > 1) ConvertTo<boost::int64_t>(params[1]);
             if (strMethod == "getreceivedbylabel"     && n > 1) ConvertTo<boost::int64_t>(params[1]);
@@ -918,6 +2472,7 @@ int CommandLineRPC(int argc, char *argv[])
             if (strMethod == "listreceivedbyaddress"  && n > 1) ConvertTo<bool>(params[1]);
             if (strMethod == "listreceivedbylabel"    && n > 0) ConvertTo<boost::int64_t>(params[0]);
             if (strMethod == "listreceivedbylabel"    && n > 1) ConvertTo<bool>(params[1]);
+            if (strMethod == "getlockstats"           && n > 0) ConvertTo<bool>(params[0]);
 
             // Execute
             result = CallRPC(strMethod, params);
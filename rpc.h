@@ -3,4 +3,9 @@
 // file license.txt or http://www.opensource.org/licenses/mit-license.php.
 
 void ThreadRPCServer(void* parg);
+void ThreadMetricsServer(void* parg);
+void ThreadRawServer(void* parg);
 int CommandLineRPC(int argc, char *argv[]);
+
+// RPC workers serving a connection, StopNode waits for them
+extern std::atomic<int> nRPCWorkersRunning;
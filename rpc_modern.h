@@ -13,6 +13,16 @@
 #include <variant>
 #include <expected>
 #include <coroutine>
+#include <algorithm>
+#include <deque>
+#include <exception>
+#include <future>
+#include <mutex>
+#include <condition_variable>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <vector>
 #include <json/json_spirit.h>
 
 namespace bitcoin::rpc {
@@ -72,37 +82,322 @@ struct Error {
 // RPC method handler type
 using MethodHandler = std::function<std::expected<Value, Error>(const Array& params)>;
 
-// Async RPC handler using coroutines
+// Executor that resumes suspended RPC coroutines. A call only holds one of
+// its threads while it runs between suspension points, so a few threads can
+// carry thousands of calls that spend most of their time waiting.
+class Executor {
+public:
+    explicit Executor(std::size_t threads) {
+        for (std::size_t i = 0; i < threads; ++i) {
+            threads_.emplace_back([this] { run(); });
+        }
+    }
+
+    ~Executor() {
+        {
+            std::lock_guard lock(mutex_);
+            stopping_ = true;
+        }
+        cv_.notify_all();
+    }
+
+    Executor(const Executor&) = delete;
+    Executor& operator=(const Executor&) = delete;
+
+    void post(std::function<void()> fn) {
+        {
+            std::lock_guard lock(mutex_);
+            queue_.push_back(std::move(fn));
+        }
+        cv_.notify_one();
+    }
+
+    // Runs handlers and resumes them after they wake up
+    static Executor& rpc() {
+        static Executor executor(2);
+        return executor;
+    }
+
+    // Runs the blocking reads (block and tx lookups) handlers wait on
+    static Executor& io() {
+        static Executor executor(std::max(4u, std::thread::hardware_concurrency()));
+        return executor;
+    }
+
+private:
+    void run() {
+        for (;;) {
+            std::function<void()> fn;
+            {
+                std::unique_lock lock(mutex_);
+                cv_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+                if (stopping_ && queue_.empty()) {
+                    return;
+                }
+                fn = std::move(queue_.front());
+                queue_.pop_front();
+            }
+            fn();
+        }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::function<void()>> queue_;
+    bool stopping_ = false;
+    std::vector<std::jthread> threads_;
+};
+
+// Async RPC handler using coroutines. The task starts when it is awaited (or
+// started) and resumes whoever awaited it when it finishes.
 struct AsyncTask {
     struct promise_type {
-        std::expected<Value, Error> result;
-        
+        // Value can't be nothrow moved, which rules out assigning an
+        // expected<Value, Error>, so it's constructed in place
+        std::optional<std::expected<Value, Error>> result;
+        std::coroutine_handle<> continuation;
+
         AsyncTask get_return_object() {
-            return {std::coroutine_handle<promise_type>::from_promise(*this)};
+            return AsyncTask{std::coroutine_handle<promise_type>::from_promise(*this)};
         }
-        
-        std::suspend_never initial_suspend() { return {}; }
-        std::suspend_never final_suspend() noexcept { return {}; }
-        
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        struct FinalAwaiter {
+            bool await_ready() const noexcept { return false; }
+
+            std::coroutine_handle<>
+            await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+                auto continuation = h.promise().continuation;
+                return continuation ? continuation : std::noop_coroutine();
+            }
+
+            void await_resume() const noexcept {}
+        };
+
+        FinalAwaiter final_suspend() noexcept { return {}; }
+
         void return_value(std::expected<Value, Error> value) {
-            result = std::move(value);
+            result.emplace(std::move(value));
         }
-        
+
         void unhandled_exception() {
-            result = std::unexpected(Error{
-                ErrorCode::INTERNAL_ERROR,
-                "Unhandled exception in async RPC method"
-            });
+            std::string message = "Unhandled exception in async RPC method";
+            try {
+                throw;
+            } catch (const std::exception& e) {
+                message += std::string(": ") + e.what();
+            } catch (...) {
+            }
+            result.emplace(std::unexpect, Error{ErrorCode::INTERNAL_ERROR, message});
         }
     };
-    
+
+    explicit AsyncTask(std::coroutine_handle<promise_type> handle) : h(handle) {}
+
+    AsyncTask(AsyncTask&& other) noexcept : h(std::exchange(other.h, {})) {}
+
+    AsyncTask& operator=(AsyncTask&& other) noexcept {
+        if (this != &other) {
+            if (h) {
+                h.destroy();
+            }
+            h = std::exchange(other.h, {});
+        }
+        return *this;
+    }
+
+    ~AsyncTask() {
+        if (h) {
+            h.destroy();
+        }
+    }
+
+    // co_await task
+    bool await_ready() const noexcept { return !h || h.done(); }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        h.promise().continuation = awaiting;
+        return h;
+    }
+
+    std::expected<Value, Error> await_resume() {
+        return std::move(*h.promise().result);
+    }
+
+    // Run the task from ordinary code. done is called on whichever thread
+    // the task finishes on.
+    void start(std::function<void(std::expected<Value, Error>)> done) &&;
+
+    // Run the task and block the calling thread until it finishes
+    [[nodiscard]] std::expected<Value, Error> get() && {
+        std::promise<std::expected<Value, Error>> promise;
+        auto future = promise.get_future();
+        std::move(*this).start([&promise](std::expected<Value, Error> result) {
+            promise.set_value(std::move(result));
+        });
+        return future.get();
+    }
+
     std::coroutine_handle<promise_type> h;
-    
-    [[nodiscard]] std::expected<Value, Error> get() {
-        return h.promise().result;
+};
+
+namespace detail {
+
+// Owns a started task until it finishes, then frees itself
+struct DetachedTask {
+    struct promise_type {
+        DetachedTask get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+};
+
+inline DetachedTask run_detached(AsyncTask task,
+                                 std::function<void(std::expected<Value, Error>)> done) {
+    done(co_await task);
+}
+
+} // namespace detail
+
+inline void AsyncTask::start(std::function<void(std::expected<Value, Error>)> done) && {
+    detail::run_detached(std::move(*this), std::move(done));
+}
+
+// Continue the calling coroutine on an executor thread
+[[nodiscard]] inline auto schedule_on(Executor& executor) {
+    struct Awaiter {
+        Executor& executor;
+
+        bool await_ready() const noexcept { return false; }
+
+        void await_suspend(std::coroutine_handle<> h) {
+            executor.post([h] { h.resume(); });
+        }
+
+        void await_resume() const noexcept {}
+    };
+    return Awaiter{executor};
+}
+
+// Run a blocking call, such as reading a block or transaction from disk, on
+// the I/O executor. The calling coroutine is suspended meanwhile and picks up
+// the result on the RPC executor, so RPC threads never wait on the disk.
+template<typename F>
+[[nodiscard]] auto offload(F fn, Executor& io = Executor::io(),
+                           Executor& resume = Executor::rpc()) {
+    using Result = std::invoke_result_t<F&>;
+    static_assert(!std::is_void_v<Result>, "offload needs a call that returns a value");
+
+    struct Awaiter {
+        F fn;
+        Executor& io;
+        Executor& resume;
+        std::optional<Result> result;
+        std::exception_ptr error;
+
+        bool await_ready() const noexcept { return false; }
+
+        void await_suspend(std::coroutine_handle<> h) {
+            io.post([this, h] {
+                try {
+                    result.emplace(fn());
+                } catch (...) {
+                    error = std::current_exception();
+                }
+                resume.post([h] { h.resume(); });
+            });
+        }
+
+        Result await_resume() {
+            if (error) {
+                std::rethrow_exception(error);
+            }
+            return std::move(*result);
+        }
+    };
+    return Awaiter{std::move(fn), io, resume, std::nullopt, nullptr};
+}
+
+// Lock a coroutine can wait on without blocking its thread, for chain state
+// shared between handlers. Waiters are handed the lock in arrival order.
+//
+//     auto guard = co_await chain_lock.lock();
+//
+class AsyncMutex {
+public:
+    class [[nodiscard]] Guard {
+    public:
+        explicit Guard(AsyncMutex* mutex) : mutex_(mutex) {}
+        Guard(Guard&& other) noexcept : mutex_(std::exchange(other.mutex_, nullptr)) {}
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+        ~Guard() {
+            if (mutex_) {
+                mutex_->unlock();
+            }
+        }
+
+    private:
+        AsyncMutex* mutex_;
+    };
+
+    struct LockAwaiter {
+        AsyncMutex& mutex;
+
+        bool await_ready() { return mutex.try_lock(); }
+
+        bool await_suspend(std::coroutine_handle<> h) {
+            std::lock_guard lock(mutex.mutex_);
+            if (!mutex.locked_) {
+                mutex.locked_ = true;
+                return false;
+            }
+            mutex.waiters_.push_back(h);
+            return true;
+        }
+
+        Guard await_resume() noexcept { return Guard(&mutex); }
+    };
+
+    [[nodiscard]] LockAwaiter lock() { return LockAwaiter{*this}; }
+
+    [[nodiscard]] bool try_lock() {
+        std::lock_guard lock(mutex_);
+        if (locked_) {
+            return false;
+        }
+        locked_ = true;
+        return true;
     }
+
+    // Ownership passes straight to the next waiter, resumed on the executor
+    void unlock(Executor& resume = Executor::rpc()) {
+        std::coroutine_handle<> next;
+        {
+            std::lock_guard lock(mutex_);
+            if (waiters_.empty()) {
+                locked_ = false;
+                return;
+            }
+            next = waiters_.front();
+            waiters_.pop_front();
+        }
+        resume.post([next] { next.resume(); });
+    }
+
+private:
+    std::mutex mutex_;
+    bool locked_ = false;
+    std::deque<std::coroutine_handle<>> waiters_;
 };
 
+// Async RPC method handler. Params are taken by value because the coroutine
+// outlives the call that starts it.
+using AsyncMethodHandler = std::function<AsyncTask(Array params)>;
+
 // RPC server
 class Server {
 public:
@@ -115,9 +410,17 @@ public:
     void register_method(std::string_view name, MethodHandler handler) {
         methods_[std::string(name)] = std::move(handler);
     }
+
+    void register_async_method(std::string_view name, AsyncMethodHandler handler) {
+        async_methods_[std::string(name)] = std::move(handler);
+    }
     
     // Process JSON-RPC request
     [[nodiscard]] Value process_request(const Value& request);
+
+    // Process JSON-RPC request without holding the calling thread. The method
+    // runs on the RPC executor and done gets the reply when it finishes.
+    void process_request_async(const Value& request, std::function<void(Value)> done);
     
     // Start/stop server
     [[nodiscard]] std::expected<void, std::string> 
@@ -138,25 +441,70 @@ private:
     
     [[nodiscard]] std::expected<Value, Error>
     execute_method(std::string_view method, const Array& params);
+
+    [[nodiscard]] AsyncTask
+    execute_method_async(std::string method, Array params);
     
     [[nodiscard]] bool 
     check_auth(std::string_view auth_header) const;
     
     std::map<std::string, MethodHandler, std::less<>> methods_;
+    std::map<std::string, AsyncMethodHandler, std::less<>> async_methods_;
     std::string username_;
     std::string password_;
     std::atomic<bool> running_{false};
 };
 
+inline AsyncTask Server::execute_method_async(std::string method, Array params) {
+    co_await schedule_on(Executor::rpc());
+    if (auto it = async_methods_.find(method); it != async_methods_.end()) {
+        co_return co_await it->second(std::move(params));
+    }
+    co_return execute_method(method, params);
+}
+
+inline void Server::process_request_async(const Value& request, std::function<void(Value)> done) {
+    auto reply = [](const std::expected<Value, Error>& result, const Value& id) {
+        Object obj;
+        if (result) {
+            obj.emplace_back("result", *result);
+            obj.emplace_back("error", Value::null);
+        } else {
+            obj.emplace_back("result", Value::null);
+            obj.emplace_back("error", result.error().to_json());
+        }
+        obj.emplace_back("id", id);
+        return Value(obj);
+    };
+
+    if (request.type() != json_spirit::obj_type) {
+        done(reply(std::unexpected(Error{ErrorCode::INVALID_REQUEST, "Invalid request"}), Value::null));
+        return;
+    }
+    const Object& obj = request.get_obj();
+    Value id = json_spirit::find_value(obj, "id");
+    const Value& method = json_spirit::find_value(obj, "method");
+    const Value& params = json_spirit::find_value(obj, "params");
+    if (method.type() != json_spirit::str_type || params.type() != json_spirit::array_type) {
+        done(reply(std::unexpected(Error{ErrorCode::INVALID_REQUEST, "Invalid request"}), id));
+        return;
+    }
+
+    execute_method_async(method.get_str(), params.get_array())
+        .start([reply, id, done = std::move(done)](std::expected<Value, Error> result) {
+            done(reply(result, id));
+        });
+}
+
 // Built-in RPC methods
 
 // Block chain information
 [[nodiscard]] std::expected<Value, Error> getblockcount(const Array& params);
 [[nodiscard]] std::expected<Value, Error> getbestblockhash(const Array& params);
 [[nodiscard]] std::expected<Value, Error> getdifficulty(const Array& params);
-[[nodiscard]] std::expected<Value, Error> getblock(const Array& params);
+[[nodiscard]] AsyncTask getblock(Array params);
 [[nodiscard]] std::expected<Value, Error> getblockhash(const Array& params);
-[[nodiscard]] std::expected<Value, Error> gettransaction(const Array& params);
+[[nodiscard]] AsyncTask gettransaction(Array params);
 
 // Mining
 [[nodiscard]] std::expected<Value, Error> getgenerate(const Array& params);
@@ -184,7 +532,7 @@ private:
 [[nodiscard]] std::expected<Value, Error> getnetworkinfo(const Array& params);
 
 // Raw transactions
-[[nodiscard]] std::expected<Value, Error> getrawtransaction(const Array& params);
+[[nodiscard]] AsyncTask getrawtransaction(Array params);
 [[nodiscard]] std::expected<Value, Error> sendrawtransaction(const Array& params);
 [[nodiscard]] std::expected<Value, Error> decoderawtransaction(const Array& params);
 
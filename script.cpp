@@ -909,18 +909,23 @@ bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CSc
 
 
 
-bool Solver(const CScript& scriptPubKey, vector<pair<opcodetype, valtype> >& vSolutionRet)
+static vector<CScript> GetSolverTemplates()
 {
-    // Templates
-    static vector<CScript> vTemplates;
-    if (vTemplates.empty())
-    {
-        // Standard tx, sender provides pubkey, receiver adds signature
-        vTemplates.push_back(CScript() << OP_PUBKEY << OP_CHECKSIG);
+    vector<CScript> vTemplates;
 
-        // Bitcoin address tx, sender provides hash of pubkey, receiver provides signature and pubkey
-        vTemplates.push_back(CScript() << OP_DUP << OP_HASH160 << OP_PUBKEYHASH << OP_EQUALVERIFY << OP_CHECKSIG);
-    }
+    // Standard tx, sender provides pubkey, receiver adds signature
+    vTemplates.push_back(CScript() << OP_PUBKEY << OP_CHECKSIG);
+
+    // Bitcoin address tx, sender provides hash of pubkey, receiver provides signature and pubkey
+    vTemplates.push_back(CScript() << OP_DUP << OP_HASH160 << OP_PUBKEYHASH << OP_EQUALVERIFY << OP_CHECKSIG);
+
+    return vTemplates;
+}
+
+bool Solver(const CScript& scriptPubKey, vector<pair<opcodetype, valtype> >& vSolutionRet)
+{
+    // Templates, initialized once even if several threads get here first
+    static const vector<CScript> vTemplates = GetSolverTemplates();
 
     // Scan templates
     const CScript& script1 = scriptPubKey;
@@ -1031,6 +1036,23 @@ bool IsMine(const CScript& scriptPubKey)
 }
 
 
+bool CKeyFilter::IsMine(const CScript& scriptPubKey) const
+{
+    vector<pair<opcodetype, valtype> > vSolution;
+    if (!Solver(scriptPubKey, vSolution))
+        return false;
+
+    foreach(PAIRTYPE(opcodetype, valtype)& item, vSolution)
+    {
+        if (item.first == OP_PUBKEY && setPubKey.count(item.second))
+            return true;
+        if (item.first == OP_PUBKEYHASH && setPubKeyHash.count(uint160(item.second)))
+            return true;
+    }
+    return false;
+}
+
+
 bool ExtractPubKey(const CScript& scriptPubKey, bool fMineOnly, vector<unsigned char>& vchPubKeyRet)
 {
     vchPubKeyRet.clear();
@@ -632,6 +632,27 @@ public:
 
 
 
+// Copy of the wallet's public keys, so scripts can be matched against the
+// wallet from several threads without taking cs_mapKeys for each one.
+class CKeyFilter
+{
+protected:
+    set<vector<unsigned char> > setPubKey;
+    set<uint160> setPubKeyHash;
+
+public:
+    void Add(const vector<unsigned char>& vchPubKey)
+    {
+        setPubKey.insert(vchPubKey);
+        setPubKeyHash.insert(Hash160(vchPubKey));
+    }
+
+    int size() const { return setPubKey.size(); }
+    bool IsMine(const CScript& scriptPubKey) const;
+};
+
+
+
 bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nIn, int nHashType=0,
                 vector<vector<unsigned char> >* pvStackRet=NULL);
 uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
@@ -0,0 +1,349 @@
+// Copyright (c) 2025 GoldcoinPoP Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+
+//
+// Crash recovery tests for CLSMStore.  A crash is simulated by copying the
+// store's directory while the store is still open, without the log sync
+// Close does, and opening the copy.
+//
+
+#include "headers.h"
+
+// db.o isn't linked, CBDBStore's transactions come from its environment
+DbEnv dbenv(0);
+
+static int nFailures = 0;
+
+#define CHECK(expr) \
+    do { if (!(expr)) { fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #expr); nFailures++; } } while (0)
+
+static string strTestDir;
+
+static string TestPath(const char* pszName)
+{
+    return strTestDir + "/" + pszName;
+}
+
+static vector<string> ListDir(const string& strDir)
+{
+    vector<string> vRet;
+    for (boost::filesystem::directory_iterator it(strDir); it != boost::filesystem::directory_iterator(); ++it)
+        vRet.push_back(it->path().filename().string());
+    sort(vRet.begin(), vRet.end());
+    return vRet;
+}
+
+static void CopyDir(const string& strFrom, const string& strTo)
+{
+    // Background flushes and merges add and remove files while we copy, a
+    // mix no real crash could leave, so copy again until nothing changed
+    loop
+    {
+        boost::filesystem::remove_all(strTo);
+        boost::filesystem::create_directory(strTo);
+        vector<string> vFiles = ListDir(strFrom);
+        bool fCopied = true;
+        foreach(const string& strName, vFiles)
+        {
+            boost::system::error_code ec;
+            boost::filesystem::copy_file(boost::filesystem::path(strFrom) / strName, boost::filesystem::path(strTo) / strName, ec);
+            if (ec)
+                fCopied = false;
+        }
+        if (fCopied && ListDir(strFrom) == vFiles)
+            return;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+}
+
+static vector<string> ListFiles(const string& strDir, const string& strExt)
+{
+    vector<string> vRet;
+    for (boost::filesystem::directory_iterator it(strDir); it != boost::filesystem::directory_iterator(); ++it)
+        if (it->path().extension().string() == strExt)
+            vRet.push_back(it->path().string());
+    sort(vRet.begin(), vRet.end());
+    return vRet;
+}
+
+static void AppendBytes(const string& strPath, const string& str)
+{
+    FILE* file = fopen(strPath.c_str(), "ab");
+    fwrite(str.data(), 1, str.size(), file);
+    fclose(file);
+}
+
+// Random puts and erases over a small key space, mirrored into mapRef
+static bool WriteRandom(CLSMStore& store, map<string, string>& mapRef, int nBatches, bool fSync)
+{
+    for (int i = 0; i < nBatches; i++)
+    {
+        CKVBatch batch;
+        for (int j = 0; j < 20; j++)
+        {
+            string strKey = strprintf("key%05d", rand() % 5000);
+            if (rand() % 5 == 0)
+            {
+                batch.Erase(strKey);
+                mapRef.erase(strKey);
+            }
+            else
+            {
+                string strValue(rand() % 300, 'a' + rand() % 26);
+                batch.Put(strKey, strValue);
+                mapRef[strKey] = strValue;
+            }
+        }
+        if (!store.Write(batch, fSync))
+            return false;
+    }
+    return true;
+}
+
+static bool SameAs(CLSMStore& store, const map<string, string>& mapRef)
+{
+    for (map<string, string>::const_iterator mi = mapRef.begin(); mi != mapRef.end(); ++mi)
+    {
+        string strValue;
+        if (!store.Get((*mi).first, strValue) || strValue != (*mi).second)
+            return false;
+    }
+
+    CKVIterator* pitem = store.NewIterator();
+    map<string, string>::const_iterator mi = mapRef.begin();
+    for (pitem->Seek(""); pitem->Valid(); pitem->Next(), ++mi)
+    {
+        if (mi == mapRef.end() || pitem->Key() != (*mi).first || pitem->Value() != (*mi).second)
+        {
+            delete pitem;
+            return false;
+        }
+    }
+    bool fOk = (mi == mapRef.end() && !pitem->Error());
+    delete pitem;
+    return fOk;
+}
+
+static void TestUnflushedLog()
+{
+    // Everything is still in the memtable and the log
+    string strDir = TestPath("unflushed");
+    map<string, string> mapRef;
+    CLSMStore store(strDir);
+    CHECK(store.Open());
+    CHECK(WriteRandom(store, mapRef, 50, true));
+    CopyDir(strDir, strDir + ".crash");
+
+    CLSMStore storeCrash(strDir + ".crash");
+    CHECK(storeCrash.Open());
+    CHECK(SameAs(storeCrash, mapRef));
+}
+
+static void TestManyLogs()
+{
+    // Small memtables, so the crash lands after many log switches, flushes
+    // and merges, with writes after the last flush still only in the logs
+    string strDir = TestPath("manylogs");
+    map<string, string> mapRef;
+    CLSMStore store(strDir, 16 * 1024);
+    CHECK(store.Open());
+    CHECK(WriteRandom(store, mapRef, 1000, false));
+    CHECK(store.Compact());
+    CHECK(store.GetTableCount() > 0);
+    CHECK(WriteRandom(store, mapRef, 3, true));
+    CHECK(SameAs(store, mapRef));
+    CopyDir(strDir, strDir + ".crash");
+
+    {
+        CLSMStore storeCrash(strDir + ".crash", 16 * 1024);
+        CHECK(storeCrash.Open());
+        CHECK(SameAs(storeCrash, mapRef));
+        CHECK(WriteRandom(storeCrash, mapRef, 100, true));
+    }
+
+    // And again after a clean close
+    CLSMStore storeReopen(strDir + ".crash", 16 * 1024);
+    CHECK(storeReopen.Open());
+    CHECK(SameAs(storeReopen, mapRef));
+}
+
+static void TestTornLog()
+{
+    // A record cut short at the end of the log is dropped, and new records
+    // go after the last good one
+    string strDir = TestPath("torn");
+    map<string, string> mapRef;
+    {
+        CLSMStore store(strDir);
+        CHECK(store.Open());
+        CHECK(WriteRandom(store, mapRef, 20, true));
+    }
+    vector<string> vLogs = ListFiles(strDir, ".log");
+    CHECK(!vLogs.empty());
+    if (vLogs.empty())
+        return;
+    AppendBytes(vLogs.back(), string("\x40\x00\x00\x00\x12\x34\x56\x78partial", 15));
+
+    {
+        CLSMStore store(strDir);
+        CHECK(store.Open());
+        CHECK(SameAs(store, mapRef));
+        CHECK(WriteRandom(store, mapRef, 20, true));
+    }
+    CLSMStore store(strDir);
+    CHECK(store.Open());
+    CHECK(SameAs(store, mapRef));
+}
+
+static void TestCrashDuringFlush()
+{
+    // A flush that went down after writing its table but before the
+    // manifest leaves a table and MANIFEST.tmp nothing refers to
+    string strDir = TestPath("midflush");
+    map<string, string> mapRef;
+    {
+        CLSMStore store(strDir, 16 * 1024);
+        CHECK(store.Open());
+        CHECK(WriteRandom(store, mapRef, 200, true));
+        CHECK(store.Compact());
+    }
+    vector<string> vTables = ListFiles(strDir, ".tbl");
+    CHECK(!vTables.empty());
+    if (vTables.empty())
+        return;
+    string strOrphan = strDir + "/999999.tbl";
+    boost::filesystem::copy_file(vTables.front(), strOrphan);
+    AppendBytes(strDir + "/MANIFEST.tmp", "half a manifest");
+
+    {
+        CLSMStore store(strDir, 16 * 1024);
+        CHECK(store.Open());
+        CHECK(!boost::filesystem::exists(strOrphan));
+        CHECK(!boost::filesystem::exists(strDir + "/MANIFEST.tmp"));
+        CHECK(SameAs(store, mapRef));
+        CHECK(WriteRandom(store, mapRef, 200, true));
+        CHECK(store.Compact());
+    }
+    CLSMStore store(strDir, 16 * 1024);
+    CHECK(store.Open());
+    CHECK(SameAs(store, mapRef));
+}
+
+static void TestCorruptTable()
+{
+    // A table block that doesn't read back has to show up as an error in
+    // scans, and a merge must not replace the tables it couldn't read
+    string strDir = TestPath("corrupt");
+    map<string, string> mapRef;
+    int nTables;
+    {
+        CLSMStore store(strDir, 64 * 1024);
+        CHECK(store.Open());
+        CHECK(WriteRandom(store, mapRef, 40, true));
+        CHECK(store.Compact());
+        nTables = store.GetTableCount();
+    }
+    vector<string> vTables = ListFiles(strDir, ".tbl");
+    CHECK(nTables > 0 && vTables.size() == nTables);
+    if (vTables.empty())
+        return;
+    {
+        FILE* file = fopen(vTables.front().c_str(), "r+b");
+        fseek(file, 10, SEEK_SET);
+        fputc(~fgetc(file), file);
+        fclose(file);
+    }
+
+    CLSMStore store(strDir, 64 * 1024);
+    CHECK(store.Open());
+    CKVIterator* pitem = store.NewIterator();
+    for (pitem->Seek(""); pitem->Valid(); pitem->Next())
+        ;
+    CHECK(pitem->Error());
+    delete pitem;
+
+    // Enough new tables to want a merge with the bad one
+    for (int i = 0; i < LSM_MERGE_WIDTH; i++)
+    {
+        CHECK(WriteRandom(store, mapRef, 40, true));
+        store.Compact();
+    }
+    foreach(const string& strPath, vTables)
+        CHECK(boost::filesystem::exists(strPath));
+    CHECK(store.GetTableCount() >= nTables + LSM_MERGE_WIDTH);
+}
+
+static void TestConcurrentWriters()
+{
+    // Writers racing the background flushes and a reader
+    string strDir = TestPath("concurrent");
+    CLSMStore store(strDir, 8 * 1024);
+    CHECK(store.Open());
+    std::atomic<bool> fDone(false);
+    std::atomic<int> nWriteFailures(0);
+    vector<std::thread> vThreads;
+    for (int n = 0; n < 4; n++)
+    {
+        vThreads.push_back(std::thread([&, n]()
+        {
+            for (int i = 0; i < 2000; i++)
+            {
+                CKVBatch batch;
+                batch.Put(strprintf("w%d-%05d", n, i), string(100, 'a' + n));
+                if (!store.Write(batch, false))
+                    nWriteFailures++;
+            }
+        }));
+    }
+    std::thread threadReader([&]()
+    {
+        while (!fDone)
+        {
+            CKVIterator* pitem = store.NewIterator();
+            for (pitem->Seek(""); pitem->Valid(); pitem->Next())
+                ;
+            CHECK(!pitem->Error());
+            delete pitem;
+        }
+    });
+    foreach(std::thread& thread, vThreads)
+        thread.join();
+    fDone = true;
+    threadReader.join();
+    CHECK(nWriteFailures == 0);
+
+    map<string, string> mapRef;
+    for (int n = 0; n < 4; n++)
+        for (int i = 0; i < 2000; i++)
+            mapRef[strprintf("w%d-%05d", n, i)] = string(100, 'a' + n);
+    CHECK(SameAs(store, mapRef));
+    store.Close();
+
+    CLSMStore storeReopen(strDir, 8 * 1024);
+    CHECK(storeReopen.Open());
+    CHECK(SameAs(storeReopen, mapRef));
+}
+
+int main(int argc, char* argv[])
+{
+    strTestDir = (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("test_kvstore-%%%%%%%%")).string();
+    boost::filesystem::create_directories(strTestDir);
+    srand(1);
+
+    TestUnflushedLog();
+    TestManyLogs();
+    TestTornLog();
+    TestCrashDuringFlush();
+    TestCorruptTable();
+    TestConcurrentWriters();
+
+    boost::filesystem::remove_all(strTestDir);
+    if (nFailures)
+    {
+        fprintf(stderr, "test_kvstore: %d checks failed\n", nFailures);
+        return 1;
+    }
+    fprintf(stdout, "test_kvstore: all passed\n");
+    return 0;
+}
@@ -0,0 +1,84 @@
+#!/usr/bin/env python3
+# Copyright (c) 2025 GoldcoinPoP Developers
+# Distributed under the MIT/X11 software license, see the accompanying
+# file license.txt or http://www.opensource.org/licenses/mit-license.php.
+#
+# Convert a trace.dat written with -trace to Chrome trace JSON, which
+# chrome://tracing and https://ui.perfetto.dev can both open.
+#
+#   tracetojson.py ~/.bitcoin/trace.dat > trace.json
+
+import json
+import struct
+import sys
+
+MAGIC = b"POPTRACE"
+VERSION = 1
+RECORD = struct.Struct("<qQIIHc5x")
+
+# Keep in sync with the TRACE_* enum in util.h
+EVENTS = {
+    1: ("block received", "block"),
+    2: ("block check", "block"),
+    3: ("block accept", "block"),
+    4: ("block connect", "block"),
+    5: ("tx accept", "tx"),
+    6: ("lottery", "pop"),
+    7: ("msg in", "net"),
+    8: ("msg out", "net"),
+}
+COMMAND_EVENTS = (7, 8)
+
+
+def convert(f):
+    header = f.read(len(MAGIC) + 4)
+    if len(header) < len(MAGIC) + 4 or header[:len(MAGIC)] != MAGIC:
+        raise ValueError("not a trace file")
+    (version,) = struct.unpack("<I", header[len(MAGIC):])
+    if version != VERSION:
+        raise ValueError("unsupported trace version %d" % version)
+
+    events = []
+    while True:
+        data = f.read(RECORD.size)
+        if len(data) < RECORD.size:
+            break
+        nTime, nId, nThread, nArg, nEvent, chPhase = RECORD.unpack(data)
+        name, cat = EVENTS.get(nEvent, ("event %d" % nEvent, "unknown"))
+        if nEvent in COMMAND_EVENTS:
+            # The id is the start of the command, show it in the name
+            command = struct.pack("<Q", nId).rstrip(b"\0").decode("ascii", "replace")
+            name = "%s %s" % (name, command)
+            args = {"bytes": nArg}
+        else:
+            args = {"id": "%016x" % nId, "arg": nArg}
+        event = {
+            "name": name,
+            "cat": cat,
+            "ph": chPhase.decode("ascii"),
+            "ts": nTime,
+            "pid": 1,
+            "tid": nThread,
+            "args": args,
+        }
+        if event["ph"] == "i":
+            event["s"] = "t"
+        events.append(event)
+
+    # Records are written a thread buffer at a time, put them back in order
+    events.sort(key=lambda e: e["ts"])
+    return {"traceEvents": events, "displayTimeUnit": "ms"}
+
+
+def main():
+    if len(sys.argv) != 2:
+        sys.stderr.write("usage: %s trace.dat > trace.json\n" % sys.argv[0])
+        return 1
+    with open(sys.argv[1], "rb") as f:
+        json.dump(convert(f), sys.stdout)
+    sys.stdout.write("\n")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
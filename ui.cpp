@@ -260,7 +260,7 @@ CMainFrame::CMainFrame(wxWindow* parent) : CMainFrameBase(parent)
     dResize = 1.22;
     SetSize(dResize * GetSize().GetWidth(), 1.15 * GetSize().GetHeight());
 #endif
-    m_staticTextBalance->SetLabel(FormatMoney(GetBalance()) + "  ");
+    m_staticTextBalance->SetLabel(FormatMoney(GetSnapshotBalance()) + "  ");
     m_listCtrl->SetFocus();
     ptaskbaricon = new CMyTaskBarIcon();
 #ifdef __WXMAC__
@@ -772,9 +772,9 @@ void CMainFrame::OnIdle(wxIdleEvent& event)
 {
     if (fRefreshListCtrl)
     {
-        // Collect list of wallet transactions and sort newest first
+        // Collect list of wallet transactions, newest first
         bool fEntered = false;
-        vector<pair<unsigned int, uint256> > vSorted;
+        vector<uint256> vSorted;
         TRY_CRITICAL_BLOCK(cs_mapWallet)
         {
             printf("RefreshListCtrl starting\n");
@@ -783,20 +783,14 @@ void CMainFrame::OnIdle(wxIdleEvent& event)
             vWalletUpdated.clear();
 
             // Do the newest transactions first
-            vSorted.reserve(mapWallet.size());
-            for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-            {
-                const CWalletTx& wtx = (*it).second;
-                unsigned int nTime = UINT_MAX - wtx.GetTxTime();
-                vSorted.push_back(make_pair(nTime, (*it).first));
-            }
+            vSorted.reserve(walletTxTimeIndex.size());
+            for (CWalletTxTimeIndex::const_reverse_iterator it = walletTxTimeIndex.rbegin(); it != walletTxTimeIndex.rend(); ++it)
+                vSorted.push_back((*it).second->GetHash());
             m_listCtrl->DeleteAllItems();
         }
         if (!fEntered)
             return;
 
-        sort(vSorted.begin(), vSorted.end());
-
         // Fill list control
         for (int i = 0; i < vSorted.size();)
         {
@@ -806,7 +800,7 @@ void CMainFrame::OnIdle(wxIdleEvent& event)
             TRY_CRITICAL_BLOCK(cs_mapWallet)
             {
                 fEntered = true;
-                uint256& hash = vSorted[i++].second;
+                uint256& hash = vSorted[i++];
                 map<uint256, CWalletTx>::iterator mi = mapWallet.find(hash);
                 if (mi != mapWallet.end())
                     InsertTransaction((*mi).second, true);
@@ -987,7 +981,7 @@ void CMainFrame::OnPaintListCtrl(wxPaintEvent& event)
         TRY_CRITICAL_BLOCK(cs_mapWallet)
         {
             fPaintedBalance = true;
-            m_staticTextBalance->SetLabel(FormatMoney(GetBalance()) + "  ");
+            m_staticTextBalance->SetLabel(FormatMoney(GetSnapshotBalance()) + "  ");
 
             // Count hidden and multi-line transactions
             nTransactionCount = 0;
@@ -10,6 +10,10 @@ map<string, vector<string> > mapMultiArgs;
 bool fDebug = false;
 bool fPrintToConsole = false;
 bool fPrintToDebugger = false;
+unsigned int nLogCategories = 0;
+int nLogLevel = LOGLEVEL_INFO;
+bool fTrace = false;
+bool fLockStats = false;
 char pszSetDataDir[MAX_PATH] = "";
 bool fShutdown = false;
 bool fDaemon = false;
@@ -131,33 +135,539 @@ uint64 GetRand(uint64 nMax)
 
 
 
-inline int OutputDebugStringF(const char* pszFormat, ...)
+//
+// Lock profiling
+//
+
+struct CHeldLock
+{
+    CCriticalSection* pcs;
+    const char* pszName;
+    const char* pszFile;
+    int nLine;
+    int64 nWait;
+    int64 nAcquired;
+    bool fContended;
+    bool fRecursive;
+};
+
+// Locks held by this thread, innermost last
+static thread_local vector<CHeldLock> vHeldLocks;
+
+// A std::mutex rather than a CCriticalSection so it isn't profiled itself
+static std::mutex mutexLockStats;
+static map<string, CLockStats> mapLockStats;
+static map<pair<string, string>, string> mapLockOrder;
+static set<pair<string, string> > setLockInversions;
+static vector<string> vLockInversions;
+
+// pnode->cs_vSend and pfrom->cs_vSend are the same lock as far as we're concerned
+static string LockName(const char* pszName)
+{
+    const char* psz = pszName;
+    for (const char* p = pszName; *p; p++)
+        if (*p == '.' || (*p == '>' && p > pszName && p[-1] == '-'))
+            psz = p + 1;
+    return psz;
+}
+
+static string LockSite(const char* pszFile, int nLine)
+{
+    return strprintf("%s:%d", pszFile, nLine);
+}
+
+// Caller holds mutexLockStats
+static void CheckLockOrder(const CHeldLock& held)
+{
+    string strName = LockName(held.pszName);
+    foreach(const CHeldLock& prev, vHeldLocks)
+    {
+        string strPrev = LockName(prev.pszName);
+        if (strPrev == strName)
+            continue;
+        pair<string, string> order(strPrev, strName);
+        if (mapLockOrder.count(order))
+            continue;
+        string strWhere = strprintf("%s at %s then %s at %s", strPrev.c_str(), LockSite(prev.pszFile, prev.nLine).c_str(),
+                                    strName.c_str(), LockSite(held.pszFile, held.nLine).c_str());
+        mapLockOrder[order] = strWhere;
+
+        pair<string, string> reverse(strName, strPrev);
+        map<pair<string, string>, string>::iterator mi = mapLockOrder.find(reverse);
+        if (mi != mapLockOrder.end() && setLockInversions.insert(order).second)
+            vLockInversions.push_back(strWhere + ", but also " + (*mi).second);
+    }
+}
+
+static void PushHeldLock(CCriticalSection& cs, const char* pszName, const char* pszFile, int nLine, int64 nStart, bool fContended)
+{
+    CHeldLock held;
+    held.pcs = &cs;
+    held.pszName = pszName;
+    held.pszFile = pszFile;
+    held.nLine = nLine;
+    held.nAcquired = (fContended ? GetTimeMicros() : nStart);
+    held.nWait = held.nAcquired - nStart;
+    held.fContended = fContended;
+    held.fRecursive = false;
+    foreach(const CHeldLock& prev, vHeldLocks)
+        if (prev.pcs == &cs)
+            held.fRecursive = true;
+    if (!held.fRecursive && !vHeldLocks.empty())
+    {
+        std::lock_guard<std::mutex> lock(mutexLockStats);
+        CheckLockOrder(held);
+    }
+    vHeldLocks.push_back(held);
+}
+
+void EnterCriticalSectionProfiled(CCriticalSection& cs, const char* pszName, const char* pszFile, int nLine)
+{
+    int64 nStart = GetTimeMicros();
+    bool fContended = !cs.TryEnter();
+    if (fContended)
+        cs.Enter();
+    PushHeldLock(cs, pszName, pszFile, nLine, nStart, fContended);
+}
+
+bool TryEnterCriticalSectionProfiled(CCriticalSection& cs, const char* pszName, const char* pszFile, int nLine)
+{
+    if (!cs.TryEnter())
+    {
+        std::lock_guard<std::mutex> lock(mutexLockStats);
+        CLockStats& stats = mapLockStats[LockName(pszName)];
+        stats.nTryFailed++;
+        stats.mapSites[LockSite(pszFile, nLine)].nTryFailed++;
+        return false;
+    }
+    PushHeldLock(cs, pszName, pszFile, nLine, GetTimeMicros(), false);
+    return true;
+}
+
+void LeaveCriticalSectionProfiled(CCriticalSection& cs)
+{
+    int64 nNow = GetTimeMicros();
+    CHeldLock held;
+    held.pcs = NULL;
+    for (int i = vHeldLocks.size() - 1; i >= 0; i--)
+    {
+        if (vHeldLocks[i].pcs == &cs)
+        {
+            held = vHeldLocks[i];
+            vHeldLocks.erase(vHeldLocks.begin() + i);
+            break;
+        }
+    }
+    cs.Leave();
+
+    // Re-entering a lock this thread already holds doesn't wait or hold anything
+    if (held.pcs == NULL || held.fRecursive)
+        return;
+
+    std::lock_guard<std::mutex> lock(mutexLockStats);
+    CLockStats& stats = mapLockStats[LockName(held.pszName)];
+    CLockSiteStats& site = stats.mapSites[LockSite(held.pszFile, held.nLine)];
+    stats.nAcquired++;
+    site.nAcquired++;
+    if (held.fContended)
+    {
+        stats.nContended++;
+        site.nContended++;
+    }
+    stats.wait.Add(held.nWait);
+    site.wait.Add(held.nWait);
+    stats.hold.Add(nNow - held.nAcquired);
+    site.hold.Add(nNow - held.nAcquired);
+}
+
+void GetLockStats(map<string, CLockStats>& mapStatsRet, vector<string>& vInversionsRet)
+{
+    std::lock_guard<std::mutex> lock(mutexLockStats);
+    mapStatsRet = mapLockStats;
+    vInversionsRet = vLockInversions;
+}
+
+void ResetLockStats()
+{
+    std::lock_guard<std::mutex> lock(mutexLockStats);
+    mapLockStats.clear();
+    mapLockOrder.clear();
+    setLockInversions.clear();
+    vLockInversions.clear();
+}
+
+
+
+
+
+
+
+
+
+
+
+//
+// debug.log
+//
+// printf formats into a ring buffer belonging to the calling thread and a
+// writer thread drains the buffers into debug.log, which it keeps open.  Each
+// buffer has one producer and one consumer so it doesn't need a lock; only the
+// consumers take cs_debuglog, for when a producer with a full buffer or
+// FlushDebugLog drains it themselves.  Lines from different threads are
+// written a buffer at a time, so they can be out of order by up to one
+// drain interval.
+//
+
+static const unsigned int DEBUGLOG_RING_SIZE = 256 * 1024;
+static const int DEBUGLOG_MAX_SIZE = 10 * 1000000;
+
+class CDebugLogRing
+{
+protected:
+    char pchBuffer[DEBUGLOG_RING_SIZE];
+    std::atomic<unsigned int> nWritePos;
+    std::atomic<unsigned int> nReadPos;
+
+public:
+    std::atomic<bool> fThreadExited;
+
+    CDebugLogRing() : nWritePos(0), nReadPos(0), fThreadExited(false) { }
+
+    bool IsEmpty() const
+    {
+        return nReadPos.load(std::memory_order_acquire) == nWritePos.load(std::memory_order_acquire);
+    }
+
+    // Producer side, fails if there isn't room for all of it
+    bool Write(const char* pch, unsigned int nSize)
+    {
+        unsigned int nWrite = nWritePos.load(std::memory_order_relaxed);
+        unsigned int nRead = nReadPos.load(std::memory_order_acquire);
+        if (DEBUGLOG_RING_SIZE - (nWrite - nRead) < nSize)
+            return false;
+        unsigned int nStart = nWrite % DEBUGLOG_RING_SIZE;
+        unsigned int nFirst = min(nSize, DEBUGLOG_RING_SIZE - nStart);
+        memcpy(pchBuffer + nStart, pch, nFirst);
+        memcpy(pchBuffer, pch + nFirst, nSize - nFirst);
+        nWritePos.store(nWrite + nSize, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side, under cs_debuglog
+    unsigned int Drain(FILE* fileout)
+    {
+        unsigned int nRead = nReadPos.load(std::memory_order_relaxed);
+        unsigned int nWrite = nWritePos.load(std::memory_order_acquire);
+        unsigned int nSize = nWrite - nRead;
+        unsigned int nStart = nRead % DEBUGLOG_RING_SIZE;
+        unsigned int nFirst = min(nSize, DEBUGLOG_RING_SIZE - nStart);
+        if (fileout)
+        {
+            fwrite(pchBuffer + nStart, 1, nFirst, fileout);
+            fwrite(pchBuffer, 1, nSize - nFirst, fileout);
+        }
+        nReadPos.store(nWrite, std::memory_order_release);
+        return nSize;
+    }
+};
+
+class CDebugLog
+{
+public:
+    CCriticalSection cs_vRings;
+    vector<CDebugLogRing*> vRings;
+    vector<CDebugLogRing*> vTraceRings;
+    CCriticalSection cs_debuglog;
+    FILE* fileout;
+    FILE* filetrace;
+    bool fWriterStarted;
+    unsigned int nNextThread;
+
+    CDebugLog()
+    {
+        fileout = NULL;
+        filetrace = NULL;
+        fWriterStarted = false;
+        nNextThread = 0;
+    }
+};
+
+// Never destroyed, threads can still be logging while the process exits
+static CDebugLog* GetDebugLog()
+{
+    static CDebugLog* pdebuglog = new CDebugLog();
+    return pdebuglog;
+}
+
+// Marks the thread's buffer for the writer to free once it's empty
+class CDebugLogThreadRing
+{
+public:
+    CDebugLogRing* pring;
+    CDebugLogRing* ptracering;
+    unsigned int nThread;
+    CDebugLogThreadRing() { pring = NULL; ptracering = NULL; nThread = 0; }
+    ~CDebugLogThreadRing()
+    {
+        if (pring)
+            pring->fThreadExited = true;
+        if (ptracering)
+            ptracering->fThreadExited = true;
+    }
+};
+static thread_local CDebugLogThreadRing debugLogThreadRing;
+
+static void ThreadDebugLogWriter(void* parg);
+
+// Whatever is still in the buffers is the most useful part of the log
+static std::terminate_handler pfnTerminatePrev = NULL;
+static void DebugLogTerminate()
+{
+    FlushDebugLog();
+    if (pfnTerminatePrev)
+        pfnTerminatePrev();
+    abort();
+}
+
+static CDebugLogRing* GetThreadDebugLogRing(bool fTraceRing=false)
+{
+    CDebugLogRing*& pringRet = (fTraceRing ? debugLogThreadRing.ptracering : debugLogThreadRing.pring);
+    if (pringRet == NULL)
+    {
+        CDebugLog* pdebuglog = GetDebugLog();
+        CDebugLogRing* pring = new CDebugLogRing();
+        bool fStartWriter = false;
+        CRITICAL_BLOCK(pdebuglog->cs_vRings)
+        {
+            (fTraceRing ? pdebuglog->vTraceRings : pdebuglog->vRings).push_back(pring);
+            if (debugLogThreadRing.nThread == 0)
+                debugLogThreadRing.nThread = ++pdebuglog->nNextThread;
+            fStartWriter = !pdebuglog->fWriterStarted;
+            pdebuglog->fWriterStarted = true;
+        }
+        pringRet = pring;
+        if (fStartWriter)
+        {
+            pfnTerminatePrev = std::set_terminate(DebugLogTerminate);
+            CreateThread(ThreadDebugLogWriter, NULL);
+        }
+    }
+    return pringRet;
+}
+
+// Caller holds cs_debuglog
+static unsigned int DrainDebugLogRings(vector<CDebugLogRing*>& vRingsIn, FILE* fileout)
+{
+    CDebugLog* pdebuglog = GetDebugLog();
+    unsigned int nTotal = 0;
+    vector<CDebugLogRing*> vRings;
+    CRITICAL_BLOCK(pdebuglog->cs_vRings)
+        vRings = vRingsIn;
+    foreach(CDebugLogRing* pring, vRings)
+    {
+        // Read the flag first, anything written before the thread exited
+        // is then drained below
+        bool fExited = pring->fThreadExited;
+        nTotal += pring->Drain(fileout);
+        if (fExited)
+        {
+            CRITICAL_BLOCK(pdebuglog->cs_vRings)
+                vRingsIn.erase(find(vRingsIn.begin(), vRingsIn.end(), pring));
+            delete pring;
+        }
+    }
+    return nTotal;
+}
+
+static unsigned int DrainDebugLog()
+{
+    CDebugLog* pdebuglog = GetDebugLog();
+    unsigned int nTotal = 0;
+    unsigned int nTraced = 0;
+    CRITICAL_BLOCK(pdebuglog->cs_debuglog)
+    {
+        if (!pdebuglog->fileout)
+        {
+            char pszFile[MAX_PATH+100];
+            GetDataDir(pszFile);
+            strlcat(pszFile, "/debug.log", sizeof(pszFile));
+            pdebuglog->fileout = fopen(pszFile, "a");
+        }
+
+        nTraced = DrainDebugLogRings(pdebuglog->vTraceRings, pdebuglog->filetrace);
+        if (pdebuglog->filetrace && nTraced > 0)
+            fflush(pdebuglog->filetrace);
+
+        nTotal = DrainDebugLogRings(pdebuglog->vRings, pdebuglog->fileout);
+        if (pdebuglog->fileout && nTotal > 0)
+        {
+            fflush(pdebuglog->fileout);
+
+            // Start a new file when it gets too big, keeping one old one
+            if (ftell(pdebuglog->fileout) > DEBUGLOG_MAX_SIZE)
+            {
+                string strFile = GetDataDir() + "/debug.log";
+                string strOld = strFile + ".1";
+                fclose(pdebuglog->fileout);
+                unlink(strOld.c_str());
+                rename(strFile.c_str(), strOld.c_str());
+                pdebuglog->fileout = fopen(strFile.c_str(), "a");
+            }
+        }
+    }
+    return nTotal + nTraced;
+}
+
+static void ThreadDebugLogWriter(void* parg)
+{
+    loop
+    {
+        if (DrainDebugLog() == 0)
+            Sleep(10);
+    }
+}
+
+void FlushDebugLog()
+{
+    DrainDebugLog();
+}
+
+static void WriteDebugLog(const char* pch, unsigned int nSize)
+{
+    CDebugLogRing* pring = GetThreadDebugLogRing();
+
+    // Too big to ever fit goes straight to the file
+    if (nSize > DEBUGLOG_RING_SIZE)
+    {
+        CDebugLog* pdebuglog = GetDebugLog();
+        DrainDebugLog();
+        CRITICAL_BLOCK(pdebuglog->cs_debuglog)
+            if (pdebuglog->fileout)
+                fwrite(pch, 1, nSize, pdebuglog->fileout);
+        return;
+    }
+
+    // Full, empty it ourselves rather than wait for the writer
+    while (!pring->Write(pch, nSize))
+        DrainDebugLog();
+}
+
+//
+// Event trace
+//
+// With -trace, TraceEvent appends fixed size binary records to trace.dat
+// through the same per-thread buffers and writer thread as debug.log, so
+// recording an event is a couple of stores and never formats anything.
+// tracetojson.py converts the file to Chrome trace JSON for chrome://tracing
+// or Perfetto.
+//
+// trace.dat is the 8 byte magic "POPTRACE", a 4 byte version, then records:
+//   int64          nTime     microseconds since the epoch
+//   uint64         nId       top 64 bits of the hash, or the message command
+//   unsigned int   nThread   small id per thread
+//   unsigned int   nArg      height, size or other event specific value
+//   unsigned short nEvent    TRACE_*
+//   char           chPhase   'B' begin, 'E' end, 'i' instant
+//   char           pad[5]
+//
+
+static const char pchTraceMagic[8] = { 'P', 'O', 'P', 'T', 'R', 'A', 'C', 'E' };
+static const unsigned int TRACE_VERSION = 1;
+
+#pragma pack(push, 1)
+struct CTraceRecord
+{
+    int64 nTime;
+    uint64 nId;
+    unsigned int nThread;
+    unsigned int nArg;
+    unsigned short nEvent;
+    char chPhase;
+    char pad[5];
+};
+#pragma pack(pop)
+
+bool OpenTraceFile()
+{
+    CDebugLog* pdebuglog = GetDebugLog();
+    CRITICAL_BLOCK(pdebuglog->cs_debuglog)
+    {
+        if (pdebuglog->filetrace)
+            return true;
+        string strFile = GetDataDir() + "/trace.dat";
+        pdebuglog->filetrace = fopen(strFile.c_str(), "wb");
+        if (!pdebuglog->filetrace)
+            return error("OpenTraceFile() : can't open %s", strFile.c_str());
+        fwrite(pchTraceMagic, 1, sizeof(pchTraceMagic), pdebuglog->filetrace);
+        fwrite(&TRACE_VERSION, 1, sizeof(TRACE_VERSION), pdebuglog->filetrace);
+    }
+    fTrace = true;
+    return true;
+}
+
+void TraceEventId(int nEvent, char chPhase, uint64 nId, unsigned int nArg)
+{
+    CDebugLogRing* pring = GetThreadDebugLogRing(true);
+    CTraceRecord rec;
+    rec.nTime = GetTimeMicros();
+    rec.nId = nId;
+    rec.nThread = debugLogThreadRing.nThread;
+    rec.nArg = nArg;
+    rec.nEvent = nEvent;
+    rec.chPhase = chPhase;
+    memset(rec.pad, 0, sizeof(rec.pad));
+    while (!pring->Write((const char*)&rec, sizeof(rec)))
+        DrainDebugLog();
+}
+
+void TraceEvent(int nEvent, char chPhase, const uint256& hash, unsigned int nArg)
+{
+    // The top bytes, so the id matches the start of hash.GetHex()
+    uint64 nId;
+    memcpy(&nId, (const unsigned char*)hash.begin() + 24, sizeof(nId));
+    TraceEventId(nEvent, chPhase, nId, nArg);
+}
+
+void TraceEvent(int nEvent, char chPhase, const char* pszCommand, unsigned int nArg)
+{
+    // Up to the first 8 characters of the command, zero padded
+    uint64 nId = 0;
+    strncpy((char*)&nId, pszCommand, sizeof(nId));
+    TraceEventId(nEvent, chPhase, nId, nArg);
+}
+
+static int VOutputDebugString(int nLevel, const char* pszFormat, va_list arg_ptrIn)
 {
     int ret = 0;
+    va_list arg_ptr;
     if (fPrintToConsole || wxTheApp == NULL)
     {
         // print to console
-        va_list arg_ptr;
-        va_start(arg_ptr, pszFormat);
+        va_copy(arg_ptr, arg_ptrIn);
         ret = vprintf(pszFormat, arg_ptr);
         va_end(arg_ptr);
+        if (nLevel <= LOGLEVEL_ERROR)
+            fflush(stdout);
     }
     else
     {
         // print to debug.log
-        char pszFile[MAX_PATH+100];
-        GetDataDir(pszFile);
-        strlcat(pszFile, "/debug.log", sizeof(pszFile));
-        FILE* fileout = fopen(pszFile, "a");
-        if (fileout)
+        char pszBuffer[4096];
+        va_copy(arg_ptr, arg_ptrIn);
+        ret = _vsnprintf(pszBuffer, sizeof(pszBuffer), pszFormat, arg_ptr);
+        va_end(arg_ptr);
+        if (ret >= 0 && ret < (int)sizeof(pszBuffer))
         {
-            //// Debug print useful for profiling
-            //fprintf(fileout, " %"PRI64d" ", GetTimeMillis());
-            va_list arg_ptr;
-            va_start(arg_ptr, pszFormat);
-            ret = vfprintf(fileout, pszFormat, arg_ptr);
+            WriteDebugLog(pszBuffer, ret);
+        }
+        else if (ret > 0)
+        {
+            vector<char> vch(ret + 1);
+            va_copy(arg_ptr, arg_ptrIn);
+            ret = _vsnprintf(&vch[0], vch.size(), pszFormat, arg_ptr);
             va_end(arg_ptr);
-            fclose(fileout);
+            if (ret > 0)
+                WriteDebugLog(&vch[0], min(ret, (int)vch.size() - 1));
         }
     }
 
@@ -172,8 +682,7 @@ inline int OutputDebugStringF(const char* pszFormat, ...)
             static char* pend;
             if (pend == NULL)
                 pend = pszBuffer;
-            va_list arg_ptr;
-            va_start(arg_ptr, pszFormat);
+            va_copy(arg_ptr, arg_ptrIn);
             int limit = END(pszBuffer) - pend - 2;
             int ret = _vsnprintf(pend, limit, pszFormat, arg_ptr);
             va_end(arg_ptr);
@@ -205,6 +714,27 @@ inline int OutputDebugStringF(const char* pszFormat, ...)
     return ret;
 }
 
+int OutputDebugStringF(const char* pszFormat, ...)
+{
+    // Plain printf is info level
+    if (nLogLevel < LOGLEVEL_INFO)
+        return 0;
+    va_list arg_ptr;
+    va_start(arg_ptr, pszFormat);
+    int ret = VOutputDebugString(LOGLEVEL_INFO, pszFormat, arg_ptr);
+    va_end(arg_ptr);
+    return ret;
+}
+
+int OutputDebugStringLevel(int nLevel, const char* pszFormat, ...)
+{
+    va_list arg_ptr;
+    va_start(arg_ptr, pszFormat);
+    int ret = VOutputDebugString(nLevel, pszFormat, arg_ptr);
+    va_end(arg_ptr);
+    return ret;
+}
+
 
 // Safer snprintf
 //  - prints up to limit-1 characters
@@ -268,7 +798,7 @@ bool error(const char* format, ...)
         ret = limit - 1;
         buffer[limit-1] = 0;
     }
-    printf("ERROR: %s\n", buffer);
+    OutputDebugStringLevel(LOGLEVEL_ERROR, "ERROR: %s\n", buffer);
     return false;
 }
 
@@ -499,14 +1029,22 @@ void LogException(std::exception* pex, const char* pszThread)
 {
     char pszMessage[1000];
     FormatException(pszMessage, pex, pszThread);
-    printf("\n%s", pszMessage);
+    OutputDebugStringLevel(LOGLEVEL_ERROR, "\n%s", pszMessage);
+}
+
+void PrintExceptionContinue(std::exception* pex, const char* pszThread)
+{
+    char pszMessage[1000];
+    FormatException(pszMessage, pex, pszThread);
+    OutputDebugStringLevel(LOGLEVEL_ERROR, "\n\n************************\n%s\n", pszMessage);
+    fprintf(stderr, "\n\n************************\n%s\n", pszMessage);
 }
 
 void PrintException(std::exception* pex, const char* pszThread)
 {
     char pszMessage[1000];
     FormatException(pszMessage, pex, pszThread);
-    printf("\n\n************************\n%s\n", pszMessage);
+    OutputDebugStringLevel(LOGLEVEL_ERROR, "\n\n************************\n%s\n", pszMessage);
     fprintf(stderr, "\n\n************************\n%s\n", pszMessage);
     if (wxTheApp && !fDaemon && fGUI)
         MyMessageBox(pszMessage, "Error", wxOK | wxICON_ERROR);
@@ -713,3 +1251,470 @@ void AddTimeData(unsigned int ip, int64 nTime)
         printf("|  nTimeOffset = %+"PRI64d"  (%+"PRI64d" minutes)\n", nTimeOffset, nTimeOffset/60);
     }
 }
+
+
+
+
+
+
+
+
+
+
+//
+// Thread pool
+//
+
+// The pool and worker the current thread belongs to, if any
+static thread_local CThreadPool* pCurrentPool = NULL;
+static thread_local int nCurrentWorker = -1;
+
+CThreadPool::CThreadPool(int nThreads) : nPending(0), nNextWorker(0)
+{
+    fStopping = false;
+    nThreads = max(1, nThreads);
+    for (int i = 0; i < nThreads; i++)
+        vWorkers.push_back(new CWorker());
+    for (int i = 0; i < nThreads; i++)
+        vThreads.push_back(std::thread(&CThreadPool::WorkerThread, this, i));
+    vThreads.push_back(std::thread(&CThreadPool::TimerThread, this));
+}
+
+CThreadPool::~CThreadPool()
+{
+    Stop();
+    foreach(CWorker* pworker, vWorkers)
+        delete pworker;
+}
+
+void CThreadPool::Stop()
+{
+    {
+        std::lock_guard<std::mutex> lockSleep(mutexSleep);
+        std::lock_guard<std::mutex> lockTimers(mutexTimers);
+        if (fStopping)
+            return;
+        fStopping = true;
+    }
+    condSleep.notify_all();
+    condTimers.notify_all();
+    foreach(std::thread& thread, vThreads)
+        if (thread.joinable() && thread.get_id() != std::this_thread::get_id())
+            thread.join();
+}
+
+void CThreadPool::Submit(const boost::function<void()>& task, int nPriority)
+{
+    nPriority = min(max(nPriority, (int)TASK_HIGH), (int)TASK_LOW);
+    int nWorker = (pCurrentPool == this ? nCurrentWorker : (int)(nNextWorker++ % vWorkers.size()));
+    CWorker* pworker = vWorkers[nWorker];
+    {
+        std::lock_guard<std::mutex> lock(pworker->mutex);
+        pworker->vqueue[nPriority].push_back(task);
+        nPending++;
+    }
+    {
+        // Taking the lock means a worker about to sleep sees nPending first
+        std::lock_guard<std::mutex> lock(mutexSleep);
+    }
+    condSleep.notify_one();
+}
+
+void CThreadPool::SubmitAfter(int64 nMillis, const boost::function<void()>& task, int nPriority)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutexTimers);
+        mapTimers.insert(make_pair(GetTimeMillis() + nMillis, make_pair(task, nPriority)));
+    }
+    condTimers.notify_one();
+}
+
+bool CThreadPool::PopTask(int nWorker, boost::function<void()>& taskRet)
+{
+    int nWorkers = vWorkers.size();
+    for (int nPriority = TASK_HIGH; nPriority < TASK_PRIORITIES; nPriority++)
+    {
+        // Our own newest first, then the oldest of everyone else's
+        for (int i = 0; i < nWorkers; i++)
+        {
+            CWorker* pworker = vWorkers[(nWorker + i) % nWorkers];
+            std::lock_guard<std::mutex> lock(pworker->mutex);
+            deque<boost::function<void()> >& queue = pworker->vqueue[nPriority];
+            if (queue.empty())
+                continue;
+            if (i == 0)
+            {
+                taskRet.swap(queue.back());
+                queue.pop_back();
+            }
+            else
+            {
+                taskRet.swap(queue.front());
+                queue.pop_front();
+            }
+            nPending--;
+            return true;
+        }
+    }
+    return false;
+}
+
+void CThreadPool::WorkerThread(int nWorker)
+{
+    pCurrentPool = this;
+    nCurrentWorker = nWorker;
+    boost::function<void()> task;
+    loop
+    {
+        if (PopTask(nWorker, task))
+        {
+            try
+            {
+                task();
+            }
+            catch (std::exception& e) {
+                PrintExceptionContinue(&e, "CThreadPool");
+            } catch (...) {
+                PrintExceptionContinue(NULL, "CThreadPool");
+            }
+            task.clear();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(mutexSleep);
+        if (fStopping)
+            return;
+        if (nPending == 0)
+            condSleep.wait(lock);
+    }
+}
+
+void CThreadPool::TimerThread()
+{
+    std::unique_lock<std::mutex> lock(mutexTimers);
+    while (!fStopping)
+    {
+        if (mapTimers.empty())
+        {
+            condTimers.wait(lock);
+            continue;
+        }
+        int64 nWait = (*mapTimers.begin()).first - GetTimeMillis();
+        if (nWait > 0)
+        {
+            condTimers.wait_for(lock, std::chrono::milliseconds(nWait));
+            continue;
+        }
+        pair<boost::function<void()>, int> item = (*mapTimers.begin()).second;
+        mapTimers.erase(mapTimers.begin());
+        lock.unlock();
+        Submit(item.first, item.second);
+        lock.lock();
+    }
+}
+
+// Never destroyed, jobs can still be running while the process exits
+CThreadPool& GetThreadPool()
+{
+    static CThreadPool* ppool = new CThreadPool(std::thread::hardware_concurrency());
+    return *ppool;
+}
+
+bool CTaskGroup::RunOne(const std::shared_ptr<CState>& pstate)
+{
+    boost::function<void()> task;
+    {
+        std::lock_guard<std::mutex> lock(pstate->mutex);
+        if (pstate->queue.empty())
+            return false;
+        task.swap(pstate->queue.front());
+        pstate->queue.pop_front();
+        pstate->nRunning++;
+    }
+    try
+    {
+        task();
+    }
+    catch (std::exception& e) {
+        PrintExceptionContinue(&e, "CTaskGroup");
+    } catch (...) {
+        PrintExceptionContinue(NULL, "CTaskGroup");
+    }
+    {
+        std::lock_guard<std::mutex> lock(pstate->mutex);
+        pstate->nRunning--;
+        if (pstate->queue.empty() && pstate->nRunning == 0)
+            pstate->cond.notify_all();
+    }
+    return true;
+}
+
+void CTaskGroup::Run(const boost::function<void()>& task)
+{
+    {
+        std::lock_guard<std::mutex> lock(pstate->mutex);
+        pstate->queue.push_back(task);
+    }
+
+    // Whoever gets there first runs the next job, a worker or Wait.  The
+    // worker's copy of pstate keeps it alive if the group is gone by then.
+    std::shared_ptr<CState> pstateCopy = pstate;
+    pool.Submit([pstateCopy]() { RunOne(pstateCopy); }, nPriority);
+}
+
+void CTaskGroup::Wait()
+{
+    while (RunOne(pstate))
+        ;
+    std::unique_lock<std::mutex> lock(pstate->mutex);
+    while (!pstate->queue.empty() || pstate->nRunning > 0)
+        pstate->cond.wait(lock);
+}
+
+
+
+
+
+
+
+
+
+
+//
+// Periodic jobs
+//
+
+static std::mutex mutexScheduledTasks;
+static map<string, CScheduledTask> mapScheduledTasks;
+
+static void RunScheduledTask(string strName);
+
+static void SubmitScheduledTask(CScheduledTask& task, int64 nDelay=-1)
+{
+    if (nDelay < 0)
+        nDelay = task.nInterval + (task.nJitter > 0 ? GetRand(task.nJitter) : 0);
+    task.nNextStart = GetTimeMillis() + nDelay;
+    GetThreadPool().SubmitAfter(nDelay, boost::bind(RunScheduledTask, task.strName), task.nPriority);
+}
+
+static void RunScheduledTask(string strName)
+{
+    if (fShutdown)
+        return;
+
+    boost::function<void()> fn;
+    {
+        std::lock_guard<std::mutex> lock(mutexScheduledTasks);
+        CScheduledTask& task = mapScheduledTasks[strName];
+        task.fRunning = true;
+        task.nLastStart = GetTimeMillis();
+        fn = task.fn;
+    }
+
+    int64 nStart = GetTimeMillis();
+    try
+    {
+        fn();
+    }
+    catch (std::exception& e) {
+        PrintExceptionContinue(&e, strName.c_str());
+    } catch (...) {
+        PrintExceptionContinue(NULL, strName.c_str());
+    }
+    int64 nTime = GetTimeMillis() - nStart;
+
+    std::lock_guard<std::mutex> lock(mutexScheduledTasks);
+    CScheduledTask& task = mapScheduledTasks[strName];
+    task.fRunning = false;
+    task.nRuns++;
+    task.nTotalTime += nTime;
+    task.nMaxTime = max(task.nMaxTime, nTime);
+    task.nLastTime = nTime;
+    if (task.nMaxRuntime > 0 && nTime > task.nMaxRuntime)
+    {
+        task.nOverruns++;
+        printf("RunScheduledTask() : %s took %"PRI64d"ms, limit %"PRI64d"ms\n", strName.c_str(), nTime, task.nMaxRuntime);
+    }
+    SubmitScheduledTask(task);
+}
+
+void ScheduleTask(const string& strName, const boost::function<void()>& fn, int64 nInterval, int64 nJitter, int64 nMaxRuntime, int64 nFirstDelay, int nPriority)
+{
+    std::lock_guard<std::mutex> lock(mutexScheduledTasks);
+    if (mapScheduledTasks.count(strName))
+        return;
+    CScheduledTask& task = mapScheduledTasks[strName];
+    task.strName = strName;
+    task.fn = fn;
+    task.nInterval = nInterval;
+    task.nJitter = nJitter;
+    task.nMaxRuntime = nMaxRuntime;
+    task.nPriority = nPriority;
+    SubmitScheduledTask(task, nFirstDelay);
+}
+
+void GetScheduledTasks(vector<CScheduledTask>& vTasksRet)
+{
+    std::lock_guard<std::mutex> lock(mutexScheduledTasks);
+    vTasksRet.clear();
+    for (map<string, CScheduledTask>::iterator mi = mapScheduledTasks.begin(); mi != mapScheduledTasks.end(); ++mi)
+        vTasksRet.push_back((*mi).second);
+}
+
+
+
+
+
+
+
+
+
+//
+// Metrics
+//
+
+// 100us to 10s
+const int64 CMetricHistogram::pnBucketBound[CMetricHistogram::BUCKETS] =
+{
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+    100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000,
+};
+
+string CMetric::Series(const string& strSuffix, const string& strExtraLabel) const
+{
+    string str = strName + strSuffix;
+    if (!strLabels.empty() || !strExtraLabel.empty())
+    {
+        str += "{" + strLabels;
+        if (!strLabels.empty() && !strExtraLabel.empty())
+            str += ",";
+        str += strExtraLabel + "}";
+    }
+    return str;
+}
+
+void CMetricCounter::Write(string& str) const
+{
+    str += strprintf("%s %"PRI64d"\n", Series().c_str(), Get());
+}
+
+void CMetricGauge::Write(string& str) const
+{
+    str += strprintf("%s %"PRI64d"\n", Series().c_str(), Get());
+}
+
+// Microseconds as seconds.  Formatted from integers since printf's %f and
+// %g use the locale's decimal point, and Prometheus wants a '.'.
+static string FormatMetricSeconds(int64 nMicros, bool fTrim)
+{
+    string str = strprintf("%"PRI64d".%06"PRI64d, nMicros / 1000000, nMicros % 1000000);
+    if (fTrim)
+    {
+        str.erase(str.find_last_not_of('0') + 1);
+        if (str[str.size()-1] == '.')
+            str.erase(str.size()-1);
+    }
+    return str;
+}
+
+void CMetricHistogram::Write(string& str) const
+{
+    // Buckets are kept separately and reported cumulative
+    int64 nTotal = 0;
+    for (int i = 0; i < BUCKETS; i++)
+    {
+        nTotal += vnBucket[i].load(std::memory_order_relaxed);
+        str += strprintf("%s %"PRI64d"\n", Series("_bucket", "le=\"" + FormatMetricSeconds(pnBucketBound[i], true) + "\"").c_str(), nTotal);
+    }
+    nTotal += vnBucket[BUCKETS].load(std::memory_order_relaxed);
+    str += strprintf("%s %"PRI64d"\n", Series("_bucket", "le=\"+Inf\"").c_str(), nTotal);
+    str += strprintf("%s %s\n", Series("_sum").c_str(), FormatMetricSeconds(nSum.load(std::memory_order_relaxed), false).c_str());
+    str += strprintf("%s %"PRI64d"\n", Series("_count").c_str(), nTotal);
+}
+
+// Never destroyed, metrics are registered from static initializers and
+// may be updated by threads still running at exit
+static std::mutex& GetMetricsMutex()
+{
+    static std::mutex* pmutex = new std::mutex();
+    return *pmutex;
+}
+
+static multimap<string, CMetric*>& GetMetricsMap()
+{
+    static multimap<string, CMetric*>* pmap = new multimap<string, CMetric*>();
+    return *pmap;
+}
+
+template<typename T>
+static T* FindMetric(const string& strName, const string& strLabels)
+{
+    multimap<string, CMetric*>& mapMetrics = GetMetricsMap();
+    for (multimap<string, CMetric*>::iterator mi = mapMetrics.lower_bound(strName); mi != mapMetrics.upper_bound(strName); ++mi)
+        if ((*mi).second->strLabels == strLabels)
+            return dynamic_cast<T*>((*mi).second);
+    return NULL;
+}
+
+CMetricCounter& GetMetricCounter(const string& strName, const string& strHelp, const string& strLabels, const boost::function<int64()>& fnValue)
+{
+    std::lock_guard<std::mutex> lock(GetMetricsMutex());
+    CMetricCounter* pmetric = FindMetric<CMetricCounter>(strName, strLabels);
+    if (pmetric == NULL)
+    {
+        pmetric = new CMetricCounter(strName, strLabels, strHelp, fnValue);
+        GetMetricsMap().insert(make_pair(strName, pmetric));
+    }
+    return *pmetric;
+}
+
+CMetricGauge& GetMetricGauge(const string& strName, const string& strHelp, const string& strLabels, const boost::function<int64()>& fnValue)
+{
+    std::lock_guard<std::mutex> lock(GetMetricsMutex());
+    CMetricGauge* pmetric = FindMetric<CMetricGauge>(strName, strLabels);
+    if (pmetric == NULL)
+    {
+        pmetric = new CMetricGauge(strName, strLabels, strHelp, fnValue);
+        GetMetricsMap().insert(make_pair(strName, pmetric));
+    }
+    return *pmetric;
+}
+
+CMetricHistogram& GetMetricHistogram(const string& strName, const string& strHelp, const string& strLabels)
+{
+    std::lock_guard<std::mutex> lock(GetMetricsMutex());
+    CMetricHistogram* pmetric = FindMetric<CMetricHistogram>(strName, strLabels);
+    if (pmetric == NULL)
+    {
+        pmetric = new CMetricHistogram(strName, strLabels, strHelp);
+        GetMetricsMap().insert(make_pair(strName, pmetric));
+    }
+    return *pmetric;
+}
+
+// Prometheus text exposition format
+string GetMetricsText()
+{
+    // Copy the list so the value functions run without the registry locked
+    vector<CMetric*> vMetrics;
+    {
+        std::lock_guard<std::mutex> lock(GetMetricsMutex());
+        multimap<string, CMetric*>& mapMetrics = GetMetricsMap();
+        for (multimap<string, CMetric*>::iterator mi = mapMetrics.begin(); mi != mapMetrics.end(); ++mi)
+            vMetrics.push_back((*mi).second);
+    }
+
+    string str;
+    string strLastName;
+    foreach(CMetric* pmetric, vMetrics)
+    {
+        if (pmetric->strName != strLastName)
+        {
+            str += strprintf("# HELP %s %s\n", pmetric->strName.c_str(), pmetric->strHelp.c_str());
+            str += strprintf("# TYPE %s %s\n", pmetric->strName.c_str(), pmetric->GetType());
+            strLastName = pmetric->strName;
+        }
+        pmetric->Write(str);
+    }
+    return str;
+}
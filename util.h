@@ -26,6 +26,92 @@ typedef unsigned long long  uint64;
 #define ARRAYLEN(array)     (sizeof(array)/sizeof((array)[0]))
 #define printf              OutputDebugStringF
 
+// Debug categories, enabled with -debug=<category>
+enum
+{
+    LOG_NET     = (1U << 0),
+    LOG_RPC     = (1U << 1),
+    LOG_WALLET  = (1U << 2),
+    LOG_POP     = (1U << 3),
+    LOG_ALL     = ~0U,
+};
+
+// Log levels, -loglevel=<level> keeps that level and the more severe ones.
+// Plain printf is info level, error() and exceptions are error level.
+// What's still buffered is written out on shutdown and by the terminate
+// handler, nothing waits for the disk on the way.
+enum
+{
+    LOGLEVEL_ERROR,
+    LOGLEVEL_WARNING,
+    LOGLEVEL_INFO,
+    LOGLEVEL_DEBUG,
+};
+
+// Both check before formatting anything.  Category messages are debug level,
+// off unless -debug=<category> or -loglevel=debug, so the chatty ones cost a
+// test and a branch by default.  Warnings go through LogPrintLevel.
+#define LogPrint(category, ...) (((nLogCategories & (category)) || nLogLevel >= LOGLEVEL_DEBUG) ? OutputDebugStringLevel(LOGLEVEL_DEBUG, __VA_ARGS__) : 0)
+#define LogPrintLevel(level, ...) ((nLogLevel >= (level)) ? OutputDebugStringLevel((level), __VA_ARGS__) : 0)
+
+// Event types for -trace, keep tracetojson.py in sync
+enum
+{
+    TRACE_BLOCK_RECEIVED = 1,
+    TRACE_BLOCK_CHECK,
+    TRACE_BLOCK_ACCEPT,
+    TRACE_BLOCK_CONNECT,
+    TRACE_TX_ACCEPT,
+    TRACE_LOTTERY,
+    TRACE_MSG_IN,
+    TRACE_MSG_OUT,
+};
+
+// Only evaluates its arguments when tracing is on
+#define TRACE(...) (fTrace ? TraceEvent(__VA_ARGS__) : (void)0)
+
+// Begin and end events around a scope, for functions with many returns
+class CTraceScope
+{
+protected:
+    int nEvent;
+    uint64 nId;
+    unsigned int nArg;
+    bool fActive;
+
+public:
+    CTraceScope(int nEventIn, const uint256& hash, unsigned int nArgIn=0)
+    {
+        nEvent = nEventIn;
+        nArg = nArgIn;
+        fActive = fTrace;
+        if (fActive)
+        {
+            memcpy(&nId, (const unsigned char*)hash.begin() + 24, sizeof(nId));
+            TraceEventId(nEvent, 'B', nId, nArg);
+        }
+    }
+
+    CTraceScope(int nEventIn, const char* pszCommand, unsigned int nArgIn=0)
+    {
+        nEvent = nEventIn;
+        nArg = nArgIn;
+        fActive = fTrace;
+        if (fActive)
+        {
+            nId = 0;
+            strncpy((char*)&nId, pszCommand, sizeof(nId));
+            TraceEventId(nEvent, 'B', nId, nArg);
+        }
+    }
+
+    ~CTraceScope()
+    {
+        if (fActive)
+            TraceEventId(nEvent, 'E', nId, nArg);
+    }
+};
+
 #ifdef snprintf
 #undef snprintf
 #endif
@@ -118,6 +204,10 @@ extern map<string, vector<string> > mapMultiArgs;
 extern bool fDebug;
 extern bool fPrintToConsole;
 extern bool fPrintToDebugger;
+extern unsigned int nLogCategories;
+extern int nLogLevel;
+extern bool fTrace;
+extern bool fLockStats;
 extern char pszSetDataDir[MAX_PATH];
 extern bool fShutdown;
 extern bool fDaemon;
@@ -126,10 +216,17 @@ extern bool fCommandLine;
 void RandAddSeed();
 void RandAddSeedPerfmon();
 int OutputDebugStringF(const char* pszFormat, ...);
+int OutputDebugStringLevel(int nLevel, const char* pszFormat, ...);
+void FlushDebugLog();
+bool OpenTraceFile();
+void TraceEventId(int nEvent, char chPhase, uint64 nId, unsigned int nArg=0);
+void TraceEvent(int nEvent, char chPhase, const uint256& hash, unsigned int nArg=0);
+void TraceEvent(int nEvent, char chPhase, const char* pszCommand, unsigned int nArg=0);
 int my_snprintf(char* buffer, size_t limit, const char* format, ...);
 string strprintf(const char* format, ...);
 bool error(const char* format, ...);
 void PrintException(std::exception* pex, const char* pszThread);
+void PrintExceptionContinue(std::exception* pex, const char* pszThread);
 void LogException(std::exception* pex, const char* pszThread);
 void ParseString(const string& str, char c, vector<string>& v);
 string FormatMoney(int64 n, bool fPlus=false);
@@ -191,14 +288,96 @@ public:
     int nLine;
 };
 
+//
+// Lock profiling
+//
+// With -lockstats every CRITICAL_BLOCK and TRY_CRITICAL_BLOCK records how long
+// it waited for the lock and how long it held it, per lock name and per call
+// site, and acquiring two locks in both orders is reported as an inversion.
+// Without it the only cost is testing fLockStats.
+//
+static const int LOCKSTATS_BUCKETS = 24;
+
+class CLockTimes
+{
+public:
+    int64 nCount;
+    int64 nTotal;
+    int64 nMax;
+    int64 vnBucket[LOCKSTATS_BUCKETS]; // vnBucket[i] counts times under 2^i microseconds
+
+    CLockTimes()
+    {
+        nCount = 0;
+        nTotal = 0;
+        nMax = 0;
+        memset(vnBucket, 0, sizeof(vnBucket));
+    }
+
+    void Add(int64 nMicros)
+    {
+        nCount++;
+        nTotal += nMicros;
+        nMax = max(nMax, nMicros);
+        int i = 0;
+        while (i < LOCKSTATS_BUCKETS-1 && nMicros >= ((int64)1 << i))
+            i++;
+        vnBucket[i]++;
+    }
+};
+
+class CLockSiteStats
+{
+public:
+    int64 nAcquired;
+    int64 nContended;
+    int64 nTryFailed;
+    CLockTimes wait;
+    CLockTimes hold;
+
+    CLockSiteStats()
+    {
+        nAcquired = 0;
+        nContended = 0;
+        nTryFailed = 0;
+    }
+};
+
+class CLockStats : public CLockSiteStats
+{
+public:
+    map<string, CLockSiteStats> mapSites; // by "file:line"
+};
+
+void EnterCriticalSectionProfiled(CCriticalSection& cs, const char* pszName, const char* pszFile, int nLine);
+bool TryEnterCriticalSectionProfiled(CCriticalSection& cs, const char* pszName, const char* pszFile, int nLine);
+void LeaveCriticalSectionProfiled(CCriticalSection& cs);
+void GetLockStats(map<string, CLockStats>& mapStatsRet, vector<string>& vInversionsRet);
+void ResetLockStats();
+
 // Automatically leave critical section when leaving block, needed for exception safety
 class CCriticalBlock
 {
 protected:
     CCriticalSection* pcs;
+    bool fProfiled;
 public:
-    CCriticalBlock(CCriticalSection& csIn) { pcs = &csIn; pcs->Enter(); }
-    ~CCriticalBlock() { pcs->Leave(); }
+    CCriticalBlock(CCriticalSection& csIn, const char* pszName="", const char* pszFile="", int nLine=0)
+    {
+        pcs = &csIn;
+        fProfiled = fLockStats;
+        if (fProfiled)
+            EnterCriticalSectionProfiled(csIn, pszName, pszFile, nLine);
+        else
+            pcs->Enter();
+    }
+    ~CCriticalBlock()
+    {
+        if (fProfiled)
+            LeaveCriticalSectionProfiled(*pcs);
+        else
+            pcs->Leave();
+    }
 };
 
 // WARNING: This will catch continue and break!
@@ -207,21 +386,37 @@ public:
 // The compiler will optimise away all this loop junk.
 #define CRITICAL_BLOCK(cs)     \
     for (bool fcriticalblockonce=true; fcriticalblockonce; assert(("break caught by CRITICAL_BLOCK!", !fcriticalblockonce)), fcriticalblockonce=false)  \
-    for (CCriticalBlock criticalblock(cs); fcriticalblockonce && (cs.pszFile=__FILE__, cs.nLine=__LINE__, true); fcriticalblockonce=false, cs.pszFile=NULL, cs.nLine=0)
+    for (CCriticalBlock criticalblock(cs, #cs, __FILE__, __LINE__); fcriticalblockonce && (cs.pszFile=__FILE__, cs.nLine=__LINE__, true); fcriticalblockonce=false, cs.pszFile=NULL, cs.nLine=0)
 
 class CTryCriticalBlock
 {
 protected:
     CCriticalSection* pcs;
+    bool fProfiled;
 public:
-    CTryCriticalBlock(CCriticalSection& csIn) { pcs = (csIn.TryEnter() ? &csIn : NULL); }
-    ~CTryCriticalBlock() { if (pcs) pcs->Leave(); }
+    CTryCriticalBlock(CCriticalSection& csIn, const char* pszName="", const char* pszFile="", int nLine=0)
+    {
+        fProfiled = fLockStats;
+        if (fProfiled)
+            pcs = (TryEnterCriticalSectionProfiled(csIn, pszName, pszFile, nLine) ? &csIn : NULL);
+        else
+            pcs = (csIn.TryEnter() ? &csIn : NULL);
+    }
+    ~CTryCriticalBlock()
+    {
+        if (!pcs)
+            return;
+        if (fProfiled)
+            LeaveCriticalSectionProfiled(*pcs);
+        else
+            pcs->Leave();
+    }
     bool Entered() { return pcs != NULL; }
 };
 
 #define TRY_CRITICAL_BLOCK(cs)     \
     for (bool fcriticalblockonce=true; fcriticalblockonce; assert(("break caught by TRY_CRITICAL_BLOCK!", !fcriticalblockonce)), fcriticalblockonce=false)  \
-    for (CTryCriticalBlock criticalblock(cs); fcriticalblockonce && (fcriticalblockonce = criticalblock.Entered()) && (cs.pszFile=__FILE__, cs.nLine=__LINE__, true); fcriticalblockonce=false, cs.pszFile=NULL, cs.nLine=0)
+    for (CTryCriticalBlock criticalblock(cs, #cs, __FILE__, __LINE__); fcriticalblockonce && (fcriticalblockonce = criticalblock.Entered()) && (cs.pszFile=__FILE__, cs.nLine=__LINE__, true); fcriticalblockonce=false, cs.pszFile=NULL, cs.nLine=0)
 
 
 
@@ -280,13 +475,20 @@ string HexStr(const T itbegin, const T itend, bool fSpaces=true)
 {
     const unsigned char* pbegin = (const unsigned char*)&itbegin[0];
     const unsigned char* pend = pbegin + (itend - itbegin) * sizeof(itbegin[0]);
+    static const char pszHex[] = "0123456789abcdef";
     string str;
+    str.reserve((pend - pbegin) * (fSpaces ? 3 : 2));
     for (const unsigned char* p = pbegin; p != pend; p++)
-        str += strprintf((fSpaces && p != pend-1 ? "%02x " : "%02x"), *p);
+    {
+        str += pszHex[*p >> 4];
+        str += pszHex[*p & 15];
+        if (fSpaces && p != pend-1)
+            str += ' ';
+    }
     return str;
 }
 
-inline string HexStr(vector<unsigned char> vch, bool fSpaces=true)
+inline string HexStr(const vector<unsigned char>& vch, bool fSpaces=true)
 {
     return HexStr(vch.begin(), vch.end(), fSpaces);
 }
@@ -332,6 +534,12 @@ inline int64 GetTimeMillis()
             posix_time::ptime(gregorian::date(1970,1,1))).total_milliseconds();
 }
 
+inline int64 GetTimeMicros()
+{
+    return (posix_time::ptime(posix_time::microsec_clock::universal_time()) -
+            posix_time::ptime(gregorian::date(1970,1,1))).total_microseconds();
+}
+
 inline string DateTimeStrFormat(const char* pszFormat, int64 nTime)
 {
     time_t n = nTime;
@@ -544,3 +752,247 @@ inline void ExitThread(unsigned int nExitCode)
     pthread_exit((void*)nExitCode);
 }
 #endif
+
+
+
+
+//
+// Thread pool
+//
+// One set of worker threads for short jobs, so work that can be split up
+// doesn't start threads of its own.  Each worker has its own queues, one per
+// priority, and takes from the back of them; a worker with nothing to do
+// takes from the front of another's.  Jobs submitted from a worker go on its
+// own queues.  SubmitAfter runs a job once a delay has passed.
+//
+enum
+{
+    TASK_HIGH,
+    TASK_NORMAL,
+    TASK_LOW,
+    TASK_PRIORITIES,
+};
+
+class CThreadPool
+{
+protected:
+    struct CWorker
+    {
+        std::mutex mutex;
+        deque<boost::function<void()> > vqueue[TASK_PRIORITIES];
+    };
+
+    vector<CWorker*> vWorkers;
+    vector<std::thread> vThreads;
+    std::atomic<int> nPending;
+    std::atomic<unsigned int> nNextWorker;
+    std::mutex mutexSleep;
+    std::condition_variable condSleep;
+    bool fStopping;
+
+    std::mutex mutexTimers;
+    std::condition_variable condTimers;
+    multimap<int64, pair<boost::function<void()>, int> > mapTimers;
+
+    bool PopTask(int nWorker, boost::function<void()>& taskRet);
+    void WorkerThread(int nWorker);
+    void TimerThread();
+
+public:
+    CThreadPool(int nThreads);
+    ~CThreadPool();
+
+    int GetThreadCount() const { return vWorkers.size(); }
+    int GetPendingCount() const { return nPending; }
+    void Submit(const boost::function<void()>& task, int nPriority=TASK_NORMAL);
+    void SubmitAfter(int64 nMillis, const boost::function<void()>& task, int nPriority=TASK_NORMAL);
+    void Stop();
+};
+
+CThreadPool& GetThreadPool();
+
+// Jobs to wait for together.  Wait runs the group's jobs that haven't been
+// started yet on the calling thread, so a pool job can wait for a group
+// without tying up a worker.
+class CTaskGroup
+{
+protected:
+    struct CState
+    {
+        std::mutex mutex;
+        std::condition_variable cond;
+        deque<boost::function<void()> > queue;
+        int nRunning;
+        CState() { nRunning = 0; }
+    };
+
+    CThreadPool& pool;
+    int nPriority;
+    std::shared_ptr<CState> pstate;
+
+    static bool RunOne(const std::shared_ptr<CState>& pstate);
+
+public:
+    CTaskGroup(CThreadPool& poolIn=GetThreadPool(), int nPriorityIn=TASK_NORMAL) : pool(poolIn), nPriority(nPriorityIn), pstate(new CState()) { }
+    ~CTaskGroup() { Wait(); }
+
+    void Run(const boost::function<void()>& task);
+    void Wait();
+};
+
+
+
+//
+// Periodic jobs
+//
+// Registered jobs run on the thread pool every nInterval plus up to nJitter
+// milliseconds, counted from when the last run finished, so a job never
+// overlaps itself.  A run taking longer than nMaxRuntime is counted as an
+// overrun and logged.  Jobs go in the pool at nPriority, low by default so
+// housekeeping gives way to work somebody is waiting on.
+//
+class CScheduledTask
+{
+public:
+    string strName;
+    boost::function<void()> fn;
+    int64 nInterval;
+    int64 nJitter;
+    int64 nMaxRuntime;
+    int nPriority;
+
+    // Statistics, in milliseconds
+    int64 nRuns;
+    int64 nOverruns;
+    int64 nTotalTime;
+    int64 nMaxTime;
+    int64 nLastTime;
+    int64 nLastStart;
+    int64 nNextStart;
+    bool fRunning;
+
+    CScheduledTask()
+    {
+        nInterval = 0;
+        nJitter = 0;
+        nMaxRuntime = 0;
+        nPriority = TASK_LOW;
+        nRuns = 0;
+        nOverruns = 0;
+        nTotalTime = 0;
+        nMaxTime = 0;
+        nLastTime = 0;
+        nLastStart = 0;
+        nNextStart = 0;
+        fRunning = false;
+    }
+};
+
+// The first run is nFirstDelay ms from now, or a normal interval if it's negative
+void ScheduleTask(const string& strName, const boost::function<void()>& fn, int64 nInterval, int64 nJitter=0, int64 nMaxRuntime=0, int64 nFirstDelay=-1, int nPriority=TASK_LOW);
+void GetScheduledTasks(vector<CScheduledTask>& vTasksRet);
+
+
+
+//
+// Metrics
+//
+// Counters, gauges and histograms for scraping with Prometheus.  A metric
+// registers once, usually into a static reference at its call site, and
+// after that an update is a relaxed atomic add.  Gauges can instead be given
+// a function that is only called when the metrics are read.
+//
+class CMetric
+{
+public:
+    string strName;
+    string strLabels;
+    string strHelp;
+
+    CMetric(const string& strNameIn, const string& strLabelsIn, const string& strHelpIn) : strName(strNameIn), strLabels(strLabelsIn), strHelp(strHelpIn) { }
+    virtual ~CMetric() { }
+    virtual const char* GetType() const = 0;
+    virtual void Write(string& str) const = 0;
+
+protected:
+    string Series(const string& strSuffix="", const string& strExtraLabel="") const;
+};
+
+class CMetricCounter : public CMetric
+{
+protected:
+    std::atomic<int64> nValue;
+    boost::function<int64()> fnValue;
+
+public:
+    CMetricCounter(const string& strNameIn, const string& strLabelsIn, const string& strHelpIn, const boost::function<int64()>& fnValueIn) : CMetric(strNameIn, strLabelsIn, strHelpIn), nValue(0), fnValue(fnValueIn) { }
+    void Inc(int64 n=1) { nValue.fetch_add(n, std::memory_order_relaxed); }
+    int64 Get() const { return (fnValue ? fnValue() : nValue.load(std::memory_order_relaxed)); }
+    const char* GetType() const { return "counter"; }
+    void Write(string& str) const;
+};
+
+class CMetricGauge : public CMetric
+{
+protected:
+    std::atomic<int64> nValue;
+    boost::function<int64()> fnValue;
+
+public:
+    CMetricGauge(const string& strNameIn, const string& strLabelsIn, const string& strHelpIn, const boost::function<int64()>& fnValueIn) : CMetric(strNameIn, strLabelsIn, strHelpIn), nValue(0), fnValue(fnValueIn) { }
+    void Set(int64 n) { nValue.store(n, std::memory_order_relaxed); }
+    void Add(int64 n) { nValue.fetch_add(n, std::memory_order_relaxed); }
+    int64 Get() const { return (fnValue ? fnValue() : nValue.load(std::memory_order_relaxed)); }
+    const char* GetType() const { return "gauge"; }
+    void Write(string& str) const;
+};
+
+// Durations in microseconds, reported in seconds
+class CMetricHistogram : public CMetric
+{
+public:
+    enum { BUCKETS = 16 };
+    static const int64 pnBucketBound[BUCKETS];
+
+protected:
+    std::atomic<int64> vnBucket[BUCKETS + 1];
+    std::atomic<int64> nCount;
+    std::atomic<int64> nSum;
+
+public:
+    CMetricHistogram(const string& strNameIn, const string& strLabelsIn, const string& strHelpIn) : CMetric(strNameIn, strLabelsIn, strHelpIn), nCount(0), nSum(0)
+    {
+        for (int i = 0; i <= BUCKETS; i++)
+            vnBucket[i] = 0;
+    }
+
+    void Observe(int64 nMicros)
+    {
+        int i = 0;
+        while (i < BUCKETS && nMicros > pnBucketBound[i])
+            i++;
+        vnBucket[i].fetch_add(1, std::memory_order_relaxed);
+        nCount.fetch_add(1, std::memory_order_relaxed);
+        nSum.fetch_add(nMicros, std::memory_order_relaxed);
+    }
+
+    const char* GetType() const { return "histogram"; }
+    void Write(string& str) const;
+};
+
+// Times the enclosing scope into a histogram
+class CMetricTimer
+{
+protected:
+    CMetricHistogram& histogram;
+    int64 nStart;
+
+public:
+    explicit CMetricTimer(CMetricHistogram& histogramIn) : histogram(histogramIn), nStart(GetTimeMicros()) { }
+    ~CMetricTimer() { histogram.Observe(GetTimeMicros() - nStart); }
+};
+
+CMetricCounter& GetMetricCounter(const string& strName, const string& strHelp, const string& strLabels="", const boost::function<int64()>& fnValue=boost::function<int64()>());
+CMetricGauge& GetMetricGauge(const string& strName, const string& strHelp, const string& strLabels="", const boost::function<int64()>& fnValue=boost::function<int64()>());
+CMetricHistogram& GetMetricHistogram(const string& strName, const string& strHelp, const string& strLabels="");
+string GetMetricsText();